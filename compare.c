@@ -0,0 +1,303 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - comparison against a reference picture
+ *
+ * For automated UI tests: the live frame is compared to a golden picture in
+ * one pass, without encoding it (nor decoding anything but the reference,
+ * once). Each line is split into the spans left by the masks; identical
+ * spans, the common case, are skipped with a memcmp(). Differing ones are
+ * checked pixel by pixel against the tolerance, and the differing pixels are
+ * counted per tile, from which bounding boxes are built the same way the
+ * change watcher builds its dirty rectangles.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "compare.h"
+#include "core.h"
+
+int reference_load(struct reference *ref, const char *path)
+{
+	uint32_t width, height;
+	uint8_t *pixels;
+	struct stat st;
+	char *copy;
+	int ret;
+
+	if (stat(path, &st))
+		return -errno;
+
+	if (ref->path && !strcmp(ref->path, path) &&
+	    ref->mtime.tv_sec == st.st_mtim.tv_sec &&
+	    ref->mtime.tv_nsec == st.st_mtim.tv_nsec)
+		return 0;
+
+	copy = strdup(path);
+	if (!copy)
+		return -ENOMEM;
+
+	ret = decode_image(path, &pixels, &width, &height);
+	if (ret) {
+		free(copy);
+		return ret;
+	}
+
+	DBG("[debug] compare: loaded reference %s (%"PRIu32"x%"PRIu32")\n",
+	    path, width, height);
+
+	reference_free(ref);
+	ref->path = copy;
+	ref->mtime = st.st_mtim;
+	ref->pixels = pixels;
+	ref->width = width;
+	ref->height = height;
+
+	return 0;
+}
+
+void reference_free(struct reference *ref)
+{
+	free(ref->path);
+	free(ref->pixels);
+	ref->path = NULL;
+	ref->pixels = NULL;
+}
+
+int compare_add_mask(struct compare_opts *opts, const char *str)
+{
+	struct kmsgrab_rect *r;
+	int len = -1;
+
+	if (opts->nb_masks == COMPARE_MAX_MASKS)
+		return -E2BIG;
+
+	r = &opts->masks[opts->nb_masks];
+
+	if (sscanf(str, "%"SCNu32",%"SCNu32",%"SCNu32",%"SCNu32"%n",
+		   &r->x, &r->y, &r->width, &r->height, &len) != 4 ||
+	    str[len] != '\0')
+		return -EINVAL;
+
+	opts->nb_masks++;
+	return 0;
+}
+
+/* Add @r to the list, which degrades to a bounding box once it is full. */
+static void rects_add(struct compare_result *res, const struct kmsgrab_rect *r)
+{
+	uint32_t i, x0, y0, x1, y1;
+
+	if (res->nb_rects < COMPARE_MAX_RECTS) {
+		res->rects[res->nb_rects++] = *r;
+		return;
+	}
+
+	x0 = r->x;
+	y0 = r->y;
+	x1 = r->x + r->width;
+	y1 = r->y + r->height;
+
+	for (i = 0; i < res->nb_rects; i++) {
+		if (res->rects[i].x < x0)
+			x0 = res->rects[i].x;
+		if (res->rects[i].y < y0)
+			y0 = res->rects[i].y;
+		if (res->rects[i].x + res->rects[i].width > x1)
+			x1 = res->rects[i].x + res->rects[i].width;
+		if (res->rects[i].y + res->rects[i].height > y1)
+			y1 = res->rects[i].y + res->rects[i].height;
+	}
+
+	res->rects[0] = (struct kmsgrab_rect){ x0, y0, x1 - x0, y1 - y0 };
+	res->nb_rects = 1;
+}
+
+/*
+ * Add a run of differing tiles, extending a rectangle of the tile rows above
+ * (the first @row ones) when it spans the same columns and ends there.
+ */
+static void add_run(struct compare_result *res, uint32_t row,
+		    const struct kmsgrab_rect *r)
+{
+	uint32_t i;
+
+	for (i = 0; i < row && i < res->nb_rects; i++) {
+		if (res->rects[i].x == r->x && res->rects[i].width == r->width &&
+		    res->rects[i].y + res->rects[i].height == r->y) {
+			res->rects[i].height += r->height;
+			return;
+		}
+	}
+
+	rects_add(res, r);
+}
+
+static int mask_cmp(const void *a, const void *b)
+{
+	const struct kmsgrab_rect *ra = a, *rb = b;
+
+	return (ra->x > rb->x) - (ra->x < rb->x);
+}
+
+/* Count the pixels of [x0, x1) that differ by more than @tolerance, per tile. */
+static void diff_span(uint32_t *counts, const uint8_t *a, const uint8_t *b,
+		      uint32_t x0, uint32_t x1, unsigned int tolerance)
+{
+	uint32_t x, end;
+	int bad;
+
+	if (!memcmp(a + x0 * 3, b + x0 * 3, (size_t)(x1 - x0) * 3))
+		return;
+
+	for (; x0 < x1; x0 = end) {
+		end = (x0 / COMPARE_TILE_SIZE + 1) * COMPARE_TILE_SIZE;
+		if (end > x1)
+			end = x1;
+
+		if (!memcmp(a + x0 * 3, b + x0 * 3, (size_t)(end - x0) * 3))
+			continue;
+
+		for (x = x0; x < end; x++) {
+			bad = (abs(a[x * 3] - b[x * 3]) > (int)tolerance) |
+				(abs(a[x * 3 + 1] - b[x * 3 + 1]) > (int)tolerance) |
+				(abs(a[x * 3 + 2] - b[x * 3 + 2]) > (int)tolerance);
+			counts[x / COMPARE_TILE_SIZE] += bad;
+		}
+	}
+}
+
+/* Compare one line, skipping the masks covering it. */
+static void diff_line(uint32_t *counts, const uint8_t *a, const uint8_t *b,
+		      uint32_t y, uint32_t width,
+		      const struct kmsgrab_rect *masks, unsigned int nb_masks,
+		      unsigned int tolerance)
+{
+	uint32_t x = 0, end;
+	unsigned int i;
+
+	for (i = 0; i < nb_masks && x < width; i++) {
+		if (y < masks[i].y || y - masks[i].y >= masks[i].height)
+			continue;
+
+		if (masks[i].x > x)
+			diff_span(counts, a, b, x, masks[i].x < width ?
+				  masks[i].x : width, tolerance);
+
+		end = masks[i].x + masks[i].width;
+		if (end > x)
+			x = end;
+	}
+
+	if (x < width)
+		diff_span(counts, a, b, x, width, tolerance);
+}
+
+int compare_frame(const struct reference *ref, const struct frame *frame,
+		  const struct compare_opts *opts, struct compare_result *res)
+{
+	struct kmsgrab_rect masks[COMPARE_MAX_MASKS], run = { 0 };
+	uint32_t tiles_w, tiles_h, tx, ty, y, y_end, tw, th, row;
+	size_t stride = (size_t)frame->width * 3;
+	uint32_t *counts;
+
+	memset(res, 0, sizeof(*res));
+	res->width = frame->width;
+	res->height = frame->height;
+
+	if (frame->width != ref->width || frame->height != ref->height) {
+		res->resized = 1;
+		res->pixels = (uint64_t)frame->width * frame->height;
+		res->rects[0] = (struct kmsgrab_rect){
+			0, 0, frame->width, frame->height,
+		};
+		res->nb_rects = 1;
+		return 0;
+	}
+
+	tiles_w = (frame->width + COMPARE_TILE_SIZE - 1) / COMPARE_TILE_SIZE;
+	tiles_h = (frame->height + COMPARE_TILE_SIZE - 1) / COMPARE_TILE_SIZE;
+
+	counts = malloc(tiles_w * sizeof(*counts));
+	if (!counts)
+		return -ENOMEM;
+
+	/* Sorted by X, so that each line is walked once from left to right */
+	memcpy(masks, opts->masks, opts->nb_masks * sizeof(*masks));
+	qsort(masks, opts->nb_masks, sizeof(*masks), mask_cmp);
+
+	for (ty = 0; ty < tiles_h; ty++) {
+		y = ty * COMPARE_TILE_SIZE;
+		th = frame->height - y;
+		if (th > COMPARE_TILE_SIZE)
+			th = COMPARE_TILE_SIZE;
+
+		memset(counts, 0, tiles_w * sizeof(*counts));
+
+		for (y_end = y + th; y < y_end; y++)
+			diff_line(counts, frame->pixels + y * stride,
+				  ref->pixels + y * stride, y, frame->width,
+				  masks, opts->nb_masks, opts->tolerance);
+
+		row = res->nb_rects;
+		run.width = 0;
+
+		for (tx = 0; tx < tiles_w; tx++) {
+			tw = frame->width - tx * COMPARE_TILE_SIZE;
+			if (tw > COMPARE_TILE_SIZE)
+				tw = COMPARE_TILE_SIZE;
+
+			res->pixels += counts[tx];
+
+			if (counts[tx] && run.width) {
+				run.width += tw;
+			} else if (counts[tx]) {
+				run = (struct kmsgrab_rect){
+					tx * COMPARE_TILE_SIZE, ty * COMPARE_TILE_SIZE,
+					tw, th,
+				};
+			} else if (run.width) {
+				add_run(res, row, &run);
+				run.width = 0;
+			}
+		}
+
+		if (run.width)
+			add_run(res, row, &run);
+	}
+
+	free(counts);
+
+	res->match = res->pixels <= opts->max_pixels;
+	return 0;
+}
+
+int compare_format(const struct compare_result *res, char *buf, size_t len)
+{
+	size_t pos;
+	uint32_t i;
+
+	pos = snprintf(buf, len, "%s pixels=%"PRIu64" size=%"PRIu32"x%"PRIu32"%s",
+		       res->match ? "match" : "mismatch", res->pixels,
+		       res->width, res->height,
+		       res->resized ? " resized" : "");
+
+	for (i = 0; i < res->nb_rects && pos < len; i++) {
+		pos += snprintf(buf + pos, len - pos,
+				"%s%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu32,
+				i ? ";" : " rects=", res->rects[i].x,
+				res->rects[i].y, res->rects[i].width,
+				res->rects[i].height);
+	}
+
+	if (pos >= len)
+		return -ENOSPC;
+
+	return (int)pos;
+}
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - comparison against a reference picture
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_COMPARE_H__
+#define __KMSGRAB_COMPARE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "kmsgrab-proto.h"
+#include "pipeline.h"
+
+/* Side of the tiles the differences are located by */
+#define COMPARE_TILE_SIZE	16
+
+#define COMPARE_MAX_MASKS	16
+#define COMPARE_MAX_RECTS	16
+
+/* Enough for the text form of any compare_result */
+#define COMPARE_TEXT_MAX	(128 + COMPARE_MAX_RECTS * 48)
+
+struct reference {
+	char *path;
+	struct timespec mtime;
+
+	uint8_t *pixels;
+	uint32_t width, height;
+};
+
+struct compare_opts {
+	/* Largest difference allowed on any channel of a pixel */
+	unsigned int tolerance;
+
+	/* Number of differing pixels still considered a match */
+	uint64_t max_pixels;
+
+	/* Regions left out of the comparison */
+	struct kmsgrab_rect masks[COMPARE_MAX_MASKS];
+	unsigned int nb_masks;
+};
+
+struct compare_result {
+	int match;
+	int resized;
+	uint64_t pixels;
+	uint32_t width, height;
+
+	/* Bounding boxes of the differences, rounded to whole tiles */
+	struct kmsgrab_rect rects[COMPARE_MAX_RECTS];
+	uint32_t nb_rects;
+};
+
+/*
+ * Load the picture @path as the reference, unless it is already loaded and
+ * the file did not change since.
+ */
+int reference_load(struct reference *ref, const char *path);
+void reference_free(struct reference *ref);
+
+/* Leave the "x,y,width,height" region @str out of the comparison. */
+int compare_add_mask(struct compare_opts *opts, const char *str);
+
+int compare_frame(const struct reference *ref, const struct frame *frame,
+		  const struct compare_opts *opts, struct compare_result *res);
+
+/* Format @res as "match ..." or "mismatch ..."; returns its length. */
+int compare_format(const struct compare_result *res, char *buf, size_t len);
+
+#endif /* __KMSGRAB_COMPARE_H__ */
@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - capture core, shared by the run modes
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_CORE_H__
+#define __KMSGRAB_CORE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "kmsgrab.h"
+#include "pipeline.h"
+
+struct device_cache {
+	char boot_id[64];
+	char path[256];
+	char driver[64];
+	uint32_t plane_id;
+};
+
+struct kms {
+	int fd;
+	uint32_t plane_id;
+	struct device_cache cache;
+	int cache_dirty;
+
+	/* Percentage of the output size to capture at, set by the governor */
+	unsigned int scale_pct;
+
+	/* ID of the planes' "rotation" property, once looked up; 0 if none */
+	uint32_t rotation_prop;
+	int rotation_probed;
+
+	/* Staging buffers, kept across captures */
+	uint8_t *linear, *picture;
+	size_t linear_size, picture_size;
+};
+
+struct output {
+	const char *fn;
+	uint32_t req_w, req_h;
+	const struct kmsgrab_encoder *enc;
+	struct kmsgrab_encode_opts opts;
+};
+
+int kms_open(struct kms *kms);
+void kms_close(struct kms *kms);
+int kms_capture(struct kms *kms, uint32_t req_w, uint32_t req_h,
+		struct frame *frame);
+
+/* Read the framebuffer and CRTC of the captured plane, without capturing. */
+int kms_get_plane_fb(struct kms *kms, uint32_t *fb_id, uint32_t *crtc_id);
+
+/* Index of the CRTC @crtc_id, as used by vblank requests. */
+int kms_crtc_index(struct kms *kms, uint32_t crtc_id);
+
+/* Block until the next vertical blank of the given CRTC. */
+int kms_wait_vblank(struct kms *kms, unsigned int crtc_index);
+
+void format_output_fn(char *buf, size_t len, const char *tmpl, uint64_t id);
+
+/* Encode @frame to an already opened file. */
+int encode_image(FILE *file, const struct frame *frame,
+		 const struct output *out);
+
+/* Encode @frame to the file named after the output template. */
+int encode_frame(struct frame *frame, void *out);
+
+/* Pick the encoder for the file name @fn, loading it if needed; thread-safe. */
+const struct kmsgrab_encoder *get_encoder(const char *fn);
+
+/* Decode the picture @fn to packed RGB888, with the encoder of its format. */
+int decode_image(const char *fn, uint8_t **pixels, uint32_t *width,
+		 uint32_t *height);
+
+void timespec_add_ms(struct timespec *ts, unsigned int ms);
+int timespec_before(const struct timespec *a, const struct timespec *b);
+
+struct daemon_config {
+	const char *socket_path;
+	unsigned int nb_buffers, nb_encoders;
+
+	/* Shared frame ring, and period of the captures feeding it */
+	unsigned int ring_slots;
+	unsigned int interval_ms;
+
+	/* CPU budget (percentage of one core) and grab deadline, or 0 */
+	unsigned int budget_pct;
+	unsigned int deadline_ms;
+
+	/* Length, capture period and memory budget of the flight recorder */
+	unsigned int record_ms, record_interval_ms;
+	unsigned int record_mb;
+
+	/* UNIX socket of the VNC server, or NULL */
+	const char *vnc_path;
+
+	/* TCP port of the VNC server (on the loopback interface), or 0 */
+	unsigned int vnc_port;
+	const char *vnc_password_file;
+	unsigned int vnc_interval_ms;
+};
+
+int run_daemon(const struct daemon_config *cfg, struct output *out);
+
+#endif /* __KMSGRAB_CORE_H__ */
@@ -0,0 +1,886 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - IPC daemon
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "kmsgrab-proto.h"
+
+static struct grab_result *daemon_result(struct daemon *d, uint64_t id)
+{
+	return &d->results[id % MAX_GRAB_RESULTS];
+}
+
+/*
+ * Status of the done grab @id, its readback time and a copy of its picture,
+ * as daemon_wait() returns them. Called with d->lock held.
+ */
+static int daemon_result_get(const struct grab_result *res, uint64_t id,
+			     struct timespec *timestamp, char **data,
+			     size_t *size)
+{
+	if (res->id != id || res->state != GRAB_DONE)
+		return -ENOENT;
+
+	if (timestamp)
+		*timestamp = res->timestamp;
+
+	if (res->err || !data || !res->data)
+		return res->err;
+
+	*data = malloc(res->size);
+	if (!*data)
+		return -ENOMEM;
+
+	memcpy(*data, res->data, res->size);
+	*size = res->size;
+	return 0;
+}
+
+/*
+ * Complete the grab of @res, with d->lock held. Returns its waiters, to be
+ * answered with daemon_answer_waiters() once the lock is released.
+ */
+static struct grab_waiter *daemon_result_done(struct daemon *d,
+					      struct grab_result *res, int err)
+{
+	struct grab_waiter *w, *waiters = res->waiters;
+
+	res->state = GRAB_DONE;
+	res->err = err;
+	res->waiters = NULL;
+	pthread_cond_broadcast(&d->cond);
+
+	for (w = waiters; w; w = w->next)
+		w->err = daemon_result_get(res, w->id, &w->timestamp,
+					   w->want_data ? &w->data : NULL,
+					   &w->size);
+
+	return waiters;
+}
+
+static void daemon_answer_waiters(struct grab_waiter *w)
+{
+	struct grab_waiter *next;
+
+	for (; w; w = next) {
+		next = w->next;
+		w->done(w);
+	}
+}
+
+static int write_file(const char *fn, const void *data, size_t size)
+{
+	FILE *file;
+	int ret = 0;
+
+	/* Drop privileges, to write the picture with user rights */
+	seteuid(getuid());
+
+	file = fopen(fn, "w+");
+	if (!file)
+		return -errno;
+
+	if (fwrite(data, 1, size, file) != size)
+		ret = -EIO;
+
+	if (fclose(file) && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+static int daemon_encode(struct frame *frame, void *p)
+{
+	struct daemon *d = p;
+	struct grab_result *res = daemon_result(d, frame->id);
+	char fn[PATH_MAX], *data = NULL;
+	size_t size = 0;
+	FILE *mem;
+	int keep, ret;
+
+	pthread_mutex_lock(&d->lock);
+	keep = res->id == frame->id && res->req.keep;
+	pthread_mutex_unlock(&d->lock);
+
+	if (!keep)
+		return encode_frame(frame, (void *)d->out);
+
+	mem = open_memstream(&data, &size);
+	if (!mem)
+		return -errno;
+
+	ret = encode_image(mem, frame, d->out);
+	if (fclose(mem) && !ret)
+		ret = -ENOMEM;
+
+	if (!ret) {
+		format_output_fn(fn, sizeof(fn), d->out->fn, frame->id);
+		ret = write_file(fn, data, size);
+	}
+
+	pthread_mutex_lock(&d->lock);
+	if (!ret && res->id == frame->id) {
+		res->data = data;
+		res->size = size;
+		data = NULL;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	free(data);
+	return ret;
+}
+
+static void daemon_complete(struct frame *frame, int err, void *p)
+{
+	struct daemon *d = p;
+	struct grab_result *res = daemon_result(d, frame->id);
+	struct grab_waiter *waiters = NULL;
+	struct grab_result copy = { 0 };
+
+	pthread_mutex_lock(&d->lock);
+	if (res->id == frame->id) {
+		waiters = daemon_result_done(d, res, err);
+		copy = *res;
+	}
+	pthread_mutex_unlock(&d->lock);
+
+	governor_update(&d->gov, frame);
+
+	if (copy.req.notify)
+		copy.req.notify(&copy, copy.req.ctx);
+
+	daemon_answer_waiters(waiters);
+}
+
+static const struct pipeline_ops daemon_ops = {
+	.encode = daemon_encode,
+	.complete = daemon_complete,
+};
+
+int daemon_capture(struct daemon *d, const struct grab_request *req,
+		   uint64_t *id, struct timespec *timestamp)
+{
+	static const struct grab_request sync_req;
+	struct grab_waiter *waiters = NULL;
+	struct grab_result *res = NULL;
+	struct frame *frame;
+	int err, skip;
+
+	if (!req)
+		req = &sync_req;
+
+	pthread_mutex_lock(&d->capture_lock);
+
+	/* (Re)open the device lazily, e.g. after a failed capture */
+	if (d->kms.fd < 0 && kms_open(&d->kms)) {
+		pthread_mutex_unlock(&d->capture_lock);
+		return -ENODEV;
+	}
+
+	/* Space the captures out, if they would exceed the CPU budget */
+	governor_throttle(&d->gov);
+
+	frame = pipeline_get_frame(&d->pl);
+	frame->id = d->next_id++;
+	governor_apply(&d->gov, &d->kms, frame);
+
+	/*
+	 * Background captures only feed the ring and their callback, and must
+	 * not recycle the results that GRAB ASYNC clients still wait for.
+	 */
+	if (!req->publish_only) {
+		res = daemon_result(d, frame->id);
+
+		pthread_mutex_lock(&d->lock);
+		while (res->state == GRAB_PENDING)
+			pthread_cond_wait(&d->cond, &d->lock);
+
+		free(res->data);
+		res->data = NULL;
+		res->size = 0;
+		res->id = frame->id;
+		res->state = GRAB_PENDING;
+		res->req = *req;
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	err = kms_capture(&d->kms, d->out->req_w, d->out->req_h, frame);
+	if (err) {
+		pipeline_put_frame(&d->pl, frame);
+		kms_close(&d->kms);
+
+		if (res) {
+			pthread_mutex_lock(&d->lock);
+			waiters = daemon_result_done(d, res, err);
+			res->req.notify = NULL;
+			pthread_mutex_unlock(&d->lock);
+		}
+
+		pthread_mutex_unlock(&d->capture_lock);
+		daemon_answer_waiters(waiters);
+		return err;
+	}
+
+	*id = frame->id;
+	*timestamp = frame->timestamp;
+
+	skip = req->publish_only;
+	if (req->inspect && req->inspect(frame, req->ctx))
+		skip = 1;
+
+	if (d->ring.nb_slots)
+		frame_ring_publish(&d->ring, frame);
+
+	if (res) {
+		pthread_mutex_lock(&d->lock);
+		res->timestamp = frame->timestamp;
+		if (skip)
+			waiters = daemon_result_done(d, res, 0);
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	if (skip) {
+		governor_update(&d->gov, frame);
+		pipeline_put_frame(&d->pl, frame);
+	} else {
+		pipeline_submit(&d->pl, frame);
+	}
+
+	pthread_mutex_unlock(&d->capture_lock);
+	daemon_answer_waiters(waiters);
+	return 0;
+}
+
+int daemon_wait(struct daemon *d, uint64_t id, struct timespec *timestamp,
+		char **data, size_t *size)
+{
+	struct grab_result *res = daemon_result(d, id);
+	int err;
+
+	if (data) {
+		*data = NULL;
+		*size = 0;
+	}
+
+	pthread_mutex_lock(&d->lock);
+
+	while (res->id == id && res->state == GRAB_PENDING)
+		pthread_cond_wait(&d->cond, &d->lock);
+
+	err = daemon_result_get(res, id, timestamp, data, size);
+
+	pthread_mutex_unlock(&d->lock);
+	return err;
+}
+
+void daemon_wait_async(struct daemon *d, struct grab_waiter *w)
+{
+	struct grab_result *res = daemon_result(d, w->id);
+
+	w->next = NULL;
+	w->data = NULL;
+	w->size = 0;
+
+	pthread_mutex_lock(&d->lock);
+
+	if (res->id == w->id && res->state == GRAB_PENDING) {
+		w->next = res->waiters;
+		res->waiters = w;
+		pthread_mutex_unlock(&d->lock);
+		return;
+	}
+
+	w->err = daemon_result_get(res, w->id, &w->timestamp,
+				   w->want_data ? &w->data : NULL, &w->size);
+
+	pthread_mutex_unlock(&d->lock);
+
+	w->done(w);
+}
+
+int send_fds(int sock_fd, const char *msg, const int *fds, unsigned int nb)
+{
+	char cbuf[CMSG_SPACE(4 * sizeof(int))] = { 0 };
+	struct iovec iov = { (void *)msg, strlen(msg) };
+	struct msghdr hdr = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = CMSG_SPACE(nb * sizeof(int)),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nb * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nb * sizeof(int));
+
+	if (sendmsg(sock_fd, &hdr, MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int daemon_ring_fd(struct daemon *d)
+{
+	static const struct grab_request publish_req = { .publish_only = 1 };
+	struct timespec ts;
+	uint64_t id;
+	int err, fd;
+
+	if (!d->ring.nb_slots)
+		return -ENOTSUP;
+
+	/* The ring is sized after the first frame, so capture one if needed */
+	if (!d->ring.ring) {
+		err = daemon_capture(d, &publish_req, &id, &ts);
+		if (err)
+			return err;
+	}
+
+	/* A copy, as a capture can replace the ring meanwhile */
+	pthread_mutex_lock(&d->capture_lock);
+	fd = d->ring.fd < 0 ? -EIO : fcntl(d->ring.fd, F_DUPFD_CLOEXEC, 0);
+	if (fd == -1)
+		fd = -errno;
+	pthread_mutex_unlock(&d->capture_lock);
+
+	return fd;
+}
+
+/* Capture with @req every @interval_ms, forever. */
+static void daemon_capture_every(struct daemon *d, const struct grab_request *req,
+				 unsigned int interval_ms, const char *what)
+{
+	struct timespec next, now, ts;
+	uint64_t id;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (;;) {
+		err = daemon_capture(d, req, &id, &ts);
+		if (err)
+			DBG("[debug] %s capture failed: %s\n", what, strerror(-err));
+
+		timespec_add_ms(&next, interval_ms);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_before(&next, &now)) {
+			next = now;
+			continue;
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+	}
+}
+
+/* Feed the frame ring at a fixed rate, for consumers that don't GRAB. */
+static void *daemon_ring_thread(void *arg)
+{
+	static const struct grab_request publish_req = { .publish_only = 1 };
+	struct daemon *d = arg;
+
+	daemon_capture_every(d, &publish_req, d->cfg->interval_ms, "ring");
+	return NULL;
+}
+
+/* Called on the capturing thread, with the capture lock held. */
+static int daemon_record_inspect(const struct frame *frame, void *p)
+{
+	struct daemon *d = p;
+	int err;
+
+	err = recorder_add(&d->rec, frame);
+	if (err)
+		DBG("[debug] unable to record frame: %s\n", strerror(-err));
+
+	return 0;
+}
+
+/* Feed the flight recorder, at its own rate. */
+static void *daemon_record_thread(void *arg)
+{
+	struct daemon *d = arg;
+	struct grab_request req = {
+		.publish_only = 1,
+		.inspect = daemon_record_inspect,
+		.ctx = d,
+	};
+
+	daemon_capture_every(d, &req, d->cfg->record_interval_ms, "recorder");
+	return NULL;
+}
+
+/*
+ * Write the recorded frames in the background, to @tmpl or to the output
+ * template if empty.
+ */
+static int daemon_dump(struct daemon *d, const char *tmpl,
+		       struct timespec *first, struct timespec *last)
+{
+	struct output out = *d->out;
+
+	if (!d->cfg->record_ms)
+		return -ENOTSUP;
+
+	if (*tmpl) {
+		out.fn = tmpl;
+		out.enc = get_encoder(tmpl);
+		if (!out.enc)
+			return -EINVAL;
+	}
+
+	return recorder_dump(&d->rec, &out, first, last);
+}
+
+struct stats_request {
+	struct daemon *d;
+	struct frame_stats stats;
+	int err;
+};
+
+/* Called on the capturing thread, with the capture lock held. */
+static int daemon_stats_inspect(const struct frame *frame, void *p)
+{
+	struct stats_request *sr = p;
+	struct daemon *d = sr->d;
+
+	sr->err = frame_stats_compute(&sr->stats, frame,
+				      d->have_stats ? &d->last_stats : NULL);
+	if (!sr->err) {
+		d->last_stats = sr->stats;
+		d->have_stats = 1;
+	}
+
+	return 0;
+}
+
+/* Capture a frame only for its statistics: it is published, not encoded. */
+static int daemon_stats(struct daemon *d, char *buf, size_t len)
+{
+	struct stats_request sr = { .d = d, .err = -EIO };
+	struct grab_request req = {
+		.publish_only = 1,
+		.inspect = daemon_stats_inspect,
+		.ctx = &sr,
+	};
+	struct timespec ts;
+	uint64_t id;
+	int err;
+
+	err = daemon_capture(d, &req, &id, &ts);
+	if (err)
+		return err;
+	if (sr.err)
+		return sr.err;
+
+	err = frame_stats_json(&sr.stats, buf, len);
+	if (err < 0)
+		return err;
+
+	return 0;
+}
+
+struct compare_request {
+	struct daemon *d;
+	struct compare_opts opts;
+	struct compare_result res;
+	int err;
+};
+
+static int daemon_compare_inspect(const struct frame *frame, void *p)
+{
+	struct compare_request *cr = p;
+
+	cr->err = compare_frame(&cr->d->ref, frame, &cr->opts, &cr->res);
+
+	/* Only the frames that don't match are encoded */
+	return cr->err || cr->res.match;
+}
+
+/*
+ * Parse "<reference> [tolerance=N] [max=N] [mask=x,y,w,h]...", and compare
+ * a capture against the reference. A frame that does not match is encoded
+ * (and kept, for FETCH) as grab @id.
+ */
+static int daemon_compare(struct daemon *d, char *args,
+			  struct compare_result *res, uint64_t *id)
+{
+	static const struct grab_request compare_req = {
+		.keep = 1,
+		.inspect = daemon_compare_inspect,
+	};
+	struct compare_request cr = { .d = d };
+	struct grab_request req = compare_req;
+	char *tok, *end, *path, *save = NULL;
+	unsigned long long val;
+	struct timespec ts;
+	int err;
+
+	path = strtok_r(args, " \t", &save);
+	if (!path)
+		return -EINVAL;
+
+	for (tok = strtok_r(NULL, " \t", &save); tok;
+	     tok = strtok_r(NULL, " \t", &save)) {
+		if (!strncmp(tok, "mask=", 5)) {
+			err = compare_add_mask(&cr.opts, tok + 5);
+			if (err)
+				return err;
+		} else if (!strncmp(tok, "tolerance=", 10) ||
+			   !strncmp(tok, "max=", 4)) {
+			val = strtoull(strchr(tok, '=') + 1, &end, 10);
+			if (*end || end == strchr(tok, '=') + 1)
+				return -EINVAL;
+
+			if (tok[0] == 't')
+				cr.opts.tolerance = val > 255 ? 255 : (unsigned int)val;
+			else
+				cr.opts.max_pixels = val;
+		} else {
+			return -EINVAL;
+		}
+	}
+
+	err = reference_load(&d->ref, path);
+	if (err) {
+		fprintf(stderr, "Unable to load reference %s: %s\n",
+			path, strerror(-err));
+		return -ENOENT;
+	}
+
+	req.ctx = &cr;
+
+	err = daemon_capture(d, &req, id, &ts);
+	if (err)
+		return err;
+	if (cr.err)
+		return cr.err;
+
+	*res = cr.res;
+	return 0;
+}
+
+int write_all(int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, ptr, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static void handle_command(struct daemon *d, int *cli_fd, char *cmd)
+{
+	static const struct grab_request async_req = { .keep = 1 };
+	char *arg, *end, *data, json[STATS_JSON_MAX];
+	char text[COMPARE_TEXT_MAX];
+	struct timespec ts, first, last;
+	struct compare_result cmp;
+	size_t size;
+	uint64_t id;
+	int err, fd, nb;
+
+	arg = cmd + strcspn(cmd, " \t");
+	if (*arg)
+		*arg++ = '\0';
+	while (*arg && isspace((unsigned char)*arg))
+		arg++;
+
+	if (!strcmp(cmd, "GRAB") && !*arg) {
+		err = daemon_capture(d, NULL, &id, &ts);
+		if (!err)
+			err = daemon_wait(d, id, NULL, NULL, NULL);
+
+		if (!err) {
+			dprintf(*cli_fd, "OK\n");
+		} else {
+			fprintf(stderr, "Failed to take screenshot: %s\n",
+				strerror(-err));
+			dprintf(*cli_fd, "ERR grab failed\n");
+		}
+	} else if (!strcmp(cmd, "GRAB") && !strcmp(arg, "ASYNC")) {
+		err = daemon_capture(d, &async_req, &id, &ts);
+		if (!err) {
+			dprintf(*cli_fd, "OK %"PRIu64" %lld.%09ld\n",
+				id, (long long)ts.tv_sec, ts.tv_nsec);
+		} else {
+			fprintf(stderr, "Failed to take screenshot: %s\n",
+				strerror(-err));
+			dprintf(*cli_fd, "ERR grab failed\n");
+		}
+	} else if (!strcmp(cmd, "WAIT") || !strcmp(cmd, "FETCH")) {
+		id = strtoull(arg, &end, 10);
+		if (end == arg || *end) {
+			dprintf(*cli_fd, "ERR invalid frame id\n");
+			return;
+		}
+
+		err = daemon_wait(d, id, NULL, cmd[0] == 'F' ? &data : NULL, &size);
+		if (err == -ENOENT) {
+			dprintf(*cli_fd, "ERR unknown frame\n");
+		} else if (err) {
+			dprintf(*cli_fd, "ERR grab failed\n");
+		} else if (cmd[0] == 'W') {
+			dprintf(*cli_fd, "OK %"PRIu64"\n", id);
+		} else if (!data) {
+			dprintf(*cli_fd, "ERR frame not kept\n");
+		} else {
+			dprintf(*cli_fd, "OK %"PRIu64" %zu\n", id, size);
+			write_all(*cli_fd, data, size);
+			free(data);
+		}
+	} else if (!strcmp(cmd, "STATS") && !*arg) {
+		err = daemon_stats(d, json, sizeof(json));
+		if (!err) {
+			dprintf(*cli_fd, "OK %s\n", json);
+		} else {
+			fprintf(stderr, "Failed to analyze frame: %s\n",
+				strerror(-err));
+			dprintf(*cli_fd, "ERR stats failed\n");
+		}
+	} else if (!strcmp(cmd, "COMPARE")) {
+		err = daemon_compare(d, arg, &cmp, &id);
+		if (err == -EINVAL || err == -E2BIG) {
+			dprintf(*cli_fd, "ERR invalid comparison\n");
+		} else if (err == -ENOENT) {
+			dprintf(*cli_fd, "ERR reference not loaded\n");
+		} else if (err || compare_format(&cmp, text, sizeof(text)) < 0) {
+			dprintf(*cli_fd, "ERR compare failed\n");
+		} else if (cmp.match) {
+			dprintf(*cli_fd, "OK %s\n", text);
+		} else {
+			/* The picture can be awaited or fetched with this id */
+			dprintf(*cli_fd, "OK %s frame=%"PRIu64"\n", text, id);
+		}
+	} else if (!strcmp(cmd, "DUMP")) {
+		nb = daemon_dump(d, arg, &first, &last);
+		if (nb == -ENOTSUP) {
+			dprintf(*cli_fd, "ERR recorder not enabled\n");
+		} else if (nb == -ENOENT) {
+			dprintf(*cli_fd, "ERR nothing recorded\n");
+		} else if (nb == -EINVAL) {
+			dprintf(*cli_fd, "ERR invalid template\n");
+		} else if (nb < 0) {
+			fprintf(stderr, "Failed to dump recording: %s\n",
+				strerror(-nb));
+			dprintf(*cli_fd, "ERR dump failed\n");
+		} else {
+			/* The files are still being written when this is sent */
+			dprintf(*cli_fd, "OK %d %lld.%09ld %lld.%09ld\n", nb,
+				(long long)first.tv_sec, first.tv_nsec,
+				(long long)last.tv_sec, last.tv_nsec);
+		}
+	} else if (!strcmp(cmd, "RING") && !*arg) {
+		fd = daemon_ring_fd(d);
+		if (fd == -ENOTSUP)
+			dprintf(*cli_fd, "ERR ring not enabled\n");
+		else if (fd < 0 || send_fds(*cli_fd, "OK\n", &fd, 1))
+			dprintf(*cli_fd, "ERR ring setup failed\n");
+		if (fd >= 0)
+			close(fd);
+	} else if (!strcmp(cmd, "SUBSCRIBE")) {
+		/* On success, the connection is kept to push the events */
+		err = daemon_text_subscribe(d, *cli_fd, arg);
+		if (!err)
+			*cli_fd = -1;
+		else if (err == -EINVAL)
+			dprintf(*cli_fd, "ERR invalid subscription\n");
+		else
+			dprintf(*cli_fd, "ERR subscription failed\n");
+	} else if (!strcmp(cmd, "SHM") && !*arg) {
+		/* On success, the session thread takes over the connection */
+		if (!daemon_shm_open(d, *cli_fd))
+			*cli_fd = -1;
+		else
+			dprintf(*cli_fd, "ERR shm setup failed\n");
+	} else {
+		dprintf(*cli_fd, "ERR unsupported command\n");
+	}
+}
+
+int run_daemon(const struct daemon_config *cfg, struct output *out)
+{
+	const char *socket_path = cfg->socket_path;
+	int srv_fd, cli_fd, err, ret = EXIT_FAILURE;
+	struct sockaddr_un addr;
+	pthread_t ring_thread, record_thread;
+	struct daemon *d;
+	unsigned int i;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return EXIT_FAILURE;
+
+	d->out = out;
+	d->cfg = cfg;
+	d->kms.fd = -1;
+	d->ring.fd = -1;
+	d->ring.nb_slots = cfg->ring_slots;
+	pthread_mutex_init(&d->capture_lock, NULL);
+	pthread_mutex_init(&d->lock, NULL);
+	pthread_cond_init(&d->cond, NULL);
+	pthread_mutex_init(&d->watch.lock, NULL);
+	governor_init(&d->gov, cfg->budget_pct, cfg->deadline_ms, 0, &out->opts);
+	recorder_init(&d->rec, cfg->record_ms, (size_t)cfg->record_mb << 20);
+
+	err = pipeline_init(&d->pl, cfg->nb_buffers, cfg->nb_encoders,
+			    &daemon_ops, d);
+	if (err) {
+		fprintf(stderr, "Unable to start pipeline: %s\n", strerror(-err));
+		goto out_free_daemon;
+	}
+
+	srv_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (srv_fd < 0) {
+		fprintf(stderr, "Unable to create IPC socket: %s\n", strerror(errno));
+		goto out_finish_pipeline;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", socket_path);
+		goto out_close_srv;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	unlink(socket_path);
+	if (bind(srv_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Unable to bind IPC socket %s: %s\n",
+			socket_path, strerror(errno));
+		goto out_close_srv;
+	}
+
+	if (listen(srv_fd, 4) < 0) {
+		fprintf(stderr, "Unable to listen on IPC socket %s: %s\n",
+			socket_path, strerror(errno));
+		goto out_unlink_socket;
+	}
+
+	DBG("[debug] daemon listening on %s\n", socket_path);
+
+	/* Clients may disconnect before their reply is written */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (cfg->ring_slots && cfg->interval_ms) {
+		err = pthread_create(&ring_thread, NULL, daemon_ring_thread, d);
+		if (err) {
+			fprintf(stderr, "Unable to start ring capture: %s\n",
+				strerror(err));
+			goto out_unlink_socket;
+		}
+		pthread_detach(ring_thread);
+	}
+
+	if (cfg->record_ms) {
+		err = pthread_create(&record_thread, NULL, daemon_record_thread, d);
+		if (err) {
+			fprintf(stderr, "Unable to start recorder: %s\n",
+				strerror(err));
+			goto out_unlink_socket;
+		}
+		pthread_detach(record_thread);
+	}
+
+	if (cfg->vnc_path || cfg->vnc_port) {
+		err = daemon_vnc_start(d);
+		if (err) {
+			fprintf(stderr, "Unable to start VNC server: %s\n",
+				strerror(-err));
+			goto out_unlink_socket;
+		}
+	}
+
+	for (;;) {
+		/* Long enough for a COMPARE with a path and a few masks */
+		char buf[PATH_MAX + 512];
+		uint32_t magic;
+		ssize_t len;
+		char *cmd;
+
+		cli_fd = accept(srv_fd, NULL, NULL);
+		if (cli_fd < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "IPC accept failed: %s\n", strerror(errno));
+			break;
+		}
+
+		/* Binary clients get their own persistent connection thread */
+		len = recv(cli_fd, &magic, sizeof(magic), MSG_PEEK | MSG_WAITALL);
+		if (len == sizeof(magic) && magic == KMSGRAB_PROTO_MAGIC) {
+			if (daemon_proto_open(d, cli_fd))
+				close(cli_fd);
+			continue;
+		}
+
+		len = read(cli_fd, buf, sizeof(buf) - 1);
+		if (len <= 0) {
+			close(cli_fd);
+			continue;
+		}
+		buf[len] = '\0';
+
+		cmd = buf;
+		while (*cmd && isspace((unsigned char)*cmd))
+			cmd++;
+		for (len = strlen(cmd); len > 0; len--) {
+			if (!isspace((unsigned char)cmd[len - 1]))
+				break;
+			cmd[len - 1] = '\0';
+		}
+
+		handle_command(d, &cli_fd, cmd);
+
+		if (cli_fd >= 0)
+			close(cli_fd);
+	}
+
+out_unlink_socket:
+	unlink(socket_path);
+out_close_srv:
+	close(srv_fd);
+out_finish_pipeline:
+	pipeline_finish(&d->pl);
+	kms_close(&d->kms);
+	frame_ring_free(&d->ring);
+out_free_daemon:
+	for (i = 0; i < MAX_GRAB_RESULTS; i++)
+		free(d->results[i].data);
+	reference_free(&d->ref);
+	recorder_free(&d->rec);
+	pthread_cond_destroy(&d->cond);
+	pthread_mutex_destroy(&d->lock);
+	pthread_mutex_destroy(&d->capture_lock);
+	pthread_mutex_destroy(&d->watch.lock);
+	governor_free(&d->gov);
+	free(d);
+	return ret;
+}
@@ -0,0 +1,210 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - IPC daemon internals
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_DAEMON_H__
+#define __KMSGRAB_DAEMON_H__
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "compare.h"
+#include "core.h"
+#include "governor.h"
+#include "kmsgrab-proto.h"
+#include "recorder.h"
+#include "ring.h"
+#include "stats.h"
+
+/* Number of recent grabs whose result can still be waited for or fetched */
+#define MAX_GRAB_RESULTS 16
+
+enum grab_state {
+	GRAB_FREE,
+	GRAB_PENDING,
+	GRAB_DONE,
+};
+
+struct grab_result;
+
+struct grab_request {
+	/* Keep the encoded picture in memory, for FETCH */
+	int keep;
+
+	/*
+	 * Only publish the frame to the shared ring, don't encode it. No result
+	 * is kept, so its id can't be waited for.
+	 */
+	int publish_only;
+
+	/* Called from an encoder thread once the frame is encoded */
+	void (*notify)(const struct grab_result *res, void *ctx);
+
+	/*
+	 * Called on the capturing thread with the pixels, before encoding. A
+	 * nonzero return skips the encoding; the frame is still published.
+	 */
+	int (*inspect)(const struct frame *frame, void *ctx);
+	void *ctx;
+};
+
+/* A wait for a grab that answers from the thread completing it. */
+struct grab_waiter {
+	struct grab_waiter *next;
+	uint64_t id;
+
+	/* Also copy the encoded picture into @data, to be freed by @done */
+	int want_data;
+
+	/* Result, set when @done is called */
+	int err;
+	struct timespec timestamp;
+	char *data;
+	size_t size;
+
+	void (*done)(struct grab_waiter *w);
+	void *ctx;
+};
+
+struct grab_result {
+	uint64_t id;
+	enum grab_state state;
+	int err;
+	struct timespec timestamp;
+	struct grab_request req;
+
+	char *data;
+	size_t size;
+
+	/* Answered once the grab is done */
+	struct grab_waiter *waiters;
+};
+
+struct subscriber {
+	struct subscriber *next;
+	struct kmsgrab_subscribe params;
+	uint64_t seq;
+
+	/* Changes held back by the rate limit */
+	uint32_t pending;
+	struct kmsgrab_rect rects[KMSGRAB_EVENT_MAX_RECTS];
+	uint32_t nb_rects;
+	struct timespec last_event;
+
+	/*
+	 * Called with a NULL event to acknowledge the subscription, then for
+	 * each event. A nonzero return drops the subscriber.
+	 */
+	int (*send)(struct subscriber *s, const struct kmsgrab_event *ev,
+		    const struct kmsgrab_rect *rects, const void *frame);
+	void (*release)(struct subscriber *s);
+	void *ctx;
+	uint32_t id;
+	int fd;
+
+	/*
+	 * Held by the list and by the watcher while it sends an event, under
+	 * the watcher lock; @unlinked once it left the list.
+	 */
+	unsigned int refs;
+	int unlinked;
+};
+
+struct watcher {
+	pthread_mutex_t lock;
+	struct subscriber *subs;
+	int running;
+};
+
+struct daemon {
+	const struct output *out;
+	const struct daemon_config *cfg;
+
+	/* Serializes captures, which may come from several threads */
+	pthread_mutex_t capture_lock;
+	struct kms kms;
+	struct pipeline pl;
+	uint64_t next_id;
+	struct frame_ring ring;
+	struct governor gov;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct grab_result results[MAX_GRAB_RESULTS];
+
+	/* Statistics of the last STATS capture, under the capture lock */
+	struct frame_stats last_stats;
+	int have_stats;
+
+	/* Reference picture of COMPARE, only used from the IPC thread */
+	struct reference ref;
+
+	/* Recent frames, fed by the recorder thread if enabled */
+	struct recorder rec;
+
+	struct watcher watch;
+};
+
+/*
+ * Snapshot the framebuffer into a private frame and queue it for encoding.
+ * Returns as soon as the pixels have been read back.
+ */
+int daemon_capture(struct daemon *d, const struct grab_request *req,
+		   uint64_t *id, struct timespec *timestamp);
+
+/*
+ * Wait for the grab @id to be encoded, and return its status. If not NULL,
+ * @timestamp receives the time of the readback, and @data a copy of the
+ * encoded picture, to be freed by the caller (or NULL if it was not kept).
+ */
+int daemon_wait(struct daemon *d, uint64_t id, struct timespec *timestamp,
+		char **data, size_t *size);
+
+/*
+ * Same as daemon_wait() for the grab @w->id, without blocking: @w->done is
+ * called right away if the grab is not pending, or else from the encoder
+ * thread that completes it.
+ */
+void daemon_wait_async(struct daemon *d, struct grab_waiter *w);
+
+int write_all(int fd, const void *buf, size_t len);
+int send_fds(int sock_fd, const char *msg, const int *fds, unsigned int nb);
+
+/* Hand the connection over to a shared-memory trigger session. */
+int daemon_shm_open(struct daemon *d, int cli_fd);
+
+/* Hand the connection over to a binary protocol reader thread. */
+int daemon_proto_open(struct daemon *d, int cli_fd);
+
+/*
+ * Add a subscriber to change notifications, starting the watcher thread if
+ * needed. The subscriber is owned by the watcher until its release().
+ */
+int daemon_subscribe(struct daemon *d, struct subscriber *s);
+
+/*
+ * Drop the subscription @id of @ctx, or all the subscriptions of @ctx if
+ * @id is NULL. No event is sent to them once this returns.
+ */
+int daemon_unsubscribe(struct daemon *d, const void *ctx, const uint32_t *id);
+
+/* Parse the arguments of a text SUBSCRIBE, and hand the connection over. */
+int daemon_text_subscribe(struct daemon *d, int cli_fd, char *args);
+
+/* Start serving VNC clients, from a thread of their own. */
+#ifdef KMSGRAB_HAVE_VNC
+int daemon_vnc_start(struct daemon *d);
+#else
+static inline int daemon_vnc_start(struct daemon *d)
+{
+	(void)d;
+	return -ENOTSUP;
+}
+#endif
+
+#endif /* __KMSGRAB_DAEMON_H__ */
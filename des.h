@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - DES, for the VNC authentication
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_DES_H__
+#define __KMSGRAB_DES_H__
+
+#include <stdint.h>
+
+struct des_key {
+	uint64_t subkeys[16];
+};
+
+/* Expand the 8 bytes of @key; the low bit of each byte is ignored. */
+void des_set_key(struct des_key *k, const uint8_t key[8]);
+
+/* Encrypt one block of 8 bytes; @in and @out may be the same. */
+void des_encrypt(const struct des_key *k, const uint8_t in[8], uint8_t out[8]);
+
+#endif /* __KMSGRAB_DES_H__ */
@@ -0,0 +1,300 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - H.264 encoder
+ *
+ * For screen recordings, where consecutive frames are mostly identical: the
+ * frames are encoded by x264 into an H.264 Annex-B stream, which players
+ * read as is and which can be remuxed into MP4 or Matroska without
+ * re-encoding. The ultrafast preset and the zerolatency tune are the
+ * default, so that each frame comes out as soon as it goes in, encoded by
+ * slices over x264's threads; a higher effort picks a slower preset.
+ *
+ * The pictures are converted from RGB888 to I420 (BT.709, limited range)
+ * two lines at a time, while they are still in the cache.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <x264.h>
+
+#include "kmsgrab.h"
+
+/* Number of x264 presets, from ultrafast (effort 0) to placebo */
+#define H264_NB_PRESETS		10
+
+struct kmsgrab_stream {
+	FILE *file;
+	struct kmsgrab_encode_opts opts;
+	unsigned int interval_ms, keyframe_ms;
+
+	/* Opened on the first picture, and again when the size changes */
+	x264_t *enc;
+	x264_picture_t pic;
+	uint32_t width, height;
+	int64_t pts;
+};
+
+static inline uint8_t rgb_to_y(unsigned int r, unsigned int g, unsigned int b)
+{
+	return (uint8_t)(((47 * r + 157 * g + 16 * b + 128) >> 8) + 16);
+}
+
+/* Chroma of the sums of 4 pixels; the offsets keep the sums positive */
+static inline uint8_t rgb4_to_u(unsigned int r, unsigned int g, unsigned int b)
+{
+	return (uint8_t)((112 * b + 128 * 1024 + 512 - 26 * r - 86 * g) >> 10);
+}
+
+static inline uint8_t rgb4_to_v(unsigned int r, unsigned int g, unsigned int b)
+{
+	return (uint8_t)((112 * r + 128 * 1024 + 512 - 102 * g - 10 * b) >> 10);
+}
+
+/*
+ * Convert two lines of @width pixels, an even number. The chroma of each 2x2
+ * block is the one of its mean color.
+ */
+static void convert_lines(const uint8_t *l0, const uint8_t *l1,
+			  uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+			  uint32_t width)
+{
+	unsigned int r, g, b;
+	uint32_t x;
+
+	for (x = 0; x < width / 2; x++, l0 += 6, l1 += 6) {
+		y0[2 * x] = rgb_to_y(l0[0], l0[1], l0[2]);
+		y0[2 * x + 1] = rgb_to_y(l0[3], l0[4], l0[5]);
+		y1[2 * x] = rgb_to_y(l1[0], l1[1], l1[2]);
+		y1[2 * x + 1] = rgb_to_y(l1[3], l1[4], l1[5]);
+
+		r = l0[0] + l0[3] + l1[0] + l1[3];
+		g = l0[1] + l0[4] + l1[1] + l1[4];
+		b = l0[2] + l0[5] + l1[2] + l1[5];
+
+		u[x] = rgb4_to_u(r, g, b);
+		v[x] = rgb4_to_v(r, g, b);
+	}
+}
+
+/*
+ * Convert @img into @dst, whose size is rounded down to even numbers: an odd
+ * last column or line is left out.
+ */
+static void convert_to_i420(const struct kmsgrab_image *img, x264_image_t *dst)
+{
+	const uint8_t *l0, *l1;
+	uint32_t y;
+
+	for (y = 0; y < img->height / 2; y++) {
+		l0 = img->pixels + 2 * y * img->stride;
+		l1 = l0 + img->stride;
+
+		convert_lines(l0, l1,
+			      dst->plane[0] + 2 * y * dst->i_stride[0],
+			      dst->plane[0] + (2 * y + 1) * dst->i_stride[0],
+			      dst->plane[1] + y * dst->i_stride[1],
+			      dst->plane[2] + y * dst->i_stride[2],
+			      img->width & ~1u);
+	}
+}
+
+static int h264_preset(const struct kmsgrab_encode_opts *opts)
+{
+	if (opts->effort < 0)
+		return 0;
+	if (opts->effort >= H264_NB_PRESETS)
+		return H264_NB_PRESETS - 1;
+
+	return opts->effort;
+}
+
+static int h264_open_encoder(struct kmsgrab_stream *s, uint32_t width,
+			     uint32_t height)
+{
+	unsigned int interval_ms = s->interval_ms ? s->interval_ms : 1000;
+	x264_param_t param;
+
+	if (width < 2 || height < 2) {
+		fprintf(stderr, "Frames of %"PRIu32"x%"PRIu32" are too small "
+			"for H.264\n", width, height);
+		return -EINVAL;
+	}
+
+	if (x264_param_default_preset(&param,
+				      x264_preset_names[h264_preset(&s->opts)],
+				      "zerolatency") < 0)
+		return -EINVAL;
+
+	param.i_log_level = g_verbose ? X264_LOG_INFO : X264_LOG_WARNING;
+	param.i_threads = s->opts.threads; /* 0 is one per CPU */
+
+	/*
+	 * 4:2:0 needs even sizes, and H.264 only crops by 2 pixels: an odd last
+	 * column or line is dropped rather than padded.
+	 */
+	param.i_csp = X264_CSP_I420;
+	param.i_width = width & ~1u;
+	param.i_height = height & ~1u;
+
+	param.vui.b_fullrange = 0;
+	param.vui.i_colorprim = 1;
+	param.vui.i_transfer = 1;
+	param.vui.i_colmatrix = 1;
+
+	param.i_fps_num = 1000;
+	param.i_fps_den = interval_ms;
+	if (s->keyframe_ms >= interval_ms)
+		param.i_keyint_max = s->keyframe_ms / interval_ms;
+	else if (s->keyframe_ms)
+		param.i_keyint_max = 1;
+
+	/* Quality 90, the default, is CRF 21; quality 100 is CRF 18 */
+	param.rc.i_rc_method = X264_RC_CRF;
+	param.rc.f_rf_constant = 51.f - s->opts.quality * 0.33f;
+
+	/* Each keyframe repeats the headers, so that the stream can be cut */
+	param.b_repeat_headers = 1;
+	param.b_annexb = 1;
+
+	if (x264_picture_alloc(&s->pic, X264_CSP_I420, param.i_width,
+			       param.i_height) < 0)
+		return -ENOMEM;
+
+	s->enc = x264_encoder_open(&param);
+	if (!s->enc) {
+		x264_picture_clean(&s->pic);
+		return -EINVAL;
+	}
+
+	s->width = width;
+	s->height = height;
+
+	DBG("[debug] h264: %dx%d, preset %s, CRF %.1f, "
+	    "keyframe every %d frames\n", param.i_width, param.i_height,
+	    x264_preset_names[h264_preset(&s->opts)], param.rc.f_rf_constant,
+	    param.i_keyint_max);
+
+	return 0;
+}
+
+static int h264_write_nals(struct kmsgrab_stream *s, x264_nal_t *nals,
+			   int size)
+{
+	/* The payloads of the NAL units are contiguous */
+	if (size > 0 && fwrite(nals[0].p_payload, size, 1, s->file) != 1)
+		return -EIO;
+
+	return 0;
+}
+
+/* Write the delayed frames, and close the encoder. */
+static int h264_close_encoder(struct kmsgrab_stream *s)
+{
+	x264_picture_t pic_out;
+	x264_nal_t *nals;
+	int nb, size, ret = 0;
+
+	while (!ret && x264_encoder_delayed_frames(s->enc) > 0) {
+		size = x264_encoder_encode(s->enc, &nals, &nb, NULL, &pic_out);
+		ret = size < 0 ? -EIO : h264_write_nals(s, nals, size);
+	}
+
+	x264_encoder_close(s->enc);
+	x264_picture_clean(&s->pic);
+	s->enc = NULL;
+
+	return ret;
+}
+
+static int h264_stream_open(struct kmsgrab_stream **stream, FILE *file,
+			    const struct kmsgrab_encode_opts *opts,
+			    unsigned int interval_ms, unsigned int keyframe_ms)
+{
+	struct kmsgrab_stream *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->file = file;
+	s->opts = *opts;
+	s->interval_ms = interval_ms;
+	s->keyframe_ms = keyframe_ms;
+
+	*stream = s;
+	return 0;
+}
+
+static int h264_stream_write(struct kmsgrab_stream *s,
+			     const struct kmsgrab_image *img)
+{
+	x264_picture_t pic_out;
+	x264_nal_t *nals;
+	int nb, size, err;
+
+	/* A new size starts over with new headers and a keyframe */
+	if (s->enc && (img->width != s->width || img->height != s->height)) {
+		err = h264_close_encoder(s);
+		if (err)
+			return err;
+	}
+
+	if (!s->enc) {
+		err = h264_open_encoder(s, img->width, img->height);
+		if (err)
+			return err;
+	}
+
+	convert_to_i420(img, &s->pic.img);
+	s->pic.i_pts = s->pts++;
+
+	size = x264_encoder_encode(s->enc, &nals, &nb, &s->pic, &pic_out);
+	if (size < 0)
+		return -EIO;
+
+	return h264_write_nals(s, nals, size);
+}
+
+static int h264_stream_close(struct kmsgrab_stream *s)
+{
+	int ret = 0;
+
+	if (s->enc)
+		ret = h264_close_encoder(s);
+
+	free(s);
+	return ret;
+}
+
+/* A single picture is a stream of one keyframe. */
+static int encode_h264(FILE *file, const struct kmsgrab_image *img,
+		       const struct kmsgrab_encode_opts *opts)
+{
+	struct kmsgrab_stream *s;
+	int err;
+
+	err = h264_stream_open(&s, file, opts, 0, 0);
+	if (err)
+		return err;
+
+	err = h264_stream_write(s, img);
+
+	if (h264_stream_close(s) && !err)
+		err = -EIO;
+
+	return err;
+}
+
+const struct kmsgrab_encoder kmsgrab_encoder_h264 = {
+	.name = "h264",
+	.write = encode_h264,
+	.stream_open = h264_stream_open,
+	.stream_write = h264_stream_write,
+	.stream_close = h264_stream_close,
+};
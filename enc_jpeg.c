@@ -0,0 +1,510 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - JPEG encoder
+ *
+ * Large pictures can be encoded by several threads: each one compresses a
+ * horizontal strip of whole MCU rows as a standalone JPEG, with the same
+ * (standard) tables. The entropy-coded data of the strips is then joined
+ * with RSTn markers, under the headers of the first strip with the full
+ * height and a restart interval of one strip, which makes a regular
+ * baseline JPEG: decoders reset the DC predictors at each marker, just like
+ * each strip's encoder started from zero.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#include "kmsgrab.h"
+
+/* Height of the bands sampled for size estimates: one MCU row at 4:2:0 */
+#define JPEG_BAND_HEIGHT	16
+
+/* One band out of this many is part of the preview */
+#define JPEG_PREVIEW_STEP	8
+
+/* Maximum number of preview encodes to search for the target quality */
+#define JPEG_MAX_PREVIEW_PASSES	4
+
+#define JPEG_MARKER_SOF0	0xc0
+#define JPEG_MARKER_RST0	0xd0
+#define JPEG_MARKER_EOI		0xd9
+#define JPEG_MARKER_SOS		0xda
+#define JPEG_MARKER_DRI		0xdd
+
+struct jpeg_strip {
+	pthread_t thread;
+	int started;
+
+	uint32_t width, height;
+	JSAMPROW *rows;
+	int quality;
+	const struct kmsgrab_encode_opts *opts;
+
+	unsigned char *buf;
+	unsigned long size;
+
+	/* Offsets of the SOF0 and SOS segments, and of the entropy-coded data */
+	unsigned long sof, sos, data, data_end;
+};
+
+/*
+ * Quality picked for the previous frame, where the next search starts, and
+ * ratio between the real size and the preview estimate, in 1/1024 units.
+ */
+static atomic_int jpeg_last_quality;
+static atomic_uint jpeg_size_correction = 1024;
+
+static uint32_t preview_step(const struct kmsgrab_image *img)
+{
+	uint32_t nb_bands = (img->height + JPEG_BAND_HEIGHT - 1) / JPEG_BAND_HEIGHT;
+
+	/* Small pictures are estimated on the whole picture */
+	return nb_bands >= 2 * JPEG_PREVIEW_STEP ? JPEG_PREVIEW_STEP : 1;
+}
+
+/* MCU size for the luma sampling; jpeg_set_defaults() picks 4:2:0 */
+static uint32_t mcu_width(const struct kmsgrab_encode_opts *opts)
+{
+	return opts->subsampling == 444 ? DCTSIZE : 2 * DCTSIZE;
+}
+
+static uint32_t mcu_height(const struct kmsgrab_encode_opts *opts)
+{
+	return opts->subsampling == 444 || opts->subsampling == 422 ?
+		DCTSIZE : 2 * DCTSIZE;
+}
+
+static void compress_rows(FILE *file, unsigned char **buf, unsigned long *size,
+			  uint32_t width, JSAMPROW *rows, uint32_t height,
+			  int quality, const struct kmsgrab_encode_opts *opts)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+
+	if (file)
+		jpeg_stdio_dest(&cinfo, file);
+	else
+		jpeg_mem_dest(&cinfo, buf, size);
+
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+
+	switch (opts->dct) {
+	case KMSGRAB_DCT_ISLOW:
+		cinfo.dct_method = JDCT_ISLOW;
+		break;
+	case KMSGRAB_DCT_IFAST:
+		cinfo.dct_method = JDCT_IFAST;
+		break;
+	case KMSGRAB_DCT_FLOAT:
+		cinfo.dct_method = JDCT_FLOAT;
+		break;
+	default:
+		if (opts->effort >= 0 && opts->effort < 5)
+			cinfo.dct_method = JDCT_IFAST;
+		break;
+	}
+
+	if (opts->subsampling) {
+		cinfo.comp_info[0].h_samp_factor = mcu_width(opts) / DCTSIZE;
+		cinfo.comp_info[0].v_samp_factor = mcu_height(opts) / DCTSIZE;
+	}
+
+	cinfo.optimize_coding = !!opts->optimize_coding;
+	cinfo.smoothing_factor = opts->smoothing;
+
+	if (opts->progressive)
+		jpeg_simple_progression(&cinfo);
+
+	jpeg_start_compress(&cinfo, TRUE);
+
+	while (cinfo.next_scanline < cinfo.image_height)
+		jpeg_write_scanlines(&cinfo, rows + cinfo.next_scanline,
+				     cinfo.image_height - cinfo.next_scanline);
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+}
+
+static void *compress_strip(void *arg)
+{
+	struct jpeg_strip *strip = arg;
+
+	compress_rows(NULL, &strip->buf, &strip->size, strip->width,
+		      strip->rows, strip->height, strip->quality, strip->opts);
+	return NULL;
+}
+
+/* Locate the segments of a JPEG produced by compress_rows(). */
+static int parse_strip(struct jpeg_strip *strip)
+{
+	const unsigned char *buf = strip->buf;
+	unsigned long pos = 2, len;
+
+	strip->sof = 0;
+
+	while (pos + 4 <= strip->size && buf[pos] == 0xff) {
+		len = (unsigned long)buf[pos + 2] << 8 | buf[pos + 3];
+
+		if (buf[pos + 1] == JPEG_MARKER_SOF0)
+			strip->sof = pos;
+
+		if (buf[pos + 1] == JPEG_MARKER_SOS) {
+			strip->sos = pos;
+			strip->data = pos + 2 + len;
+			strip->data_end = strip->size - 2;
+
+			if (!strip->sof || strip->data > strip->data_end ||
+			    buf[strip->data_end] != 0xff ||
+			    buf[strip->data_end + 1] != JPEG_MARKER_EOI)
+				return -EINVAL;
+
+			return 0;
+		}
+
+		pos += 2 + len;
+	}
+
+	return -EINVAL;
+}
+
+static int join_strips(struct jpeg_strip *strips, unsigned int nb,
+		       uint32_t height, unsigned int restart_interval,
+		       unsigned char **out, unsigned long *out_size)
+{
+	const struct jpeg_strip *first = &strips[0];
+	unsigned long size, pos;
+	unsigned char *buf;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < nb; i++) {
+		err = parse_strip(&strips[i]);
+		if (err)
+			return err;
+	}
+
+	/* Headers, DRI segment, SOS, scans with a RSTn after each but the last, EOI */
+	size = first->data + 6 + 2 * nb;
+	for (i = 0; i < nb; i++)
+		size += strips[i].data_end - strips[i].data;
+
+	buf = malloc(size);
+	if (!buf)
+		return -ENOMEM;
+
+	memcpy(buf, first->buf, first->sos);
+	pos = first->sos;
+
+	/* SOF0: precision, then height */
+	buf[first->sof + 5] = height >> 8;
+	buf[first->sof + 6] = height & 0xff;
+
+	buf[pos++] = 0xff;
+	buf[pos++] = JPEG_MARKER_DRI;
+	buf[pos++] = 0;
+	buf[pos++] = 4;
+	buf[pos++] = restart_interval >> 8;
+	buf[pos++] = restart_interval & 0xff;
+
+	memcpy(buf + pos, first->buf + first->sos, first->data - first->sos);
+	pos += first->data - first->sos;
+
+	for (i = 0; i < nb; i++) {
+		memcpy(buf + pos, strips[i].buf + strips[i].data,
+		       strips[i].data_end - strips[i].data);
+		pos += strips[i].data_end - strips[i].data;
+
+		if (i + 1 < nb) {
+			buf[pos++] = 0xff;
+			buf[pos++] = JPEG_MARKER_RST0 + (i % 8);
+		}
+	}
+
+	buf[pos++] = 0xff;
+	buf[pos++] = JPEG_MARKER_EOI;
+
+	*out = buf;
+	*out_size = pos;
+	return 0;
+}
+
+/*
+ * Encode the picture into a memory buffer, in strips compressed in
+ * parallel when that is worth it.
+ */
+static int compress_image(unsigned char **buf, unsigned long *size,
+			  const struct kmsgrab_image *img, JSAMPROW *rows,
+			  int quality, const struct kmsgrab_encode_opts *opts)
+{
+	uint32_t mcus_per_row, mcu_rows, strip_mcu_rows, max_mcu_rows, y;
+	uint32_t mcu_w = mcu_width(opts), mcu_h = mcu_height(opts);
+	unsigned int i, nb = opts->threads;
+	struct jpeg_strip *strips;
+	int err;
+
+	mcus_per_row = (img->width + mcu_w - 1) / mcu_w;
+	mcu_rows = (img->height + mcu_h - 1) / mcu_h;
+
+	if (nb > mcu_rows)
+		nb = mcu_rows;
+
+	/* Strips must share their Huffman tables, and have a single scan */
+	if (opts->optimize_coding || opts->progressive)
+		nb = 1;
+
+	if (nb < 2) {
+		compress_rows(NULL, buf, size, img->width, rows, img->height,
+			      quality, opts);
+		return 0;
+	}
+
+	/* The restart interval, in MCUs, is a 16-bit field */
+	strip_mcu_rows = (mcu_rows + nb - 1) / nb;
+	max_mcu_rows = 0xffff / mcus_per_row;
+	if (strip_mcu_rows > max_mcu_rows)
+		strip_mcu_rows = max_mcu_rows;
+	nb = (mcu_rows + strip_mcu_rows - 1) / strip_mcu_rows;
+
+	strips = calloc(nb, sizeof(*strips));
+	if (!strips)
+		return -ENOMEM;
+
+	for (i = 0; i < nb; i++) {
+		y = i * strip_mcu_rows * mcu_h;
+
+		strips[i].width = img->width;
+		strips[i].height = img->height - y;
+		if (strips[i].height > strip_mcu_rows * mcu_h)
+			strips[i].height = strip_mcu_rows * mcu_h;
+		strips[i].rows = rows + y;
+		strips[i].quality = quality;
+		strips[i].opts = opts;
+
+		/* The first strip is encoded by the calling thread */
+		if (i)
+			strips[i].started = !pthread_create(&strips[i].thread,
+							     NULL, compress_strip,
+							     &strips[i]);
+	}
+
+	for (i = 0; i < nb; i++) {
+		if (strips[i].started)
+			pthread_join(strips[i].thread, NULL);
+		else
+			compress_strip(&strips[i]);
+	}
+
+	DBG("[debug] jpeg: %u strips of %"PRIu32" MCU rows\n", nb, strip_mcu_rows);
+
+	err = join_strips(strips, nb, img->height,
+			  strip_mcu_rows * mcus_per_row, buf, size);
+
+	for (i = 0; i < nb; i++)
+		free(strips[i].buf);
+	free(strips);
+
+	return err;
+}
+
+static unsigned long compressed_size(uint32_t width, JSAMPROW *rows,
+				     uint32_t height, int quality,
+				     const struct kmsgrab_encode_opts *opts)
+{
+	unsigned char *buf = NULL;
+	unsigned long size = 0;
+
+	compress_rows(NULL, &buf, &size, width, rows, height, quality, opts);
+	free(buf);
+
+	return size;
+}
+
+/*
+ * Pick the highest quality whose estimated size fits the target. Sizes are
+ * estimated on a preview made of full-resolution bands sampled over the
+ * picture, so that it has the same level of detail. The search starts from
+ * the quality of the previous frame, halves the distance to the bound until
+ * the target is bracketed, then interpolates between the closest qualities
+ * known to be under and over it.
+ */
+static int search_quality(const struct kmsgrab_image *img, JSAMPROW *rows,
+			  const struct kmsgrab_encode_opts *opts,
+			  unsigned long *estimate)
+{
+	uint32_t nb_bands, step, band, y, preview_h = 0;
+	unsigned long est, size_ok = 0, size_bad = 0;
+	int q, q_ok = 0, q_bad = 0, max_q = opts->quality;
+	unsigned int pass, correction;
+	JSAMPROW *preview;
+
+	nb_bands = (img->height + JPEG_BAND_HEIGHT - 1) / JPEG_BAND_HEIGHT;
+	step = preview_step(img);
+
+	preview = malloc(sizeof(*preview) * img->height);
+	if (!preview)
+		return -ENOMEM;
+
+	for (band = 0; band < nb_bands; band += step) {
+		for (y = band * JPEG_BAND_HEIGHT;
+		     y < (band + 1) * JPEG_BAND_HEIGHT && y < img->height; y++)
+			preview[preview_h++] = rows[y];
+	}
+
+	correction = step > 1 ? atomic_load(&jpeg_size_correction) : 1024;
+
+	q = atomic_load(&jpeg_last_quality);
+	if (q < 1 || q > max_q)
+		q = max_q;
+
+	for (pass = 0; pass < JPEG_MAX_PREVIEW_PASSES; pass++) {
+		est = compressed_size(img->width, preview, preview_h, q, opts);
+		est = (unsigned long)((unsigned long long)est * img->height / preview_h
+				      * correction / 1024);
+
+		if (est <= opts->target_size) {
+			q_ok = q;
+			size_ok = est;
+		} else {
+			q_bad = q;
+			size_bad = est;
+		}
+
+		if (q_ok == max_q || q_bad == 1 || (q_ok && q_bad == q_ok + 1))
+			break;
+
+		if (q_ok && q_bad) {
+			q = q_ok + (int)((unsigned long long)(opts->target_size - size_ok)
+					 * (q_bad - q_ok) / (size_bad - size_ok));
+			if (q <= q_ok)
+				q = q_ok + 1;
+			else if (q >= q_bad)
+				q = q_bad - 1;
+		} else if (q_ok) {
+			q = (q_ok + max_q + 1) / 2;
+		} else {
+			q = (q_bad + 1) / 2;
+		}
+	}
+
+	free(preview);
+
+	if (!q_ok) {
+		*estimate = size_bad;
+		return q_bad;
+	}
+
+	*estimate = size_ok;
+	return q_ok;
+}
+
+static int encode_jpeg_target(FILE *file, const struct kmsgrab_image *img,
+			      JSAMPROW *rows,
+			      const struct kmsgrab_encode_opts *opts)
+{
+	unsigned char *buf = NULL;
+	unsigned long size = 0, estimate;
+	unsigned int correction;
+	int q, ret = 0;
+
+	q = search_quality(img, rows, opts, &estimate);
+	if (q < 0)
+		return q;
+
+	ret = compress_image(&buf, &size, img, rows, q, opts);
+	if (ret)
+		return ret;
+
+	/* Learn how far off the preview was, for the next frames */
+	if (estimate && preview_step(img) > 1) {
+		correction = atomic_load(&jpeg_size_correction);
+		correction = (unsigned int)((correction * 3ull +
+			(unsigned long long)size * correction / estimate) / 4);
+		atomic_store(&jpeg_size_correction, correction ? correction : 1);
+	}
+
+	/* One last full pass when the estimate was way off */
+	if (size > opts->target_size + opts->target_size / 10 && q > 1) {
+		q = (int)((unsigned long long)q * opts->target_size / size);
+		if (q < 1)
+			q = 1;
+
+		free(buf);
+		buf = NULL;
+		size = 0;
+
+		ret = compress_image(&buf, &size, img, rows, q, opts);
+		if (ret)
+			return ret;
+	}
+
+	DBG("[debug] jpeg: target=%zu quality=%d size=%lu estimate=%lu\n",
+	    opts->target_size, q, size, estimate);
+
+	atomic_store(&jpeg_last_quality, q);
+
+	if (fwrite(buf, 1, size, file) != size)
+		ret = -EIO;
+
+	free(buf);
+	return ret;
+}
+
+static int encode_jpeg(FILE *file, const struct kmsgrab_image *img,
+		       const struct kmsgrab_encode_opts *opts)
+{
+	unsigned char *buf = NULL;
+	unsigned long size = 0;
+	JSAMPROW *rows;
+	unsigned int i;
+	int ret = 0;
+
+	rows = malloc(sizeof(*rows) * img->height);
+	if (!rows)
+		return -ENOMEM;
+
+	for (i = 0; i < img->height; i++)
+		rows[i] = (JSAMPROW)(img->pixels + i * img->stride);
+
+	if (opts->target_size) {
+		ret = encode_jpeg_target(file, img, rows, opts);
+	} else if (opts->threads > 1 && !opts->optimize_coding &&
+		   !opts->progressive) {
+		DBG("[debug] jpeg: quality=%d threads=%u\n",
+		    opts->quality, opts->threads);
+
+		ret = compress_image(&buf, &size, img, rows, opts->quality, opts);
+		if (!ret && fwrite(buf, 1, size, file) != size)
+			ret = -EIO;
+		free(buf);
+	} else {
+		DBG("[debug] jpeg: quality=%d\n", opts->quality);
+
+		compress_rows(file, NULL, NULL, img->width, rows, img->height,
+			      opts->quality, opts);
+	}
+
+	free(rows);
+	return ret;
+}
+
+const struct kmsgrab_encoder kmsgrab_encoder_jpeg = {
+	.name = "jpeg",
+	.write = encode_jpeg,
+};
@@ -0,0 +1,154 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - JPEG XL encoder
+ *
+ * Lossless only, at effort 1 or 2 by default: libjxl then uses its fast
+ * lossless path, which encodes screen content several times faster than zlib
+ * and into smaller files than PNG. The encoding is spread over libjxl's
+ * thread pool.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <jxl/encode.h>
+#include <jxl/thread_parallel_runner.h>
+#include <stdlib.h>
+
+#include "kmsgrab.h"
+
+#define JXL_OUTPUT_CHUNK	(256 * 1024)
+
+/* libjxl's effort goes from 1 (fastest) to 9; fast lossless is 1 and 2 */
+#define JXL_DEFAULT_EFFORT	2
+#define JXL_MAX_EFFORT		9
+
+static int jxl_effort(const struct kmsgrab_encode_opts *opts)
+{
+	if (opts->effort < 0)
+		return JXL_DEFAULT_EFFORT;
+	if (opts->effort < 1)
+		return 1;
+	if (opts->effort > JXL_MAX_EFFORT)
+		return JXL_MAX_EFFORT;
+
+	return opts->effort;
+}
+
+static int write_output(FILE *file, JxlEncoder *enc)
+{
+	JxlEncoderStatus status;
+	uint8_t *buf, *next;
+	size_t avail;
+	int ret = 0;
+
+	buf = malloc(JXL_OUTPUT_CHUNK);
+	if (!buf)
+		return -ENOMEM;
+
+	do {
+		next = buf;
+		avail = JXL_OUTPUT_CHUNK;
+
+		status = JxlEncoderProcessOutput(enc, &next, &avail);
+		if (status == JXL_ENC_ERROR) {
+			ret = -EIO;
+			break;
+		}
+
+		if (next > buf && fwrite(buf, next - buf, 1, file) != 1) {
+			ret = -EIO;
+			break;
+		}
+	} while (status == JXL_ENC_NEED_MORE_OUTPUT);
+
+	free(buf);
+	return ret;
+}
+
+static int encode_jxl(FILE *file, const struct kmsgrab_image *img,
+		      const struct kmsgrab_encode_opts *opts)
+{
+	JxlPixelFormat format = {
+		.num_channels = 3,
+		.data_type = JXL_TYPE_UINT8,
+		.endianness = JXL_NATIVE_ENDIAN,
+		/* Rows are padded up to a multiple of this, i.e. to the stride */
+		.align = img->stride,
+	};
+	JxlEncoderFrameSettings *settings;
+	JxlColorEncoding color;
+	JxlBasicInfo info;
+	JxlEncoder *enc;
+	size_t threads;
+	void *runner;
+	int ret = -ENOMEM;
+
+	threads = opts->threads ? opts->threads
+		: JxlThreadParallelRunnerDefaultNumWorkerThreads();
+
+	runner = JxlThreadParallelRunnerCreate(NULL, threads);
+	if (!runner)
+		return -ENOMEM;
+
+	enc = JxlEncoderCreate(NULL);
+	if (!enc)
+		goto out_destroy_runner;
+
+	if (JxlEncoderSetParallelRunner(enc, JxlThreadParallelRunner, runner)) {
+		ret = -EINVAL;
+		goto out_destroy_encoder;
+	}
+
+	JxlEncoderInitBasicInfo(&info);
+	info.xsize = img->width;
+	info.ysize = img->height;
+	info.bits_per_sample = 8;
+	info.num_color_channels = 3;
+	info.uses_original_profile = JXL_TRUE;
+
+	JxlColorEncodingSetToSRGB(&color, JXL_FALSE);
+
+	if (JxlEncoderSetBasicInfo(enc, &info) ||
+	    JxlEncoderSetColorEncoding(enc, &color)) {
+		ret = -EINVAL;
+		goto out_destroy_encoder;
+	}
+
+	settings = JxlEncoderFrameSettingsCreate(enc, NULL);
+	if (!settings)
+		goto out_destroy_encoder;
+
+	if (JxlEncoderSetFrameLossless(settings, JXL_TRUE) ||
+	    JxlEncoderFrameSettingsSetOption(settings,
+					     JXL_ENC_FRAME_SETTING_EFFORT,
+					     jxl_effort(opts))) {
+		ret = -EINVAL;
+		goto out_destroy_encoder;
+	}
+
+	DBG("[debug] jxl: encoding %"PRIu32"x%"PRIu32" effort=%d threads=%zu\n",
+	    img->width, img->height, jxl_effort(opts), threads);
+
+	if (JxlEncoderAddImageFrame(settings, &format, img->pixels,
+				    img->stride * img->height)) {
+		ret = -EINVAL;
+		goto out_destroy_encoder;
+	}
+
+	JxlEncoderCloseInput(enc);
+
+	ret = write_output(file, enc);
+
+out_destroy_encoder:
+	JxlEncoderDestroy(enc);
+out_destroy_runner:
+	JxlThreadParallelRunnerDestroy(runner);
+	return ret;
+}
+
+const struct kmsgrab_encoder kmsgrab_encoder_jxl = {
+	.name = "jxl",
+	.write = encode_jxl,
+};
@@ -0,0 +1,466 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - PNG encoder
+ *
+ * Pictures with no more than 256 colors (typical of flat UIs) are written
+ * with a palette and 1, 2, 4 or 8 bits per pixel, which gives deflate three
+ * times less data or more to chew on. The colors are counted in a small
+ * open-addressing hash set, skipping runs of identical pixels, and the count
+ * stops at the 257th color. Optionally, other pictures are quantized to 256
+ * colors with a median cut over a 15-bit histogram.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <png.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kmsgrab.h"
+#include "png_write.h"
+
+/* Twice the maximum number of colors, to keep the probe sequences short */
+#define PALETTE_HASH_BITS	9
+#define PALETTE_HASH_SIZE	(1 << PALETTE_HASH_BITS)
+
+/* Bits kept per channel in the quantization histogram */
+#define QUANT_BITS		5
+#define QUANT_LEVELS		(1 << QUANT_BITS)
+#define QUANT_BINS		(1 << (3 * QUANT_BITS))
+
+static inline uint32_t pixel_key(const uint8_t *px)
+{
+	/* The top byte tells used slots of the hash set from empty ones */
+	return 0xff000000 | px[0] << 16 | px[1] << 8 | px[2];
+}
+
+static inline unsigned int pixel_hash(uint32_t key)
+{
+	return (key * 0x9e3779b1u) >> (32 - PALETTE_HASH_BITS);
+}
+
+/*
+ * Write the palette index of each pixel to @indices.
+ * Returns -E2BIG as soon as the picture is found to have too many colors.
+ */
+static int index_colors(const struct kmsgrab_image *img, uint8_t *indices,
+			struct palette *pal)
+{
+	uint32_t keys[PALETTE_HASH_SIZE] = { 0 };
+	uint8_t values[PALETTE_HASH_SIZE];
+	uint32_t x, y, key, last = 0;
+	const uint8_t *row;
+	unsigned int slot;
+	uint8_t idx = 0;
+
+	pal->nb = 0;
+
+	for (y = 0; y < img->height; y++) {
+		row = (const uint8_t *)img->pixels + y * img->stride;
+
+		for (x = 0; x < img->width; x++, indices++) {
+			key = pixel_key(&row[x * 3]);
+
+			if (key != last) {
+				slot = pixel_hash(key);
+
+				while (keys[slot] && keys[slot] != key)
+					slot = (slot + 1) & (PALETTE_HASH_SIZE - 1);
+
+				if (!keys[slot]) {
+					if (pal->nb == PALETTE_MAX_COLORS)
+						return -E2BIG;
+
+					keys[slot] = key;
+					values[slot] = (uint8_t)pal->nb;
+					pal->colors[pal->nb].red = row[x * 3];
+					pal->colors[pal->nb].green = row[x * 3 + 1];
+					pal->colors[pal->nb].blue = row[x * 3 + 2];
+					pal->nb++;
+				}
+
+				idx = values[slot];
+				last = key;
+			}
+
+			*indices = idx;
+		}
+	}
+
+	return 0;
+}
+
+static inline unsigned int quant_bin(const uint8_t *px)
+{
+	return (px[0] >> (8 - QUANT_BITS)) << (2 * QUANT_BITS)
+		| (px[1] >> (8 - QUANT_BITS)) << QUANT_BITS
+		| px[2] >> (8 - QUANT_BITS);
+}
+
+static inline unsigned int bin_channel(unsigned int bin, unsigned int c)
+{
+	return (bin >> ((2 - c) * QUANT_BITS)) & (QUANT_LEVELS - 1);
+}
+
+struct quant_box {
+	unsigned int start, end;
+	uint8_t min[3], max[3];
+};
+
+static void box_bounds(struct quant_box *box, const uint16_t *bins)
+{
+	unsigned int i, c, v;
+
+	for (c = 0; c < 3; c++) {
+		box->min[c] = QUANT_LEVELS - 1;
+		box->max[c] = 0;
+	}
+
+	for (i = box->start; i < box->end; i++) {
+		for (c = 0; c < 3; c++) {
+			v = bin_channel(bins[i], c);
+			if (v < box->min[c])
+				box->min[c] = v;
+			if (v > box->max[c])
+				box->max[c] = v;
+		}
+	}
+}
+
+/* Widest channel of the box, or -1 if the box can't be split */
+static int box_axis(const struct quant_box *box, unsigned int *extent)
+{
+	int best = 0, axis = -1;
+	unsigned int c;
+
+	if (box->end - box->start < 2)
+		return -1;
+
+	for (c = 0; c < 3; c++) {
+		if (box->max[c] - box->min[c] >= best) {
+			best = box->max[c] - box->min[c];
+			axis = c;
+		}
+	}
+
+	*extent = best;
+	return axis;
+}
+
+/* Counting sort of the bins of a box along one channel */
+static void sort_box(const struct quant_box *box, uint16_t *bins,
+		     uint16_t *tmp, unsigned int axis)
+{
+	unsigned int offsets[QUANT_LEVELS] = { 0 };
+	unsigned int i, v, sum = 0, count;
+
+	for (i = box->start; i < box->end; i++)
+		offsets[bin_channel(bins[i], axis)]++;
+
+	for (v = 0; v < QUANT_LEVELS; v++) {
+		count = offsets[v];
+		offsets[v] = sum;
+		sum += count;
+	}
+
+	for (i = box->start; i < box->end; i++)
+		tmp[offsets[bin_channel(bins[i], axis)]++] = bins[i];
+
+	memcpy(&bins[box->start], tmp, sum * sizeof(*bins));
+}
+
+/*
+ * Median cut: split the box with the widest color range at the median pixel
+ * along that range, until there are 256 boxes; each box becomes one palette
+ * entry, averaged over its pixels.
+ */
+static int quantize_colors(const struct kmsgrab_image *img, uint8_t *indices,
+			   struct palette *pal)
+{
+	struct quant_box boxes[PALETTE_MAX_COLORS], *box;
+	unsigned int i, c, nb_bins = 0, nb_boxes = 1, extent, best_extent;
+	uint64_t half, sum, total, acc[3];
+	uint16_t *bins, *tmp;
+	uint32_t *hist, x, y;
+	uint8_t *map;
+	const uint8_t *row;
+	int axis, best;
+	int ret = -ENOMEM;
+
+	hist = calloc(QUANT_BINS, sizeof(*hist));
+	bins = malloc(QUANT_BINS * sizeof(*bins));
+	tmp = malloc(QUANT_BINS * sizeof(*tmp));
+	map = malloc(QUANT_BINS);
+	if (!hist || !bins || !tmp || !map)
+		goto out_free;
+
+	for (y = 0; y < img->height; y++) {
+		row = (const uint8_t *)img->pixels + y * img->stride;
+
+		for (x = 0; x < img->width; x++)
+			hist[quant_bin(&row[x * 3])]++;
+	}
+
+	for (i = 0; i < QUANT_BINS; i++) {
+		if (hist[i])
+			bins[nb_bins++] = (uint16_t)i;
+	}
+
+	boxes[0].start = 0;
+	boxes[0].end = nb_bins;
+	box_bounds(&boxes[0], bins);
+
+	while (nb_boxes < PALETTE_MAX_COLORS) {
+		best = -1;
+		best_extent = 0;
+
+		for (i = 0; i < nb_boxes; i++) {
+			if (box_axis(&boxes[i], &extent) >= 0 &&
+			    (best < 0 || extent > best_extent)) {
+				best = (int)i;
+				best_extent = extent;
+			}
+		}
+
+		if (best < 0)
+			break;
+
+		box = &boxes[best];
+		axis = box_axis(box, &extent);
+		sort_box(box, bins, tmp, (unsigned int)axis);
+
+		for (total = 0, i = box->start; i < box->end; i++)
+			total += hist[bins[i]];
+
+		/* Keep at least one bin on each side */
+		half = total / 2;
+		sum = hist[bins[box->start]];
+		for (i = box->start + 1; i < box->end - 1 && sum < half; i++)
+			sum += hist[bins[i]];
+
+		boxes[nb_boxes].start = i;
+		boxes[nb_boxes].end = box->end;
+		box->end = i;
+
+		box_bounds(box, bins);
+		box_bounds(&boxes[nb_boxes], bins);
+		nb_boxes++;
+	}
+
+	for (pal->nb = 0; pal->nb < nb_boxes; pal->nb++) {
+		box = &boxes[pal->nb];
+		total = 0;
+		acc[0] = acc[1] = acc[2] = 0;
+
+		for (i = box->start; i < box->end; i++) {
+			map[bins[i]] = (uint8_t)pal->nb;
+			total += hist[bins[i]];
+
+			/* Center of the bin */
+			for (c = 0; c < 3; c++) {
+				acc[c] += (uint64_t)hist[bins[i]] *
+					(bin_channel(bins[i], c) << (8 - QUANT_BITS)
+					 | 1 << (7 - QUANT_BITS));
+			}
+		}
+
+		pal->colors[pal->nb].red = (png_byte)(acc[0] / total);
+		pal->colors[pal->nb].green = (png_byte)(acc[1] / total);
+		pal->colors[pal->nb].blue = (png_byte)(acc[2] / total);
+	}
+
+	for (y = 0; y < img->height; y++) {
+		row = (const uint8_t *)img->pixels + y * img->stride;
+
+		for (x = 0; x < img->width; x++)
+			*indices++ = map[quant_bin(&row[x * 3])];
+	}
+
+	DBG("[debug] png: quantized %u color bins to %u colors\n", nb_bins, pal->nb);
+
+	ret = 0;
+
+out_free:
+	free(map);
+	free(tmp);
+	free(bins);
+	free(hist);
+	return ret;
+}
+
+static int palette_depth(const struct palette *pal)
+{
+	if (pal->nb <= 2)
+		return 1;
+	if (pal->nb <= 4)
+		return 2;
+	if (pal->nb <= 16)
+		return 4;
+	return 8;
+}
+
+#ifndef KMSGRAB_PNG_DIRECT
+static int write_libpng(FILE *file, const struct kmsgrab_image *img,
+			const struct palette *pal, uint8_t *indices,
+			const struct kmsgrab_encode_opts *opts)
+{
+	png_bytep *row_pointers;
+	png_structp png;
+	png_infop info;
+	unsigned int i;
+	int ret;
+
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+				NULL, NULL, NULL);
+	if (!png)
+		return -ENOMEM;
+
+	info = png_create_info_struct(png);
+	if (!info) {
+		ret = -ENOMEM;
+		goto out_free_png;
+	}
+
+	row_pointers = malloc(sizeof(*row_pointers) * img->height);
+	if (!row_pointers) {
+		ret = -ENOMEM;
+		goto out_free_info;
+	}
+
+	png_init_io(png, file);
+
+	if (pal) {
+		for (i = 0; i < img->height; i++)
+			row_pointers[i] = indices + (size_t)i * img->width;
+
+		png_set_IHDR(png, info, img->width, img->height,
+					palette_depth(pal),
+					PNG_COLOR_TYPE_PALETTE,
+					PNG_INTERLACE_NONE,
+					PNG_COMPRESSION_TYPE_BASE,
+					PNG_FILTER_TYPE_BASE);
+		png_set_PLTE(png, info, pal->colors, (int)pal->nb);
+	} else {
+		for (i = 0; i < img->height; i++)
+			row_pointers[i] = (png_bytep)img->pixels + i * img->stride;
+
+		png_set_IHDR(png, info, img->width, img->height, 8,
+					PNG_COLOR_TYPE_RGB,
+					PNG_INTERLACE_NONE,
+					PNG_COMPRESSION_TYPE_BASE,
+					PNG_FILTER_TYPE_BASE);
+	}
+
+	if (opts->effort >= 0) {
+		png_set_compression_level(png, opts->effort);
+
+		/* Adaptive filtering costs more than the deflate level itself */
+		if (opts->effort < 3 && !pal)
+			png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+	}
+
+	png_write_info(png, info);
+
+	/* One index per byte in, packed to the bit depth by libpng */
+	if (pal)
+		png_set_packing(png);
+
+	png_write_image(png, row_pointers);
+	png_write_end(png, info);
+
+	ret = 0;
+
+	free(row_pointers);
+out_free_info:
+	png_destroy_write_struct(NULL, &info);
+out_free_png:
+	png_destroy_write_struct(&png, NULL);
+	return ret;
+}
+#endif /* !KMSGRAB_PNG_DIRECT */
+
+static int encode_png(FILE *file, const struct kmsgrab_image *img,
+		      const struct kmsgrab_encode_opts *opts)
+{
+	struct palette pal, *used_pal = NULL;
+	uint8_t *indices = NULL;
+	int ret;
+
+	if (opts->palette != KMSGRAB_PALETTE_OFF) {
+		indices = malloc((size_t)img->width * img->height);
+		if (!indices)
+			return -ENOMEM;
+
+		ret = index_colors(img, indices, &pal);
+		if (ret == -E2BIG && opts->palette == KMSGRAB_PALETTE_LOSSY)
+			ret = quantize_colors(img, indices, &pal);
+
+		if (ret == -ENOMEM)
+			goto out_free_indices;
+
+		if (!ret)
+			used_pal = &pal;
+	}
+
+	if (used_pal) {
+		DBG("[debug] png: writing palette PNG rows=%"PRIu32" colors=%u depth=%d\n",
+			img->height, pal.nb, palette_depth(&pal));
+	} else {
+		DBG("[debug] png: writing PNG rows=%"PRIu32" row_bytes=%"PRIu32"\n",
+			img->height, img->width * 3);
+	}
+
+#ifdef KMSGRAB_PNG_DIRECT
+	ret = png_write_direct(file, img, used_pal, indices,
+			       used_pal ? palette_depth(used_pal) : 8,
+			       opts->effort);
+#else
+	ret = write_libpng(file, img, used_pal, indices, opts);
+#endif
+
+out_free_indices:
+	free(indices);
+	return ret;
+}
+
+static int read_png(FILE *file, uint8_t **pixels, uint32_t *width,
+		    uint32_t *height)
+{
+	png_image image = { .version = PNG_IMAGE_VERSION };
+	png_color black = { 0 };
+	uint8_t *buf;
+
+	if (!png_image_begin_read_from_stdio(&image, file)) {
+		DBG("[debug] png: %s\n", image.message);
+		return -EINVAL;
+	}
+
+	/* Gray and palette pictures are expanded, alpha goes over black */
+	image.format = PNG_FORMAT_RGB;
+
+	buf = malloc(PNG_IMAGE_SIZE(image));
+	if (!buf) {
+		png_image_free(&image);
+		return -ENOMEM;
+	}
+
+	if (!png_image_finish_read(&image, &black, buf, 0, NULL)) {
+		DBG("[debug] png: %s\n", image.message);
+		free(buf);
+		return -EINVAL;
+	}
+
+	*pixels = buf;
+	*width = image.width;
+	*height = image.height;
+
+	return 0;
+}
+
+const struct kmsgrab_encoder kmsgrab_encoder_png = {
+	.name = "png",
+	.write = encode_png,
+	.read = read_png,
+};
@@ -0,0 +1,406 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - compressed raw encoder
+ *
+ * For shipping frames to a server, where PNG is too slow and plain pixels
+ * too big: the converted frame is cut into bands of about RAW_CHUNK_SIZE
+ * bytes, compressed at a fast level of LZ4 or zstd (chosen at build time) by
+ * a pool of threads that take the next band until there are none left. On
+ * screen content, that is a 5-20x reduction at close to memcpy() speed. The
+ * file format is described in kmsgrab-raw.h.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(KMSGRAB_RAW_LZ4)
+#include <lz4.h>
+#include <lz4hc.h>
+#elif defined(KMSGRAB_RAW_ZSTD)
+#include <zstd.h>
+#else
+#error "No compression library selected for the raw encoder"
+#endif
+
+#include "kmsgrab.h"
+#include "kmsgrab-raw.h"
+
+/* Uncompressed size of a chunk, rounded to whole lines */
+#define RAW_CHUNK_SIZE		(512 * 1024)
+
+/* Effort from which LZ4 switches to its HC compressor, at that level */
+#define RAW_LZ4_HC_EFFORT	3
+
+struct raw_chunk {
+	uint8_t *buf;
+	size_t size;
+	int err;
+};
+
+struct raw_job {
+	const struct kmsgrab_image *img;
+	int effort;
+
+	uint32_t chunk_rows, nb_chunks;
+	struct raw_chunk *chunks;
+	atomic_uint next;
+};
+
+#if defined(KMSGRAB_RAW_LZ4)
+#define RAW_CODEC		KMSGRAB_RAW_CODEC_LZ4
+
+static int codec_init(void **ctx)
+{
+	/* LZ4 keeps its state on the stack */
+	*ctx = NULL;
+	return 0;
+}
+
+static void codec_free(void *ctx)
+{
+	(void)ctx;
+}
+
+static size_t codec_bound(size_t len)
+{
+	return LZ4_compressBound((int)len);
+}
+
+static int codec_compress(void *ctx, void *dst, size_t cap, const void *src,
+			  size_t len, int effort, size_t *size)
+{
+	int ret;
+
+	(void)ctx;
+
+	if (effort >= RAW_LZ4_HC_EFFORT)
+		ret = LZ4_compress_HC(src, dst, (int)len, (int)cap, effort);
+	else
+		ret = LZ4_compress_default(src, dst, (int)len, (int)cap);
+	if (ret <= 0)
+		return -EIO;
+
+	*size = ret;
+	return 0;
+}
+
+static int codec_decompress(void *dst, size_t len, const void *src,
+			    size_t size)
+{
+	int ret = LZ4_decompress_safe(src, dst, (int)size, (int)len);
+
+	return ret == (int)len ? 0 : -EINVAL;
+}
+#else
+#define RAW_CODEC		KMSGRAB_RAW_CODEC_ZSTD
+
+static int codec_init(void **ctx)
+{
+	*ctx = ZSTD_createCCtx();
+	return *ctx ? 0 : -ENOMEM;
+}
+
+static void codec_free(void *ctx)
+{
+	ZSTD_freeCCtx(ctx);
+}
+
+static size_t codec_bound(size_t len)
+{
+	return ZSTD_compressBound(len);
+}
+
+static int codec_compress(void *ctx, void *dst, size_t cap, const void *src,
+			  size_t len, int effort, size_t *size)
+{
+	/* Level 0 is zstd's default (3); the fastest is the negative ones */
+	size_t ret = ZSTD_compressCCtx(ctx, dst, cap, src, len,
+				       effort ? effort : -1);
+
+	if (ZSTD_isError(ret))
+		return -EIO;
+
+	*size = ret;
+	return 0;
+}
+
+static int codec_decompress(void *dst, size_t len, const void *src,
+			    size_t size)
+{
+	size_t ret = ZSTD_decompress(dst, len, src, size);
+
+	return !ZSTD_isError(ret) && ret == len ? 0 : -EINVAL;
+}
+#endif
+
+static int raw_effort(const struct kmsgrab_encode_opts *opts)
+{
+	/* The default is the fastest level that still compresses well */
+	if (opts->effort < 0)
+		return 1;
+	if (opts->effort > 9)
+		return 9;
+
+	return opts->effort;
+}
+
+static int compress_chunk(struct raw_job *job, void *ctx, uint32_t i)
+{
+	const struct kmsgrab_image *img = job->img;
+	struct raw_chunk *chunk = &job->chunks[i];
+	size_t line = (size_t)img->width * 3, len, cap;
+	uint32_t y = i * job->chunk_rows, rows, row;
+	const uint8_t *src = img->pixels + y * img->stride;
+	uint8_t *packed = NULL;
+	int err;
+
+	rows = img->height - y;
+	if (rows > job->chunk_rows)
+		rows = job->chunk_rows;
+	len = line * rows;
+
+	/* Lines are stored without the padding of the converted picture */
+	if (img->stride != line) {
+		packed = malloc(len);
+		if (!packed)
+			return -ENOMEM;
+
+		for (row = 0; row < rows; row++)
+			memcpy(packed + row * line, src + row * img->stride, line);
+		src = packed;
+	}
+
+	cap = codec_bound(len);
+	chunk->buf = malloc(cap);
+	if (!chunk->buf) {
+		free(packed);
+		return -ENOMEM;
+	}
+
+	err = codec_compress(ctx, chunk->buf, cap, src, len, job->effort,
+			     &chunk->size);
+
+	free(packed);
+	return err;
+}
+
+static void *compress_chunks(void *arg)
+{
+	struct raw_job *job = arg;
+	int err;
+	uint32_t i;
+	void *ctx;
+
+	err = codec_init(&ctx);
+
+	/* Without a context, the chunks taken fail and the others go on */
+	while ((i = atomic_fetch_add(&job->next, 1)) < job->nb_chunks)
+		job->chunks[i].err = err ? err : compress_chunk(job, ctx, i);
+
+	if (!err)
+		codec_free(ctx);
+	return NULL;
+}
+
+static unsigned int raw_threads(const struct kmsgrab_encode_opts *opts,
+				uint32_t nb_chunks)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int nb = opts->threads;
+
+	if (!nb)
+		nb = cpus > 0 ? (unsigned int)cpus : 1;
+	if (nb > nb_chunks)
+		nb = nb_chunks;
+
+	return nb;
+}
+
+static int write_chunks(FILE *file, const struct raw_job *job)
+{
+	const struct kmsgrab_image *img = job->img;
+	struct kmsgrab_raw_header hdr = {
+		.magic = htole32(KMSGRAB_RAW_MAGIC),
+		.version = htole16(KMSGRAB_RAW_VERSION),
+		.codec = htole16(RAW_CODEC),
+		.format = htole32(KMSGRAB_RAW_FORMAT_RGB888),
+		.width = htole32(img->width),
+		.height = htole32(img->height),
+		.stride = htole32(img->width * 3),
+		.chunk_rows = htole32(job->chunk_rows),
+		.nb_chunks = htole32(job->nb_chunks),
+	};
+	uint32_t i, size;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1)
+		return -EIO;
+
+	for (i = 0; i < job->nb_chunks; i++) {
+		size = htole32((uint32_t)job->chunks[i].size);
+		if (fwrite(&size, sizeof(size), 1, file) != 1)
+			return -EIO;
+	}
+
+	for (i = 0; i < job->nb_chunks; i++) {
+		if (fwrite(job->chunks[i].buf, 1, job->chunks[i].size,
+			   file) != job->chunks[i].size)
+			return -EIO;
+	}
+
+	return 0;
+}
+
+static int encode_raw(FILE *file, const struct kmsgrab_image *img,
+		      const struct kmsgrab_encode_opts *opts)
+{
+	struct raw_job job = {
+		.img = img,
+		.effort = raw_effort(opts),
+	};
+	size_t line = (size_t)img->width * 3, total = 0;
+	unsigned int i, nb_threads;
+	pthread_t *threads;
+	int ret = 0;
+
+	job.chunk_rows = RAW_CHUNK_SIZE / line;
+	if (!job.chunk_rows)
+		job.chunk_rows = 1;
+	job.nb_chunks = (img->height + job.chunk_rows - 1) / job.chunk_rows;
+	atomic_init(&job.next, 0);
+
+	job.chunks = calloc(job.nb_chunks, sizeof(*job.chunks));
+	if (!job.chunks)
+		return -ENOMEM;
+
+	nb_threads = raw_threads(opts, job.nb_chunks);
+
+	threads = calloc(nb_threads, sizeof(*threads));
+	if (!threads) {
+		free(job.chunks);
+		return -ENOMEM;
+	}
+
+	/* The calling thread compresses its share too */
+	for (i = 1; i < nb_threads; i++)
+		if (pthread_create(&threads[i], NULL, compress_chunks, &job))
+			break;
+	nb_threads = i;
+
+	compress_chunks(&job);
+
+	for (i = 1; i < nb_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	for (i = 0; !ret && i < job.nb_chunks; i++) {
+		ret = job.chunks[i].err;
+		total += job.chunks[i].size;
+	}
+
+	if (!ret) {
+		DBG("[debug] raw: %"PRIu32" chunks of %"PRIu32" lines, %u threads, "
+		    "effort %d, %zu -> %zu bytes\n", job.nb_chunks, job.chunk_rows,
+		    nb_threads, job.effort, line * img->height, total);
+
+		ret = write_chunks(file, &job);
+	}
+
+	for (i = 0; i < job.nb_chunks; i++)
+		free(job.chunks[i].buf);
+	free(job.chunks);
+	free(threads);
+
+	return ret;
+}
+
+static int read_raw(FILE *file, uint8_t **pixels, uint32_t *width,
+		    uint32_t *height)
+{
+	struct kmsgrab_raw_header hdr;
+	uint32_t i, rows, *sizes = NULL;
+	size_t stride, max = 0;
+	uint8_t *buf = NULL, *data = NULL;
+	int ret = -EINVAL;
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1)
+		return -EINVAL;
+
+	hdr.width = le32toh(hdr.width);
+	hdr.height = le32toh(hdr.height);
+	hdr.stride = le32toh(hdr.stride);
+	hdr.chunk_rows = le32toh(hdr.chunk_rows);
+	hdr.nb_chunks = le32toh(hdr.nb_chunks);
+	stride = (size_t)hdr.width * 3;
+
+	if (le32toh(hdr.magic) != KMSGRAB_RAW_MAGIC ||
+	    le16toh(hdr.version) != KMSGRAB_RAW_VERSION ||
+	    le32toh(hdr.format) != KMSGRAB_RAW_FORMAT_RGB888 ||
+	    !hdr.width || !hdr.height || hdr.stride != stride ||
+	    !hdr.chunk_rows || hdr.nb_chunks !=
+	    (hdr.height + hdr.chunk_rows - 1) / hdr.chunk_rows)
+		return -EINVAL;
+
+	if (le16toh(hdr.codec) != RAW_CODEC) {
+		DBG("[debug] raw: codec %u not supported\n", le16toh(hdr.codec));
+		return -ENOTSUP;
+	}
+
+	sizes = malloc(hdr.nb_chunks * sizeof(*sizes));
+	data = malloc(stride * hdr.height);
+	if (!sizes || !data) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	if (fread(sizes, sizeof(*sizes), hdr.nb_chunks, file) != hdr.nb_chunks)
+		goto out_free;
+
+	for (i = 0; i < hdr.nb_chunks; i++) {
+		sizes[i] = le32toh(sizes[i]);
+		if (sizes[i] > max)
+			max = sizes[i];
+	}
+
+	buf = malloc(max);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	for (i = 0; i < hdr.nb_chunks; i++) {
+		rows = hdr.height - i * hdr.chunk_rows;
+		if (rows > hdr.chunk_rows)
+			rows = hdr.chunk_rows;
+
+		if (fread(buf, 1, sizes[i], file) != sizes[i] ||
+		    codec_decompress(data + i * hdr.chunk_rows * stride,
+				     rows * stride, buf, sizes[i]))
+			goto out_free;
+	}
+
+	*pixels = data;
+	*width = hdr.width;
+	*height = hdr.height;
+	data = NULL;
+	ret = 0;
+
+out_free:
+	free(buf);
+	free(data);
+	free(sizes);
+	return ret;
+}
+
+const struct kmsgrab_encoder kmsgrab_encoder_raw = {
+	.name = "raw",
+	.write = encode_raw,
+	.read = read_raw,
+};
@@ -0,0 +1,310 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - CPU budget governor
+ *
+ * Every grab accounts for the CPU time of its readback and of its encoding.
+ * When the average cost exceeds the budget at the nominal rate (or a grab
+ * misses its deadline), the governor steps down a ladder of cheaper settings:
+ * faster encoder effort first, then lower JPEG quality, then a smaller output.
+ * Whatever the step, captures are spaced so that the average CPU use never
+ * exceeds the budget; when the cost falls well below it, the ladder is
+ * climbed back one step at a time.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "governor.h"
+
+/* Frames to let the averages settle after a change of step */
+#define GOVERNOR_HOLD_FRAMES	4
+
+/* Frames well within budget before stepping back up */
+#define GOVERNOR_CALM_FRAMES	16
+
+/* The JPEG quality is never lowered below this */
+#define GOVERNOR_MIN_QUALITY	20
+
+static const struct governor_level {
+	int effort;
+	int quality_drop;
+	unsigned int scale_pct;
+} governor_levels[] = {
+	{ -1,  0, 100 },
+	{  3,  0, 100 },
+	{  1, 15, 100 },
+	{  1, 15,  75 },
+	{  1, 30,  50 },
+	{  0, 30,  35 },
+	{  0, 40,  25 },
+};
+
+#define GOVERNOR_NB_LEVELS \
+	(sizeof(governor_levels) / sizeof(governor_levels[0]))
+
+static uint64_t timespec_diff_ns(const struct timespec *a,
+				 const struct timespec *b)
+{
+	int64_t ns = (int64_t)(a->tv_sec - b->tv_sec) * 1000000000ll
+		+ (a->tv_nsec - b->tv_nsec);
+
+	return ns > 0 ? (uint64_t)ns : 0;
+}
+
+static void running_average(uint64_t *avg, uint64_t sample)
+{
+	if (!*avg)
+		*avg = sample;
+	else
+		*avg = *avg - *avg / 4 + sample / 4;
+}
+
+static int governor_enabled(const struct governor *gov)
+{
+	return gov->budget_pct || gov->deadline_ms;
+}
+
+/* Minimum time between two captures to stay within the budget. */
+static uint64_t governor_spacing_ns(const struct governor *gov)
+{
+	if (!gov->budget_pct)
+		return 0;
+
+	return gov->cost_ns * 100 / gov->budget_pct;
+}
+
+void governor_init(struct governor *gov, unsigned int budget_pct,
+		   unsigned int deadline_ms, unsigned int interval_ms,
+		   const struct kmsgrab_encode_opts *opts)
+{
+	memset(gov, 0, sizeof(*gov));
+
+	gov->budget_pct = budget_pct;
+	gov->deadline_ms = deadline_ms;
+	gov->interval_ms = interval_ms;
+	gov->opts = *opts;
+	pthread_mutex_init(&gov->lock, NULL);
+}
+
+void governor_free(struct governor *gov)
+{
+	pthread_mutex_destroy(&gov->lock);
+}
+
+void governor_apply(struct governor *gov, struct kms *kms, struct frame *frame)
+{
+	const struct governor_level *level;
+
+	frame->opts = gov->opts;
+	frame->cpu_ns = 0;
+	kms->scale_pct = 0;
+
+	if (!governor_enabled(gov))
+		return;
+
+	pthread_mutex_lock(&gov->lock);
+	level = &governor_levels[gov->level];
+	pthread_mutex_unlock(&gov->lock);
+
+	if (level->effort >= 0)
+		frame->opts.effort = level->effort;
+
+	if (frame->opts.quality > GOVERNOR_MIN_QUALITY) {
+		frame->opts.quality -= level->quality_drop;
+		if (frame->opts.quality < GOVERNOR_MIN_QUALITY)
+			frame->opts.quality = GOVERNOR_MIN_QUALITY;
+	}
+
+	if (level->scale_pct < 100)
+		kms->scale_pct = level->scale_pct;
+}
+
+void governor_update(struct governor *gov, const struct frame *frame)
+{
+	uint64_t ref_ns, budget_ns = 0, deadline_ns;
+	struct timespec now;
+	int over, under;
+
+	if (!governor_enabled(gov))
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	deadline_ns = (uint64_t)gov->deadline_ms * 1000000ull;
+
+	pthread_mutex_lock(&gov->lock);
+
+	running_average(&gov->cost_ns, frame->cpu_ns);
+	running_average(&gov->latency_ns,
+			timespec_diff_ns(&now, &frame->timestamp));
+
+	if (gov->hold) {
+		gov->hold--;
+		goto out_unlock;
+	}
+
+	/* The budget is judged against the rate the captures are wanted at */
+	ref_ns = gov->interval_ms ? (uint64_t)gov->interval_ms * 1000000ull
+		: gov->period_ns;
+	if (gov->budget_pct && ref_ns)
+		budget_ns = ref_ns * gov->budget_pct / 100;
+
+	over = (budget_ns && gov->cost_ns > budget_ns) ||
+		(deadline_ns && gov->latency_ns > deadline_ns);
+	under = (!budget_ns || gov->cost_ns < budget_ns * 6 / 10) &&
+		(!deadline_ns || gov->latency_ns < deadline_ns * 6 / 10);
+
+	if (over && gov->level + 1 < GOVERNOR_NB_LEVELS) {
+		gov->level++;
+		gov->hold = GOVERNOR_HOLD_FRAMES;
+		gov->calm = 0;
+	} else if (under && gov->level && ++gov->calm >= GOVERNOR_CALM_FRAMES) {
+		gov->level--;
+		gov->hold = GOVERNOR_HOLD_FRAMES;
+		gov->calm = 0;
+	} else if (!under) {
+		gov->calm = 0;
+	} else {
+		goto out_unlock;
+	}
+
+	if (gov->hold) {
+		DBG("[debug] governor: level %u, cost %"PRIu64" us, latency %"PRIu64" us\n",
+		    gov->level, gov->cost_ns / 1000, gov->latency_ns / 1000);
+	}
+
+out_unlock:
+	pthread_mutex_unlock(&gov->lock);
+}
+
+unsigned int governor_interval(struct governor *gov)
+{
+	unsigned int interval_ms = gov->interval_ms;
+	uint64_t spacing_ms;
+
+	if (!gov->budget_pct)
+		return interval_ms;
+
+	pthread_mutex_lock(&gov->lock);
+	spacing_ms = governor_spacing_ns(gov) / 1000000;
+	pthread_mutex_unlock(&gov->lock);
+
+	if (spacing_ms > interval_ms)
+		interval_ms = spacing_ms > UINT32_MAX ? UINT32_MAX : (unsigned int)spacing_ms;
+
+	return interval_ms;
+}
+
+void governor_throttle(struct governor *gov)
+{
+	struct timespec now, next;
+	uint64_t spacing_ns;
+
+	if (!governor_enabled(gov))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&gov->lock);
+
+	if (gov->last_request.tv_sec || gov->last_request.tv_nsec)
+		running_average(&gov->period_ns,
+				timespec_diff_ns(&now, &gov->last_request));
+	gov->last_request = now;
+
+	spacing_ns = governor_spacing_ns(gov);
+	next = gov->last_capture;
+	next.tv_sec += spacing_ns / 1000000000ull;
+	next.tv_nsec += spacing_ns % 1000000000ull;
+	if (next.tv_nsec >= 1000000000L) {
+		next.tv_sec++;
+		next.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_unlock(&gov->lock);
+
+	if (timespec_before(&now, &next)) {
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}
+
+	pthread_mutex_lock(&gov->lock);
+	gov->last_capture = now;
+	pthread_mutex_unlock(&gov->lock);
+}
+
+static int parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	unsigned long first, last;
+	const char *ptr = list;
+	char *end;
+
+	CPU_ZERO(set);
+
+	while (*ptr) {
+		first = strtoul(ptr, &end, 10);
+		if (end == ptr)
+			return -EINVAL;
+
+		last = first;
+		if (*end == '-') {
+			ptr = end + 1;
+			last = strtoul(ptr, &end, 10);
+			if (end == ptr || last < first)
+				return -EINVAL;
+		}
+
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+
+		if (*end == ',')
+			end++;
+		else if (*end)
+			return -EINVAL;
+
+		ptr = end;
+	}
+
+	return CPU_COUNT(set) ? 0 : -EINVAL;
+}
+
+int governor_set_sched(int idle, const char *cpus)
+{
+	struct sched_param param = { .sched_priority = 0 };
+	cpu_set_t set;
+	int err;
+
+	if (cpus) {
+		err = parse_cpu_list(cpus, &set);
+		if (err) {
+			fprintf(stderr, "Invalid CPU list: %s\n", cpus);
+			return err;
+		}
+
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			err = -errno;
+			fprintf(stderr, "Unable to set CPU affinity: %s\n",
+				strerror(errno));
+			return err;
+		}
+	}
+
+	if (idle && sched_setscheduler(0, SCHED_IDLE, &param)) {
+		err = -errno;
+		fprintf(stderr, "Unable to switch to SCHED_IDLE: %s\n",
+			strerror(errno));
+		return err;
+	}
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - CPU budget governor
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_GOVERNOR_H__
+#define __KMSGRAB_GOVERNOR_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "core.h"
+
+struct governor {
+	/* Percentage of one core, and per-grab latency; 0 when unbounded */
+	unsigned int budget_pct;
+	unsigned int deadline_ms;
+
+	/* Nominal capture period (0 if request driven), and encoder options */
+	unsigned int interval_ms;
+	struct kmsgrab_encode_opts opts;
+
+	pthread_mutex_t lock;
+
+	/* Degradation step, 0 when running at the nominal settings */
+	unsigned int level;
+
+	/* Frames to wait before the next decision, and frames well in budget */
+	unsigned int hold, calm;
+
+	/* Running averages of the CPU time and latency of a grab */
+	uint64_t cost_ns, latency_ns;
+
+	/* Running average of the time between two capture requests */
+	uint64_t period_ns;
+	struct timespec last_request, last_capture;
+};
+
+void governor_init(struct governor *gov, unsigned int budget_pct,
+		   unsigned int deadline_ms, unsigned int interval_ms,
+		   const struct kmsgrab_encode_opts *opts);
+void governor_free(struct governor *gov);
+
+/* Set the output scale and encoder options of the next capture. */
+void governor_apply(struct governor *gov, struct kms *kms, struct frame *frame);
+
+/* Account for a grab, once its frame is encoded (or published). */
+void governor_update(struct governor *gov, const struct frame *frame);
+
+/* Capture period stretched to fit the budget, for periodic captures. */
+unsigned int governor_interval(struct governor *gov);
+
+/* For request-driven captures: delay the capture to fit the budget. */
+void governor_throttle(struct governor *gov);
+
+/*
+ * Move the calling process to SCHED_IDLE and/or restrict it to the CPUs in
+ * @cpus (e.g. "2,3" or "1-3"). Must be called before starting any thread,
+ * so that they all inherit it.
+ */
+int governor_set_sched(int idle, const char *cpus);
+
+#endif /* __KMSGRAB_GOVERNOR_H__ */
@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - binary IPC protocol
+ *
+ * Besides the one-line text commands, the daemon socket accepts a binary
+ * protocol, recognized by the magic at the start of the connection. Each
+ * message is a struct kmsgrab_msg header followed by @length bytes of
+ * payload, all in host byte order. A connection carries any number of
+ * requests; the client picks the @id of each request and may send the next
+ * ones without waiting. Responses carry the ID of their request and may
+ * arrive in any order, e.g. a GRAB_ASYNC is answered before a GRAB that was
+ * sent earlier.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_PROTO_H__
+#define __KMSGRAB_PROTO_H__
+
+#include <stdint.h>
+
+#define KMSGRAB_PROTO_MAGIC	0x314b4d4b /* "KMK1" */
+#define KMSGRAB_PROTO_VERSION	1
+
+/* Requests larger than this are rejected, and the connection closed */
+#define KMSGRAB_PROTO_MAX_REQUEST 4096
+
+enum kmsgrab_op {
+	/* No payload. Answered once the frame is encoded: kmsgrab_frame_info */
+	KMSGRAB_OP_GRAB		= 1,
+
+	/* No payload. Answered once the frame is read back: kmsgrab_frame_info */
+	KMSGRAB_OP_GRAB_ASYNC	= 2,
+
+	/* Payload: uint64_t frame id. Answered once encoded: kmsgrab_frame_info */
+	KMSGRAB_OP_WAIT		= 3,
+
+	/* Payload: uint64_t frame id. Answered with the encoded picture */
+	KMSGRAB_OP_FETCH	= 4,
+
+	/* No payload, empty answer */
+	KMSGRAB_OP_PING		= 5,
+
+	/*
+	 * Payload: kmsgrab_subscribe. Empty answer, followed by a
+	 * KMSGRAB_MSG_EVENT message with the same id for each change.
+	 */
+	KMSGRAB_OP_SUBSCRIBE	= 6,
+
+	/* Payload: uint32_t id of the SUBSCRIBE request. Empty answer */
+	KMSGRAB_OP_UNSUBSCRIBE	= 7,
+};
+
+/* Set in the type of responses */
+#define KMSGRAB_MSG_RESPONSE	0x8000
+
+/* Set in the type of unsolicited messages, e.g. KMSGRAB_OP_SUBSCRIBE events */
+#define KMSGRAB_MSG_EVENT	0x4000
+
+struct kmsgrab_msg {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t type;		/* enum kmsgrab_op, | KMSGRAB_MSG_RESPONSE */
+	uint32_t id;		/* chosen by the client, echoed in the response */
+	int32_t status;		/* responses: 0 or negative errno */
+	uint32_t length;	/* of the payload following this header */
+};
+
+struct kmsgrab_frame_info {
+	uint64_t frame_id;
+	int64_t tv_sec;		/* CLOCK_REALTIME time of the readback */
+	int64_t tv_nsec;
+};
+
+/* What a subscription watches, and what its events carry */
+#define KMSGRAB_WATCH_FB	(1 << 0) /* page flips: the plane's FB_ID changed */
+#define KMSGRAB_WATCH_CONTENT	(1 << 1) /* the pixels changed (hashed in tiles) */
+#define KMSGRAB_WATCH_RECTS	(1 << 2) /* report the dirty rectangles */
+#define KMSGRAB_WATCH_FRAME	(1 << 3) /* capture and attach the encoded picture */
+
+/* Beyond this, the dirty rectangles are merged into their bounding box */
+#define KMSGRAB_EVENT_MAX_RECTS	32
+
+struct kmsgrab_subscribe {
+	uint32_t flags;
+	uint32_t min_interval_ms;	/* at most one event per period */
+	uint32_t poll_ms;		/* period of the content checks, 0: 250 ms */
+	uint32_t reserved;
+};
+
+struct kmsgrab_rect {
+	uint32_t x, y, width, height;
+};
+
+/*
+ * Changes that happen within the rate limit of a subscription are merged
+ * into its next event. Followed by @nb_rects struct kmsgrab_rect, then by
+ * @frame_size bytes of encoded picture.
+ */
+struct kmsgrab_event {
+	uint64_t seq;
+	int64_t tv_sec;		/* CLOCK_REALTIME time of the detection */
+	int64_t tv_nsec;
+	uint64_t hash;		/* of the content, 0 if it is not watched */
+	uint64_t frame_id;	/* of the attached picture */
+	uint32_t changed;	/* KMSGRAB_WATCH_FB and/or KMSGRAB_WATCH_CONTENT */
+	uint32_t fb_id;
+	uint32_t width, height;	/* of the frame the rectangles refer to */
+	uint32_t nb_rects;
+	uint32_t frame_size;
+};
+
+#endif /* __KMSGRAB_PROTO_H__ */
@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - compressed raw frame format
+ *
+ * A ".kraw" file holds the converted frame as it is in memory, split into
+ * bands of whole lines that are compressed independently (with LZ4 or zstd,
+ * as recorded in the header), so that they can be compressed and
+ * decompressed in parallel. The file is:
+ *
+ *   struct kmsgrab_raw_header
+ *   uint32_t sizes[nb_chunks]	compressed size of each chunk
+ *   the chunks, back to back
+ *
+ * Chunk i holds the lines [i * chunk_rows, (i + 1) * chunk_rows) of the
+ * picture, fewer for the last one. All the fields are little-endian.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_RAW_H__
+#define __KMSGRAB_RAW_H__
+
+#include <stdint.h>
+
+#define KMSGRAB_RAW_MAGIC	0x5741524b /* "KRAW" */
+#define KMSGRAB_RAW_VERSION	1
+
+/* LZ4 block format, or one zstd frame per chunk */
+#define KMSGRAB_RAW_CODEC_LZ4	1
+#define KMSGRAB_RAW_CODEC_ZSTD	2
+
+/* Packed 8-bit R, G, B, in that order in memory */
+#define KMSGRAB_RAW_FORMAT_RGB888	1
+
+struct kmsgrab_raw_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t codec;
+	uint32_t format;
+	uint32_t width, height;
+	uint32_t stride;	/* of the decompressed lines, in bytes */
+	uint32_t chunk_rows;
+	uint32_t nb_chunks;
+};
+
+#endif /* __KMSGRAB_RAW_H__ */
@@ -0,0 +1,136 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - shared-memory frame ring
+ *
+ * When started with --ring, the daemon publishes every frame it captures
+ * into a ring of slots living in a memfd. A client sends "RING\n" to the
+ * daemon socket and receives "OK\n" with the memfd (SCM_RIGHTS), which it
+ * maps read-only once. Any number of consumers can then read the latest
+ * frame directly from the mapping, without copies or requests.
+ *
+ * Each slot is protected by a sequence counter (seqlock): it is odd while
+ * the daemon rewrites the slot, and a reader must check that it did not
+ * change while it was accessing the slot, see kmsgrab_ring_read_begin() and
+ * kmsgrab_ring_read_end().
+ *
+ * The slots are sized after the first frame. When a bigger one comes, e.g.
+ * after a mode change, the daemon retires the ring (KMSGRAB_RING_RETIRED)
+ * and publishes into a new one from then on: consumers that find their ring
+ * retired must send "RING\n" again and map the new memfd.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_RING_H__
+#define __KMSGRAB_RING_H__
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KMSGRAB_RING_MAGIC	0x4b4d5252 /* "KMRR" */
+#define KMSGRAB_RING_VERSION	1
+
+/* Packed 8-bit R, G, B, in that order in memory */
+#define KMSGRAB_RING_FORMAT_RGB888	1
+
+/* Flags of the ring */
+#define KMSGRAB_RING_RETIRED		(1 << 0) /* replaced, nothing more is published */
+
+struct kmsgrab_ring_slot {
+	uint64_t seq;		/* odd while the slot is being written */
+	uint64_t frame_id;
+	int64_t tv_sec;		/* CLOCK_REALTIME time of the readback */
+	int64_t tv_nsec;
+	uint32_t width, height, stride, format;
+	uint64_t offset;	/* of the pixels, from the start of the ring */
+} __attribute__((aligned(64)));
+
+struct kmsgrab_ring {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nb_slots;
+	uint32_t flags;
+	uint64_t slot_size;	/* maximum size of the pixels of one slot */
+
+	/* Number of frames published so far; the latest one is in slot (latest - 1) % nb_slots */
+	uint64_t latest __attribute__((aligned(64)));
+
+	/* Low 32 bits of @latest, woken up (FUTEX_WAKE) on every publication */
+	uint32_t futex;
+	uint32_t reserved2;
+
+	struct kmsgrab_ring_slot slots[];
+};
+
+/*
+ * Start reading the latest frame. Returns the slot, and its sequence number
+ * in @seq, or NULL if nothing was published yet.
+ */
+static inline const struct kmsgrab_ring_slot *
+kmsgrab_ring_read_begin(const struct kmsgrab_ring *ring, uint64_t *seq)
+{
+	const struct kmsgrab_ring_slot *slot;
+	uint64_t latest;
+
+	for (;;) {
+		latest = __atomic_load_n(&ring->latest, __ATOMIC_ACQUIRE);
+		if (!latest)
+			return NULL;
+
+		slot = &ring->slots[(latest - 1) % ring->nb_slots];
+		*seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (!(*seq & 1))
+			return slot;
+	}
+}
+
+/* Returns nonzero if the slot was not overwritten since read_begin(). */
+static inline int kmsgrab_ring_read_end(const struct kmsgrab_ring_slot *slot,
+					uint64_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+static inline const uint8_t *
+kmsgrab_ring_pixels(const struct kmsgrab_ring *ring,
+		    const struct kmsgrab_ring_slot *slot)
+{
+	return (const uint8_t *)ring + slot->offset;
+}
+
+/* Returns nonzero if the daemon replaced the ring with a new one. */
+static inline int kmsgrab_ring_retired(const struct kmsgrab_ring *ring)
+{
+	return __atomic_load_n(&ring->flags, __ATOMIC_ACQUIRE) & KMSGRAB_RING_RETIRED;
+}
+
+/*
+ * Block until more than @seen frames have been published, or until the
+ * (relative) timeout expires. Returns -ESTALE once the ring is retired.
+ * Consumers that never block can simply poll ring->latest instead.
+ */
+static inline int kmsgrab_ring_wait(const struct kmsgrab_ring *ring,
+				    uint64_t seen,
+				    const struct timespec *timeout)
+{
+	uint32_t val;
+
+	for (;;) {
+		val = __atomic_load_n(&ring->futex, __ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ring->latest, __ATOMIC_ACQUIRE) > seen)
+			return 0;
+		if (kmsgrab_ring_retired(ring))
+			return -ESTALE;
+
+		if (syscall(SYS_futex, &ring->futex, FUTEX_WAIT, val,
+			    timeout, NULL, 0) && errno == ETIMEDOUT)
+			return -ETIMEDOUT;
+	}
+}
+
+#endif /* __KMSGRAB_RING_H__ */
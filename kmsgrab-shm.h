@@ -0,0 +1,167 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - shared-memory trigger interface
+ *
+ * A client sends "SHM\n" to the daemon socket and receives "OK\n" along with
+ * three file descriptors (SCM_RIGHTS): the memfd holding a struct kmsgrab_shm,
+ * the doorbell eventfd and the completion eventfd. The connection must be
+ * kept open for as long as the session is used; closing it ends the session.
+ *
+ * To trigger a capture, the client increments @requested and writes to the
+ * doorbell. Each request is answered by an entry in the completion ring,
+ * after which the completion eventfd is signalled. A doorbell serves at most
+ * KMSGRAB_SHM_RING_SIZE - 1 requests, as many as can be read back; the rest
+ * waits for the next one. No other syscall is
+ * involved, so this can be used from tight in-process test loops.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_SHM_H__
+#define __KMSGRAB_SHM_H__
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define KMSGRAB_SHM_MAGIC	0x4b4d5347 /* "KMSG" */
+#define KMSGRAB_SHM_VERSION	1
+#define KMSGRAB_SHM_RING_SIZE	64
+
+struct kmsgrab_shm_completion {
+	uint64_t cookie;	/* value of @requested for this trigger */
+	uint64_t frame_id;
+	int64_t tv_sec;		/* CLOCK_REALTIME time of the readback */
+	int64_t tv_nsec;
+	int32_t status;		/* 0 on success, negative errno otherwise */
+	uint32_t reserved;
+};
+
+struct kmsgrab_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ring_size;
+	uint32_t reserved;
+
+	/* Written by the client: number of triggers issued so far */
+	uint64_t requested __attribute__((aligned(64)));
+
+	/* Written by the daemon: number of completions in the ring so far */
+	uint64_t completed __attribute__((aligned(64)));
+
+	struct kmsgrab_shm_completion ring[KMSGRAB_SHM_RING_SIZE];
+};
+
+/* Trigger a capture. Returns the cookie identifying its completion. */
+static inline uint64_t kmsgrab_shm_trigger(struct kmsgrab_shm *shm,
+					   int doorbell_fd)
+{
+	uint64_t one = 1, cookie;
+
+	cookie = __atomic_add_fetch(&shm->requested, 1, __ATOMIC_RELEASE);
+	(void)!write(doorbell_fd, &one, sizeof(one));
+
+	return cookie;
+}
+
+/*
+ * Copy the completion number @seq (counting from 0) into @c. Returns 0 on
+ * success, -EAGAIN if it did not arrive yet (wait for the completion eventfd
+ * to become readable), or -ENOBUFS if it was already overwritten; only the
+ * last KMSGRAB_SHM_RING_SIZE - 1 completions can be read.
+ */
+static inline int kmsgrab_shm_completion(const struct kmsgrab_shm *shm,
+					 uint64_t seq,
+					 struct kmsgrab_shm_completion *c)
+{
+	uint64_t completed = __atomic_load_n(&shm->completed, __ATOMIC_ACQUIRE);
+
+	if (seq >= completed)
+		return -EAGAIN;
+	/*
+	 * The daemon writes the entry @completed before publishing it, so the
+	 * slot it shares with @seq may already be changing.
+	 */
+	if (completed - seq >= KMSGRAB_SHM_RING_SIZE)
+		return -ENOBUFS;
+
+	*c = shm->ring[seq % KMSGRAB_SHM_RING_SIZE];
+
+	/* The daemon might have lapped us while we were copying */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	completed = __atomic_load_n(&shm->completed, __ATOMIC_RELAXED);
+	if (completed - seq >= KMSGRAB_SHM_RING_SIZE)
+		return -ENOBUFS;
+
+	return 0;
+}
+
+/*
+ * Connect to the daemon and set up a session. On success, @sock_fd must be
+ * kept open for the lifetime of the session.
+ */
+static inline int kmsgrab_shm_connect(const char *socket_path,
+				      struct kmsgrab_shm **shm, int *sock_fd,
+				      int *doorbell_fd, int *completion_fd)
+{
+	char reply[16], cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = { reply, sizeof(reply) - 1 };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf),
+	};
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct cmsghdr *cmsg;
+	int fd, fds[3];
+	ssize_t len;
+	void *map;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    write(fd, "SHM\n", 4) != 4)
+		goto err_close;
+
+	len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (len < 3 || memcmp(reply, "OK\n", 3) || !cmsg ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+		errno = EPROTO;
+		goto err_close;
+	}
+
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	map = mmap(NULL, sizeof(**shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if (map == MAP_FAILED) {
+		close(fds[1]);
+		close(fds[2]);
+		goto err_close;
+	}
+
+	*shm = (struct kmsgrab_shm *)map;
+	*sock_fd = fd;
+	*doorbell_fd = fds[1];
+	*completion_fd = fds[2];
+	return 0;
+
+err_close:
+	len = -errno;
+	close(fd);
+	return (int)len;
+}
+
+#endif /* __KMSGRAB_SHM_H__ */
@@ -5,53 +5,61 @@
  * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
  */
 
+#define _GNU_SOURCE
 #include <drm.h>
 #include <drm_fourcc.h>
 #include <drm_mode.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
-#include <png.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <ctype.h>
+#include <dlfcn.h>
+#include <stdatomic.h>
 #include <sys/mman.h>
-#include <sys/socket.h>
-#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
-#include <jpeglib.h>
+
+#include "compare.h"
+#include "core.h"
+#include "governor.h"
+#include "stats.h"
+#include "timelapse.h"
+#include "trace.h"
 
 typedef struct {
 	uint8_t r, g, b;
 } uint24_t;
 
-static int g_verbose;
+int g_verbose;
 static int g_bilinear;
+static int g_linear_light;
+static const char *g_driver;
+static const char *g_cache_path;
+
+/* Capture trace, when recording one */
+static struct trace *g_trace;
 
-#define DBG(...) do { \
-	if (g_verbose) \
-		fprintf(stderr, __VA_ARGS__); \
-} while (0)
+#define MAX_DRM_DEVICES 16
 
-static uint8_t *scale_rgb24_bilinear(const uint8_t *src,
-				     uint32_t src_w, uint32_t src_h,
-				     uint32_t dst_w, uint32_t dst_h)
+static void scale_rgb24_bilinear(uint8_t *dst, const uint8_t *src,
+				 uint32_t src_w, uint32_t src_h,
+				 uint32_t dst_w, uint32_t dst_h)
 {
-	uint8_t *dst;
 	uint32_t x, y;
 	uint32_t max_x = src_w ? src_w - 1 : 0;
 	uint32_t max_y = src_h ? src_h - 1 : 0;
 
-	dst = malloc((size_t)dst_w * dst_h * 3);
-	if (!dst)
-		return NULL;
-
 	if (dst_w == 0 || dst_h == 0 || src_w == 0 || src_h == 0)
-		return dst;
+		return;
 
 	for (y = 0; y < dst_h; y++) {
 		uint32_t sy = (dst_h == 1) ? 0 :
@@ -86,21 +94,14 @@ static uint8_t *scale_rgb24_bilinear(const uint8_t *src,
 					   p01[2] * w01 + p11[2] * w11 + (1ULL << 31)) >> 32);
 		}
 	}
-
-	return dst;
 }
 
-static uint8_t *scale_rgb24(const uint8_t *src,
-			    uint32_t src_w, uint32_t src_h,
-			    uint32_t dst_w, uint32_t dst_h)
+static void scale_rgb24(uint8_t *dst, const uint8_t *src,
+			uint32_t src_w, uint32_t src_h,
+			uint32_t dst_w, uint32_t dst_h)
 {
-	uint8_t *dst;
 	uint32_t x, y;
 
-	dst = malloc((size_t)dst_w * dst_h * 3);
-	if (!dst)
-		return NULL;
-
 	for (y = 0; y < dst_h; y++) {
 		uint32_t sy = (uint64_t)y * src_h / dst_h;
 		for (x = 0; x < dst_w; x++) {
@@ -112,17 +113,110 @@ static uint8_t *scale_rgb24(const uint8_t *src,
 			dp[2] = sp[2];
 		}
 	}
+}
+
+/*
+ * Linear light scaling: the framebuffer is converted straight to 16-bit
+ * linear values through a 256-entry table, interpolated in 64-bit fixed
+ * point, and brought back to sRGB through a 4096-entry table indexed by the
+ * top 12 bits. Averaging sRGB values instead darkens thin bright lines and
+ * text on dark backgrounds, and the other way around.
+ */
+#define LINEAR_LUT_BITS	12
+
+static uint16_t srgb_to_linear[256];
+static uint8_t linear_to_srgb[1 << LINEAR_LUT_BITS];
+
+/*
+ * Interpolate four linear samples; @fx and @fy are the weights of the second
+ * column and row, out of 256. The weights add up to 65536, so that a sum of
+ * 65535s needs 33 bits.
+ */
+static inline uint8_t blend_linear(uint16_t p00, uint16_t p10, uint16_t p01,
+				   uint16_t p11, uint32_t fx, uint32_t fy)
+{
+	uint64_t sum = (uint64_t)p00 * ((256 - fx) * (256 - fy)) +
+		(uint64_t)p10 * (fx * (256 - fy)) +
+		(uint64_t)p01 * ((256 - fx) * fy) +
+		(uint64_t)p11 * (fx * fy);
+
+	/* Each entry covers a range of sums; no rounding, or 65535 overflows */
+	return linear_to_srgb[sum >> (32 - LINEAR_LUT_BITS)];
+}
+
+static int init_gamma_luts(void)
+{
+	static const uint32_t fracs[] = { 0, 1, 128, 255 };
+	unsigned int i, j, v, out;
+	uint16_t l16;
+	double c, l;
+
+	for (i = 0; i < 256; i++) {
+		c = i / 255.0;
+		l = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+		srgb_to_linear[i] = (uint16_t)(l * 65535.0 + 0.5);
+	}
+
+	for (i = 0; i < (1 << LINEAR_LUT_BITS); i++) {
+		/* Middle of the range of linear values mapping to this entry */
+		l = ((i << (16 - LINEAR_LUT_BITS)) +
+		     (1 << (15 - LINEAR_LUT_BITS))) / 65535.0;
+		c = l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1 / 2.4) - 0.055;
+		linear_to_srgb[i] = c >= 1.0 ? 255 : (uint8_t)(c * 255.0 + 0.5);
+	}
+
+	/* Black and white must come out of any blend unchanged */
+	for (i = 0; i < sizeof(fracs) / sizeof(*fracs); i++) {
+		for (j = 0; j < sizeof(fracs) / sizeof(*fracs); j++) {
+			for (v = 0; v < 256; v += 255) {
+				l16 = srgb_to_linear[v];
+				out = blend_linear(l16, l16, l16, l16,
+						   fracs[i], fracs[j]);
+				if (out != v) {
+					fprintf(stderr, "Linear light scaling "
+						"turns %u into %u\n", v, out);
+					return -EINVAL;
+				}
+			}
+		}
+	}
 
-	return dst;
+	return 0;
 }
 
-static uint8_t *scale_rgb24_auto(const uint8_t *src,
-				 uint32_t src_w, uint32_t src_h,
-				 uint32_t dst_w, uint32_t dst_h)
+struct scale_tap {
+	uint32_t offset0, offset1;
+	uint32_t frac;		/* Weight of the second sample, out of 256 */
+};
+
+/*
+ * Source samples and weights of each output column or row, placed as the
+ * sRGB bilinear scaler places them.
+ */
+static void scale_taps(struct scale_tap *taps, uint32_t src_len,
+		       uint32_t dst_len, uint32_t step)
+{
+	uint32_t i, pos, p0;
+
+	for (i = 0; i < dst_len; i++) {
+		pos = dst_len == 1 ? 0 :
+			(uint32_t)(((uint64_t)i * (src_len - 1) << 16) / (dst_len - 1));
+		p0 = pos >> 16;
+
+		taps[i].offset0 = p0 * step;
+		taps[i].offset1 = (p0 + 1 < src_len ? p0 + 1 : p0) * step;
+		taps[i].frac = (pos >> 8) & 0xff;
+	}
+}
+
+static void scale_rgb24_auto(uint8_t *dst, const uint8_t *src,
+			     uint32_t src_w, uint32_t src_h,
+			     uint32_t dst_w, uint32_t dst_h)
 {
 	if (g_bilinear)
-		return scale_rgb24_bilinear(src, src_w, src_h, dst_w, dst_h);
-	return scale_rgb24(src, src_w, src_h, dst_w, dst_h);
+		scale_rgb24_bilinear(dst, src, src_w, src_h, dst_w, dst_h);
+	else
+		scale_rgb24(dst, src, src_w, src_h, dst_w, dst_h);
 }
 
 static inline uint24_t rgb16_to_24(uint16_t px)
@@ -164,291 +258,796 @@ static inline void convert_to_24(drmModeFB *fb, uint24_t *to, void *from)
 	}
 }
 
-static int save_png(drmModeFB *fb, int prime_fd, uint32_t pitch,
-		    uint32_t out_w, uint32_t out_h, const char *png_fn)
+static void convert_row_to_linear(drmModeFB *fb, uint16_t *to,
+				  const void *from)
 {
-	png_bytep *row_pointers;
-	png_structp png;
-	png_infop info;
-	FILE *pngfile;
-	void *buffer, *linear;
-	uint8_t *picture, *scaled = NULL, *pixels;
-	unsigned int i;
-	int ret;
-	size_t bytes_per_pixel = fb->bpp >> 3;
-	size_t linear_size = (size_t)fb->width * fb->height * bytes_per_pixel;
-	size_t mmap_size = (size_t)pitch * fb->height;
+	unsigned int len = fb->width;
+	uint24_t px;
+
+	if (fb->bpp == 24) {
+		const uint8_t *ptr = from;
+		for (len *= 3; len--; )
+			*to++ = srgb_to_linear[*ptr++];
+	} else if (fb->bpp == 16) {
+		const uint16_t *ptr = from;
+		while (len--) {
+			px = rgb16_to_24(*ptr++);
+			*to++ = srgb_to_linear[px.r];
+			*to++ = srgb_to_linear[px.g];
+			*to++ = srgb_to_linear[px.b];
+		}
+	} else {
+		const uint32_t *ptr = from;
+		while (len--) {
+			px = rgb32_to_24(*ptr++);
+			*to++ = srgb_to_linear[px.r];
+			*to++ = srgb_to_linear[px.g];
+			*to++ = srgb_to_linear[px.b];
+		}
+	}
+}
 
-	DBG("[debug] save_png: fb_id=%"PRIu32" width=%"PRIu32" height=%"PRIu32" bpp=%"PRIu32" depth=%"PRIu32" handle=%"PRIu32"\n",
-		fb->fb_id, fb->width, fb->height, fb->bpp, fb->depth, fb->handle);
-	DBG("[debug] save_png: prime_fd=%d pitch=%"PRIu32" png_fn=%s\n",
-		prime_fd, pitch, png_fn);
+/*
+ * Convert the framebuffer to linear light and scale it to @dst. Only the
+ * source rows that the interpolation reads are converted, into @tmp, which
+ * holds a whole picture of 16-bit samples.
+ */
+static int scale_linear(drmModeFB *fb, uint8_t *dst, uint16_t *tmp,
+			const uint8_t *from, uint32_t dst_w, uint32_t dst_h)
+{
+	size_t src_stride = (size_t)fb->width * 3;
+	size_t fb_stride = (size_t)fb->width * (fb->bpp >> 3);
+	const uint16_t *r0, *r1, *p00, *p10, *p01, *p11;
+	uint32_t x, y, c, fx, fy, row;
+	struct scale_tap *cols, *rows;
+	uint8_t *converted;
+	int err = 0;
+
+	if (dst_w == 0 || dst_h == 0 || fb->width == 0 || fb->height == 0)
+		return 0;
+
+	cols = malloc(sizeof(*cols) * dst_w);
+	rows = malloc(sizeof(*rows) * dst_h);
+	converted = calloc(1, fb->height);
+	if (!cols || !rows || !converted) {
+		err = -ENOMEM;
+		goto out_free;
+	}
 
-	picture = malloc((size_t)fb->width * fb->height * 4);
-	if (!picture)
-		return -ENOMEM;
+	scale_taps(cols, fb->width, dst_w, 3);
+	scale_taps(rows, fb->height, dst_h, 1);
 
-	linear = malloc(linear_size);
-	if (!linear) {
-		ret = -ENOMEM;
-		goto out_free_picture;
-	}
+	for (y = 0; y < dst_h; y++) {
+		for (row = rows[y].offset0; row <= rows[y].offset1; row++) {
+			if (!converted[row]) {
+				convert_row_to_linear(fb, tmp + row * src_stride,
+						      from + row * fb_stride);
+				converted[row] = 1;
+			}
+		}
 
-	buffer = mmap(NULL, mmap_size,
-		      PROT_READ, MAP_PRIVATE, prime_fd, 0);
-	if (buffer == MAP_FAILED) {
-		ret = -errno;
-		fprintf(stderr, "Unable to mmap prime buffer\n");
-		goto out_free_linear;
+		r0 = tmp + rows[y].offset0 * src_stride;
+		r1 = tmp + rows[y].offset1 * src_stride;
+		fy = rows[y].frac;
+
+		for (x = 0; x < dst_w; x++, dst += 3) {
+			fx = cols[x].frac;
+			p00 = r0 + cols[x].offset0;
+			p10 = r0 + cols[x].offset1;
+			p01 = r1 + cols[x].offset0;
+			p11 = r1 + cols[x].offset1;
+
+			for (c = 0; c < 3; c++)
+				dst[c] = blend_linear(p00[c], p10[c], p01[c],
+						      p11[c], fx, fy);
+		}
 	}
 
-	DBG("[debug] save_png: mmap length=%zu buffer=%p\n",
-		mmap_size, buffer);
+out_free:
+	free(converted);
+	free(rows);
+	free(cols);
+	return err;
+}
 
-	/* Drop privileges, to write PNG with user rights */
-	seteuid(getuid());
+/* Side of the square tiles a 90 or 270 degree rotation proceeds by */
+#define ROTATE_TILE	32
 
-	pngfile = fopen(png_fn, "w+");
-	if (!pngfile) {
-		ret = -errno;
-		goto out_unmap_buffer;
+/*
+ * Framebuffer coordinates of the output pixel (X, Y), as
+ * x = x0 + ax * X + bx * Y, y = y0 + ay * X + by * Y
+ */
+struct plane_transform {
+	int32_t x0, ax, bx;
+	int32_t y0, ay, by;
+};
+
+/*
+ * The plane is shown reflected first, then rotated counter-clockwise, as
+ * drm_rect_rotate() does; this inverts that, from the output's side.
+ */
+static void plane_transform(struct plane_transform *t, uint32_t rotation,
+			    uint32_t w, uint32_t h)
+{
+	int32_t mw = (int32_t)w - 1, mh = (int32_t)h - 1;
+
+	switch (rotation & DRM_MODE_ROTATE_MASK) {
+	case DRM_MODE_ROTATE_90:
+		*t = (struct plane_transform){ mw, 0, -1, 0, 1, 0 };
+		break;
+	case DRM_MODE_ROTATE_180:
+		*t = (struct plane_transform){ mw, -1, 0, mh, 0, -1 };
+		break;
+	case DRM_MODE_ROTATE_270:
+		*t = (struct plane_transform){ 0, 0, 1, mh, -1, 0 };
+		break;
+	default:
+		*t = (struct plane_transform){ 0, 1, 0, 0, 0, 1 };
+		break;
 	}
 
-	png = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-				NULL, NULL, NULL);
-	if (!png) {
-		ret = -errno;
-		goto out_fclose;
+	if (rotation & DRM_MODE_REFLECT_X) {
+		t->x0 = mw - t->x0;
+		t->ax = -t->ax;
+		t->bx = -t->bx;
 	}
 
-	info = png_create_info_struct(png);
-	if (!info) {
-		ret = -errno;
-		goto out_free_png;
+	if (rotation & DRM_MODE_REFLECT_Y) {
+		t->y0 = mh - t->y0;
+		t->ay = -t->ay;
+		t->by = -t->by;
 	}
+}
 
-	png_init_io(png, pngfile);
-	png_set_IHDR(png, info, out_w, out_h, 8,
-				PNG_COLOR_TYPE_RGB,
-				PNG_INTERLACE_NONE,
-				PNG_COMPRESSION_TYPE_BASE,
-				PNG_FILTER_TYPE_BASE);
-	png_write_info(png, info);
+static inline int rotation_swaps_axes(uint32_t rotation)
+{
+	return !!(rotation & (DRM_MODE_ROTATE_90 | DRM_MODE_ROTATE_270));
+}
 
-	// Copy framebuffer using pitch to a linear buffer, then convert to rgb888.
-	for (i = 0; i < fb->height; i++)
-		memcpy((uint8_t *)linear + i * fb->width * bytes_per_pixel,
-		       (uint8_t *)buffer + i * pitch,
-		       fb->width * bytes_per_pixel);
-
-	convert_to_24(fb, (uint24_t *)picture, linear);
-	if (out_w != fb->width || out_h != fb->height) {
-		scaled = scale_rgb24_auto(picture, fb->width, fb->height, out_w, out_h);
-		if (!scaled) {
-			ret = -ENOMEM;
-			goto out_free_info;
-		}
-		pixels = scaled;
+static void convert_span_to_24(drmModeFB *fb, uint24_t *to, ptrdiff_t to_step,
+			       const void *from, ptrdiff_t pos, ptrdiff_t step,
+			       uint32_t len)
+{
+	if (fb->bpp == 16) {
+		const uint16_t *ptr = from;
+		for (; len--; pos += step, to += to_step)
+			*to = rgb16_to_24(ptr[pos]);
 	} else {
-		pixels = picture;
+		const uint32_t *ptr = from;
+		for (; len--; pos += step, to += to_step)
+			*to = rgb32_to_24(ptr[pos]);
 	}
+}
+
+/*
+ * Convert the framebuffer to RGB24 as it appears on screen. Without a 90 or
+ * 270 degree rotation, each output line comes from one framebuffer line, read
+ * forwards or backwards. Otherwise the framebuffer lines run down the output
+ * columns, so the picture is done by square tiles, each being read along the
+ * framebuffer lines, with the writes striding: the few output lines a tile
+ * writes stay in the cache until it is done, instead of one cache line being
+ * loaded per pixel.
+ */
+static void convert_to_24_rotated(drmModeFB *fb, uint24_t *to, void *from,
+				  uint32_t rotation)
+{
+	uint32_t out_w = fb->width, out_h = fb->height, x, y, t_x, w, h;
+	ptrdiff_t origin, step_x, step_y;
+	struct plane_transform t;
 
-	row_pointers = malloc(sizeof(*row_pointers) * out_h);
-	if (!row_pointers) {
-		ret = -ENOMEM;
-		goto out_free_info;
+	plane_transform(&t, rotation, fb->width, fb->height);
+
+	origin = (ptrdiff_t)t.y0 * fb->width + t.x0;
+	step_x = (ptrdiff_t)t.ay * fb->width + t.ax;
+	step_y = (ptrdiff_t)t.by * fb->width + t.bx;
+
+	if (!rotation_swaps_axes(rotation)) {
+		for (y = 0; y < out_h; y++)
+			convert_span_to_24(fb, to + (size_t)y * out_w, 1, from,
+					   origin + y * step_y, step_x, out_w);
+		return;
 	}
 
-	// And save the final image
-	for (i = 0; i < out_h; i++)
-		row_pointers[i] = pixels + i * out_w * 3;
+	out_w = fb->height;
+	out_h = fb->width;
 
-	DBG("[debug] save_png: writing PNG rows=%"PRIu32" row_bytes=%"PRIu32"\n",
-		out_h, out_w * 3);
+	for (y = 0; y < out_h; y += ROTATE_TILE) {
+		h = out_h - y < ROTATE_TILE ? out_h - y : ROTATE_TILE;
 
-	png_write_image(png, row_pointers);
-	png_write_end(png, info);
+		for (x = 0; x < out_w; x += ROTATE_TILE) {
+			w = out_w - x < ROTATE_TILE ? out_w - x : ROTATE_TILE;
 
-	ret = 0;
+			for (t_x = x; t_x < x + w; t_x++)
+				convert_span_to_24(fb, to + (size_t)y * out_w + t_x,
+						   out_w, from,
+						   origin + y * step_y + t_x * step_x,
+						   step_y, h);
+		}
+	}
+}
 
-	free(row_pointers);
-	free(scaled);
-out_free_info:
-	png_destroy_write_struct(NULL, &info);
-out_free_png:
-	png_destroy_write_struct(&png, NULL);
-out_fclose:
-	fclose(pngfile);
-out_unmap_buffer:
-	munmap(buffer, mmap_size);
-out_free_linear:
-	free(linear);
-out_free_picture:
-	free(picture);
-	return ret;
+/* Current value of the plane's "rotation" property. */
+static uint32_t plane_rotation(struct kms *kms, uint32_t plane_id)
+{
+	uint32_t i, rotation = DRM_MODE_ROTATE_0;
+	drmModeObjectProperties *props;
+	drmModePropertyRes *prop;
+
+	if (kms->rotation_probed && !kms->rotation_prop)
+		return rotation;
+
+	props = drmModeObjectGetProperties(kms->fd, plane_id,
+					   DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return rotation;
+
+	/* Property IDs are the same for all the planes of a device */
+	for (i = 0; !kms->rotation_probed && i < props->count_props; i++) {
+		prop = drmModeGetProperty(kms->fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		if (!strcmp(prop->name, "rotation"))
+			kms->rotation_prop = prop->prop_id;
+		drmModeFreeProperty(prop);
+
+		if (kms->rotation_prop)
+			break;
+	}
+
+	kms->rotation_probed = 1;
+
+	for (i = 0; i < props->count_props; i++) {
+		if (props->props[i] == kms->rotation_prop) {
+			rotation = (uint32_t)props->prop_values[i];
+			break;
+		}
+	}
+
+	drmModeFreeObjectProperties(props);
+	return rotation;
 }
 
-static int save_jpg(drmModeFB *fb, int prime_fd, uint32_t pitch,
-		    uint32_t out_w, uint32_t out_h,
-		    const char *jpg_fn, int quality)
+#ifdef KMSGRAB_MODULES
+static const char *module_dirs[] = {
+	NULL, /* $KMSGRAB_MODULE_DIR */
+	NULL, /* directory of the executable, for running from the build tree */
+	KMSGRAB_MODULE_DIR,
+};
+
+static const struct kmsgrab_encoder *open_encoder_module(const char *name)
 {
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	FILE *jpgfile;
-	void *buffer, *linear;
-	uint8_t *picture, *scaled = NULL, *pixels;
+	static char exe_dir[PATH_MAX];
+	const struct kmsgrab_encoder *enc;
+	char path[PATH_MAX], sym[64];
 	unsigned int i;
-	int ret;
-	size_t bytes_per_pixel = fb->bpp >> 3;
-	size_t linear_size = (size_t)fb->width * fb->height * bytes_per_pixel;
-	size_t mmap_size = (size_t)pitch * fb->height;
-	JSAMPROW row_pointer[1];
+	ssize_t len;
+	void *handle;
+	char *slash;
+
+	/*
+	 * Running setuid, the environment and the location of the executable
+	 * are the caller's: only the installed modules may be loaded then.
+	 */
+	if (getuid() == geteuid() && getgid() == getegid()) {
+		module_dirs[0] = secure_getenv("KMSGRAB_MODULE_DIR");
+
+		len = readlink("/proc/self/exe", exe_dir, sizeof(exe_dir) - 1);
+		if (len > 0) {
+			exe_dir[len] = '\0';
+			slash = strrchr(exe_dir, '/');
+			if (slash) {
+				*slash = '\0';
+				module_dirs[1] = exe_dir;
+			}
+		}
+	}
 
-	DBG("[debug] save_jpg: fb_id=%"PRIu32" width=%"PRIu32" height=%"PRIu32" bpp=%"PRIu32" depth=%"PRIu32" handle=%"PRIu32"\n",
-		fb->fb_id, fb->width, fb->height, fb->bpp, fb->depth, fb->handle);
-	DBG("[debug] save_jpg: prime_fd=%d pitch=%"PRIu32" jpg_fn=%s quality=%d\n",
-		prime_fd, pitch, jpg_fn, quality);
+	snprintf(sym, sizeof(sym), KMSGRAB_ENCODER_SYMBOL_PREFIX "%s", name);
 
-	picture = malloc((size_t)fb->width * fb->height * 4);
-	if (!picture)
-		return -ENOMEM;
+	for (i = 0; i < sizeof(module_dirs) / sizeof(*module_dirs); i++) {
+		if (!module_dirs[i])
+			continue;
+
+		snprintf(path, sizeof(path), "%s/kmsgrab-%s.so", module_dirs[i], name);
+
+		handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+		if (!handle) {
+			DBG("[debug] dlopen %s: %s\n", path, dlerror());
+			continue;
+		}
+
+		enc = dlsym(handle, sym);
+		if (enc) {
+			DBG("[debug] loaded %s encoder from %s\n", name, path);
+			return enc;
+		}
 
-	linear = malloc(linear_size);
-	if (!linear) {
-		ret = -ENOMEM;
-		goto out_free_picture;
+		DBG("[debug] %s: missing symbol %s\n", path, sym);
+		dlclose(handle);
 	}
 
-	buffer = mmap(NULL, mmap_size, PROT_READ, MAP_PRIVATE, prime_fd, 0);
-	if (buffer == MAP_FAILED) {
-		ret = -errno;
-		fprintf(stderr, "Unable to mmap prime buffer\n");
-		goto out_free_linear;
+	return NULL;
+}
+#else
+#ifdef KMSGRAB_HAVE_PNG
+extern const struct kmsgrab_encoder kmsgrab_encoder_png;
+#endif
+#ifdef KMSGRAB_HAVE_JPEG
+extern const struct kmsgrab_encoder kmsgrab_encoder_jpeg;
+#endif
+#ifdef KMSGRAB_HAVE_JXL
+extern const struct kmsgrab_encoder kmsgrab_encoder_jxl;
+#endif
+#ifdef KMSGRAB_HAVE_RAW
+extern const struct kmsgrab_encoder kmsgrab_encoder_raw;
+#endif
+#ifdef KMSGRAB_HAVE_H264
+extern const struct kmsgrab_encoder kmsgrab_encoder_h264;
+#endif
+
+static const struct kmsgrab_encoder *builtin_encoders[] = {
+#ifdef KMSGRAB_HAVE_PNG
+	&kmsgrab_encoder_png,
+#endif
+#ifdef KMSGRAB_HAVE_JPEG
+	&kmsgrab_encoder_jpeg,
+#endif
+#ifdef KMSGRAB_HAVE_JXL
+	&kmsgrab_encoder_jxl,
+#endif
+#ifdef KMSGRAB_HAVE_RAW
+	&kmsgrab_encoder_raw,
+#endif
+#ifdef KMSGRAB_HAVE_H264
+	&kmsgrab_encoder_h264,
+#endif
+	NULL,
+};
+
+static const struct kmsgrab_encoder *open_encoder_module(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; builtin_encoders[i]; i++)
+		if (!strcmp(builtin_encoders[i]->name, name))
+			return builtin_encoders[i];
+
+	return NULL;
+}
+#endif /* KMSGRAB_MODULES */
+
+static struct encoder_desc {
+	const char *name;
+	const char *extensions[3];
+	const struct kmsgrab_encoder *enc;
+} encoders[] = {
+	{ "jpeg", { ".jpg", ".jpeg" }, NULL },
+	{ "jxl",  { ".jxl" }, NULL },
+	{ "raw",  { ".kraw" }, NULL },
+	{ "h264", { ".h264", ".264" }, NULL },
+	{ "png",  { ".png" }, NULL },
+};
+
+/* Held while looking up and loading encoders, done from any thread */
+static pthread_mutex_t encoders_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Pick the encoder from the output file name, and load it if it's not been
+ * used yet. PNG is the fallback for unknown extensions.
+ */
+const struct kmsgrab_encoder *get_encoder(const char *fn)
+{
+	const struct kmsgrab_encoder *enc;
+	struct encoder_desc *desc = NULL;
+	unsigned int i, j;
+
+	for (i = 0; !desc && i < sizeof(encoders) / sizeof(*encoders); i++) {
+		for (j = 0; encoders[i].extensions[j]; j++) {
+			if (strstr(fn, encoders[i].extensions[j])) {
+				desc = &encoders[i];
+				break;
+			}
+		}
 	}
 
-	DBG("[debug] save_jpg: mmap length=%zu buffer=%p\n",
-		mmap_size, buffer);
+	if (!desc)
+		desc = &encoders[sizeof(encoders) / sizeof(*encoders) - 1];
 
-	/* Drop privileges, to write JPEG with user rights */
-	seteuid(getuid());
+	pthread_mutex_lock(&encoders_lock);
 
-	jpgfile = fopen(jpg_fn, "w+");
-	if (!jpgfile) {
-		ret = -errno;
-		goto out_unmap_buffer;
+	if (!desc->enc) {
+		desc->enc = open_encoder_module(desc->name);
+		if (!desc->enc)
+			fprintf(stderr, "The %s encoder is not available\n", desc->name);
 	}
 
-	// Copy framebuffer using pitch to a linear buffer, then convert to rgb888.
-	for (i = 0; i < fb->height; i++)
-		memcpy((uint8_t *)linear + i * fb->width * bytes_per_pixel,
-		       (uint8_t *)buffer + i * pitch,
-		       fb->width * bytes_per_pixel);
-
-	convert_to_24(fb, (uint24_t *)picture, linear);
-	if (out_w != fb->width || out_h != fb->height) {
-		scaled = scale_rgb24_auto(picture, fb->width, fb->height, out_w, out_h);
-		if (!scaled) {
-			ret = -ENOMEM;
-			goto out_unmap_buffer;
-		}
-		pixels = scaled;
-	} else {
-		pixels = picture;
+	enc = desc->enc;
+
+	pthread_mutex_unlock(&encoders_lock);
+
+	return enc;
+}
+
+/*
+ * JPEG encoding profiles. 4:4:4 keeps the edges of colored text sharp, at the
+ * cost of twice the chroma data; 4:2:0 is smaller and faster to encode.
+ */
+static const struct jpeg_profile {
+	const char *name;
+	enum kmsgrab_dct dct;
+	int optimize_coding;
+	int progressive;
+	int subsampling;
+} jpeg_profiles[] = {
+	{ "fast",     KMSGRAB_DCT_IFAST, 0, 0, 420 },
+	{ "balanced", KMSGRAB_DCT_ISLOW, 0, 0, 420 },
+	{ "small",    KMSGRAB_DCT_ISLOW, 1, 1, 420 },
+	{ "text",     KMSGRAB_DCT_ISLOW, 1, 0, 444 },
+};
+
+#define NB_JPEG_PROFILES (sizeof(jpeg_profiles) / sizeof(*jpeg_profiles))
+
+static const struct jpeg_profile *find_jpeg_profile(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < NB_JPEG_PROFILES; i++) {
+		if (!strcmp(jpeg_profiles[i].name, name))
+			return &jpeg_profiles[i];
 	}
 
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-	jpeg_stdio_dest(&cinfo, jpgfile);
+	return NULL;
+}
+
+static void set_jpeg_profile(struct kmsgrab_encode_opts *opts,
+			     const struct jpeg_profile *profile)
+{
+	opts->dct = profile->dct;
+	opts->optimize_coding = profile->optimize_coding;
+	opts->progressive = profile->progressive;
+	opts->subsampling = profile->subsampling;
+}
 
-	cinfo.image_width = out_w;
-	cinfo.image_height = out_h;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_RGB;
+static const char *dct_names[] = {
+	[KMSGRAB_DCT_DEFAULT] = "default",
+	[KMSGRAB_DCT_ISLOW] = "islow",
+	[KMSGRAB_DCT_IFAST] = "ifast",
+	[KMSGRAB_DCT_FLOAT] = "float",
+};
 
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_start_compress(&cinfo, TRUE);
+static int parse_dct(const char *name)
+{
+	unsigned int i;
 
-	while (cinfo.next_scanline < cinfo.image_height) {
-		row_pointer[0] = (JSAMPROW)(pixels +
-				cinfo.next_scanline * out_w * 3);
-		jpeg_write_scanlines(&cinfo, row_pointer, 1);
+	for (i = 0; i < sizeof(dct_names) / sizeof(*dct_names); i++) {
+		if (!strcmp(dct_names[i], name))
+			return (int)i;
 	}
 
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
+	return -EINVAL;
+}
+
+static const char *palette_modes[] = {
+	[KMSGRAB_PALETTE_AUTO] = "auto",
+	[KMSGRAB_PALETTE_OFF] = "off",
+	[KMSGRAB_PALETTE_LOSSY] = "lossy",
+};
 
-	ret = 0;
+static int parse_palette_mode(const char *name)
+{
+	unsigned int i;
 
-	fclose(jpgfile);
-	free(scaled);
-out_unmap_buffer:
-	munmap(buffer, mmap_size);
-out_free_linear:
-	free(linear);
-out_free_picture:
-	free(picture);
-	return ret;
+	for (i = 0; i < sizeof(palette_modes) / sizeof(*palette_modes); i++) {
+		if (!strcmp(palette_modes[i], name))
+			return (int)i;
+	}
+
+	return -EINVAL;
 }
 
 static void print_usage(const char *prog)
 {
-	printf("Usage: %s [-v] [-bilinear] [-daemon] [--socket PATH] [-width N] [-height N] [--quality N] <output.png|output.jpg>\n",
-	       prog);
+	printf("Usage: %s [options] <output.png|.jpg|.jxl|.kraw|.h264|.ktl>\n"
+	       "       %s --analyze [options]\n"
+	       "       %s --compare <reference.png> [options] [<mismatch.png>]\n"
+	       "       %s --extract <archive.ktl> [--at TIME] <output.png>\n"
+	       "       %s --replay-trace <trace.ktr> [options] <output.png>\n"
+	       "\n"
+	       "Options:\n"
+	       "  -v                 Verbose debug output\n"
+	       "  -width N           Scale output to N pixels wide\n"
+	       "  -height N          Scale output to N pixels high\n"
+	       "  -bilinear          Use bilinear instead of nearest-neighbor scaling\n"
+	       "  --linear-light     Bilinear scaling in linear light (gamma correct)\n"
+	       "  --quality N        JPEG quality, 1 to 100 (default 90)\n"
+	       "  --target-kb N      Lower the JPEG quality as needed to stay under N KiB\n"
+	       "  --threads N        Threads to encode each picture with: JPEG strips\n"
+	       "                     (default 1), or JPEG XL and raw workers (default one\n"
+	       "                     per CPU)\n"
+	       "  --jpeg-threads N   Same as --threads\n"
+	       "  --jpeg-profile P   JPEG settings: fast, balanced, small or text\n"
+	       "  --jpeg-dct M       JPEG DCT method: islow, ifast or float\n"
+	       "  --jpeg-optimize B  Compute optimal Huffman tables (0 or 1)\n"
+	       "  --jpeg-progressive B  Write a progressive JPEG (0 or 1)\n"
+	       "  --jpeg-subsampling S  Chroma subsampling: 444, 422 or 420\n"
+	       "  --jpeg-smoothing N Smooth the input before encoding, 0 to 100\n"
+	       "  --jpeg-sweep       Encode one frame with each JPEG profile, and\n"
+	       "                     report the time and size of each (nothing is written)\n"
+	       "  --analyze          Print the luminance statistics, perceptual hash and\n"
+	       "                     change against the previous frame as JSON, instead\n"
+	       "                     of encoding (one line per frame with --interval)\n"
+	       "  --compare REF      Compare the screen with the picture REF, and only\n"
+	       "                     write the output if they differ (exit status 2)\n"
+	       "  --tolerance N      Largest difference on any channel of a matching pixel\n"
+	       "  --max-diff N       Number of differing pixels still matching (default 0)\n"
+	       "  --mask X,Y,W,H     Leave a region out of the comparison (repeatable)\n"
+	       "  --keyframe S       Seconds between keyframes of timelapse archives (.ktl,\n"
+	       "                     default 60) and videos (.h264, default 250 frames)\n"
+	       "  --archive-format F Format of the pictures in archives: kraw (the default,\n"
+	       "                     if available) or png\n"
+	       "  --extract ARCHIVE  Write the frame of a timelapse archive shown at TIME\n"
+	       "  --at TIME          Seconds since the epoch, or +S from the first frame\n"
+	       "                     (default: the last frame)\n"
+	       "  --png-palette M    Indexed color PNGs: auto (when 256 colors or less,\n"
+	       "                     the default), off, or lossy (quantize to 256 colors)\n"
+	       "  --driver NAME      Only use DRM devices bound to this driver\n"
+	       "  --cache PATH       Cache the device and plane used across runs\n"
+	       "  --interval MS      Capture continuously, every MS milliseconds\n"
+	       "  --count N          Stop continuous capture after N frames\n"
+	       "  --buffers N        Frames in flight between capture and encoders (default 2)\n"
+	       "  --encoders N       Number of encoder threads (default 1)\n"
+	       "  --cpu-budget PCT   Keep capture and encoding under PCT%% of one core,\n"
+	       "                     degrading rate, size, quality and effort as needed\n"
+	       "  --deadline MS      Degrade output when a grab takes longer than MS\n"
+	       "  --idle             Only run when the CPUs are otherwise idle (SCHED_IDLE)\n"
+	       "  --cpus LIST        Restrict to these CPUs, e.g. 2,3 or 1-3\n"
+	       "  -daemon            Run as a daemon, capturing on IPC request\n"
+	       "  --socket PATH      IPC socket path (default /tmp/kmsgrab.sock)\n"
+	       "  --ring N           Daemon: publish frames to a shared ring of N slots\n"
+	       "                     (with --interval, frames are captured periodically)\n"
+	       "  --record S         Daemon: keep the last S seconds of frames in memory,\n"
+	       "                     written out on DUMP\n"
+	       "  --record-interval MS  Period of the recorded frames (default 200)\n"
+	       "  --record-mb N      Memory the recording may use, in MiB (default 256)\n"
+	       "  --vnc PATH         Daemon: serve the screen over VNC on the UNIX socket PATH\n"
+	       "  --vnc-tcp PORT     Daemon: serve VNC on 127.0.0.1:PORT, with authentication\n"
+	       "  --vnc-password F   Password of the VNC authentication, on the first line\n"
+	       "                     of the file F (required by --vnc-tcp)\n"
+	       "  --vnc-interval MS  Minimum period of the VNC updates (default 50)\n"
+	       "  --record-trace F   Store each capture's raw framebuffer, format and plane\n"
+	       "                     properties in the trace F (large: one frame each)\n"
+	       "  --replay-trace F   Convert, scale and encode the captures of the trace F,\n"
+	       "                     at the recorded pace, and report the time taken\n"
+	       "  --replay-fast      Replay the captures without waiting between them\n",
+	       prog, prog, prog, prog, prog);
 }
 
-static int grab_once(const char *output_fn, uint32_t req_w, uint32_t req_h,
-		     int jpeg_quality)
+static int read_boot_id(char *buf, size_t len)
+{
+	FILE *f;
+	size_t n;
+
+	f = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (!f)
+		return -errno;
+
+	if (!fgets(buf, len, f)) {
+		fclose(f);
+		return -EIO;
+	}
+	fclose(f);
+
+	n = strcspn(buf, "\n");
+	buf[n] = '\0';
+	return 0;
+}
+
+static int get_driver_name(int drm_fd, char *buf, size_t len)
+{
+	drmVersionPtr ver;
+
+	ver = drmGetVersion(drm_fd);
+	if (!ver)
+		return -errno;
+
+	snprintf(buf, len, "%.*s", ver->name_len, ver->name);
+	drmFreeVersion(ver);
+	return 0;
+}
+
+static int has_dumb_buffers(int drm_fd)
 {
-	int err, drm_fd, prime_fd, retval = EXIT_FAILURE;
-	unsigned int i, card;
-	uint32_t fb_id = 0, crtc_id = 0;
-	uint32_t plane_id = 0;
-	drmModePlaneRes *plane_res;
-	drmModePlane *plane;
-	drmModeFB *fb;
-	drmModeFB2 *fb2;
-	uint32_t handle, pitch;
-	uint32_t out_w = req_w, out_h = req_h;
-	char buf[256];
 	uint64_t has_dumb;
 
-	for (card = 0; ; card++) {
-		snprintf(buf, sizeof(buf), "/dev/dri/card%u", card);
+	return drmGetCap(drm_fd, DRM_CAP_DUMB_BUFFER, &has_dumb) >= 0 && has_dumb;
+}
 
-		drm_fd = open(buf, O_RDWR | O_CLOEXEC);
-		if (drm_fd < 0) {
-			fprintf(stderr, "Could not open KMS/DRM device.\n");
-			goto out_return;
-		}
+/*
+ * Whether @path names a primary node directly under /dev/dri, which only
+ * root can create files in: the cache file belongs to the user.
+ */
+static int is_primary_node_path(const char *path)
+{
+	static const char prefix[] = DRM_DIR_NAME "/" DRM_PRIMARY_MINOR_NAME;
 
-		if (drmGetCap(drm_fd, DRM_CAP_DUMB_BUFFER, &has_dumb) >= 0 &&
-		    has_dumb)
-			break;
+	return !strncmp(path, prefix, sizeof(prefix) - 1) &&
+		!strchr(path + sizeof(DRM_DIR_NAME), '/');
+}
+
+/*
+ * Open the device recorded in the cache file, if the cache is still valid
+ * for this boot and the node still belongs to the same driver. On success
+ * the cached plane ID is left in cache->plane_id as a hint for find_plane().
+ */
+static int open_cached_device(struct device_cache *cache)
+{
+	char boot_id[64], driver[64];
+	uid_t euid;
+	FILE *f;
+	int drm_fd, n, err;
+
+	if (read_boot_id(boot_id, sizeof(boot_id)) < 0)
+		return -ENOENT;
+
+	/* The cache belongs to the user, like the pictures */
+	euid = geteuid();
+	seteuid(getuid());
+	f = fopen(g_cache_path, "r");
+	err = -errno;
+	seteuid(euid);
+	if (!f)
+		return err;
+
+	n = fscanf(f, "%63s %255s %63s %"SCNu32, cache->boot_id,
+		   cache->path, cache->driver, &cache->plane_id);
+	fclose(f);
+
+	if (n != 4 || strcmp(cache->boot_id, boot_id)) {
+		DBG("[debug] device cache %s is stale\n", g_cache_path);
+		return -ESTALE;
+	}
+
+	if (g_driver && strcmp(cache->driver, g_driver))
+		return -ESTALE;
+
+	if (!is_primary_node_path(cache->path)) {
+		DBG("[debug] cached device %s is not a primary node\n",
+		    cache->path);
+		return -ESTALE;
+	}
 
+	drm_fd = open(cache->path, O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+	if (drm_fd < 0)
+		return -errno;
+
+	if (drmGetNodeTypeFromFd(drm_fd) != DRM_NODE_PRIMARY ||
+	    get_driver_name(drm_fd, driver, sizeof(driver)) < 0 ||
+	    strcmp(driver, cache->driver) || !has_dumb_buffers(drm_fd)) {
+		DBG("[debug] cached device %s no longer matches\n", cache->path);
 		close(drm_fd);
+		return -ESTALE;
+	}
+
+	DBG("[debug] using cached device %s driver=%s plane_id=%"PRIu32"\n",
+		cache->path, cache->driver, cache->plane_id);
+
+	return drm_fd;
+}
+
+static void store_cached_device(const struct device_cache *cache)
+{
+	char tmp_fn[PATH_MAX];
+	uid_t euid;
+	FILE *f;
+
+	snprintf(tmp_fn, sizeof(tmp_fn), "%s.tmp", g_cache_path);
+
+	/* Written with user rights, like the pictures */
+	euid = geteuid();
+	seteuid(getuid());
+
+	f = fopen(tmp_fn, "w");
+	if (!f) {
+		DBG("[debug] unable to write device cache %s: %s\n",
+			tmp_fn, strerror(errno));
+		seteuid(euid);
+		return;
 	}
 
-	drm_fd = open(buf, O_RDWR | O_CLOEXEC);
-	if (drm_fd < 0) {
-		fprintf(stderr, "Could not open KMS/DRM device.\n");
-		goto out_return;
+	fprintf(f, "%s %s %s %"PRIu32"\n", cache->boot_id, cache->path,
+		cache->driver, cache->plane_id);
+
+	if (fclose(f) || rename(tmp_fn, g_cache_path)) {
+		DBG("[debug] unable to write device cache %s: %s\n",
+			g_cache_path, strerror(errno));
+		unlink(tmp_fn);
 	}
 
-	if (drmSetClientCap(drm_fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
-		fprintf(stderr, "Unable to set atomic cap.\n");
-		goto out_close_fd;
+	seteuid(euid);
+}
+
+/*
+ * Enumerate the DRM devices through libdrm and open the first primary node
+ * that supports dumb buffers (and matches the requested driver, if any).
+ * Each candidate node is opened exactly once, and the winning fd is returned.
+ */
+static int open_device(struct device_cache *cache)
+{
+	drmDevicePtr devices[MAX_DRM_DEVICES];
+	int i, count, drm_fd = -ENODEV;
+
+	count = drmGetDevices2(0, devices, MAX_DRM_DEVICES);
+	if (count < 0) {
+		DBG("[debug] drmGetDevices2 failed: %s\n", strerror(-count));
+		return count;
 	}
 
-	if (drmSetClientCap(drm_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1)) {
-		fprintf(stderr, "Unable to set universal planes cap.\n");
-		goto out_close_fd;
+	for (i = 0; i < count; i++) {
+		const char *node;
+
+		if (!(devices[i]->available_nodes & (1 << DRM_NODE_PRIMARY)))
+			continue;
+
+		node = devices[i]->nodes[DRM_NODE_PRIMARY];
+
+		drm_fd = open(node, O_RDWR | O_CLOEXEC);
+		if (drm_fd < 0) {
+			DBG("[debug] unable to open %s: %s\n", node, strerror(errno));
+			drm_fd = -ENODEV;
+			continue;
+		}
+
+		if (get_driver_name(drm_fd, cache->driver, sizeof(cache->driver)) < 0 ||
+		    (g_driver && strcmp(cache->driver, g_driver)) ||
+		    !has_dumb_buffers(drm_fd)) {
+			DBG("[debug] skipping %s driver=%s\n", node, cache->driver);
+			close(drm_fd);
+			drm_fd = -ENODEV;
+			continue;
+		}
+
+		snprintf(cache->path, sizeof(cache->path), "%s", node);
+		DBG("[debug] using device %s driver=%s\n", cache->path, cache->driver);
+		break;
+	}
+
+	drmFreeDevices(devices, count);
+	return drm_fd;
+}
+
+/*
+ * Find a plane that is currently scanning out a framebuffer. The plane ID
+ * in @hint (typically coming from the device cache) is tried first, so that
+ * the plane resources don't need to be walked at all when it is still valid.
+ */
+static int find_plane(int drm_fd, uint32_t hint, uint32_t *plane_id,
+		      uint32_t *fb_id, uint32_t *crtc_id)
+{
+	drmModePlaneRes *plane_res;
+	drmModePlane *plane;
+	unsigned int i;
+	int ret = -ENOENT;
+
+	if (hint) {
+		plane = drmModeGetPlane(drm_fd, hint);
+		if (plane) {
+			*plane_id = plane->plane_id;
+			*fb_id = plane->fb_id;
+			*crtc_id = plane->crtc_id;
+			drmModeFreePlane(plane);
+
+			if (*fb_id != 0 && *crtc_id != 0)
+				return 0;
+		}
+
+		DBG("[debug] cached plane %"PRIu32" is not active, rescanning\n", hint);
 	}
 
 	plane_res = drmModeGetPlaneResources(drm_fd);
 	if (!plane_res) {
 		fprintf(stderr, "Unable to get plane resources.\n");
-		goto out_close_fd;
+		return -errno;
 	}
 
 	for (i = 0; i < plane_res->count_planes; i++) {
@@ -461,36 +1060,357 @@ static int grab_once(const char *output_fn, uint32_t req_w, uint32_t req_h,
 		DBG("[debug] plane[%u] id=%"PRIu32" fb_id=%"PRIu32" crtc_id=%"PRIu32" crtc_x=%"PRIu32" crtc_y=%"PRIu32"\n",
 			i, plane->plane_id, plane->fb_id, plane->crtc_id,
 			plane->crtc_x, plane->crtc_y);
-		fb_id = plane->fb_id;
-		crtc_id = plane->crtc_id;
-		plane_id = plane->plane_id;
+		*fb_id = plane->fb_id;
+		*crtc_id = plane->crtc_id;
+		*plane_id = plane->plane_id;
 		drmModeFreePlane(plane);
 
-		if (fb_id != 0 && crtc_id != 0)
+		if (*fb_id != 0 && *crtc_id != 0) {
+			ret = 0;
 			break;
+		}
 	}
 
-	if (i == plane_res->count_planes) {
+	if (ret)
 		fprintf(stderr, "No planes found\n");
-		goto out_free_resources;
-	}
 
-	fb = drmModeGetFB(drm_fd, fb_id);
-	if (!fb) {
-		fprintf(stderr, "Failed to get framebuffer %"PRIu32": %s\n",
-			fb_id, strerror(errno));
-		goto out_free_resources;
-	}
+	drmModeFreePlaneResources(plane_res);
+	return ret;
+}
+
+int kms_open(struct kms *kms)
+{
+	memset(kms, 0, sizeof(*kms));
+	kms->fd = -1;
+
+	if (g_cache_path)
+		kms->fd = open_cached_device(&kms->cache);
+
+	if (kms->fd < 0) {
+		memset(&kms->cache, 0, sizeof(kms->cache));
+		kms->cache_dirty = !!g_cache_path;
+
+		kms->fd = open_device(&kms->cache);
+		if (kms->fd < 0) {
+			fprintf(stderr, "Could not open KMS/DRM device.\n");
+			return kms->fd;
+		}
+	}
+
+	kms->plane_id = kms->cache.plane_id;
+
+	if (drmSetClientCap(kms->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+		fprintf(stderr, "Unable to set atomic cap.\n");
+		goto err_close_fd;
+	}
+
+	if (drmSetClientCap(kms->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1)) {
+		fprintf(stderr, "Unable to set universal planes cap.\n");
+		goto err_close_fd;
+	}
+
+	return 0;
+
+err_close_fd:
+	close(kms->fd);
+	kms->fd = -1;
+	return -ENODEV;
+}
+
+void kms_close(struct kms *kms)
+{
+	if (kms->fd >= 0)
+		close(kms->fd);
+	kms->fd = -1;
+
+	free(kms->linear);
+	free(kms->picture);
+	kms->linear = kms->picture = NULL;
+	kms->linear_size = kms->picture_size = 0;
+}
+
+int kms_get_plane_fb(struct kms *kms, uint32_t *fb_id, uint32_t *crtc_id)
+{
+	uint32_t plane_id = 0;
+	int err;
+
+	err = find_plane(kms->fd, kms->plane_id, &plane_id, fb_id, crtc_id);
+	if (!err)
+		kms->plane_id = plane_id;
+
+	return err;
+}
+
+int kms_crtc_index(struct kms *kms, uint32_t crtc_id)
+{
+	drmModeRes *res;
+	int i, ret = -ENOENT;
+
+	res = drmModeGetResources(kms->fd);
+	if (!res)
+		return -errno;
+
+	for (i = 0; i < res->count_crtcs; i++) {
+		if (res->crtcs[i] == crtc_id) {
+			ret = i;
+			break;
+		}
+	}
+
+	drmModeFreeResources(res);
+	return ret;
+}
+
+int kms_wait_vblank(struct kms *kms, unsigned int crtc_index)
+{
+	drmVBlank vbl = {
+		.request.type = DRM_VBLANK_RELATIVE |
+			((crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+			 DRM_VBLANK_HIGH_CRTC_MASK),
+		.request.sequence = 1,
+	};
+
+	if (drmWaitVBlank(kms->fd, &vbl))
+		return -errno;
+
+	return 0;
+}
+
+static int reserve_buffer(uint8_t **buf, size_t *size, size_t needed)
+{
+	uint8_t *ptr;
+
+	if (*size >= needed)
+		return 0;
+
+	ptr = realloc(*buf, needed);
+	if (!ptr)
+		return -ENOMEM;
+
+	*buf = ptr;
+	*size = needed;
+	return 0;
+}
+
+static void close_gem_handle(int drm_fd, uint32_t handle)
+{
+	struct drm_gem_close req = { .handle = handle };
+
+	if (handle)
+		drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &req);
+}
+
+/* Values of all the properties of the plane, for capture traces. */
+static unsigned int plane_props(struct kms *kms, uint32_t plane_id,
+				struct trace_prop *out)
+{
+	drmModeObjectProperties *props;
+	drmModePropertyRes *prop;
+	unsigned int i, nb = 0;
+
+	props = drmModeObjectGetProperties(kms->fd, plane_id,
+					   DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return 0;
+
+	for (i = 0; i < props->count_props && nb < TRACE_MAX_PROPS; i++) {
+		prop = drmModeGetProperty(kms->fd, props->props[i]);
+		if (!prop)
+			continue;
+
+		snprintf(out[nb].name, sizeof(out[nb].name), "%s", prop->name);
+		out[nb++].value = props->prop_values[i];
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	return nb;
+}
+
+/* Copy the lines of the framebuffer to the linear buffer, without padding. */
+static void copy_lines(struct kms *kms, const drmModeFB *fb,
+		       const uint8_t *from, uint32_t pitch)
+{
+	size_t line = (size_t)fb->width * (fb->bpp >> 3);
+	uint32_t i;
+
+	for (i = 0; i < fb->height; i++)
+		memcpy(kms->linear + i * line, from + (size_t)i * pitch, line);
+}
+
+/*
+ * Convert the framebuffer in the linear buffer to RGB888 the way the plane
+ * shows it with @rotation, and scale it to the requested size, into @frame.
+ */
+static int kms_convert(struct kms *kms, drmModeFB *fb, uint32_t rotation,
+		       uint32_t req_w, uint32_t req_h, struct frame *frame)
+{
+	uint32_t out_w = req_w, out_h = req_h, disp_w, disp_h;
+	int scaled, rotated, err;
+	drmModeFB upright;
+	size_t pixels;
+
+	rotated = rotation != DRM_MODE_ROTATE_0;
+	disp_w = rotation_swaps_axes(rotation) ? fb->height : fb->width;
+	disp_h = rotation_swaps_axes(rotation) ? fb->width : fb->height;
+	pixels = (size_t)disp_w * disp_h;
+
+	if (!out_w && !out_h) {
+		out_w = disp_w;
+		out_h = disp_h;
+	} else if (!out_w) {
+		out_w = (uint32_t)((uint64_t)out_h * disp_w / disp_h);
+	} else if (!out_h) {
+		out_h = (uint32_t)((uint64_t)out_w * disp_h / disp_w);
+	}
+
+	if (kms->scale_pct && kms->scale_pct < 100) {
+		out_w = out_w * kms->scale_pct / 100;
+		out_h = out_h * kms->scale_pct / 100;
+	}
+
+	if (out_w == 0 || out_h == 0) {
+		fprintf(stderr, "Invalid output size\n");
+		return -EINVAL;
+	}
+
+	DBG("[debug] convert: out=%"PRIu32"x%"PRIu32" rotation=0x%"PRIx32"\n",
+		out_w, out_h, rotation);
+
+	scaled = out_w != disp_w || out_h != disp_h;
+
+	err = reserve_buffer(&frame->pixels, &frame->capacity,
+			     (size_t)out_w * out_h * 3);
+	/*
+	 * 16-bit linear samples for linear light scaling, sRGB bytes otherwise;
+	 * rotated pictures go through sRGB bytes first in both cases.
+	 */
+	if (!err && scaled)
+		err = reserve_buffer(&kms->picture, &kms->picture_size,
+				     pixels * (!g_linear_light ? 3 :
+					       rotated ? 4 + 6 : 6));
+	if (err)
+		return err;
+
+	if (scaled && g_linear_light && rotated) {
+		convert_to_24_rotated(fb, (uint24_t *)kms->picture, kms->linear,
+				      rotation);
+
+		upright = *fb;
+		upright.width = disp_w;
+		upright.height = disp_h;
+		upright.bpp = 24;
+
+		err = scale_linear(&upright, frame->pixels,
+				   (uint16_t *)(kms->picture + pixels * 4),
+				   kms->picture, out_w, out_h);
+	} else if (scaled && g_linear_light) {
+		err = scale_linear(fb, frame->pixels, (uint16_t *)kms->picture,
+				   kms->linear, out_w, out_h);
+	} else if (scaled) {
+		if (rotated)
+			convert_to_24_rotated(fb, (uint24_t *)kms->picture,
+					      kms->linear, rotation);
+		else
+			convert_to_24(fb, (uint24_t *)kms->picture, kms->linear);
+
+		scale_rgb24_auto(frame->pixels, kms->picture,
+				 disp_w, disp_h, out_w, out_h);
+	} else if (rotated) {
+		convert_to_24_rotated(fb, (uint24_t *)frame->pixels, kms->linear,
+				      rotation);
+	} else {
+		convert_to_24(fb, (uint24_t *)frame->pixels, kms->linear);
+	}
+
+	if (err)
+		return err;
+
+	frame->width = out_w;
+	frame->height = out_h;
+	return 0;
+}
+
+/* Append what a capture read to the capture trace. */
+static void trace_capture(struct kms *kms, uint32_t plane_id,
+			  struct trace_record *rec, const drmModeFB *fb,
+			  uint32_t rotation, const void *buffer, size_t size)
+{
+	struct trace_prop props[TRACE_MAX_PROPS];
+	struct timespec ts;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	rec->tv_sec = ts.tv_sec;
+	rec->tv_nsec = ts.tv_nsec;
+	rec->width = fb->width;
+	rec->height = fb->height;
+	rec->bpp = fb->bpp;
+	rec->depth = fb->depth;
+	rec->rotation = rotation;
+	rec->size = size;
+	rec->nb_props = plane_props(kms, plane_id, props);
+
+	err = trace_add(g_trace, rec, props, buffer);
+	if (err)
+		fprintf(stderr, "Failed to trace capture: %s\n", strerror(-err));
+}
+
+/*
+ * Read the framebuffer currently scanned out by the primary plane, convert it
+ * to RGB888 and scale it to the requested size, into @frame.
+ */
+int kms_capture(struct kms *kms, uint32_t req_w, uint32_t req_h,
+		struct frame *frame)
+{
+	uint32_t fb_id = 0, crtc_id = 0, plane_id = 0;
+	uint32_t handle, pitch, rotation;
+	size_t bytes_per_pixel, linear_size, mmap_size;
+	struct trace_record rec = { 0 };
+	uint64_t cpu_start = thread_cpu_time_ns();
+	drmModeFB *fb;
+	drmModeFB2 *fb2;
+	void *buffer;
+	int err, prime_fd;
+
+	err = find_plane(kms->fd, kms->plane_id, &plane_id, &fb_id, &crtc_id);
+	if (err)
+		return err;
+
+	if (kms->plane_id != plane_id) {
+		kms->plane_id = kms->cache.plane_id = plane_id;
+		kms->cache_dirty = !!g_cache_path;
+
+		/* The new plane may have a rotation property the last one lacked */
+		if (!kms->rotation_prop)
+			kms->rotation_probed = 0;
+	}
+
+	if (kms->cache_dirty &&
+	    !read_boot_id(kms->cache.boot_id, sizeof(kms->cache.boot_id))) {
+		store_cached_device(&kms->cache);
+		kms->cache_dirty = 0;
+	}
+
+	fb = drmModeGetFB(kms->fd, fb_id);
+	if (!fb) {
+		err = -errno;
+		fprintf(stderr, "Failed to get framebuffer %"PRIu32": %s\n",
+			fb_id, strerror(errno));
+		return err;
+	}
 
 	DBG("[debug] using plane_id=%"PRIu32" fb_id=%"PRIu32" crtc_id=%"PRIu32"\n",
 		plane_id, fb_id, crtc_id);
 
-	fb2 = drmModeGetFB2(drm_fd, fb_id);
+	fb2 = drmModeGetFB2(kms->fd, fb_id);
 	if (!fb2) {
 		DBG("[debug] drmModeGetFB2 failed for fb_id=%"PRIu32": %s\n",
 			fb_id, strerror(errno));
 		handle = fb->handle;
 		pitch = fb->width * (fb->bpp >> 3);
+		rec.pitches[0] = pitch;
 	} else {
 		DBG("[debug] fb2: w=%"PRIu32" h=%"PRIu32" pixel_format=0x%"PRIx32" flags=0x%"PRIx32"\n",
 			fb2->width, fb2->height, fb2->pixel_format, fb2->flags);
@@ -503,135 +1423,971 @@ static int grab_once(const char *output_fn, uint32_t req_w, uint32_t req_h,
 		DBG("[debug] fb2: modifier not printed (libdrm ABI varies)\n");
 		handle = fb2->handles[0];
 		pitch = fb2->pitches[0];
+
+		rec.pixel_format = fb2->pixel_format;
+		rec.flags = fb2->flags;
+		rec.modifier = fb2->modifier;
+		memcpy(rec.pitches, fb2->pitches, sizeof(rec.pitches));
+		memcpy(rec.offsets, fb2->offsets, sizeof(rec.offsets));
 		drmModeFreeFB2(fb2);
 	}
 
-	err = drmPrimeHandleToFD(drm_fd, handle, O_RDONLY, &prime_fd);
-	if (err < 0) {
-		fprintf(stderr, "Failed to retrieve prime handler: %s\n",
-			strerror(-err));
-		goto out_free_fb;
-	}
+	err = drmPrimeHandleToFD(kms->fd, handle, O_RDONLY, &prime_fd);
+	if (err < 0) {
+		fprintf(stderr, "Failed to retrieve prime handler: %s\n",
+			strerror(-err));
+		goto out_close_handles;
+	}
+
+	/* The picture is captured the way the plane is shown */
+	rotation = plane_rotation(kms, plane_id);
+
+	bytes_per_pixel = fb->bpp >> 3;
+	linear_size = (size_t)fb->width * fb->height * bytes_per_pixel;
+	mmap_size = (size_t)pitch * fb->height;
+
+	DBG("[debug] capture: fb_id=%"PRIu32" width=%"PRIu32" height=%"PRIu32" bpp=%"PRIu32" depth=%"PRIu32" handle=%"PRIu32"\n",
+		fb->fb_id, fb->width, fb->height, fb->bpp, fb->depth, fb->handle);
+	DBG("[debug] capture: prime_fd=%d pitch=%"PRIu32"\n", prime_fd, pitch);
+
+	err = reserve_buffer(&kms->linear, &kms->linear_size, linear_size);
+	if (err)
+		goto out_close_prime_fd;
+
+	buffer = mmap(NULL, mmap_size, PROT_READ, MAP_PRIVATE, prime_fd, 0);
+	if (buffer == MAP_FAILED) {
+		err = -errno;
+		fprintf(stderr, "Unable to mmap prime buffer\n");
+		goto out_close_prime_fd;
+	}
+
+	DBG("[debug] capture: mmap length=%zu buffer=%p\n",
+		mmap_size, buffer);
+
+	clock_gettime(CLOCK_REALTIME, &frame->timestamp);
+
+	// Copy framebuffer using pitch to a linear buffer, then convert to rgb888.
+	copy_lines(kms, fb, buffer, pitch);
+
+	if (g_trace)
+		trace_capture(kms, plane_id, &rec, fb, rotation, buffer, mmap_size);
+
+	munmap(buffer, mmap_size);
+
+	err = kms_convert(kms, fb, rotation, req_w, req_h, frame);
+	if (err)
+		goto out_close_prime_fd;
+
+	frame->cpu_ns += thread_cpu_time_ns() - cpu_start;
+
+out_close_prime_fd:
+	close(prime_fd);
+out_close_handles:
+	if (handle != fb->handle)
+		close_gem_handle(kms->fd, handle);
+	close_gem_handle(kms->fd, fb->handle);
+	drmModeFreeFB(fb);
+	return err;
+}
+
+/*
+ * Expand the frame number into the output file name. Only integer
+ * conversions ("%d", "%05u", ...) and "%%" are recognized; anything else is
+ * copied verbatim, so that a file name is never used as a format string.
+ */
+void format_output_fn(char *buf, size_t len, const char *tmpl, uint64_t id)
+{
+	const char *p = tmpl, *conv;
+	size_t pos = 0;
+	int pad, width;
+
+	while (*p && pos + 1 < len) {
+		if (*p != '%') {
+			buf[pos++] = *p++;
+			continue;
+		}
+
+		conv = p + 1;
+		if (*conv == '%') {
+			buf[pos++] = '%';
+			p += 2;
+			continue;
+		}
+
+		pad = *conv == '0';
+		width = (int)strtoul(conv, (char **)&conv, 10);
+
+		if (*conv != 'd' && *conv != 'u') {
+			buf[pos++] = *p++;
+			continue;
+		}
+
+		pos += snprintf(buf + pos, len - pos, pad ? "%0*"PRIu64 : "%*"PRIu64,
+				width, id);
+		if (pos >= len)
+			pos = len - 1;
+		p = conv + 1;
+	}
+
+	buf[pos] = '\0';
+}
+
+int encode_image(FILE *file, const struct frame *frame,
+		 const struct output *out)
+{
+	struct kmsgrab_image img;
+
+	img.pixels = frame->pixels;
+	img.width = frame->width;
+	img.height = frame->height;
+	img.stride = (size_t)frame->width * 3;
+
+	return out->enc->write(file, &img, &frame->opts);
+}
+
+int encode_frame(struct frame *frame, void *d)
+{
+	const struct output *out = d;
+	char fn[PATH_MAX];
+	FILE *file;
+	int ret;
+
+	format_output_fn(fn, sizeof(fn), out->fn, frame->id);
+
+	DBG("[debug] encode: frame=%"PRIu64" fn=%s encoder=%s\n",
+		frame->id, fn, out->enc->name);
+
+	/* Drop privileges, to write the picture with user rights */
+	seteuid(getuid());
+
+	file = fopen(fn, "w+");
+	if (!file)
+		return -errno;
+
+	ret = encode_image(file, frame, out);
+
+	if (fclose(file) && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+int decode_image(const char *fn, uint8_t **pixels, uint32_t *width,
+		 uint32_t *height)
+{
+	const struct kmsgrab_encoder *enc = get_encoder(fn);
+	FILE *file;
+	int ret;
+
+	if (!enc)
+		return -ENOTSUP;
+
+	if (!enc->read) {
+		fprintf(stderr, "The %s encoder cannot read pictures\n", enc->name);
+		return -ENOTSUP;
+	}
+
+	file = fopen(fn, "r");
+	if (!file)
+		return -errno;
+
+	ret = enc->read(file, pixels, width, height);
+	fclose(file);
+
+	return ret;
+}
+
+static int grab_once(const struct output *out)
+{
+	struct frame frame = { 0 };
+	struct kms kms;
+	int err;
+
+	if (kms_open(&kms))
+		return EXIT_FAILURE;
+
+	frame.opts = out->opts;
+
+	err = kms_capture(&kms, out->req_w, out->req_h, &frame);
+	if (!err)
+		err = encode_frame(&frame, (void *)out);
+
+	kms_close(&kms);
+	free(frame.pixels);
+
+	if (err < 0) {
+		fprintf(stderr, "Failed to take screenshot: %s\n",
+			strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int encode_to_memory(const struct frame *frame,
+			    const struct output *out, size_t *size)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *file;
+	int err;
+
+	file = open_memstream(&buf, &len);
+	if (!file)
+		return -errno;
+
+	err = encode_image(file, frame, out);
+
+	if (fclose(file) && !err)
+		err = -errno;
+
+	*size = len;
+	free(buf);
+
+	return err;
+}
+
+/* Best of a few runs, to leave out the page faults of the first one */
+#define JPEG_SWEEP_RUNS	3
+
+static int sweep_one(const struct frame *frame, const struct output *out,
+		     const char *name)
+{
+	struct timespec start, end;
+	uint64_t ns, best_ns = UINT64_MAX;
+	size_t size = 0;
+	unsigned int i;
+	int err;
+
+	for (i = 0; i < JPEG_SWEEP_RUNS; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		err = encode_to_memory(frame, out, &size);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		if (err)
+			return err;
+
+		ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ull
+			+ end.tv_nsec - start.tv_nsec;
+		if (ns < best_ns)
+			best_ns = ns;
+	}
+
+	printf("%-10s %-7s %8s %11s %11u %8.2f %10zu\n", name,
+	       dct_names[frame->opts.dct],
+	       frame->opts.optimize_coding ? "yes" : "no",
+	       frame->opts.progressive ? "yes" : "no",
+	       frame->opts.subsampling ? frame->opts.subsampling : 420,
+	       (double)best_ns / 1e6, size);
+
+	return 0;
+}
+
+/*
+ * Encode the current frame with every JPEG profile, then with the settings
+ * given on the command line, and print how long each took and its size.
+ */
+static int jpeg_sweep(const struct output *out)
+{
+	struct frame frame = { 0 };
+	struct kms kms;
+	unsigned int i;
+	int err;
+
+	if (strcmp(out->enc->name, "jpeg")) {
+		fprintf(stderr, "The JPEG sweep needs a .jpg output name\n");
+		return EXIT_FAILURE;
+	}
+
+	if (kms_open(&kms))
+		return EXIT_FAILURE;
+
+	err = kms_capture(&kms, out->req_w, out->req_h, &frame);
+	kms_close(&kms);
+	if (err)
+		goto out_free;
+
+	printf("%ux%u, quality %d, %u thread(s)\n\n", frame.width, frame.height,
+	       out->opts.quality, out->opts.threads ? out->opts.threads : 1);
+	printf("%-10s %-7s %8s %11s %11s %8s %10s\n", "profile", "dct",
+	       "optimize", "progressive", "subsampling", "ms", "bytes");
+
+	frame.opts = out->opts;
+	frame.opts.target_size = 0;
+
+	for (i = 0; !err && i < NB_JPEG_PROFILES; i++) {
+		set_jpeg_profile(&frame.opts, &jpeg_profiles[i]);
+		frame.opts.smoothing = 0;
+
+		err = sweep_one(&frame, out, jpeg_profiles[i].name);
+	}
+
+	if (!err) {
+		frame.opts = out->opts;
+		frame.opts.target_size = 0;
+		err = sweep_one(&frame, out, "options");
+	}
+
+out_free:
+	free(frame.pixels);
+
+	if (err < 0) {
+		fprintf(stderr, "JPEG sweep failed: %s\n", strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Exit status of a comparison that ran fine but found differences */
+#define EXIT_MISMATCH	2
+
+/*
+ * Compare a capture against the picture @ref_fn, and print the result. Only
+ * when it does not match is the frame encoded, if an output was given.
+ */
+static int run_compare(const struct output *out, const char *ref_fn,
+		       const struct compare_opts *opts)
+{
+	struct reference ref = { 0 };
+	struct frame frame = { 0 };
+	char text[COMPARE_TEXT_MAX];
+	struct compare_result res;
+	struct kms kms;
+	int err;
+
+	err = reference_load(&ref, ref_fn);
+	if (err) {
+		fprintf(stderr, "Unable to load reference %s: %s\n",
+			ref_fn, strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	if (kms_open(&kms)) {
+		reference_free(&ref);
+		return EXIT_FAILURE;
+	}
+
+	frame.opts = out->opts;
+
+	err = kms_capture(&kms, out->req_w, out->req_h, &frame);
+	kms_close(&kms);
+
+	if (!err)
+		err = compare_frame(&ref, &frame, opts, &res);
+	if (!err)
+		err = compare_format(&res, text, sizeof(text));
+	if (err >= 0) {
+		printf("%s\n", text);
+		err = 0;
+	}
+
+	if (!err && !res.match && out->fn)
+		err = encode_frame(&frame, (void *)out);
+
+	free(frame.pixels);
+	reference_free(&ref);
+
+	if (err < 0) {
+		fprintf(stderr, "Failed to compare screenshot: %s\n",
+			strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	return res.match ? EXIT_SUCCESS : EXIT_MISMATCH;
+}
+
+/*
+ * Print the statistics of a frame as a line of JSON, every @interval_ms
+ * milliseconds, @count times (or forever if zero); nothing is encoded.
+ */
+static int run_analyze(const struct output *out, unsigned int interval_ms,
+		       uint64_t count)
+{
+	struct frame_stats stats[2], *st, *prev = NULL;
+	char json[STATS_JSON_MAX];
+	struct frame frame = { 0 };
+	struct timespec next, now;
+	unsigned int errors = 0;
+	struct kms kms;
+	uint64_t id;
+	int err;
+
+	if (kms_open(&kms))
+		return EXIT_FAILURE;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (id = 0; !count || id < count; id++) {
+		st = &stats[id % 2];
+		frame.id = id;
+
+		err = kms_capture(&kms, out->req_w, out->req_h, &frame);
+		if (!err)
+			err = frame_stats_compute(st, &frame, prev);
+		if (!err)
+			err = frame_stats_json(st, json, sizeof(json));
+
+		if (err < 0) {
+			fprintf(stderr, "Failed to analyze frame %"PRIu64": %s\n",
+				id, strerror(-err));
+			errors++;
+			prev = NULL;
+		} else {
+			printf("%s\n", json);
+			fflush(stdout);
+			prev = st;
+		}
+
+		if (count && id + 1 == count)
+			break;
+
+		timespec_add_ms(&next, interval_ms);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_before(&next, &now)) {
+			next = now;
+			continue;
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+	}
+
+	kms_close(&kms);
+	free(frame.pixels);
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Append a frame to the timelapse archive @out->fn every @interval_ms
+ * milliseconds, @count times (or forever if zero). Its pictures are written
+ * with the encoder of @format, .kraw if available, or else .png.
+ */
+static int run_timelapse(const struct output *out, const char *format,
+			 unsigned int interval_ms, uint64_t count,
+			 unsigned int keyframe_ms)
+{
+	const struct kmsgrab_encoder *enc;
+	struct frame frame = { 0 };
+	struct timespec next, now;
+	unsigned int errors = 0;
+	struct timelapse tl;
+	char ext[8];
+	struct kms kms;
+	uint64_t id;
+	int err;
+
+	/* Frames are rebuilt from the pictures, so they must be lossless */
+	if (format && strcmp(format, "kraw") && strcmp(format, "png")) {
+		fprintf(stderr, "Unsupported archive format: %s\n", format);
+		return EXIT_FAILURE;
+	}
+
+	snprintf(ext, sizeof(ext), ".%s", format ? format : "kraw");
+	enc = get_encoder(ext);
+	if (!enc && !format) {
+		strcpy(ext, ".png");
+		enc = get_encoder(ext);
+	}
+	if (!enc)
+		return EXIT_FAILURE;
+
+	if (kms_open(&kms))
+		return EXIT_FAILURE;
+
+	/* Drop privileges, to write the archive with user rights */
+	seteuid(getuid());
+
+	err = timelapse_open(&tl, out->fn, enc, ext, &out->opts, keyframe_ms);
+	if (err) {
+		fprintf(stderr, "Unable to create archive %s: %s\n",
+			out->fn, strerror(-err));
+		kms_close(&kms);
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (id = 0; !count || id < count; id++) {
+		frame.id = id;
+
+		err = kms_capture(&kms, out->req_w, out->req_h, &frame);
+		if (err) {
+			fprintf(stderr, "Failed to take screenshot: %s\n",
+				strerror(-err));
+			errors++;
+		} else {
+			err = timelapse_add(&tl, &frame);
+			if (err) {
+				/* The archive can't be trusted past a failed write */
+				fprintf(stderr, "Failed to archive frame %"PRIu64": %s\n",
+					id, strerror(-err));
+				errors++;
+				break;
+			}
+		}
+
+		if (count && id + 1 == count)
+			break;
+
+		timespec_add_ms(&next, interval_ms);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_before(&next, &now)) {
+			next = now;
+			continue;
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+	}
+
+	if (timelapse_close(&tl))
+		errors++;
+
+	kms_close(&kms);
+	free(frame.pixels);
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static volatile sig_atomic_t video_stop;
+
+static void video_signal(int sig)
+{
+	(void)sig;
+	video_stop = 1;
+}
+
+/*
+ * Encode a frame every @interval_ms milliseconds, @count times (or until
+ * interrupted if zero), into the video @out->fn. SIGINT and SIGTERM end the
+ * video cleanly, with the frames the encoder still holds.
+ */
+static int run_video(const struct output *out, unsigned int interval_ms,
+		     uint64_t count, unsigned int keyframe_ms)
+{
+	struct kmsgrab_stream *stream;
+	struct frame frame = { 0 };
+	struct kmsgrab_image img;
+	struct timespec next, now;
+	unsigned int errors = 0;
+	struct kms kms;
+	FILE *file;
+	uint64_t id;
+	int err;
+
+	if (kms_open(&kms))
+		return EXIT_FAILURE;
+
+	/* Drop privileges, to write the video with user rights */
+	seteuid(getuid());
+
+	file = fopen(out->fn, "w");
+	if (!file) {
+		fprintf(stderr, "Unable to create video %s: %s\n",
+			out->fn, strerror(errno));
+		kms_close(&kms);
+		return EXIT_FAILURE;
+	}
+
+	err = out->enc->stream_open(&stream, file, &out->opts, interval_ms,
+				    keyframe_ms);
+	if (err) {
+		fprintf(stderr, "Unable to start video: %s\n", strerror(-err));
+		fclose(file);
+		kms_close(&kms);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGINT, video_signal);
+	signal(SIGTERM, video_signal);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (id = 0; !video_stop && (!count || id < count); id++) {
+		frame.id = id;
+
+		err = kms_capture(&kms, out->req_w, out->req_h, &frame);
+		if (err) {
+			fprintf(stderr, "Failed to take screenshot: %s\n",
+				strerror(-err));
+			errors++;
+		} else {
+			img.pixels = frame.pixels;
+			img.width = frame.width;
+			img.height = frame.height;
+			img.stride = (size_t)frame.width * 3;
+
+			err = out->enc->stream_write(stream, &img);
+			if (err) {
+				fprintf(stderr, "Failed to encode frame %"PRIu64": %s\n",
+					id, strerror(-err));
+				errors++;
+				break;
+			}
+		}
+
+		if (count && id + 1 == count)
+			break;
+
+		timespec_add_ms(&next, interval_ms);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_before(&next, &now)) {
+			next = now;
+			continue;
+		}
+
+		while (!video_stop &&
+		       clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+	}
+
+	DBG("[debug] video: %"PRIu64" frames\n", id);
+
+	if (out->enc->stream_close(stream))
+		errors++;
+	if (fclose(file))
+		errors++;
+
+	kms_close(&kms);
+	free(frame.pixels);
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Parse "<seconds>[.<fraction>]". */
+static int parse_time(const char *str, struct timespec *ts)
+{
+	long scale = 100000000;
+	char *end;
+
+	ts->tv_sec = strtoll(str, &end, 10);
+	ts->tv_nsec = 0;
+	if (end == str)
+		return -EINVAL;
+
+	if (*end == '.') {
+		for (end++; isdigit((unsigned char)*end); end++, scale /= 10)
+			ts->tv_nsec += (*end - '0') * scale;
+	}
+
+	return *end ? -EINVAL : 0;
+}
+
+/*
+ * Rebuild the frame of the archive @archive_fn shown at @at (see --at), and
+ * encode it to the output.
+ */
+static int run_extract(const struct output *out, const char *archive_fn,
+		       const char *at)
+{
+	struct timespec first, last, ts;
+	struct frame frame = { 0 };
+	int err;
+
+	err = timelapse_span(archive_fn, &first, &last);
+	if (err) {
+		fprintf(stderr, "Unable to read the index of %s: %s\n",
+			archive_fn, strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	ts = last;
+
+	if (at && (parse_time(at[0] == '+' ? at + 1 : at, &ts) ||
+		   ts.tv_sec < 0)) {
+		fprintf(stderr, "Invalid time: %s\n", at);
+		return EXIT_FAILURE;
+	}
+
+	if (at && at[0] == '+') {
+		ts.tv_sec += first.tv_sec;
+		ts.tv_nsec += first.tv_nsec;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	err = timelapse_extract(archive_fn, &ts, &frame);
+	if (!err) {
+		printf("%"PRIu64" %lld.%09ld\n", frame.id,
+		       (long long)frame.timestamp.tv_sec, frame.timestamp.tv_nsec);
+
+		frame.opts = out->opts;
+		err = encode_frame(&frame, (void *)out);
+	}
+
+	free(frame.pixels);
+
+	if (err < 0) {
+		fprintf(stderr, "Failed to extract frame: %s\n", strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Feed the captures of the trace @trace_fn through the conversion, scaling
+ * and encoding of the output, at the pace they were recorded (or as fast as
+ * possible with @fast), and report how long each step took.
+ */
+static int run_replay(const struct output *out, const char *trace_fn,
+		      int fast, uint64_t count)
+{
+	struct trace_prop props[TRACE_MAX_PROPS];
+	uint64_t convert_ns = 0, encode_ns = 0, max_convert = 0, max_encode = 0;
+	uint64_t start, convert, encode, n, done = 0;
+	struct timespec first = { 0 }, next, now;
+	struct trace_record rec;
+	struct frame frame = { 0 };
+	struct kms kms = { 0 };
+	unsigned int errors = 0;
+	size_t capacity = 0;
+	uint8_t *data = NULL;
+	drmModeFB fb = { 0 };
+	FILE *file;
+	int err;
+
+	err = trace_open(trace_fn, &file);
+	if (err) {
+		fprintf(stderr, "Unable to open trace %s: %s\n",
+			trace_fn, strerror(-err));
+		return EXIT_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &first);
+
+	for (n = 0; !count || n < count; n++) {
+		err = trace_next(file, &rec, props, &data, &capacity);
+		if (err == -ENOENT)
+			break;
+		if (err) {
+			fprintf(stderr, "Failed to read trace: %s\n", strerror(-err));
+			errors++;
+			break;
+		}
+
+		fb.width = rec.width;
+		fb.height = rec.height;
+		fb.bpp = rec.bpp;
+		fb.depth = rec.depth;
+		fb.pitch = rec.pitches[0];
+
+		if ((fb.bpp != 16 && fb.bpp != 32) || !fb.width || !fb.height ||
+		    fb.pitch < fb.width * (fb.bpp >> 3) ||
+		    rec.size < (uint64_t)fb.pitch * fb.height) {
+			fprintf(stderr, "Invalid capture %"PRIu64" in trace\n", n);
+			errors++;
+			break;
+		}
+
+		DBG("[debug] replay: frame %"PRIu64" %"PRIu32"x%"PRIu32" bpp=%"PRIu32" pitch=%"PRIu32" pixel_format=0x%"PRIx32" modifier=0x%"PRIx64" rotation=0x%"PRIx32" props=%"PRIu32"\n",
+			n, fb.width, fb.height, fb.bpp, fb.pitch, rec.pixel_format,
+			rec.modifier, rec.rotation, rec.nb_props);
+
+		/* Keep the spacing the captures were recorded with */
+		if (!fast) {
+			if (!n) {
+				first.tv_sec -= rec.tv_sec;
+				first.tv_nsec -= rec.tv_nsec;
+			}
+
+			next.tv_sec = first.tv_sec + rec.tv_sec;
+			next.tv_nsec = first.tv_nsec + rec.tv_nsec;
+			while (next.tv_nsec < 0) {
+				next.tv_sec--;
+				next.tv_nsec += 1000000000;
+			}
+			while (next.tv_nsec >= 1000000000) {
+				next.tv_sec++;
+				next.tv_nsec -= 1000000000;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (timespec_before(&now, &next))
+				while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						       &next, NULL) == EINTR);
+		}
+
+		start = thread_cpu_time_ns();
 
-	if (!out_w && !out_h) {
-		out_w = fb->width;
-		out_h = fb->height;
-	} else if (!out_w) {
-		out_w = (uint32_t)((uint64_t)out_h * fb->width / fb->height);
-	} else if (!out_h) {
-		out_h = (uint32_t)((uint64_t)out_w * fb->height / fb->width);
-	}
+		err = reserve_buffer(&kms.linear, &kms.linear_size,
+				     (size_t)fb.width * fb.height * (fb.bpp >> 3));
+		if (!err) {
+			clock_gettime(CLOCK_REALTIME, &frame.timestamp);
+			copy_lines(&kms, &fb, data, fb.pitch);
+			err = kms_convert(&kms, &fb, rec.rotation,
+					  out->req_w, out->req_h, &frame);
+		}
+		if (err) {
+			fprintf(stderr, "Failed to convert capture %"PRIu64": %s\n",
+				n, strerror(-err));
+			errors++;
+			continue;
+		}
 
-	if (out_w == 0 || out_h == 0) {
-		fprintf(stderr, "Invalid output size\n");
-		goto out_close_prime_fd;
+		convert = thread_cpu_time_ns() - start;
+
+		frame.id = n;
+		frame.opts = out->opts;
+
+		start = thread_cpu_time_ns();
+		err = encode_frame(&frame, (void *)out);
+		encode = thread_cpu_time_ns() - start;
+
+		if (err < 0) {
+			fprintf(stderr, "Failed to encode capture %"PRIu64": %s\n",
+				n, strerror(-err));
+			errors++;
+		}
+
+		DBG("[debug] replay: frame %"PRIu64" convert %.3f ms, encode %.3f ms\n",
+			n, convert / 1e6, encode / 1e6);
+
+		done++;
+		convert_ns += convert;
+		encode_ns += encode;
+		if (convert > max_convert)
+			max_convert = convert;
+		if (encode > max_encode)
+			max_encode = encode;
 	}
 
-	if (strstr(output_fn, ".jpg") || strstr(output_fn, ".jpeg"))
-		err = save_jpg(fb, prime_fd, pitch, out_w, out_h, output_fn, jpeg_quality);
-	else
-		err = save_png(fb, prime_fd, pitch, out_w, out_h, output_fn);
+	if (done)
+		printf("%"PRIu64" frames: convert %.3f ms (max %.3f), encode %.3f ms (max %.3f)\n",
+		       done, convert_ns / 1e6 / done, max_convert / 1e6,
+		       encode_ns / 1e6 / done, max_encode / 1e6);
+
+	fclose(file);
+	free(data);
+	free(kms.linear);
+	free(kms.picture);
+	free(frame.pixels);
+
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static atomic_uint continuous_errors;
+
+struct continuous {
+	struct output *out;
+	struct governor gov;
+};
+
+static int continuous_encode(struct frame *frame, void *d)
+{
+	struct continuous *c = d;
+
+	return encode_frame(frame, c->out);
+}
+
+static void continuous_complete(struct frame *frame, int err, void *d)
+{
+	struct continuous *c = d;
+
 	if (err < 0) {
-		fprintf(stderr, "Failed to take screenshot: %s\n",
-			strerror(-err));
-		goto out_close_prime_fd;
+		fprintf(stderr, "Failed to encode frame %"PRIu64": %s\n",
+			frame->id, strerror(-err));
+		atomic_fetch_add(&continuous_errors, 1);
 	}
 
-	retval = EXIT_SUCCESS;
+	governor_update(&c->gov, frame);
+}
 
-out_close_prime_fd:
-	close(prime_fd);
-out_free_fb:
-	drmModeFreeFB(fb);
-out_free_resources:
-	drmModeFreePlaneResources(plane_res);
-out_close_fd:
-	close(drm_fd);
-out_return:
-	return retval;
+static const struct pipeline_ops continuous_ops = {
+	.encode = continuous_encode,
+	.complete = continuous_complete,
+};
+
+void timespec_add_ms(struct timespec *ts, unsigned int ms)
+{
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
 }
 
-static int run_daemon(const char *socket_path, const char *output_fn,
-		      uint32_t req_w, uint32_t req_h, int jpeg_quality)
+int timespec_before(const struct timespec *a, const struct timespec *b)
 {
-	int srv_fd, cli_fd, ret = EXIT_FAILURE;
-	struct sockaddr_un addr;
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
 
-	srv_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (srv_fd < 0) {
-		fprintf(stderr, "Unable to create IPC socket: %s\n", strerror(errno));
+/*
+ * Capture a frame every @interval_ms milliseconds, @count times (or forever
+ * if zero). The readback happens on this thread while the previous frames
+ * are being encoded by the pipeline workers. With a CPU budget, the period
+ * is stretched and the output degraded as needed by the governor.
+ */
+static int run_continuous(struct output *out, unsigned int interval_ms,
+			  uint64_t count, unsigned int nb_buffers,
+			  unsigned int nb_encoders, unsigned int budget_pct,
+			  unsigned int deadline_ms)
+{
+	struct continuous c = { .out = out };
+	struct timespec next, now;
+	struct pipeline pl;
+	struct frame *frame;
+	struct kms kms;
+	uint64_t id;
+	int err;
+
+	if (kms_open(&kms))
 		return EXIT_FAILURE;
-	}
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sun_family = AF_UNIX;
-	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
-		fprintf(stderr, "Socket path too long: %s\n", socket_path);
-		goto out_close_srv;
-	}
-	strcpy(addr.sun_path, socket_path);
+	governor_init(&c.gov, budget_pct, deadline_ms, interval_ms, &out->opts);
 
-	unlink(socket_path);
-	if (bind(srv_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		fprintf(stderr, "Unable to bind IPC socket %s: %s\n",
-			socket_path, strerror(errno));
-		goto out_close_srv;
+	err = pipeline_init(&pl, nb_buffers, nb_encoders, &continuous_ops, &c);
+	if (err) {
+		fprintf(stderr, "Unable to start pipeline: %s\n", strerror(-err));
+		governor_free(&c.gov);
+		kms_close(&kms);
+		return EXIT_FAILURE;
 	}
 
-	if (listen(srv_fd, 4) < 0) {
-		fprintf(stderr, "Unable to listen on IPC socket %s: %s\n",
-			socket_path, strerror(errno));
-		goto out_unlink_socket;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &next);
 
-	DBG("[debug] daemon listening on %s\n", socket_path);
+	for (id = 0; !count || id < count; id++) {
+		frame = pipeline_get_frame(&pl);
+		frame->id = id;
 
-	for (;;) {
-		char buf[128];
-		ssize_t len;
-		char *cmd;
+		governor_apply(&c.gov, &kms, frame);
 
-		cli_fd = accept(srv_fd, NULL, NULL);
-		if (cli_fd < 0) {
-			if (errno == EINTR)
-				continue;
-			fprintf(stderr, "IPC accept failed: %s\n", strerror(errno));
-			break;
+		err = kms_capture(&kms, out->req_w, out->req_h, frame);
+		if (err) {
+			fprintf(stderr, "Failed to capture frame %"PRIu64": %s\n",
+				id, strerror(-err));
+			atomic_fetch_add(&continuous_errors, 1);
+			pipeline_put_frame(&pl, frame);
+		} else {
+			pipeline_submit(&pl, frame);
 		}
 
-		len = read(cli_fd, buf, sizeof(buf) - 1);
-		if (len <= 0) {
-			close(cli_fd);
-			continue;
-		}
-		buf[len] = '\0';
+		if (count && id + 1 == count)
+			break;
 
-		cmd = buf;
-		while (*cmd && isspace((unsigned char)*cmd))
-			cmd++;
-		for (len = strlen(cmd); len > 0; len--) {
-			if (!isspace((unsigned char)cmd[len - 1]))
-				break;
-			cmd[len - 1] = '\0';
-		}
+		timespec_add_ms(&next, governor_interval(&c.gov));
 
-		if (!strcmp(cmd, "GRAB")) {
-			if (grab_once(output_fn, req_w, req_h, jpeg_quality) == EXIT_SUCCESS)
-				write(cli_fd, "OK\n", 3);
-			else
-				write(cli_fd, "ERR grab failed\n", 16);
-		} else {
-			write(cli_fd, "ERR unsupported command\n", 24);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespec_before(&next, &now)) {
+			/* Running late: don't try to catch up with a burst */
+			DBG("[debug] frame %"PRIu64" overran the capture interval\n", id);
+			next = now;
+			continue;
 		}
 
-		close(cli_fd);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
 	}
 
-out_unlink_socket:
-	unlink(socket_path);
-out_close_srv:
-	close(srv_fd);
-	return ret;
+	pipeline_finish(&pl);
+	governor_free(&c.gov);
+	kms_close(&kms);
+
+	return atomic_load(&continuous_errors) ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 int main(int argc, char **argv)
@@ -641,6 +2397,32 @@ int main(int argc, char **argv)
 	int daemon_mode = 0;
 	const char *socket_path = "/tmp/kmsgrab.sock";
 	const char *output_fn = NULL;
+	unsigned int interval_ms = 0, nb_buffers = 2, nb_encoders = 1;
+	unsigned int ring_slots = 0, budget_pct = 0, deadline_ms = 0;
+	unsigned int target_kb = 0, threads = 0;
+	unsigned int record_s = 0, record_interval_ms = 200, record_mb = 256;
+	unsigned int vnc_port = 0, vnc_interval_ms = 50;
+	const char *vnc_path = NULL, *vnc_password_file = NULL;
+	const char *record_trace_fn = NULL, *replay_fn = NULL;
+	int replay_fast = 0;
+	struct trace trace;
+	uid_t euid;
+	int err;
+	const struct jpeg_profile *jpeg_profile = NULL;
+	int jpeg_dct = -1, jpeg_optimize = -1, jpeg_progressive = -1;
+	int jpeg_subsampling = 0, jpeg_smoothing = 0, jpeg_sweep_mode = 0;
+	int analyze_mode = 0;
+	const char *compare_fn = NULL;
+	const char *extract_fn = NULL, *extract_at = NULL;
+	const char *archive_format = NULL;
+	unsigned int keyframe_s = 0;
+	struct compare_opts compare_opts = { 0 };
+	int png_palette = KMSGRAB_PALETTE_AUTO;
+	const char *cpus = NULL;
+	int sched_idle = 0;
+	struct daemon_config daemon_cfg;
+	uint64_t count = 0;
+	struct output out;
 	int i;
 
 	if (argc < 2) {
@@ -653,6 +2435,14 @@ int main(int argc, char **argv)
 			g_verbose = 1;
 		} else if (!strcmp(argv[i], "-bilinear")) {
 			g_bilinear = 1;
+		} else if (!strcmp(argv[i], "--linear-light")) {
+			g_linear_light = 1;
+		} else if (!strcmp(argv[i], "--jpeg-sweep")) {
+			jpeg_sweep_mode = 1;
+		} else if (!strcmp(argv[i], "--analyze")) {
+			analyze_mode = 1;
+		} else if (!strcmp(argv[i], "--idle")) {
+			sched_idle = 1;
 		} else if (!strcmp(argv[i], "-daemon") || !strcmp(argv[i], "--daemon")) {
 			daemon_mode = 1;
 		} else if (!strcmp(argv[i], "-width")) {
@@ -677,12 +2467,265 @@ int main(int argc, char **argv)
 				jpeg_quality = 1;
 			if (jpeg_quality > 100)
 				jpeg_quality = 100;
+		} else if (!strcmp(argv[i], "--target-kb")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			target_kb = (unsigned int)strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--threads") ||
+			   !strcmp(argv[i], "--jpeg-threads")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			threads = (unsigned int)strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--jpeg-profile")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			jpeg_profile = find_jpeg_profile(argv[i]);
+			if (!jpeg_profile) {
+				fprintf(stderr, "Unknown JPEG profile: %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "--jpeg-dct")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			jpeg_dct = parse_dct(argv[i]);
+			if (jpeg_dct < 0) {
+				fprintf(stderr, "Unknown DCT method: %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "--jpeg-optimize")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			jpeg_optimize = !!strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--jpeg-progressive")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			jpeg_progressive = !!strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--jpeg-subsampling")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			jpeg_subsampling = (int)strtoul(argv[i], NULL, 10);
+			if (jpeg_subsampling != 444 && jpeg_subsampling != 422 &&
+			    jpeg_subsampling != 420) {
+				fprintf(stderr, "Invalid chroma subsampling: %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "--jpeg-smoothing")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			jpeg_smoothing = (int)strtoul(argv[i], NULL, 10);
+			if (jpeg_smoothing > 100)
+				jpeg_smoothing = 100;
+		} else if (!strcmp(argv[i], "--png-palette")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			png_palette = parse_palette_mode(argv[i]);
+			if (png_palette < 0) {
+				fprintf(stderr, "Unknown palette mode: %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "--compare")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			compare_fn = argv[i];
+		} else if (!strcmp(argv[i], "--extract")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			extract_fn = argv[i];
+		} else if (!strcmp(argv[i], "--at")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			extract_at = argv[i];
+		} else if (!strcmp(argv[i], "--keyframe")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			keyframe_s = (unsigned int)strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--archive-format")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			archive_format = argv[i];
+		} else if (!strcmp(argv[i], "--tolerance")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			compare_opts.tolerance = (unsigned int)strtoul(argv[i], NULL, 10);
+			if (compare_opts.tolerance > 255)
+				compare_opts.tolerance = 255;
+		} else if (!strcmp(argv[i], "--max-diff")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			compare_opts.max_pixels = strtoull(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--mask")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			if (compare_add_mask(&compare_opts, argv[i])) {
+				fprintf(stderr, "Invalid or too many masks: %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
 		} else if (!strcmp(argv[i], "--socket")) {
 			if (++i >= argc) {
 				print_usage(argv[0]);
 				return EXIT_FAILURE;
 			}
 			socket_path = argv[i];
+		} else if (!strcmp(argv[i], "--driver")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			g_driver = argv[i];
+		} else if (!strcmp(argv[i], "--cache")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			g_cache_path = argv[i];
+		} else if (!strcmp(argv[i], "--interval")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			interval_ms = (unsigned int)strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--count")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			count = strtoull(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--buffers")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			nb_buffers = (unsigned int)strtoul(argv[i], NULL, 10);
+			if (nb_buffers < 1)
+				nb_buffers = 1;
+		} else if (!strcmp(argv[i], "--encoders")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			nb_encoders = (unsigned int)strtoul(argv[i], NULL, 10);
+			if (nb_encoders < 1)
+				nb_encoders = 1;
+		} else if (!strcmp(argv[i], "--ring")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			ring_slots = (unsigned int)strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--record")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			record_s = (unsigned int)strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--record-interval")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			record_interval_ms = (unsigned int)strtoul(argv[i], NULL, 10);
+			if (record_interval_ms < 1)
+				record_interval_ms = 1;
+		} else if (!strcmp(argv[i], "--record-mb")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			record_mb = (unsigned int)strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--vnc")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			vnc_path = argv[i];
+		} else if (!strcmp(argv[i], "--vnc-tcp")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			vnc_port = (unsigned int)strtoul(argv[i], NULL, 10);
+			if (vnc_port > 65535) {
+				fprintf(stderr, "Invalid VNC port: %s\n", argv[i]);
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "--vnc-interval")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			vnc_interval_ms = (unsigned int)strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--vnc-password")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			vnc_password_file = argv[i];
+		} else if (!strcmp(argv[i], "--record-trace")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			record_trace_fn = argv[i];
+		} else if (!strcmp(argv[i], "--replay-trace")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			replay_fn = argv[i];
+		} else if (!strcmp(argv[i], "--replay-fast")) {
+			replay_fast = 1;
+		} else if (!strcmp(argv[i], "--cpu-budget")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			budget_pct = (unsigned int)strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--deadline")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			deadline_ms = (unsigned int)strtoul(argv[i], NULL, 10);
+		} else if (!strcmp(argv[i], "--cpus")) {
+			if (++i >= argc) {
+				print_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			cpus = argv[i];
 		} else if (argv[i][0] == '-') {
 			fprintf(stderr, "Unknown option: %s\n", argv[i]);
 			print_usage(argv[0]);
@@ -697,13 +2740,135 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (!output_fn) {
+	/* Only the analysis and the comparison can do without an output */
+	if (!output_fn && ((!analyze_mode && !compare_fn) || daemon_mode)) {
 		print_usage(argv[0]);
 		return EXIT_FAILURE;
 	}
 
-	if (daemon_mode)
-		return run_daemon(socket_path, output_fn, out_w, out_h, jpeg_quality);
+	out.fn = output_fn;
+	out.req_w = out_w;
+	out.req_h = out_h;
+	out.opts.quality = jpeg_quality;
+	out.opts.effort = -1;
+	out.opts.target_size = (size_t)target_kb * 1024;
+	out.opts.threads = threads;
+	out.opts.dct = KMSGRAB_DCT_DEFAULT;
+	out.opts.optimize_coding = 0;
+	out.opts.progressive = 0;
+	out.opts.subsampling = 0;
+	out.opts.smoothing = jpeg_smoothing;
+	out.opts.palette = (enum kmsgrab_palette)png_palette;
+
+	/* Explicit flags override the profile's settings */
+	if (jpeg_profile)
+		set_jpeg_profile(&out.opts, jpeg_profile);
+	if (jpeg_dct >= 0)
+		out.opts.dct = (enum kmsgrab_dct)jpeg_dct;
+	if (jpeg_optimize >= 0)
+		out.opts.optimize_coding = jpeg_optimize;
+	if (jpeg_progressive >= 0)
+		out.opts.progressive = jpeg_progressive;
+	if (jpeg_subsampling)
+		out.opts.subsampling = jpeg_subsampling;
+
+	if (g_linear_light && init_gamma_luts())
+		return EXIT_FAILURE;
+
+	if ((sched_idle || cpus) && governor_set_sched(sched_idle, cpus))
+		return EXIT_FAILURE;
+
+	if (record_trace_fn && !replay_fn) {
+		/* The trace belongs to the user, like the pictures */
+		euid = geteuid();
+		seteuid(getuid());
+		err = trace_create(&trace, record_trace_fn);
+		seteuid(euid);
+
+		if (err) {
+			fprintf(stderr, "Unable to create trace %s: %s\n",
+				record_trace_fn, strerror(-err));
+			return EXIT_FAILURE;
+		}
+
+		g_trace = &trace;
+	}
+
+	if (analyze_mode && !daemon_mode)
+		return run_analyze(&out, interval_ms, count ? count : !interval_ms);
+
+	if (output_fn) {
+		out.enc = get_encoder(output_fn);
+		if (!out.enc)
+			return EXIT_FAILURE;
+	}
+
+	if (compare_fn && !daemon_mode)
+		return run_compare(&out, compare_fn, &compare_opts);
+
+	if (extract_fn)
+		return run_extract(&out, extract_fn, extract_at);
+
+	if (replay_fn) {
+		if (strstr(output_fn, ".ktl") || out.enc->stream_open) {
+			fprintf(stderr, "Traces can only be replayed to pictures\n");
+			return EXIT_FAILURE;
+		}
+
+		return run_replay(&out, replay_fn, replay_fast, count);
+	}
+
+	if (strstr(output_fn, ".ktl")) {
+		if (daemon_mode) {
+			fprintf(stderr, "Timelapse archives are not supported by the daemon\n");
+			return EXIT_FAILURE;
+		}
+
+		return run_timelapse(&out, archive_format, interval_ms,
+				     count ? count : !interval_ms,
+				     keyframe_s ? keyframe_s * 1000 :
+				     TIMELAPSE_KEYFRAME_MS);
+	}
+
+	if (out.enc->stream_open && (interval_ms || count > 1)) {
+		if (daemon_mode) {
+			fprintf(stderr, "Videos are not supported by the daemon\n");
+			return EXIT_FAILURE;
+		}
+
+		return run_video(&out, interval_ms, count, keyframe_s * 1000);
+	}
+
+	if (jpeg_sweep_mode)
+		return jpeg_sweep(&out);
+
+	if (daemon_mode) {
+		if (vnc_port && !vnc_password_file) {
+			fprintf(stderr, "--vnc-tcp requires --vnc-password\n");
+			return EXIT_FAILURE;
+		}
+
+		daemon_cfg.socket_path = socket_path;
+		daemon_cfg.nb_buffers = nb_buffers;
+		daemon_cfg.nb_encoders = nb_encoders;
+		daemon_cfg.ring_slots = ring_slots;
+		daemon_cfg.interval_ms = interval_ms;
+		daemon_cfg.budget_pct = budget_pct;
+		daemon_cfg.deadline_ms = deadline_ms;
+		daemon_cfg.record_ms = record_s * 1000;
+		daemon_cfg.record_interval_ms = record_interval_ms;
+		daemon_cfg.record_mb = record_mb;
+		daemon_cfg.vnc_path = vnc_path;
+		daemon_cfg.vnc_port = vnc_port;
+		daemon_cfg.vnc_password_file = vnc_password_file;
+		daemon_cfg.vnc_interval_ms = vnc_interval_ms;
+
+		return run_daemon(&daemon_cfg, &out);
+	}
+
+	if (interval_ms || count > 1)
+		return run_continuous(&out, interval_ms, count, nb_buffers,
+				      nb_encoders, budget_pct, deadline_ms);
 
-	return grab_once(output_fn, out_w, out_h, jpeg_quality);
+	return grab_once(&out);
 }
@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - interface between the core and encoders
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_H__
+#define __KMSGRAB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+extern int g_verbose;
+
+#define DBG(...) do { \
+	if (g_verbose) \
+		fprintf(stderr, __VA_ARGS__); \
+} while (0)
+
+/* A converted picture, handed to the encoders. Pixels are packed RGB888. */
+struct kmsgrab_image {
+	const uint8_t *pixels;
+	uint32_t width, height;
+	size_t stride;
+};
+
+enum kmsgrab_palette {
+	/* Indexed colors when the picture has no more than 256 colors */
+	KMSGRAB_PALETTE_AUTO,
+	KMSGRAB_PALETTE_OFF,
+	/* Otherwise, quantize the picture down to 256 colors */
+	KMSGRAB_PALETTE_LOSSY,
+};
+
+enum kmsgrab_dct {
+	KMSGRAB_DCT_DEFAULT,
+	KMSGRAB_DCT_ISLOW,
+	KMSGRAB_DCT_IFAST,
+	KMSGRAB_DCT_FLOAT,
+};
+
+struct kmsgrab_encode_opts {
+	int quality;
+
+	/* From 0 (fastest) to 9 (smallest output), or -1 for the default */
+	int effort;
+
+	/*
+	 * If nonzero, lossy encoders pick the highest quality (up to @quality)
+	 * that keeps the output under this many bytes.
+	 */
+	size_t target_size;
+
+	/* Threads to encode a single picture with, or 0 for the encoder default */
+	unsigned int threads;
+
+	/* JPEG tuning; zero values keep the libjpeg defaults */
+	enum kmsgrab_dct dct;
+	int optimize_coding;
+	int progressive;
+	int subsampling;	/* 444, 422 or 420 */
+	int smoothing;		/* 0 to 100 */
+
+	/* PNG indexed color mode */
+	enum kmsgrab_palette palette;
+};
+
+/* A video stream being encoded, private to its encoder */
+struct kmsgrab_stream;
+
+struct kmsgrab_encoder {
+	const char *name;
+
+	/* Encode @img to @file. Returns 0 on success, a negative errno otherwise. */
+	int (*write)(FILE *file, const struct kmsgrab_image *img,
+		     const struct kmsgrab_encode_opts *opts);
+
+	/*
+	 * Optional: decode the picture in @file to packed RGB888, in a buffer
+	 * allocated with malloc(). Used to load reference pictures.
+	 */
+	int (*read)(FILE *file, uint8_t **pixels, uint32_t *width,
+		    uint32_t *height);
+
+	/*
+	 * Optional, for video formats: encode a sequence of pictures, captured
+	 * nominally every @interval_ms, into one stream written to @file, with
+	 * a keyframe every @keyframe_ms (or the encoder's default if zero).
+	 * Closing the stream writes the frames the encoder held back.
+	 */
+	int (*stream_open)(struct kmsgrab_stream **stream, FILE *file,
+			   const struct kmsgrab_encode_opts *opts,
+			   unsigned int interval_ms, unsigned int keyframe_ms);
+	int (*stream_write)(struct kmsgrab_stream *stream,
+			    const struct kmsgrab_image *img);
+	int (*stream_close)(struct kmsgrab_stream *stream);
+};
+
+/*
+ * Each encoder module exports its descriptor as "kmsgrab_encoder_<name>",
+ * which is also the symbol the core links to when encoders are built in.
+ */
+#define KMSGRAB_ENCODER_SYMBOL_PREFIX "kmsgrab_encoder_"
+
+#endif /* __KMSGRAB_H__ */
@@ -0,0 +1,451 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - daemon control client
+ *
+ * Sends any number of requests to the daemon over a single connection,
+ * without waiting for the previous ones to complete, and prints the
+ * responses as they come back.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "kmsgrab-proto.h"
+
+/* Requests sent ahead of their replies, at most */
+#define CTL_MAX_INFLIGHT 64
+
+struct ctl_request {
+	const char *name;
+	uint16_t op;
+	uint64_t frame_id;
+	const char *fn;
+	struct kmsgrab_subscribe sub;
+	int done;
+};
+
+static void print_usage(const char *prog)
+{
+	printf("Usage: %s [-s PATH] [-n N] COMMAND...\n"
+	       "\n"
+	       "Options:\n"
+	       "  -s PATH            Daemon socket path (default /tmp/kmsgrab.sock)\n"
+	       "  -n N               Send the command list N times\n"
+	       "\n"
+	       "Commands:\n"
+	       "  grab               Capture, reply once the picture is written\n"
+	       "  grab-async         Capture, reply once the pixels are read back\n"
+	       "  wait ID            Reply once frame ID is written\n"
+	       "  fetch ID FILE      Save the encoded frame ID to FILE (- for stdout)\n"
+	       "  ping               Check that the daemon is alive\n"
+	       "  subscribe WHAT MS  Print change events, at most one per MS milliseconds;\n"
+	       "                     WHAT is a comma-separated list of fb, content, rects\n",
+	       prog);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *ptr = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, ptr, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *ptr = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, ptr, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret ? -errno : -EPIPE;
+
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int send_request(int fd, const struct ctl_request *req, uint32_t id)
+{
+	struct kmsgrab_msg msg = {
+		.magic = KMSGRAB_PROTO_MAGIC,
+		.version = KMSGRAB_PROTO_VERSION,
+		.type = req->op,
+		.id = id,
+	};
+	int err;
+
+	if (req->op == KMSGRAB_OP_WAIT || req->op == KMSGRAB_OP_FETCH)
+		msg.length = sizeof(req->frame_id);
+	else if (req->op == KMSGRAB_OP_SUBSCRIBE)
+		msg.length = sizeof(req->sub);
+
+	err = write_all(fd, &msg, sizeof(msg));
+	if (!err && msg.length)
+		err = write_all(fd, req->op == KMSGRAB_OP_SUBSCRIBE ?
+				(const void *)&req->sub : (const void *)&req->frame_id,
+				msg.length);
+
+	return err;
+}
+
+static int parse_watch_flags(char *arg, uint32_t *flags)
+{
+	char *tok, *save = NULL;
+
+	*flags = 0;
+
+	for (tok = strtok_r(arg, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (!strcmp(tok, "fb"))
+			*flags |= KMSGRAB_WATCH_FB;
+		else if (!strcmp(tok, "content"))
+			*flags |= KMSGRAB_WATCH_CONTENT;
+		else if (!strcmp(tok, "rects"))
+			*flags |= KMSGRAB_WATCH_CONTENT | KMSGRAB_WATCH_RECTS;
+		else
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int parse_commands(int argc, char **argv, struct ctl_request *reqs)
+{
+	unsigned int nb = 0;
+	char *end;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		struct ctl_request *req = &reqs[nb++];
+
+		req->name = argv[i];
+
+		if (!strcmp(argv[i], "grab")) {
+			req->op = KMSGRAB_OP_GRAB;
+		} else if (!strcmp(argv[i], "grab-async")) {
+			req->op = KMSGRAB_OP_GRAB_ASYNC;
+		} else if (!strcmp(argv[i], "ping")) {
+			req->op = KMSGRAB_OP_PING;
+		} else if (!strcmp(argv[i], "wait") || !strcmp(argv[i], "fetch")) {
+			req->op = argv[i][0] == 'w' ? KMSGRAB_OP_WAIT : KMSGRAB_OP_FETCH;
+
+			if (++i >= argc)
+				return -EINVAL;
+
+			req->frame_id = strtoull(argv[i], &end, 10);
+			if (end == argv[i] || *end)
+				return -EINVAL;
+
+			if (req->op == KMSGRAB_OP_FETCH) {
+				if (++i >= argc)
+					return -EINVAL;
+				req->fn = argv[i];
+			}
+		} else if (!strcmp(argv[i], "subscribe")) {
+			req->op = KMSGRAB_OP_SUBSCRIBE;
+
+			if (i + 2 >= argc || parse_watch_flags(argv[i + 1], &req->sub.flags))
+				return -EINVAL;
+
+			req->sub.min_interval_ms = (uint32_t)strtoul(argv[i + 2], &end, 10);
+			if (end == argv[i + 2] || *end)
+				return -EINVAL;
+
+			i += 2;
+		} else {
+			fprintf(stderr, "Unknown command: %s\n", argv[i]);
+			return -EINVAL;
+		}
+	}
+
+	return nb;
+}
+
+/*
+ * Read the payload into @fn. The whole payload is always consumed, so that
+ * the connection stays usable; file errors are reported in @file_err.
+ */
+static int save_payload(const char *fn, int fd, uint32_t length, int *file_err)
+{
+	char buf[65536];
+	FILE *file;
+	uint32_t chunk;
+	int err = 0;
+
+	*file_err = 0;
+
+	if (!strcmp(fn, "-")) {
+		file = stdout;
+	} else {
+		file = fopen(fn, "w");
+		if (!file)
+			*file_err = -errno;
+	}
+
+	while (length) {
+		chunk = length < sizeof(buf) ? length : sizeof(buf);
+
+		err = read_all(fd, buf, chunk);
+		if (err)
+			break;
+
+		if (file && fwrite(buf, 1, chunk, file) != chunk && !*file_err)
+			*file_err = -EIO;
+		length -= chunk;
+	}
+
+	if (file && file != stdout && fclose(file) && !*file_err)
+		*file_err = -errno;
+
+	return length ? err : 0;
+}
+
+static int discard_payload(int fd, uint32_t length)
+{
+	char buf[4096];
+	uint32_t chunk;
+	int err;
+
+	while (length) {
+		chunk = length < sizeof(buf) ? length : sizeof(buf);
+
+		err = read_all(fd, buf, chunk);
+		if (err)
+			return err;
+
+		length -= chunk;
+	}
+
+	return 0;
+}
+
+static int print_event(FILE *out, int fd, const struct kmsgrab_msg *msg)
+{
+	struct kmsgrab_rect rects[KMSGRAB_EVENT_MAX_RECTS];
+	struct kmsgrab_event ev;
+	uint32_t i;
+	int err;
+
+	if (msg->length < sizeof(ev))
+		return -EPROTO;
+
+	err = read_all(fd, &ev, sizeof(ev));
+	if (err)
+		return err;
+
+	if (ev.nb_rects > KMSGRAB_EVENT_MAX_RECTS ||
+	    msg->length != sizeof(ev) + ev.nb_rects * sizeof(*rects) + ev.frame_size)
+		return -EPROTO;
+
+	err = read_all(fd, rects, ev.nb_rects * sizeof(*rects));
+	if (err)
+		return err;
+
+	fprintf(out, "%u event %"PRIu64" at %lld.%09lld:%s%s fb %"PRIu32" hash %016"PRIx64,
+		msg->id, ev.seq, (long long)ev.tv_sec, (long long)ev.tv_nsec,
+		ev.changed & KMSGRAB_WATCH_FB ? " flip" : "",
+		ev.changed & KMSGRAB_WATCH_CONTENT ? " content" : "",
+		ev.fb_id, ev.hash);
+
+	for (i = 0; i < ev.nb_rects; i++)
+		fprintf(out, " %"PRIu32"x%"PRIu32"+%"PRIu32"+%"PRIu32,
+			rects[i].width, rects[i].height, rects[i].x, rects[i].y);
+
+	fprintf(out, "\n");
+	fflush(out);
+
+	return discard_payload(fd, ev.frame_size);
+}
+
+int main(int argc, char **argv)
+{
+	const char *socket_path = "/tmp/kmsgrab.sock";
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct kmsgrab_frame_info info;
+	struct ctl_request *reqs, *req;
+	struct kmsgrab_msg msg;
+	unsigned int repeat = 1, nb_cmds, nb_reqs, sent, pending, subscribed = 0, i;
+	struct pollfd pfd;
+	FILE *status_out = stdout;
+	int fd, opt, nb, err, file_err, ret = EXIT_SUCCESS;
+
+	while ((opt = getopt(argc, argv, "+s:n:h")) != -1) {
+		switch (opt) {
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'n':
+			repeat = (unsigned int)strtoul(optarg, NULL, 10);
+			if (repeat < 1)
+				repeat = 1;
+			break;
+		default:
+			print_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	nb_cmds = argc - optind;
+	reqs = calloc((size_t)nb_cmds * repeat, sizeof(*reqs));
+	if (!reqs)
+		return EXIT_FAILURE;
+
+	nb = parse_commands(nb_cmds, argv + optind, reqs);
+	if (nb < 0) {
+		print_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 1; i < repeat; i++)
+		memcpy(&reqs[i * nb], reqs, nb * sizeof(*reqs));
+	nb_reqs = nb * repeat;
+
+	for (i = 0; i < nb_reqs; i++)
+		if (reqs[i].fn && !strcmp(reqs[i].fn, "-"))
+			status_out = stderr;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", socket_path);
+		return EXIT_FAILURE;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Unable to connect to %s: %s\n",
+			socket_path, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/*
+	 * Keep sending while reading the replies, which the daemon sends in
+	 * completion order, with a bounded number of requests in flight: a
+	 * client that only writes would eventually block the connection.
+	 * Once all the requests are answered, keep printing the events.
+	 */
+	for (sent = 0, pending = 0; sent < nb_reqs || pending || subscribed; ) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (sent < nb_reqs && pending < CTL_MAX_INFLIGHT)
+			pfd.events |= POLLOUT;
+
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			fprintf(stderr, "Connection lost: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		if (pfd.revents & POLLOUT) {
+			err = send_request(fd, &reqs[sent], sent);
+			if (err) {
+				fprintf(stderr, "Unable to send request: %s\n",
+					strerror(-err));
+				return EXIT_FAILURE;
+			}
+
+			sent++;
+			pending++;
+		}
+
+		if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+
+		err = read_all(fd, &msg, sizeof(msg));
+		if (err) {
+			fprintf(stderr, "Connection lost: %s\n", strerror(-err));
+			return EXIT_FAILURE;
+		}
+
+		if (msg.magic == KMSGRAB_PROTO_MAGIC &&
+		    msg.type == (KMSGRAB_OP_SUBSCRIBE | KMSGRAB_MSG_EVENT)) {
+			err = print_event(status_out, fd, &msg);
+			if (err) {
+				fprintf(stderr, "Connection lost: %s\n", strerror(-err));
+				return EXIT_FAILURE;
+			}
+			continue;
+		}
+
+		if (msg.magic != KMSGRAB_PROTO_MAGIC || msg.id >= sent ||
+		    !(msg.type & KMSGRAB_MSG_RESPONSE) || reqs[msg.id].done) {
+			fprintf(stderr, "Protocol error\n");
+			return EXIT_FAILURE;
+		}
+
+		req = &reqs[msg.id];
+		req->done = 1;
+		pending--;
+
+		if (req->op == KMSGRAB_OP_SUBSCRIBE && !msg.status)
+			subscribed++;
+
+		if (msg.status) {
+			fprintf(status_out, "%u %s: ERR %s\n", msg.id, req->name,
+				strerror(-msg.status));
+			ret = EXIT_FAILURE;
+			err = discard_payload(fd, msg.length);
+		} else if (req->op == KMSGRAB_OP_FETCH) {
+			err = save_payload(req->fn, fd, msg.length, &file_err);
+			if (file_err) {
+				fprintf(status_out, "%u %s: ERR %s: %s\n", msg.id,
+					req->name, req->fn, strerror(-file_err));
+				ret = EXIT_FAILURE;
+			} else {
+				fprintf(status_out, "%u %s: OK %"PRIu32" bytes\n",
+					msg.id, req->name, msg.length);
+			}
+		} else if (msg.length == sizeof(info)) {
+			err = read_all(fd, &info, sizeof(info));
+			if (!err)
+				fprintf(status_out, "%u %s: OK frame %"PRIu64" at %lld.%09lld\n",
+					msg.id, req->name, info.frame_id,
+					(long long)info.tv_sec, (long long)info.tv_nsec);
+		} else {
+			err = discard_payload(fd, msg.length);
+			fprintf(status_out, "%u %s: OK\n", msg.id, req->name);
+		}
+
+		if (err) {
+			fprintf(stderr, "Connection lost: %s\n", strerror(-err));
+			return EXIT_FAILURE;
+		}
+	}
+
+	close(fd);
+	free(reqs);
+	return ret;
+}
@@ -0,0 +1,216 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - capture/encode pipeline
+ *
+ * The capture thread owns a pool of frames. It takes a free frame, reads the
+ * scanout buffer into it, and pushes it to one of the encoder threads through
+ * a lock-free SPSC queue. Each encoder thread hands the frame back through a
+ * second SPSC queue once encoded, so the readback of the next frame overlaps
+ * with the encoding of the previous ones.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kmsgrab.h"
+#include "pipeline.h"
+
+static int spsc_init(struct spsc_queue *q, unsigned int size)
+{
+	unsigned int nb = 1;
+
+	while (nb < size)
+		nb <<= 1;
+
+	q->slots = calloc(nb, sizeof(*q->slots));
+	if (!q->slots)
+		return -ENOMEM;
+
+	q->mask = nb - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return 0;
+}
+
+static void spsc_push(struct spsc_queue *q, struct frame *frame)
+{
+	unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	q->slots[tail & q->mask] = frame;
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+static struct frame *spsc_pop(struct spsc_queue *q)
+{
+	unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	struct frame *frame;
+
+	if (head == atomic_load_explicit(&q->tail, memory_order_acquire))
+		return NULL;
+
+	frame = q->slots[head & q->mask];
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return frame;
+}
+
+static void *pipeline_worker_thread(void *d)
+{
+	struct pipeline_worker *w = d;
+	struct pipeline *pl = w->pipeline;
+	struct frame *frame;
+	uint64_t start;
+	int err;
+
+	for (;;) {
+		while (sem_wait(&w->pending) && errno == EINTR);
+
+		/* Woken up with an empty queue: pipeline_finish() was called */
+		frame = spsc_pop(&w->todo);
+		if (!frame)
+			break;
+
+		start = thread_cpu_time_ns();
+		err = pl->ops->encode(frame, pl->data);
+		frame->cpu_ns += thread_cpu_time_ns() - start;
+
+		if (pl->ops->complete)
+			pl->ops->complete(frame, err, pl->data);
+
+		spsc_push(&w->done, frame);
+		sem_post(&pl->free_frames);
+	}
+
+	return NULL;
+}
+
+int pipeline_init(struct pipeline *pl, unsigned int nb_frames,
+		  unsigned int nb_workers, const struct pipeline_ops *ops,
+		  void *data)
+{
+	struct pipeline_worker *w;
+	unsigned int i;
+	int ret;
+
+	memset(pl, 0, sizeof(*pl));
+	pl->ops = ops;
+	pl->data = data;
+	pl->nb_frames = nb_frames;
+	sem_init(&pl->free_frames, 0, nb_frames);
+
+	pl->frames = calloc(nb_frames, sizeof(*pl->frames));
+	pl->workers = calloc(nb_workers, sizeof(*pl->workers));
+	if (!pl->frames || !pl->workers) {
+		ret = -ENOMEM;
+		goto err_free;
+	}
+
+	for (i = 0; i < nb_workers; i++) {
+		w = &pl->workers[i];
+		w->pipeline = pl;
+
+		if (spsc_init(&w->todo, nb_frames) || spsc_init(&w->done, nb_frames)) {
+			free(w->todo.slots);
+			ret = -ENOMEM;
+			goto err_stop_workers;
+		}
+
+		sem_init(&w->pending, 0, 0);
+
+		/* The first worker's done queue initially holds the whole pool */
+		if (i == 0) {
+			unsigned int j;
+
+			for (j = 0; j < nb_frames; j++)
+				spsc_push(&w->done, &pl->frames[j]);
+		}
+
+		ret = pthread_create(&w->thread, NULL, pipeline_worker_thread, w);
+		if (ret) {
+			free(w->todo.slots);
+			free(w->done.slots);
+			ret = -ret;
+			goto err_stop_workers;
+		}
+
+		pl->nb_workers++;
+	}
+
+	DBG("[debug] pipeline: %u frames, %u encoder threads\n",
+		nb_frames, nb_workers);
+
+	return 0;
+
+err_stop_workers:
+	pipeline_finish(pl);
+	return ret;
+err_free:
+	sem_destroy(&pl->free_frames);
+	free(pl->workers);
+	free(pl->frames);
+	return ret;
+}
+
+void pipeline_finish(struct pipeline *pl)
+{
+	struct pipeline_worker *w;
+	unsigned int i;
+
+	for (i = 0; i < pl->nb_workers; i++) {
+		w = &pl->workers[i];
+
+		sem_post(&w->pending);
+		pthread_join(w->thread, NULL);
+
+		sem_destroy(&w->pending);
+		free(w->todo.slots);
+		free(w->done.slots);
+	}
+
+	for (i = 0; i < pl->nb_frames; i++)
+		free(pl->frames[i].pixels);
+
+	sem_destroy(&pl->free_frames);
+	free(pl->workers);
+	free(pl->frames);
+}
+
+struct frame *pipeline_get_frame(struct pipeline *pl)
+{
+	struct frame *frame;
+	unsigned int i;
+
+	while (sem_wait(&pl->free_frames) && errno == EINTR);
+
+	if (pl->spare) {
+		frame = pl->spare;
+		pl->spare = NULL;
+		return frame;
+	}
+
+	/* The semaphore guarantees that one of the done queues is not empty */
+	for (i = 0; ; i = (i + 1) % pl->nb_workers) {
+		frame = spsc_pop(&pl->workers[i].done);
+		if (frame)
+			return frame;
+	}
+}
+
+void pipeline_submit(struct pipeline *pl, struct frame *frame)
+{
+	struct pipeline_worker *w;
+
+	w = &pl->workers[pl->next_worker++ % pl->nb_workers];
+
+	spsc_push(&w->todo, frame);
+	sem_post(&w->pending);
+}
+
+void pipeline_put_frame(struct pipeline *pl, struct frame *frame)
+{
+	/* Return a frame that ended up not being submitted, e.g. on error */
+	pl->spare = frame;
+	sem_post(&pl->free_frames);
+}
@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - capture/encode pipeline
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_PIPELINE_H__
+#define __KMSGRAB_PIPELINE_H__
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "kmsgrab.h"
+
+/* A pooled, converted frame travelling from the capture to an encoder. */
+struct frame {
+	uint64_t id;
+	struct timespec timestamp;
+
+	uint8_t *pixels;
+	size_t capacity;
+	uint32_t width, height;
+
+	/* Encoder options for this frame, set before submission */
+	struct kmsgrab_encode_opts opts;
+
+	/* CPU time spent on the readback, then on the encoding */
+	uint64_t cpu_ns;
+
+	/* Owner cookie, carried untouched from submission to completion */
+	void *priv;
+};
+
+/*
+ * Single-producer single-consumer ring of frame pointers. The ring is sized
+ * so that it can hold every frame of the pool, and therefore never fills up.
+ */
+struct spsc_queue {
+	struct frame **slots;
+	unsigned int mask;
+	atomic_uint head, tail;
+};
+
+struct pipeline_worker {
+	struct pipeline *pipeline;
+	pthread_t thread;
+
+	/* Frames to encode, filled by the capture thread */
+	struct spsc_queue todo;
+	sem_t pending;
+
+	/* Encoded frames handed back to the capture thread */
+	struct spsc_queue done;
+};
+
+struct pipeline_ops {
+	/* Called from the encoder threads */
+	int (*encode)(struct frame *frame, void *data);
+
+	/* Called from the encoder threads once the frame is encoded */
+	void (*complete)(struct frame *frame, int err, void *data);
+};
+
+struct pipeline {
+	const struct pipeline_ops *ops;
+	void *data;
+
+	struct frame *frames;
+	unsigned int nb_frames;
+
+	struct pipeline_worker *workers;
+	unsigned int nb_workers, next_worker;
+
+	/* Number of frames sitting in the workers' done queues, or spare */
+	sem_t free_frames;
+	struct frame *spare;
+};
+
+static inline uint64_t thread_cpu_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int pipeline_init(struct pipeline *pl, unsigned int nb_frames,
+		  unsigned int nb_workers, const struct pipeline_ops *ops,
+		  void *data);
+
+/* Stop the encoder threads once all the submitted frames are encoded. */
+void pipeline_finish(struct pipeline *pl);
+
+/* Called from the capture thread only. */
+struct frame *pipeline_get_frame(struct pipeline *pl);
+void pipeline_submit(struct pipeline *pl, struct frame *frame);
+void pipeline_put_frame(struct pipeline *pl, struct frame *frame);
+
+#endif /* __KMSGRAB_PIPELINE_H__ */
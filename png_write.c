@@ -0,0 +1,382 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - PNG writer for whole-buffer deflate backends
+ *
+ * libdeflate only compresses whole buffers, and zlib-ng is fastest that way
+ * too, so instead of streaming rows through libpng (and its zlib), the rows
+ * are filtered into one buffer, compressed in one go, and the result is
+ * written out as IDAT chunks, with the CRCs computed here.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(KMSGRAB_PNG_LIBDEFLATE)
+#include <libdeflate.h>
+#elif defined(KMSGRAB_PNG_ZLIB_NG)
+#include <zlib-ng.h>
+#else
+#error "No whole-buffer deflate backend selected"
+#endif
+
+#include "png_write.h"
+
+/* Maximum size of an IDAT chunk; decoders read them in one piece */
+#define PNG_IDAT_SIZE		(256 * 1024)
+
+static const uint8_t png_signature[8] = {
+	0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+};
+
+#if defined(KMSGRAB_PNG_LIBDEFLATE)
+
+static uint32_t png_crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	return libdeflate_crc32(crc, buf, len);
+}
+
+static int deflate_whole(const uint8_t *src, size_t len, int effort,
+			 uint8_t **dst, size_t *dst_len)
+{
+	struct libdeflate_compressor *c;
+	size_t bound;
+
+	/* Level 0 is missing from older releases, and level 1 is cheap */
+	c = libdeflate_alloc_compressor(effort < 0 ? 6 : effort ? effort : 1);
+	if (!c)
+		return -ENOMEM;
+
+	bound = libdeflate_zlib_compress_bound(c, len);
+
+	*dst = malloc(bound);
+	if (!*dst) {
+		libdeflate_free_compressor(c);
+		return -ENOMEM;
+	}
+
+	*dst_len = libdeflate_zlib_compress(c, src, len, *dst, bound);
+	libdeflate_free_compressor(c);
+
+	if (!*dst_len) {
+		free(*dst);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+#else /* KMSGRAB_PNG_ZLIB_NG */
+
+static uint32_t png_crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	return (uint32_t)zng_crc32_z(crc, buf, len);
+}
+
+static int deflate_whole(const uint8_t *src, size_t len, int effort,
+			 uint8_t **dst, size_t *dst_len)
+{
+	int ret;
+
+	*dst_len = zng_compressBound(len);
+
+	*dst = malloc(*dst_len);
+	if (!*dst)
+		return -ENOMEM;
+
+	ret = zng_compress2(*dst, dst_len, src, len,
+			    effort < 0 ? Z_DEFAULT_COMPRESSION : effort);
+	if (ret != Z_OK) {
+		free(*dst);
+		return ret == Z_MEM_ERROR ? -ENOMEM : -EIO;
+	}
+
+	return 0;
+}
+
+#endif
+
+static inline void put_be32(uint8_t *buf, uint32_t val)
+{
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val;
+}
+
+static int write_chunk(FILE *file, const char *type,
+		       const uint8_t *data, size_t len)
+{
+	uint8_t hdr[8], crc[4];
+	uint32_t sum;
+
+	put_be32(hdr, (uint32_t)len);
+	memcpy(&hdr[4], type, 4);
+
+	/* libdeflate and zlib-ng return 0, not the CRC, for a NULL buffer */
+	sum = png_crc32(0, &hdr[4], 4);
+	if (len)
+		sum = png_crc32(sum, data, len);
+	put_be32(crc, sum);
+
+	if (fwrite(hdr, sizeof(hdr), 1, file) != 1 ||
+	    (len && fwrite(data, len, 1, file) != 1) ||
+	    fwrite(crc, sizeof(crc), 1, file) != 1)
+		return -EIO;
+
+	return 0;
+}
+
+static inline uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+
+	return pb <= pc ? b : c;
+}
+
+/*
+ * Filter @row against @prev (all zeros for the first row), and return the
+ * sum of the absolute values of the signed output bytes. The first pixel has
+ * no left neighbour, so it's handled apart to keep the loops branchless.
+ */
+static unsigned long filter_row(uint8_t *out, const uint8_t *row,
+				const uint8_t *prev, size_t len,
+				unsigned int bpp, unsigned int filter)
+{
+	unsigned long sum = 0;
+	size_t i;
+
+	switch (filter) {
+	case PNG_FILTER_VALUE_SUB:
+		memcpy(out, row, bpp);
+		for (i = bpp; i < len; i++)
+			out[i] = row[i] - row[i - bpp];
+		break;
+	case PNG_FILTER_VALUE_UP:
+		for (i = 0; i < len; i++)
+			out[i] = row[i] - prev[i];
+		break;
+	case PNG_FILTER_VALUE_AVG:
+		for (i = 0; i < bpp; i++)
+			out[i] = row[i] - prev[i] / 2;
+		for (; i < len; i++)
+			out[i] = row[i] - (uint8_t)((row[i - bpp] + prev[i]) / 2);
+		break;
+	case PNG_FILTER_VALUE_PAETH:
+		for (i = 0; i < bpp; i++)
+			out[i] = row[i] - prev[i];
+		for (; i < len; i++)
+			out[i] = row[i] - paeth(row[i - bpp], prev[i],
+						prev[i - bpp]);
+		break;
+	default:
+		memcpy(out, row, len);
+		break;
+	}
+
+	for (i = 0; i < len; i++)
+		sum += abs((int8_t)out[i]);
+
+	return sum;
+}
+
+/*
+ * Pick the filter of each row the way libpng does: the one with the smallest
+ * sum of absolute differences. Palette pictures are left unfiltered, and low
+ * efforts only try the SUB filter.
+ */
+static int filter_image(uint8_t *dst, const uint8_t *rows, size_t stride,
+			uint32_t height, size_t len, unsigned int bpp,
+			int indexed, int effort)
+{
+	uint8_t *zero, *tmp, *best, *swap;
+	unsigned long sum, best_sum;
+	const uint8_t *row, *prev;
+	unsigned int f;
+	uint32_t y;
+
+	zero = calloc(1, len);
+	tmp = malloc(len);
+	best = malloc(len);
+	if (!zero || !tmp || !best) {
+		free(best);
+		free(tmp);
+		free(zero);
+		return -ENOMEM;
+	}
+
+	for (y = 0; y < height; y++, dst += len + 1) {
+		row = rows + y * stride;
+		prev = y ? row - stride : zero;
+
+		if (indexed) {
+			dst[0] = PNG_FILTER_VALUE_NONE;
+			memcpy(&dst[1], row, len);
+			continue;
+		}
+
+		if (effort >= 0 && effort < 3) {
+			dst[0] = PNG_FILTER_VALUE_SUB;
+			filter_row(&dst[1], row, prev, len, bpp,
+				   PNG_FILTER_VALUE_SUB);
+			continue;
+		}
+
+		dst[0] = PNG_FILTER_VALUE_NONE;
+		best_sum = filter_row(best, row, prev, len, bpp,
+				      PNG_FILTER_VALUE_NONE);
+
+		for (f = PNG_FILTER_VALUE_SUB; f < PNG_FILTER_VALUE_LAST; f++) {
+			sum = filter_row(tmp, row, prev, len, bpp, f);
+			if (sum < best_sum) {
+				best_sum = sum;
+				dst[0] = f;
+				swap = best;
+				best = tmp;
+				tmp = swap;
+			}
+		}
+
+		memcpy(&dst[1], best, len);
+	}
+
+	free(best);
+	free(tmp);
+	free(zero);
+	return 0;
+}
+
+/* Pack one index per byte into @depth bits per pixel, MSB first. */
+static uint8_t *pack_indices(const uint8_t *indices, uint32_t width,
+			     uint32_t height, unsigned int depth, size_t *len)
+{
+	unsigned int per_byte = 8 / depth, shift;
+	const uint8_t *src = indices;
+	uint8_t *packed, *dst;
+	uint32_t x, y;
+
+	*len = ((size_t)width * depth + 7) / 8;
+
+	if (depth == 8)
+		return (uint8_t *)indices;
+
+	packed = calloc(height, *len);
+	if (!packed)
+		return NULL;
+
+	for (y = 0; y < height; y++) {
+		dst = packed + y * *len;
+
+		for (x = 0; x < width; x++) {
+			shift = 8 - depth * (x % per_byte + 1);
+			dst[x / per_byte] |= *src++ << shift;
+		}
+	}
+
+	return packed;
+}
+
+int png_write_direct(FILE *file, const struct kmsgrab_image *img,
+		     const struct palette *pal, const uint8_t *indices,
+		     unsigned int depth, int effort)
+{
+	uint8_t ihdr[13], plte[PALETTE_MAX_COLORS * 3];
+	uint8_t *packed = NULL, *filtered, *compressed;
+	const uint8_t *rows;
+	size_t len, stride, size, offset, chunk;
+	unsigned int i, bpp;
+	int ret;
+
+	if (pal) {
+		packed = pack_indices(indices, img->width, img->height,
+				      depth, &len);
+		if (!packed)
+			return -ENOMEM;
+
+		rows = packed;
+		stride = len;
+		bpp = 1;
+	} else {
+		rows = img->pixels;
+		stride = img->stride;
+		len = (size_t)img->width * 3;
+		bpp = 3;
+		depth = 8;
+	}
+
+	filtered = malloc((len + 1) * img->height);
+	if (!filtered) {
+		ret = -ENOMEM;
+		goto out_free_packed;
+	}
+
+	ret = filter_image(filtered, rows, stride, img->height, len, bpp,
+			   !!pal, effort);
+	if (ret)
+		goto out_free_filtered;
+
+	ret = deflate_whole(filtered, (len + 1) * img->height, effort,
+			    &compressed, &size);
+	if (ret)
+		goto out_free_filtered;
+
+	DBG("[debug] png: deflated %zu bytes to %zu\n",
+	    (len + 1) * img->height, size);
+
+	put_be32(&ihdr[0], img->width);
+	put_be32(&ihdr[4], img->height);
+	ihdr[8] = depth;
+	ihdr[9] = pal ? PNG_COLOR_TYPE_PALETTE : PNG_COLOR_TYPE_RGB;
+	ihdr[10] = PNG_COMPRESSION_TYPE_BASE;
+	ihdr[11] = PNG_FILTER_TYPE_BASE;
+	ihdr[12] = PNG_INTERLACE_NONE;
+
+	if (fwrite(png_signature, sizeof(png_signature), 1, file) != 1) {
+		ret = -EIO;
+		goto out_free_compressed;
+	}
+
+	ret = write_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+	if (ret)
+		goto out_free_compressed;
+
+	if (pal) {
+		for (i = 0; i < pal->nb; i++) {
+			plte[i * 3] = pal->colors[i].red;
+			plte[i * 3 + 1] = pal->colors[i].green;
+			plte[i * 3 + 2] = pal->colors[i].blue;
+		}
+
+		ret = write_chunk(file, "PLTE", plte, pal->nb * 3);
+		if (ret)
+			goto out_free_compressed;
+	}
+
+	for (offset = 0; offset < size; offset += chunk) {
+		chunk = size - offset;
+		if (chunk > PNG_IDAT_SIZE)
+			chunk = PNG_IDAT_SIZE;
+
+		ret = write_chunk(file, "IDAT", compressed + offset, chunk);
+		if (ret)
+			goto out_free_compressed;
+	}
+
+	ret = write_chunk(file, "IEND", NULL, 0);
+
+out_free_compressed:
+	free(compressed);
+out_free_filtered:
+	free(filtered);
+out_free_packed:
+	if (packed != indices)
+		free(packed);
+	return ret;
+}
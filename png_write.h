@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - PNG writer for whole-buffer deflate backends
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_PNG_WRITE_H__
+#define __KMSGRAB_PNG_WRITE_H__
+
+#include <png.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "kmsgrab.h"
+
+#define PALETTE_MAX_COLORS	256
+
+struct palette {
+	png_color colors[PALETTE_MAX_COLORS];
+	unsigned int nb;
+};
+
+/*
+ * Write @img as a PNG, filtering and compressing the whole picture at once,
+ * then splitting it into IDAT chunks. If @pal is not NULL, the picture is
+ * written from its palette indices (one per byte in @indices), packed to
+ * @depth bits per pixel.
+ */
+int png_write_direct(FILE *file, const struct kmsgrab_image *img,
+		     const struct palette *pal, const uint8_t *indices,
+		     unsigned int depth, int effort);
+
+#endif /* __KMSGRAB_PNG_WRITE_H__ */
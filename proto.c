@@ -0,0 +1,510 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - binary IPC protocol, daemon side
+ *
+ * Each binary connection gets a reader thread and a writer thread. Requests
+ * that complete later (GRAB, WAIT, FETCH) are answered from whichever thread
+ * finishes them, so replies may go out of order; they are only queued there,
+ * for the writer thread. The connection is refcounted by its pending
+ * requests and its subscriptions.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "kmsgrab-proto.h"
+
+/*
+ * Replies are queued and written by a writer thread per connection, so that
+ * no daemon thread ever blocks on a client. Beyond this many queued bytes,
+ * the reader thread stops taking requests until the client reads its replies.
+ */
+#define PROTO_MAX_QUEUED	(8 << 20)
+
+struct proto_out {
+	struct proto_out *next;
+	size_t len;
+	char buf[];
+};
+
+struct proto_conn {
+	struct daemon *d;
+	int fd;
+
+	/* Messages waiting for the writer thread */
+	pthread_mutex_t write_lock;
+	pthread_cond_t write_cond;
+	struct proto_out *out, **out_tail;
+	size_t queued;
+	int write_err, closing;
+
+	pthread_mutex_t lock;
+	unsigned int refs;
+};
+
+struct proto_request {
+	struct proto_conn *conn;
+	uint32_t id;
+	uint16_t op;
+	struct grab_waiter wait;
+};
+
+static void proto_conn_get(struct proto_conn *c)
+{
+	pthread_mutex_lock(&c->lock);
+	c->refs++;
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void proto_conn_put(struct proto_conn *c)
+{
+	unsigned int refs;
+
+	pthread_mutex_lock(&c->lock);
+	refs = --c->refs;
+	pthread_mutex_unlock(&c->lock);
+
+	if (refs)
+		return;
+
+	/* The writer thread frees the connection once the queue is empty */
+	pthread_mutex_lock(&c->write_lock);
+	c->closing = 1;
+	pthread_cond_broadcast(&c->write_cond);
+	pthread_mutex_unlock(&c->write_lock);
+}
+
+static void *proto_writer_thread(void *arg)
+{
+	struct proto_conn *c = arg;
+	struct proto_out *o;
+	int err;
+
+	pthread_mutex_lock(&c->write_lock);
+
+	for (;;) {
+		while (!c->out && !c->closing)
+			pthread_cond_wait(&c->write_cond, &c->write_lock);
+
+		o = c->out;
+		if (!o)
+			break;
+
+		c->out = o->next;
+		if (!c->out)
+			c->out_tail = &c->out;
+
+		/* Once the client is gone, the rest of the queue is dropped */
+		err = c->write_err;
+		pthread_mutex_unlock(&c->write_lock);
+
+		if (!err)
+			err = write_all(c->fd, o->buf, o->len);
+
+		pthread_mutex_lock(&c->write_lock);
+		c->write_err = err;
+		c->queued -= o->len;
+		pthread_cond_broadcast(&c->write_cond);
+		free(o);
+	}
+
+	pthread_mutex_unlock(&c->write_lock);
+
+	DBG("[debug] proto: connection %d closed\n", c->fd);
+
+	if (c->fd >= 0)
+		close(c->fd);
+	pthread_cond_destroy(&c->write_cond);
+	pthread_mutex_destroy(&c->write_lock);
+	pthread_mutex_destroy(&c->lock);
+	free(c);
+	return NULL;
+}
+
+/*
+ * Queue @msg followed by the @nb parts of its payload. With @drop_if_full,
+ * the message is refused with -ENOBUFS when the client is already behind.
+ */
+static int proto_queue(struct proto_conn *c, const struct kmsgrab_msg *msg,
+		       const struct iovec *parts, unsigned int nb,
+		       int drop_if_full)
+{
+	size_t len = sizeof(*msg);
+	struct proto_out *o;
+	unsigned int i;
+	char *ptr;
+	int err;
+
+	for (i = 0; i < nb; i++)
+		len += parts[i].iov_len;
+
+	o = malloc(sizeof(*o) + len);
+	if (!o)
+		return -ENOMEM;
+
+	o->next = NULL;
+	o->len = len;
+
+	memcpy(o->buf, msg, sizeof(*msg));
+	ptr = o->buf + sizeof(*msg);
+	for (i = 0; i < nb; i++) {
+		if (parts[i].iov_len)
+			memcpy(ptr, parts[i].iov_base, parts[i].iov_len);
+		ptr += parts[i].iov_len;
+	}
+
+	pthread_mutex_lock(&c->write_lock);
+
+	err = c->write_err;
+	if (!err && drop_if_full && c->queued > PROTO_MAX_QUEUED)
+		err = -ENOBUFS;
+
+	if (!err) {
+		*c->out_tail = o;
+		c->out_tail = &o->next;
+		c->queued += len;
+		pthread_cond_broadcast(&c->write_cond);
+		o = NULL;
+	}
+
+	pthread_mutex_unlock(&c->write_lock);
+
+	free(o);
+	return err;
+}
+
+/* Hold back the requests of a client that doesn't read its replies. */
+static int proto_wait_room(struct proto_conn *c)
+{
+	int err;
+
+	pthread_mutex_lock(&c->write_lock);
+	while (!c->write_err && c->queued > PROTO_MAX_QUEUED)
+		pthread_cond_wait(&c->write_cond, &c->write_lock);
+	err = c->write_err;
+	pthread_mutex_unlock(&c->write_lock);
+
+	return err;
+}
+
+static int proto_reply(struct proto_conn *c, uint16_t op, uint32_t id,
+		       int status, const void *payload, size_t length)
+{
+	struct kmsgrab_msg msg = {
+		.magic = KMSGRAB_PROTO_MAGIC,
+		.version = KMSGRAB_PROTO_VERSION,
+		.type = op | KMSGRAB_MSG_RESPONSE,
+		.id = id,
+		.status = status,
+		.length = (uint32_t)length,
+	};
+	struct iovec part = { (void *)payload, length };
+
+	return proto_queue(c, &msg, &part, length ? 1 : 0, 0);
+}
+
+static void proto_reply_info(struct proto_conn *c, uint16_t op, uint32_t id,
+			     int status, uint64_t frame_id,
+			     const struct timespec *ts)
+{
+	struct kmsgrab_frame_info info = {
+		.frame_id = frame_id,
+		.tv_sec = ts->tv_sec,
+		.tv_nsec = ts->tv_nsec,
+	};
+
+	proto_reply(c, op, id, status, &info, status ? 0 : sizeof(info));
+}
+
+static void proto_grab_done(const struct grab_result *res, void *ctx)
+{
+	struct proto_request *req = ctx;
+
+	proto_reply_info(req->conn, req->op, req->id, res->err,
+			 res->id, &res->timestamp);
+
+	proto_conn_put(req->conn);
+	free(req);
+}
+
+static void proto_wait_done(struct grab_waiter *w)
+{
+	struct proto_request *req = w->ctx;
+	struct proto_conn *c = req->conn;
+	int err = w->err;
+
+	if (req->op == KMSGRAB_OP_WAIT) {
+		proto_reply_info(c, req->op, req->id, err, w->id, &w->timestamp);
+	} else {
+		if (!err && !w->data)
+			err = -ENODATA;
+		proto_reply(c, req->op, req->id, err, w->data, err ? 0 : w->size);
+	}
+
+	free(w->data);
+	proto_conn_put(c);
+	free(req);
+}
+
+static int proto_event(struct subscriber *s, const struct kmsgrab_event *ev,
+		       const struct kmsgrab_rect *rects, const void *frame)
+{
+	struct proto_conn *c = s->ctx;
+	struct kmsgrab_msg msg = {
+		.magic = KMSGRAB_PROTO_MAGIC,
+		.version = KMSGRAB_PROTO_VERSION,
+		.type = KMSGRAB_OP_SUBSCRIBE | KMSGRAB_MSG_EVENT,
+		.id = s->id,
+	};
+	struct iovec parts[3];
+
+	if (!ev)
+		return proto_reply(c, KMSGRAB_OP_SUBSCRIBE, s->id, 0, NULL, 0);
+
+	parts[0].iov_base = (void *)ev;
+	parts[0].iov_len = sizeof(*ev);
+	parts[1].iov_base = (void *)rects;
+	parts[1].iov_len = ev->nb_rects * sizeof(*rects);
+	parts[2].iov_base = (void *)frame;
+	parts[2].iov_len = ev->frame_size;
+
+	msg.length = (uint32_t)(parts[0].iov_len + parts[1].iov_len +
+				parts[2].iov_len);
+
+	/* A subscriber that lags that far behind is dropped */
+	return proto_queue(c, &msg, parts, 3, 1);
+}
+
+static void proto_release(struct subscriber *s)
+{
+	proto_conn_put(s->ctx);
+	free(s);
+}
+
+static int proto_subscribe(struct proto_conn *c, const struct kmsgrab_msg *msg,
+			   const void *payload)
+{
+	struct subscriber *s;
+	int err;
+
+	if (msg->length != sizeof(s->params))
+		return -EINVAL;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	memcpy(&s->params, payload, sizeof(s->params));
+	s->send = proto_event;
+	s->release = proto_release;
+	s->ctx = c;
+	s->id = msg->id;
+	s->fd = c->fd;
+
+	proto_conn_get(c);
+
+	err = daemon_subscribe(c->d, s);
+	if (err) {
+		proto_conn_put(c);
+		free(s);
+	}
+
+	return err;
+}
+
+static int proto_handle(struct proto_conn *c, const struct kmsgrab_msg *msg,
+			const void *payload)
+{
+	static const struct grab_request async_req = { .keep = 1 };
+	struct grab_request grab_req = { .notify = proto_grab_done };
+	struct proto_request *req;
+	struct timespec ts = { 0 };
+	uint64_t frame_id = 0;
+	uint32_t sub_id;
+	int err;
+
+	switch (msg->type) {
+	case KMSGRAB_OP_PING:
+		proto_reply(c, msg->type, msg->id, 0, NULL, 0);
+		return 0;
+
+	case KMSGRAB_OP_GRAB_ASYNC:
+		err = daemon_capture(c->d, &async_req, &frame_id, &ts);
+		proto_reply_info(c, msg->type, msg->id, err, frame_id, &ts);
+		return 0;
+
+	case KMSGRAB_OP_SUBSCRIBE:
+		/* Acknowledged by the watcher itself, ahead of any event */
+		err = proto_subscribe(c, msg, payload);
+		if (err)
+			proto_reply(c, msg->type, msg->id, err, NULL, 0);
+		return 0;
+
+	case KMSGRAB_OP_UNSUBSCRIBE:
+		if (msg->length != sizeof(uint32_t)) {
+			err = -EINVAL;
+		} else {
+			memcpy(&sub_id, payload, sizeof(sub_id));
+			err = daemon_unsubscribe(c->d, c, &sub_id);
+		}
+
+		proto_reply(c, msg->type, msg->id, err, NULL, 0);
+		return 0;
+
+	case KMSGRAB_OP_GRAB:
+	case KMSGRAB_OP_WAIT:
+	case KMSGRAB_OP_FETCH:
+		break;
+
+	default:
+		proto_reply(c, msg->type, msg->id, -EOPNOTSUPP, NULL, 0);
+		return 0;
+	}
+
+	req = calloc(1, sizeof(*req));
+	if (!req) {
+		proto_reply(c, msg->type, msg->id, -ENOMEM, NULL, 0);
+		return 0;
+	}
+
+	req->conn = c;
+	req->id = msg->id;
+	req->op = msg->type;
+	proto_conn_get(c);
+
+	if (msg->type == KMSGRAB_OP_GRAB) {
+		grab_req.ctx = req;
+
+		err = daemon_capture(c->d, &grab_req, &frame_id, &ts);
+		if (err) {
+			proto_reply(c, msg->type, msg->id, err, NULL, 0);
+			goto err_put_request;
+		}
+
+		return 0;
+	}
+
+	if (msg->length != sizeof(req->wait.id)) {
+		proto_reply(c, msg->type, msg->id, -EINVAL, NULL, 0);
+		goto err_put_request;
+	}
+
+	/* Answered by the encoder thread, not to hold back other requests */
+	memcpy(&req->wait.id, payload, sizeof(req->wait.id));
+	req->wait.want_data = msg->type == KMSGRAB_OP_FETCH;
+	req->wait.done = proto_wait_done;
+	req->wait.ctx = req;
+
+	daemon_wait_async(c->d, &req->wait);
+
+	return 0;
+
+err_put_request:
+	proto_conn_put(c);
+	free(req);
+	return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+	char *ptr = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, ptr, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret ? -errno : -EPIPE;
+
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static void *proto_conn_thread(void *arg)
+{
+	struct proto_conn *c = arg;
+	char payload[KMSGRAB_PROTO_MAX_REQUEST];
+	struct kmsgrab_msg msg;
+
+	for (;;) {
+		if (proto_wait_room(c) || read_all(c->fd, &msg, sizeof(msg)))
+			break;
+
+		if (msg.magic != KMSGRAB_PROTO_MAGIC ||
+		    msg.version != KMSGRAB_PROTO_VERSION ||
+		    msg.length > sizeof(payload)) {
+			DBG("[debug] proto: bad message on connection %d\n", c->fd);
+			break;
+		}
+
+		if (msg.length && read_all(c->fd, payload, msg.length))
+			break;
+
+		proto_handle(c, &msg, payload);
+	}
+
+	/* Let the pending replies go out, but don't accept more requests */
+	shutdown(c->fd, SHUT_RD);
+	daemon_unsubscribe(c->d, c, NULL);
+	proto_conn_put(c);
+	return NULL;
+}
+
+int daemon_proto_open(struct daemon *d, int cli_fd)
+{
+	struct proto_conn *c;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	c->d = d;
+	c->fd = cli_fd;
+	c->refs = 1;
+	c->out_tail = &c->out;
+	pthread_mutex_init(&c->write_lock, NULL);
+	pthread_cond_init(&c->write_cond, NULL);
+	pthread_mutex_init(&c->lock, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	err = pthread_create(&thread, &attr, proto_writer_thread, c);
+	if (err) {
+		pthread_attr_destroy(&attr);
+		pthread_cond_destroy(&c->write_cond);
+		pthread_mutex_destroy(&c->write_lock);
+		pthread_mutex_destroy(&c->lock);
+		free(c);
+		return -err;
+	}
+
+	err = pthread_create(&thread, &attr, proto_conn_thread, c);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		/* The caller closes the socket; the writer frees the rest */
+		c->fd = -1;
+		proto_conn_put(c);
+		return -err;
+	}
+
+	DBG("[debug] proto: connection %d opened\n", cli_fd);
+
+	return 0;
+}
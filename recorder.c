@@ -0,0 +1,352 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - in-memory flight recorder
+ *
+ * Keeps the last seconds of frames in memory, cheaply enough to be left on
+ * permanently: each frame is compared with the previous one by tiles, and
+ * only the tiles that changed are stored, so that a static screen costs one
+ * pass of memcmp() per frame and next to no memory. When the recording gets
+ * too long or too big, its oldest frame is applied onto the base picture and
+ * dropped. Nothing is encoded until the frames are dumped.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "recorder.h"
+#include "tiles.h"
+
+struct rec_dump {
+	struct output out;
+	char *fn;
+
+	uint8_t *base;
+	uint32_t base_w, base_h;
+	struct rec_frame *frames;
+};
+
+/* Copy the tiles of @f over the picture it applies to, of its size. */
+static void apply_frame(uint8_t *pixels, const struct rec_frame *f)
+{
+	size_t stride = (size_t)f->width * 3;
+	uint32_t i, index, x, y, w, h;
+	const uint8_t *ptr = f->data;
+	uint8_t *dst;
+
+	for (i = 0; i < f->nb_tiles; i++) {
+		memcpy(&index, ptr, sizeof(index));
+		ptr += sizeof(index);
+
+		tile_rect(index, f->width, f->height, RECORDER_TILE_SIZE,
+			  &x, &y, &w, &h);
+		dst = pixels + y * stride + x * 3;
+
+		for (; h; h--, dst += stride, ptr += w * 3)
+			memcpy(dst, ptr, w * 3);
+	}
+}
+
+/* Apply @f onto a base picture, which keyframes may resize. */
+static int apply_to_base(uint8_t **base, uint32_t *width, uint32_t *height,
+			 const struct rec_frame *f)
+{
+	uint8_t *buf;
+
+	if (f->width != *width || f->height != *height) {
+		buf = realloc(*base, (size_t)f->width * f->height * 3);
+		if (!buf)
+			return -ENOMEM;
+
+		*base = buf;
+		*width = f->width;
+		*height = f->height;
+	}
+
+	apply_frame(*base, f);
+	return 0;
+}
+
+static void free_frames(struct rec_frame *f)
+{
+	struct rec_frame *next;
+
+	for (; f; f = next) {
+		next = f->next;
+		free(f);
+	}
+}
+
+static void recorder_reset(struct recorder *rec)
+{
+	free_frames(rec->head);
+	free(rec->base);
+
+	rec->base = NULL;
+	rec->base_w = rec->base_h = 0;
+	rec->head = rec->tail = NULL;
+	rec->nb_frames = 0;
+	rec->used = 0;
+	rec->need_keyframe = 1;
+}
+
+void recorder_init(struct recorder *rec, unsigned int max_age_ms,
+		   size_t budget)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->max_age_ms = max_age_ms;
+	rec->budget = budget;
+	rec->need_keyframe = 1;
+	pthread_mutex_init(&rec->lock, NULL);
+}
+
+void recorder_free(struct recorder *rec)
+{
+	recorder_reset(rec);
+	free(rec->last);
+	rec->last = NULL;
+	pthread_mutex_destroy(&rec->lock);
+}
+
+static uint64_t frame_age_ms(const struct rec_frame *f,
+			     const struct rec_frame *newest)
+{
+	return (uint64_t)(newest->timestamp.tv_sec - f->timestamp.tv_sec) * 1000 +
+		(newest->timestamp.tv_nsec - f->timestamp.tv_nsec) / 1000000;
+}
+
+/* Drop the oldest frames, as long as the recording exceeds its limits. */
+static void recorder_trim(struct recorder *rec)
+{
+	struct rec_frame *f;
+	size_t pictures;
+
+	while (rec->head != rec->tail) {
+		f = rec->head;
+
+		pictures = ((size_t)rec->base_w * rec->base_h +
+			    (size_t)rec->last_w * rec->last_h) * 3;
+
+		if (rec->used + pictures <= rec->budget &&
+		    frame_age_ms(f, rec->tail) <= rec->max_age_ms)
+			break;
+
+		if (apply_to_base(&rec->base, &rec->base_w, &rec->base_h, f)) {
+			/* Without its base, the rest could not be rebuilt */
+			recorder_reset(rec);
+			return;
+		}
+
+		rec->head = f->next;
+		rec->nb_frames--;
+		rec->used -= sizeof(*f) + f->size;
+		free(f);
+	}
+}
+
+int recorder_add(struct recorder *rec, const struct frame *frame)
+{
+	uint32_t nb_tiles, nb = 0, i, x, y, w, h, *changed;
+	size_t stride = (size_t)frame->width * 3, size = 0, offset;
+	const uint8_t *src;
+	struct rec_frame *f;
+	uint8_t *last, *ptr;
+	int keyframe, ret = 0;
+
+	nb_tiles = tiles_across(frame->width, RECORDER_TILE_SIZE) *
+		tiles_across(frame->height, RECORDER_TILE_SIZE);
+
+	changed = malloc(nb_tiles * sizeof(*changed));
+	if (!changed)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&rec->lock);
+
+	keyframe = rec->need_keyframe || frame->width != rec->last_w ||
+		frame->height != rec->last_h;
+
+	if (keyframe && (frame->width != rec->last_w ||
+			 frame->height != rec->last_h)) {
+		last = realloc(rec->last, stride * frame->height);
+		if (!last) {
+			ret = -ENOMEM;
+			goto out_unlock;
+		}
+
+		rec->last = last;
+		rec->last_w = frame->width;
+		rec->last_h = frame->height;
+	}
+
+	for (i = 0; i < nb_tiles; i++) {
+		tile_rect(i, frame->width, frame->height, RECORDER_TILE_SIZE,
+			  &x, &y, &w, &h);
+		offset = y * stride + x * 3;
+
+		if (!keyframe && !tile_changed(frame->pixels + offset,
+					       rec->last + offset, stride, w, h))
+			continue;
+
+		changed[nb++] = i;
+		size += sizeof(i) + (size_t)w * h * 3;
+	}
+
+	f = malloc(sizeof(*f) + size);
+	if (!f) {
+		ret = -ENOMEM;
+		goto out_unlock;
+	}
+
+	f->next = NULL;
+	f->id = frame->id;
+	f->timestamp = frame->timestamp;
+	f->width = frame->width;
+	f->height = frame->height;
+	f->keyframe = keyframe;
+	f->nb_tiles = nb;
+	f->size = size;
+
+	for (ptr = f->data, i = 0; i < nb; i++) {
+		memcpy(ptr, &changed[i], sizeof(changed[i]));
+		ptr += sizeof(changed[i]);
+
+		tile_rect(changed[i], frame->width, frame->height,
+			  RECORDER_TILE_SIZE, &x, &y, &w, &h);
+		offset = y * stride + x * 3;
+
+		for (src = frame->pixels + offset, last = rec->last + offset; h;
+		     h--, src += stride, last += stride, ptr += w * 3) {
+			memcpy(ptr, src, w * 3);
+			memcpy(last, src, w * 3);
+		}
+	}
+
+	if (rec->tail)
+		rec->tail->next = f;
+	else
+		rec->head = f;
+	rec->tail = f;
+	rec->nb_frames++;
+	rec->used += sizeof(*f) + size;
+	rec->need_keyframe = 0;
+
+	recorder_trim(rec);
+
+	DBG("[debug] recorder: frame %"PRIu64" %u/%u tiles, %u frames, %zu KiB\n",
+	    frame->id, nb, nb_tiles, rec->nb_frames, rec->used / 1024);
+
+out_unlock:
+	pthread_mutex_unlock(&rec->lock);
+	free(changed);
+	return ret;
+}
+
+static void *recorder_dump_thread(void *arg)
+{
+	struct rec_dump *dump = arg;
+	struct frame frame = { 0 };
+	struct timespec times[2];
+	struct rec_frame *f;
+	char fn[PATH_MAX];
+	int err;
+
+	frame.opts = dump->out.opts;
+
+	for (f = dump->frames; f; f = f->next) {
+		err = apply_to_base(&dump->base, &dump->base_w, &dump->base_h, f);
+		if (err)
+			break;
+
+		frame.id = f->id;
+		frame.timestamp = f->timestamp;
+		frame.pixels = dump->base;
+		frame.width = f->width;
+		frame.height = f->height;
+
+		err = encode_frame(&frame, &dump->out);
+		if (!err) {
+			/* The files carry the time of their capture */
+			format_output_fn(fn, sizeof(fn), dump->out.fn, f->id);
+			times[0] = times[1] = f->timestamp;
+			if (utimensat(AT_FDCWD, fn, times, 0))
+				err = -errno;
+		}
+
+		if (err) {
+			fprintf(stderr, "Failed to dump frame %"PRIu64": %s\n",
+				f->id, strerror(-err));
+		}
+	}
+
+	DBG("[debug] recorder: dump to %s done\n", dump->fn);
+
+	free_frames(dump->frames);
+	free(dump->base);
+	free(dump->fn);
+	free(dump);
+	return NULL;
+}
+
+int recorder_dump(struct recorder *rec, const struct output *out,
+		  struct timespec *first, struct timespec *last)
+{
+	struct rec_dump *dump;
+	unsigned int nb;
+	pthread_t thread;
+	int err;
+
+	dump = calloc(1, sizeof(*dump));
+	if (!dump)
+		return -ENOMEM;
+
+	dump->out = *out;
+	dump->fn = strdup(out->fn);
+	if (!dump->fn) {
+		free(dump);
+		return -ENOMEM;
+	}
+	dump->out.fn = dump->fn;
+
+	pthread_mutex_lock(&rec->lock);
+
+	if (!rec->head) {
+		pthread_mutex_unlock(&rec->lock);
+		free(dump->fn);
+		free(dump);
+		return -ENOENT;
+	}
+
+	/* Take the whole recording, and start a new one from a keyframe */
+	dump->base = rec->base;
+	dump->base_w = rec->base_w;
+	dump->base_h = rec->base_h;
+	dump->frames = rec->head;
+	nb = rec->nb_frames;
+	*first = rec->head->timestamp;
+	*last = rec->tail->timestamp;
+
+	rec->base = NULL;
+	rec->head = NULL;
+	recorder_reset(rec);
+
+	pthread_mutex_unlock(&rec->lock);
+
+	err = pthread_create(&thread, NULL, recorder_dump_thread, dump);
+	if (err) {
+		free_frames(dump->frames);
+		free(dump->base);
+		free(dump->fn);
+		free(dump);
+		return -err;
+	}
+
+	pthread_detach(thread);
+	return (int)nb;
+}
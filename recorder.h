@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - in-memory flight recorder
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_RECORDER_H__
+#define __KMSGRAB_RECORDER_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "core.h"
+
+/* Side of the tiles frames are stored by, when they changed */
+#define RECORDER_TILE_SIZE	32
+
+/* A recorded frame: the tiles that changed since the previous one */
+struct rec_frame {
+	struct rec_frame *next;
+	uint64_t id;
+	struct timespec timestamp;
+	uint32_t width, height;
+
+	/* All the tiles are stored when the size changed, or after a dump */
+	int keyframe;
+	uint32_t nb_tiles;
+
+	/* Each tile: its index (uint32_t), then its lines of pixels */
+	size_t size;
+	uint8_t data[];
+};
+
+struct recorder {
+	/* Limits of the recording: its length, and the memory it may use */
+	unsigned int max_age_ms;
+	size_t budget;
+
+	pthread_mutex_t lock;
+
+	/*
+	 * Picture the oldest frame applies to, and the frames from the oldest
+	 * to the newest. Dropping the oldest frame applies it to the base.
+	 */
+	uint8_t *base;
+	uint32_t base_w, base_h;
+	struct rec_frame *head, *tail;
+	unsigned int nb_frames;
+	size_t used;
+
+	/* Newest picture, to diff the next frame against */
+	uint8_t *last;
+	uint32_t last_w, last_h;
+	int need_keyframe;
+};
+
+void recorder_init(struct recorder *rec, unsigned int max_age_ms,
+		   size_t budget);
+void recorder_free(struct recorder *rec);
+
+/* Record @frame, dropping the oldest frames as needed to fit the limits. */
+int recorder_add(struct recorder *rec, const struct frame *frame);
+
+/*
+ * Hand the recorded frames over to a background thread, which encodes them
+ * for @out (whose file name is formatted with each frame's id), and sets the
+ * time of each file to the time of its capture. The recording then starts
+ * over. Returns the number of frames, and the time of the first and last.
+ */
+int recorder_dump(struct recorder *rec, const struct output *out,
+		  struct timespec *first, struct timespec *last);
+
+#endif /* __KMSGRAB_RECORDER_H__ */
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - shared-memory frame ring, publisher side
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "kmsgrab.h"
+#include "ring.h"
+
+static size_t ring_header_size(unsigned int nb_slots)
+{
+	size_t size = sizeof(struct kmsgrab_ring) +
+		nb_slots * sizeof(struct kmsgrab_ring_slot);
+
+	/* Page-align the pixel data */
+	return (size + 4095) & ~(size_t)4095;
+}
+
+/*
+ * The ring is created on the first publication, as its slots are sized
+ * after the first frame, and created again for frames that don't fit.
+ */
+static int frame_ring_create(struct frame_ring *r, const struct frame *frame)
+{
+	size_t header_size = ring_header_size(r->nb_slots);
+	size_t slot_size = ((size_t)frame->width * frame->height * 3 + 4095) & ~(size_t)4095;
+	struct kmsgrab_ring *ring;
+	unsigned int i;
+	int fd, seals, err;
+
+	fd = memfd_create("kmsgrab-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -errno;
+
+	r->map_size = header_size + r->nb_slots * slot_size;
+
+	if (ftruncate(fd, r->map_size)) {
+		close(fd);
+		return -errno;
+	}
+
+	ring = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		close(fd);
+		return -errno;
+	}
+
+	/*
+	 * Consumers must neither resize the ring, which would crash the
+	 * daemon with SIGBUS, nor write to it. Kernels older than 5.1 can't
+	 * forbid writing; the publisher never trusts the header anyway.
+	 */
+	seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+	if (fcntl(fd, F_ADD_SEALS, seals | F_SEAL_FUTURE_WRITE) < 0 &&
+	    errno == EINVAL) {
+		DBG("[debug] frame ring: consumers can write to the ring\n");
+		err = fcntl(fd, F_ADD_SEALS, seals);
+	} else {
+		err = 0;
+	}
+#else
+	err = fcntl(fd, F_ADD_SEALS, seals);
+#endif
+	if (err < 0) {
+		err = -errno;
+		munmap(ring, r->map_size);
+		close(fd);
+		return err;
+	}
+
+	ring->magic = KMSGRAB_RING_MAGIC;
+	ring->version = KMSGRAB_RING_VERSION;
+	ring->nb_slots = r->nb_slots;
+	ring->slot_size = slot_size;
+
+	for (i = 0; i < r->nb_slots; i++)
+		ring->slots[i].offset = header_size + i * slot_size;
+
+	r->fd = fd;
+	r->ring = ring;
+	r->header_size = header_size;
+	r->slot_size = slot_size;
+	r->latest = 0;
+
+	DBG("[debug] frame ring: %u slots of %zu bytes\n", r->nb_slots, slot_size);
+
+	return 0;
+}
+
+/* Flag the ring as replaced, and wake up its consumers so that they notice. */
+static void frame_ring_retire(struct frame_ring *r)
+{
+	struct kmsgrab_ring *ring = r->ring;
+
+	__atomic_fetch_or(&ring->flags, KMSGRAB_RING_RETIRED, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->futex, (uint32_t)r->latest + 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &ring->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	/* The consumers keep their mappings of the memfd */
+	frame_ring_free(r);
+}
+
+int frame_ring_publish(struct frame_ring *r, const struct frame *frame)
+{
+	struct kmsgrab_ring_slot *slot;
+	struct kmsgrab_ring *ring;
+	size_t size = (size_t)frame->width * frame->height * 3;
+	unsigned int idx;
+	uint64_t seq;
+	int err;
+
+	if (r->ring && size > r->slot_size) {
+		DBG("[debug] frame ring: frame %"PRIu64" (%"PRIu32"x%"PRIu32") too big, replacing the ring\n",
+			frame->id, frame->width, frame->height);
+		frame_ring_retire(r);
+	}
+
+	if (!r->ring) {
+		err = frame_ring_create(r, frame);
+		if (err) {
+			fprintf(stderr, "Unable to create the frame ring: %s\n",
+				strerror(-err));
+			return err;
+		}
+	}
+
+	ring = r->ring;
+
+	idx = r->latest % r->nb_slots;
+	slot = &ring->slots[idx];
+
+	/*
+	 * Seqlock write side: odd while the slot is inconsistent. Each
+	 * publication in the slot adds 2, so its value follows from r->latest.
+	 */
+	seq = 2 * (r->latest / r->nb_slots) + 1;
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELAXED);
+	atomic_thread_fence(memory_order_release);
+
+	slot->frame_id = frame->id;
+	slot->tv_sec = frame->timestamp.tv_sec;
+	slot->tv_nsec = frame->timestamp.tv_nsec;
+	slot->width = frame->width;
+	slot->height = frame->height;
+	slot->stride = frame->width * 3;
+	slot->format = KMSGRAB_RING_FORMAT_RGB888;
+	slot->offset = r->header_size + idx * r->slot_size;
+	memcpy((uint8_t *)ring + r->header_size + idx * r->slot_size,
+	       frame->pixels, size);
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+
+	r->latest++;
+	__atomic_store_n(&ring->latest, r->latest, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->futex, (uint32_t)r->latest, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &ring->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	return 0;
+}
+
+void frame_ring_free(struct frame_ring *r)
+{
+	if (r->ring)
+		munmap(r->ring, r->map_size);
+	if (r->fd >= 0)
+		close(r->fd);
+	r->ring = NULL;
+	r->fd = -1;
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - shared-memory frame ring, publisher side
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_RING_PUB_H__
+#define __KMSGRAB_RING_PUB_H__
+
+#include <stddef.h>
+
+#include "kmsgrab-ring.h"
+#include "pipeline.h"
+
+/*
+ * The consumers may be able to write to the shared header, so the publisher
+ * keeps its own copy of what it needs and never reads it back.
+ */
+struct frame_ring {
+	unsigned int nb_slots;
+	int fd;
+	struct kmsgrab_ring *ring;
+	size_t map_size;
+
+	size_t header_size, slot_size;
+	uint64_t latest;
+};
+
+/* Copy @frame into the next slot. Must be called by a single thread. */
+int frame_ring_publish(struct frame_ring *r, const struct frame *frame);
+void frame_ring_free(struct frame_ring *r);
+
+#endif /* __KMSGRAB_RING_PUB_H__ */
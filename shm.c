@@ -0,0 +1,262 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - shared-memory trigger sessions
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "kmsgrab-shm.h"
+
+/* Triggers served per doorbell, at most: no more completions can be read */
+#define SHM_MAX_PENDING		(KMSGRAB_SHM_RING_SIZE - 1)
+
+struct shm_session {
+	struct daemon *d;
+	int sock_fd, mem_fd, doorbell_fd, completion_fd;
+	struct kmsgrab_shm *shm;
+	uint64_t served;
+
+	/* Protects the completion ring, which encoder threads write to */
+	pthread_mutex_t lock;
+	uint64_t completed;
+	pthread_cond_t cond;
+	unsigned int inflight;
+};
+
+static void shm_complete(struct shm_session *s, uint64_t cookie,
+			 uint64_t frame_id, const struct timespec *ts, int err)
+{
+	struct kmsgrab_shm_completion *c;
+	uint64_t idx, one = 1;
+
+	pthread_mutex_lock(&s->lock);
+
+	/* The shared counters are the client's to scribble on; ours is not */
+	idx = s->completed++;
+	c = &s->shm->ring[idx % KMSGRAB_SHM_RING_SIZE];
+	c->cookie = cookie;
+	c->frame_id = frame_id;
+	c->tv_sec = ts ? ts->tv_sec : 0;
+	c->tv_nsec = ts ? ts->tv_nsec : 0;
+	c->status = err;
+	__atomic_store_n(&s->shm->completed, idx + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&s->lock);
+
+	(void)!write(s->completion_fd, &one, sizeof(one));
+}
+
+struct shm_cookie {
+	struct shm_session *session;
+	uint64_t cookie;
+};
+
+static void shm_notify(const struct grab_result *res, void *ctx)
+{
+	struct shm_cookie *c = ctx;
+	struct shm_session *s = c->session;
+
+	shm_complete(s, c->cookie, res->id, &res->timestamp, res->err);
+	free(c);
+
+	pthread_mutex_lock(&s->lock);
+	if (!--s->inflight)
+		pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void shm_serve(struct shm_session *s)
+{
+	struct grab_request req = { .notify = shm_notify };
+	struct shm_cookie *cookie;
+	struct timespec ts;
+	uint64_t requested, end, id;
+	int err;
+
+	requested = __atomic_load_n(&s->shm->requested, __ATOMIC_ACQUIRE);
+
+	if (requested < s->served) {
+		DBG("[debug] shm session %p: requests went back from %"PRIu64
+		    " to %"PRIu64"\n", (void *)s, s->served, requested);
+		s->served = requested;
+	}
+
+	/* The rest waits for the next doorbell */
+	end = s->served + SHM_MAX_PENDING;
+	if (end > requested)
+		end = requested;
+
+	while (s->served < end) {
+		s->served++;
+
+		cookie = malloc(sizeof(*cookie));
+		if (!cookie) {
+			shm_complete(s, s->served, 0, NULL, -ENOMEM);
+			continue;
+		}
+
+		cookie->session = s;
+		cookie->cookie = s->served;
+		req.ctx = cookie;
+
+		pthread_mutex_lock(&s->lock);
+		s->inflight++;
+		pthread_mutex_unlock(&s->lock);
+
+		err = daemon_capture(s->d, &req, &id, &ts);
+		if (err) {
+			/* Not queued, so the notify callback won't run */
+			pthread_mutex_lock(&s->lock);
+			s->inflight--;
+			pthread_mutex_unlock(&s->lock);
+
+			free(cookie);
+			shm_complete(s, s->served, 0, NULL, err);
+		}
+	}
+}
+
+static void shm_session_free(struct shm_session *s)
+{
+	pthread_mutex_lock(&s->lock);
+	while (s->inflight)
+		pthread_cond_wait(&s->cond, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+
+	if (s->shm)
+		munmap(s->shm, sizeof(*s->shm));
+	if (s->completion_fd >= 0)
+		close(s->completion_fd);
+	if (s->doorbell_fd >= 0)
+		close(s->doorbell_fd);
+	if (s->mem_fd >= 0)
+		close(s->mem_fd);
+	if (s->sock_fd >= 0)
+		close(s->sock_fd);
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	free(s);
+}
+
+static void *shm_session_thread(void *arg)
+{
+	struct shm_session *s = arg;
+	struct pollfd pfd[2] = {
+		{ .fd = s->doorbell_fd, .events = POLLIN },
+		{ .fd = s->sock_fd, .events = POLLIN },
+	};
+	uint64_t count;
+	char buf[64];
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* Anything on the socket but data means the client went away */
+		if (pfd[1].revents) {
+			if (read(s->sock_fd, buf, sizeof(buf)) <= 0)
+				break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			if (read(s->doorbell_fd, &count, sizeof(count)) == sizeof(count))
+				shm_serve(s);
+		}
+	}
+
+	DBG("[debug] shm session %p closed\n", (void *)s);
+
+	shm_session_free(s);
+	return NULL;
+}
+
+int daemon_shm_open(struct daemon *d, int cli_fd)
+{
+	struct shm_session *s;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fds[3], err;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->d = d;
+	s->sock_fd = -1;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	s->mem_fd = memfd_create("kmsgrab-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	s->doorbell_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	s->completion_fd = eventfd(0, EFD_CLOEXEC);
+	if (s->mem_fd < 0 || s->doorbell_fd < 0 || s->completion_fd < 0) {
+		err = -errno;
+		goto err_free_session;
+	}
+
+	/* A shrunk memfd would crash the daemon with SIGBUS */
+	if (ftruncate(s->mem_fd, sizeof(*s->shm)) ||
+	    fcntl(s->mem_fd, F_ADD_SEALS,
+		  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+		err = -errno;
+		goto err_free_session;
+	}
+
+	s->shm = mmap(NULL, sizeof(*s->shm), PROT_READ | PROT_WRITE,
+		      MAP_SHARED, s->mem_fd, 0);
+	if (s->shm == MAP_FAILED) {
+		s->shm = NULL;
+		err = -errno;
+		goto err_free_session;
+	}
+
+	s->shm->magic = KMSGRAB_SHM_MAGIC;
+	s->shm->version = KMSGRAB_SHM_VERSION;
+	s->shm->ring_size = KMSGRAB_SHM_RING_SIZE;
+
+	fds[0] = s->mem_fd;
+	fds[1] = s->doorbell_fd;
+	fds[2] = s->completion_fd;
+
+	err = send_fds(cli_fd, "OK\n", fds, 3);
+	if (err)
+		goto err_free_session;
+
+	s->sock_fd = cli_fd;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = -pthread_create(&thread, &attr, shm_session_thread, s);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		s->sock_fd = -1;
+		goto err_free_session;
+	}
+
+	DBG("[debug] shm session %p opened\n", (void *)s);
+
+	return 0;
+
+err_free_session:
+	shm_session_free(s);
+	return err;
+}
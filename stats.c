@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - frame statistics
+ *
+ * Tells whether the display is alive (not black, not frozen, showing the
+ * expected content) without encoding anything, in one pass over the frame.
+ * Each pixel is converted to luminance once, and counted in a histogram of
+ * the 256 levels, which is then enough for the mean, the variance and the
+ * fraction of black pixels, and summed per cell of a coarse grid, from which
+ * the perceptual hash and the change against the previous frame are
+ * computed. The exact content is hashed along, so that a frozen screen can
+ * be told from a merely static one.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+/* The dHash compares 9 blocks per line of the grid, over 8 lines */
+#define DHASH_W			9
+#define DHASH_H			8
+
+#define FNV_PRIME_64		0x100000001b3ull
+#define FNV_OFFSET_64		0xcbf29ce484222325ull
+
+/* Luminance from BT.709 weights (in 1/256), kept in 0-255 */
+static inline uint8_t rgb_luma(const uint8_t *px)
+{
+	return (54 * px[0] + 183 * px[1] + 19 * px[2] + 128) >> 8;
+}
+
+/*
+ * FNV-1a over 64-bit words, in four interleaved lanes so that the multiplies
+ * don't wait on each other. Each step is a bijection of its lane, so frames
+ * differing by one word always hash differently.
+ */
+static void hash_line(uint64_t lanes[4], const uint8_t *line, size_t len)
+{
+	uint64_t words[4];
+	unsigned int i;
+	size_t pos;
+
+	for (pos = 0; pos + sizeof(words) <= len; pos += sizeof(words)) {
+		memcpy(words, line + pos, sizeof(words));
+
+		for (i = 0; i < 4; i++)
+			lanes[i] = (lanes[i] ^ words[i]) * FNV_PRIME_64;
+	}
+
+	for (; pos < len; pos++)
+		lanes[0] = (lanes[0] ^ line[pos]) * FNV_PRIME_64;
+}
+
+/*
+ * Accumulate the luminance of @len pixels into the histograms, and return
+ * its sum. Consecutive pixels go to different histograms, so that runs of
+ * identical pixels don't serialize on the same counter.
+ */
+static uint32_t luma_span(uint32_t (*hist)[256], const uint8_t *px,
+			  uint32_t len)
+{
+	uint8_t l0, l1, l2, l3;
+	uint32_t sum = 0;
+
+	for (; len >= 4; len -= 4, px += 12) {
+		l0 = rgb_luma(px);
+		l1 = rgb_luma(px + 3);
+		l2 = rgb_luma(px + 6);
+		l3 = rgb_luma(px + 9);
+
+		hist[0][l0]++;
+		hist[1][l1]++;
+		hist[2][l2]++;
+		hist[3][l3]++;
+
+		sum += l0 + l1 + l2 + l3;
+	}
+
+	for (; len; len--, px += 3) {
+		l0 = rgb_luma(px);
+		hist[0][l0]++;
+		sum += l0;
+	}
+
+	return sum;
+}
+
+static unsigned int popcount64(uint64_t val)
+{
+	unsigned int count = 0;
+
+	for (; val; val &= val - 1)
+		count++;
+
+	return count;
+}
+
+static void compute_dhash(struct frame_stats *st)
+{
+	unsigned int blocks[DHASH_H][DHASH_W] = { 0 };
+	unsigned int x, y;
+
+	for (y = 0; y < STATS_GRID_H; y++)
+		for (x = 0; x < STATS_GRID_W; x++)
+			blocks[y * DHASH_H / STATS_GRID_H][x * DHASH_W / STATS_GRID_W] +=
+				st->grid[y][x];
+
+	st->dhash = 0;
+
+	for (y = 0; y < DHASH_H; y++)
+		for (x = 0; x < DHASH_W - 1; x++)
+			st->dhash = st->dhash << 1 | (blocks[y][x] > blocks[y][x + 1]);
+}
+
+static void compare_stats(struct frame_stats *st,
+			  const struct frame_stats *prev)
+{
+	unsigned int x, y, diff = 0;
+
+	for (y = 0; y < STATS_GRID_H; y++)
+		for (x = 0; x < STATS_GRID_W; x++)
+			diff += abs((int)st->grid[y][x] - (int)prev->grid[y][x]);
+
+	/* The grid does not depend on the size, the exact content does */
+	st->has_prev = 1;
+	st->change = (double)diff / (STATS_GRID_W * STATS_GRID_H * 255);
+	st->dhash_distance = popcount64(st->dhash ^ prev->dhash);
+	st->frozen = st->width == prev->width && st->height == prev->height &&
+		st->digest == prev->digest;
+}
+
+int frame_stats_compute(struct frame_stats *st, const struct frame *frame,
+			const struct frame_stats *prev)
+{
+	uint32_t cell_x[STATS_GRID_W + 1], cell_y[STATS_GRID_H + 1];
+	uint32_t width = frame->width, height = frame->height, y, cells;
+	uint64_t sums[STATS_GRID_W], lanes[4], total = 0, squares = 0, black = 0;
+	size_t stride = (size_t)width * 3;
+	unsigned int gx, gy, i;
+	uint32_t (*hist)[256];
+	const uint8_t *line;
+	uint64_t pixels;
+
+	if (!width || !height)
+		return -EINVAL;
+
+	hist = calloc(4, sizeof(*hist));
+	if (!hist)
+		return -ENOMEM;
+
+	memset(st, 0, sizeof(*st));
+	st->id = frame->id;
+	st->timestamp = frame->timestamp;
+	st->width = width;
+	st->height = height;
+
+	for (i = 0; i < 4; i++)
+		lanes[i] = FNV_OFFSET_64;
+
+	for (i = 0; i <= STATS_GRID_W; i++)
+		cell_x[i] = (uint32_t)((uint64_t)i * width / STATS_GRID_W);
+	for (i = 0; i <= STATS_GRID_H; i++)
+		cell_y[i] = (uint32_t)((uint64_t)i * height / STATS_GRID_H);
+
+	for (gy = 0; gy < STATS_GRID_H; gy++) {
+		memset(sums, 0, sizeof(sums));
+
+		for (y = cell_y[gy]; y < cell_y[gy + 1]; y++) {
+			line = frame->pixels + y * stride;
+
+			hash_line(lanes, line, stride);
+
+			for (gx = 0; gx < STATS_GRID_W; gx++)
+				sums[gx] += luma_span(hist, line + cell_x[gx] * 3,
+						      cell_x[gx + 1] - cell_x[gx]);
+		}
+
+		for (gx = 0; gx < STATS_GRID_W; gx++) {
+			cells = (cell_x[gx + 1] - cell_x[gx]) *
+				(cell_y[gy + 1] - cell_y[gy]);
+			st->grid[gy][gx] = cells ? (sums[gx] + cells / 2) / cells : 0;
+		}
+	}
+
+	st->digest = lanes[0];
+	for (i = 1; i < 4; i++)
+		st->digest = (st->digest ^ lanes[i]) * FNV_PRIME_64;
+
+	pixels = (uint64_t)width * height;
+
+	for (i = 0; i < 256; i++) {
+		uint64_t count = (uint64_t)hist[0][i] + hist[1][i] +
+			hist[2][i] + hist[3][i];
+
+		st->histogram[i * STATS_HIST_BINS / 256] += count;
+		total += count * i;
+		squares += count * i * i;
+		if (i < STATS_BLACK_LEVEL)
+			black += count;
+	}
+
+	st->mean = (double)total / pixels;
+	st->variance = (double)squares / pixels - st->mean * st->mean;
+	st->black = (double)black / pixels;
+
+	compute_dhash(st);
+
+	if (prev)
+		compare_stats(st, prev);
+
+	free(hist);
+	return 0;
+}
+
+int frame_stats_json(const struct frame_stats *st, char *buf, size_t len)
+{
+	char hist[STATS_HIST_BINS * 21], change[96];
+	size_t pos = 0;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < STATS_HIST_BINS; i++)
+		pos += snprintf(hist + pos, sizeof(hist) - pos, "%s%"PRIu64,
+				i ? "," : "", st->histogram[i]);
+
+	if (st->has_prev)
+		snprintf(change, sizeof(change),
+			 "\"change\":%.6f,\"dhash_distance\":%u,\"frozen\":%s",
+			 st->change, st->dhash_distance,
+			 st->frozen ? "true" : "false");
+	else
+		snprintf(change, sizeof(change),
+			 "\"change\":null,\"dhash_distance\":null,\"frozen\":null");
+
+	ret = snprintf(buf, len,
+		       "{\"id\":%"PRIu64",\"timestamp\":%lld.%09ld,"
+		       "\"width\":%"PRIu32",\"height\":%"PRIu32","
+		       "\"mean\":%.3f,\"variance\":%.3f,\"black\":%.6f,"
+		       "\"histogram\":[%s],"
+		       "\"dhash\":\"%016"PRIx64"\",\"digest\":\"%016"PRIx64"\",%s}",
+		       st->id, (long long)st->timestamp.tv_sec,
+		       st->timestamp.tv_nsec, st->width, st->height,
+		       st->mean, st->variance, st->black, hist,
+		       st->dhash, st->digest, change);
+
+	if (ret < 0 || (size_t)ret >= len)
+		return -ENOSPC;
+
+	return ret;
+}
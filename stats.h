@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - frame statistics
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_STATS_H__
+#define __KMSGRAB_STATS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pipeline.h"
+
+/* Number of bins of the reported luminance histogram */
+#define STATS_HIST_BINS		16
+
+/* Pixels darker than this luminance (0-255) count as black */
+#define STATS_BLACK_LEVEL	16
+
+/* Grid of mean luminances the change and the dHash are computed from */
+#define STATS_GRID_W		36
+#define STATS_GRID_H		32
+
+/* Enough for the JSON form of any frame_stats */
+#define STATS_JSON_MAX		1024
+
+struct frame_stats {
+	uint64_t id;
+	struct timespec timestamp;
+	uint32_t width, height;
+
+	/* Luminance (BT.709, 0-255) */
+	double mean, variance;
+	uint64_t histogram[STATS_HIST_BINS];
+
+	/* Fraction of the pixels under STATS_BLACK_LEVEL */
+	double black;
+
+	/* Perceptual hash of the picture, and hash of its exact content */
+	uint64_t dhash, digest;
+
+	/* Against the previous frame, if has_prev is set */
+	int has_prev;
+	unsigned int dhash_distance;
+	double change;
+	int frozen;
+
+	uint8_t grid[STATS_GRID_H][STATS_GRID_W];
+};
+
+/*
+ * Compute the statistics of @frame in a single pass over its pixels, and
+ * compare them against @prev, if not NULL.
+ */
+int frame_stats_compute(struct frame_stats *st, const struct frame *frame,
+			const struct frame_stats *prev);
+
+/* Format @st as a single line JSON object; returns its length. */
+int frame_stats_json(const struct frame_stats *st, char *buf, size_t len);
+
+#endif /* __KMSGRAB_STATS_H__ */
@@ -0,0 +1,649 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - change notifications
+ *
+ * A watcher thread runs as long as there are subscribers. It reads the
+ * FB_ID of the captured plane at every vertical blank, which catches page
+ * flips for the cost of one ioctl, and for subscribers that care about
+ * front-buffer rendering too, periodically captures the screen and hashes
+ * it in tiles. Each subscriber gets at most one event per rate-limit
+ * period; changes in between are merged into its next event.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daemon.h"
+
+#define WATCH_TILE_SIZE		64
+#define WATCH_DEFAULT_POLL_MS	250
+#define WATCH_MIN_POLL_MS	10
+
+/* Period of the FB_ID checks when vblank events are not available */
+#define WATCH_IDLE_MS		16
+
+/* Delay before retrying after the device or the plane went away */
+#define WATCH_RETRY_MS		1000
+
+/* Text subscribers that don't take an event within this are dropped */
+#define WATCH_SEND_TIMEOUT_MS	1000
+
+#define WATCH_CHANGES		(KMSGRAB_WATCH_FB | KMSGRAB_WATCH_CONTENT)
+
+/* State private to the watcher thread */
+struct watch_state {
+	struct daemon *d;
+	struct kms kms;
+
+	uint32_t fb_id, crtc_id;
+	int crtc_index;
+
+	/* Hash of each tile of the last frame, and what changed since */
+	uint64_t *tiles;
+	uint32_t width, height;
+	uint64_t hash;
+	int content_changed;
+	struct kmsgrab_rect rects[KMSGRAB_EVENT_MAX_RECTS];
+	uint32_t nb_rects;
+};
+
+static void sleep_ms(unsigned int ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (long)(ms % 1000) * 1000000,
+	};
+
+	while (nanosleep(&ts, &ts) && errno == EINTR);
+}
+
+static uint64_t hash_bytes(uint64_t h, const uint8_t *ptr, size_t len)
+{
+	uint64_t v;
+
+	for (; len >= sizeof(v); len -= sizeof(v), ptr += sizeof(v)) {
+		memcpy(&v, ptr, sizeof(v));
+		h = (h ^ v) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 32;
+	}
+
+	for (; len; len--)
+		h = (h ^ *ptr++) * 0x100000001b3ull;
+
+	return h;
+}
+
+/* Add @r to the list, which degrades to a bounding box once it is full. */
+static void rects_add(struct kmsgrab_rect *rects, uint32_t *nb,
+		      const struct kmsgrab_rect *r)
+{
+	uint32_t i, x0, y0, x1, y1;
+
+	if (*nb < KMSGRAB_EVENT_MAX_RECTS) {
+		rects[(*nb)++] = *r;
+		return;
+	}
+
+	x0 = r->x;
+	y0 = r->y;
+	x1 = r->x + r->width;
+	y1 = r->y + r->height;
+
+	for (i = 0; i < *nb; i++) {
+		if (rects[i].x < x0)
+			x0 = rects[i].x;
+		if (rects[i].y < y0)
+			y0 = rects[i].y;
+		if (rects[i].x + rects[i].width > x1)
+			x1 = rects[i].x + rects[i].width;
+		if (rects[i].y + rects[i].height > y1)
+			y1 = rects[i].y + rects[i].height;
+	}
+
+	rects[0] = (struct kmsgrab_rect){ x0, y0, x1 - x0, y1 - y0 };
+	*nb = 1;
+}
+
+/*
+ * Add a run of dirty tiles, extending a rectangle of the tile rows above
+ * (the first @row ones) when it spans the same columns and ends there.
+ */
+static void watch_add_run(struct watch_state *st, uint32_t row,
+			  const struct kmsgrab_rect *r)
+{
+	uint32_t i;
+
+	for (i = 0; i < row && i < st->nb_rects; i++) {
+		if (st->rects[i].x == r->x && st->rects[i].width == r->width &&
+		    st->rects[i].y + st->rects[i].height == r->y) {
+			st->rects[i].height += r->height;
+			return;
+		}
+	}
+
+	rects_add(st->rects, &st->nb_rects, r);
+}
+
+static int watch_inspect(const struct frame *frame, void *ctx)
+{
+	struct watch_state *st = ctx;
+	uint32_t tiles_w, tiles_h, tx, ty, y, tw, th, row;
+	size_t stride = (size_t)frame->width * 3;
+	struct kmsgrab_rect run = { 0 };
+	const uint8_t *ptr;
+	uint64_t h, *tile;
+	int resized, dirty;
+
+	tiles_w = (frame->width + WATCH_TILE_SIZE - 1) / WATCH_TILE_SIZE;
+	tiles_h = (frame->height + WATCH_TILE_SIZE - 1) / WATCH_TILE_SIZE;
+
+	resized = frame->width != st->width || frame->height != st->height;
+	if (resized) {
+		free(st->tiles);
+		st->tiles = calloc((size_t)tiles_w * tiles_h, sizeof(*st->tiles));
+		if (!st->tiles) {
+			st->width = st->height = 0;
+			return 0;
+		}
+	}
+
+	/* A size change is a full-screen change, except for the first frame */
+	st->content_changed = resized && st->width;
+	st->width = frame->width;
+	st->height = frame->height;
+	st->nb_rects = 0;
+
+	for (ty = 0; ty < tiles_h; ty++) {
+		th = frame->height - ty * WATCH_TILE_SIZE;
+		if (th > WATCH_TILE_SIZE)
+			th = WATCH_TILE_SIZE;
+
+		row = st->nb_rects;
+		run.width = 0;
+
+		for (tx = 0; tx < tiles_w; tx++) {
+			tw = frame->width - tx * WATCH_TILE_SIZE;
+			if (tw > WATCH_TILE_SIZE)
+				tw = WATCH_TILE_SIZE;
+
+			ptr = frame->pixels + (size_t)ty * WATCH_TILE_SIZE * stride
+				+ (size_t)tx * WATCH_TILE_SIZE * 3;
+			h = (uint64_t)ty << 32 | tx;
+
+			for (y = 0; y < th; y++, ptr += stride)
+				h = hash_bytes(h, ptr, (size_t)tw * 3);
+
+			tile = &st->tiles[ty * tiles_w + tx];
+			dirty = resized || *tile != h;
+			*tile = h;
+
+			if (dirty && run.width) {
+				run.width += tw;
+			} else if (dirty) {
+				run = (struct kmsgrab_rect){
+					tx * WATCH_TILE_SIZE, ty * WATCH_TILE_SIZE, tw, th,
+				};
+			} else if (run.width) {
+				watch_add_run(st, row, &run);
+				run.width = 0;
+			}
+		}
+
+		if (run.width)
+			watch_add_run(st, row, &run);
+	}
+
+	if (st->nb_rects && !resized)
+		st->content_changed = 1;
+
+	st->hash = hash_bytes(0, (const uint8_t *)st->tiles,
+			      (size_t)tiles_w * tiles_h * sizeof(*st->tiles));
+
+	return 0;
+}
+
+/* An event ready to be sent, outside of the watcher lock */
+struct watch_send {
+	struct subscriber *s;
+	struct kmsgrab_event ev;
+	struct kmsgrab_rect rects[KMSGRAB_EVENT_MAX_RECTS];
+	int err;
+};
+
+/* Take @s off the list, with the watcher lock held. */
+static void subscriber_unlink(struct watcher *w, struct subscriber *s)
+{
+	struct subscriber **prev;
+
+	for (prev = &w->subs; *prev != s; prev = &(*prev)->next);
+
+	*prev = s->next;
+	s->unlinked = 1;
+}
+
+/* Drop a reference to @s, with the watcher lock held. */
+static void subscriber_put(struct subscriber *s)
+{
+	if (!--s->refs)
+		s->release(s);
+}
+
+static int subscriber_due(const struct subscriber *s,
+			  const struct timespec *now)
+{
+	struct timespec next = s->last_event;
+
+	if (!s->pending)
+		return 0;
+
+	timespec_add_ms(&next, s->params.min_interval_ms);
+	return !timespec_before(now, &next);
+}
+
+static void watch_notify(struct watch_state *st, uint32_t changed)
+{
+	static const struct grab_request keep_req = { .keep = 1 };
+	struct watcher *w = &st->d->watch;
+	struct watch_send *send, *sends = NULL;
+	unsigned int nb_subs = 0, nb_sends = 0;
+	struct kmsgrab_event *ev;
+	struct subscriber *s;
+	struct timespec now, ts;
+	uint64_t frame_id = 0;
+	char *data = NULL;
+	size_t size = 0;
+	uint32_t c, i;
+	int want_frame = 0, err;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&w->lock);
+
+	for (s = w->subs; s; s = s->next) {
+		c = changed & s->params.flags;
+		s->pending |= c;
+
+		if ((c & KMSGRAB_WATCH_CONTENT) &&
+		    (s->params.flags & KMSGRAB_WATCH_RECTS)) {
+			for (i = 0; i < st->nb_rects; i++)
+				rects_add(s->rects, &s->nb_rects, &st->rects[i]);
+		}
+
+		if ((s->params.flags & KMSGRAB_WATCH_FRAME) &&
+		    subscriber_due(s, &now))
+			want_frame = 1;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	if (want_frame) {
+		err = daemon_capture(st->d, &keep_req, &frame_id, &ts);
+		if (!err)
+			err = daemon_wait(st->d, frame_id, NULL, &data, &size);
+		if (err) {
+			DBG("[debug] watch: unable to grab frame: %s\n",
+			    strerror(-err));
+			frame_id = 0;
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	pthread_mutex_lock(&w->lock);
+
+	for (s = w->subs; s; s = s->next)
+		nb_subs++;
+
+	/* Without memory, the changes stay pending until the next round */
+	if (nb_subs)
+		sends = malloc(nb_subs * sizeof(*sends));
+
+	for (s = w->subs; sends && s; s = s->next) {
+		if (!subscriber_due(s, &now))
+			continue;
+
+		send = &sends[nb_sends++];
+		send->s = s;
+		s->refs++;
+
+		ev = &send->ev;
+		memset(ev, 0, sizeof(*ev));
+		ev->seq = ++s->seq;
+		ev->tv_sec = ts.tv_sec;
+		ev->tv_nsec = ts.tv_nsec;
+		ev->hash = st->hash;
+		ev->changed = s->pending;
+		ev->fb_id = st->fb_id;
+		ev->width = st->width;
+		ev->height = st->height;
+		ev->nb_rects = s->nb_rects;
+		memcpy(send->rects, s->rects, s->nb_rects * sizeof(*s->rects));
+
+		if ((s->params.flags & KMSGRAB_WATCH_FRAME) && data) {
+			ev->frame_id = frame_id;
+			ev->frame_size = (uint32_t)size;
+		}
+
+		s->pending = 0;
+		s->nb_rects = 0;
+		s->last_event = now;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	/*
+	 * Send outside of the lock, so that a slow subscriber only delays the
+	 * others' events, never the (un)subscriptions.
+	 */
+	for (i = 0; i < nb_sends; i++) {
+		send = &sends[i];
+		send->err = send->s->send(send->s, &send->ev, send->rects, data);
+	}
+
+	pthread_mutex_lock(&w->lock);
+
+	for (i = 0; i < nb_sends; i++) {
+		s = sends[i].s;
+
+		if (sends[i].err && !s->unlinked) {
+			DBG("[debug] watch: dropping subscriber %"PRIu32"\n", s->id);
+			subscriber_unlink(w, s);
+			subscriber_put(s);
+		}
+
+		subscriber_put(s);
+	}
+
+	pthread_mutex_unlock(&w->lock);
+
+	free(sends);
+	free(data);
+}
+
+/* Return what the subscribers watch, or 0 to stop the watcher. */
+static uint32_t watch_wanted(struct watcher *w, unsigned int *poll_ms)
+{
+	struct subscriber *s;
+	uint32_t want = 0;
+
+	*poll_ms = UINT32_MAX;
+
+	pthread_mutex_lock(&w->lock);
+
+	for (s = w->subs; s; s = s->next) {
+		want |= s->params.flags;
+
+		if ((s->params.flags & KMSGRAB_WATCH_CONTENT) &&
+		    s->params.poll_ms < *poll_ms)
+			*poll_ms = s->params.poll_ms;
+	}
+
+	if (!want)
+		w->running = 0;
+
+	pthread_mutex_unlock(&w->lock);
+
+	return want;
+}
+
+static void *watch_thread(void *arg)
+{
+	struct watch_state st = { .d = arg, .crtc_index = -1 };
+	struct grab_request hash_req = {
+		.publish_only = 1,
+		.inspect = watch_inspect,
+		.ctx = &st,
+	};
+	struct timespec now, next_poll = { 0 }, ts;
+	uint32_t want, changed, fb_id, crtc_id;
+	unsigned int poll_ms;
+	uint64_t id;
+	int err;
+
+	st.kms.fd = -1;
+
+	while ((want = watch_wanted(&st.d->watch, &poll_ms))) {
+		if (st.kms.fd < 0 && kms_open(&st.kms)) {
+			sleep_ms(WATCH_RETRY_MS);
+			continue;
+		}
+
+		if (!(want & KMSGRAB_WATCH_FB))
+			sleep_ms(poll_ms);
+		else if (st.crtc_index < 0 ||
+			 kms_wait_vblank(&st.kms, st.crtc_index))
+			sleep_ms(WATCH_IDLE_MS);
+
+		err = kms_get_plane_fb(&st.kms, &fb_id, &crtc_id);
+		if (err) {
+			DBG("[debug] watch: no active plane: %s\n", strerror(-err));
+			kms_close(&st.kms);
+			st.crtc_id = 0;
+			st.crtc_index = -1;
+			sleep_ms(WATCH_RETRY_MS);
+			continue;
+		}
+
+		changed = 0;
+
+		/* The first FB_ID seen is the reference, not a change */
+		if (fb_id != st.fb_id) {
+			if (st.fb_id)
+				changed |= KMSGRAB_WATCH_FB;
+			st.fb_id = fb_id;
+		}
+
+		if (crtc_id != st.crtc_id) {
+			st.crtc_id = crtc_id;
+			st.crtc_index = kms_crtc_index(&st.kms, crtc_id);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if ((want & KMSGRAB_WATCH_CONTENT) &&
+		    !timespec_before(&now, &next_poll)) {
+			next_poll = now;
+			timespec_add_ms(&next_poll, poll_ms);
+
+			st.content_changed = 0;
+			err = daemon_capture(st.d, &hash_req, &id, &ts);
+			if (!err && st.content_changed)
+				changed |= KMSGRAB_WATCH_CONTENT;
+		}
+
+		watch_notify(&st, changed);
+	}
+
+	DBG("[debug] watch: no more subscribers\n");
+
+	kms_close(&st.kms);
+	free(st.tiles);
+	return NULL;
+}
+
+int daemon_subscribe(struct daemon *d, struct subscriber *s)
+{
+	struct watcher *w = &d->watch;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err = 0;
+
+	if (!(s->params.flags & WATCH_CHANGES))
+		s->params.flags |= KMSGRAB_WATCH_FB;
+	if (!s->params.poll_ms)
+		s->params.poll_ms = WATCH_DEFAULT_POLL_MS;
+	else if (s->params.poll_ms < WATCH_MIN_POLL_MS)
+		s->params.poll_ms = WATCH_MIN_POLL_MS;
+
+	pthread_mutex_lock(&w->lock);
+
+	if (!w->running) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		err = -pthread_create(&thread, &attr, watch_thread, d);
+		pthread_attr_destroy(&attr);
+		if (err)
+			goto out_unlock;
+
+		w->running = 1;
+	}
+
+	/* Acknowledge under the lock, so that no event can get ahead of it */
+	err = s->send(s, NULL, NULL, NULL);
+	if (err)
+		goto out_unlock;
+
+	s->next = w->subs;
+	s->refs = 1;
+	w->subs = s;
+
+	DBG("[debug] watch: subscriber %"PRIu32" flags=0x%"PRIx32" interval=%"PRIu32"ms\n",
+	    s->id, s->params.flags, s->params.min_interval_ms);
+
+out_unlock:
+	pthread_mutex_unlock(&w->lock);
+	return err;
+}
+
+int daemon_unsubscribe(struct daemon *d, const void *ctx, const uint32_t *id)
+{
+	struct watcher *w = &d->watch;
+	struct subscriber *s, **prev;
+	int err = -ENOENT;
+
+	pthread_mutex_lock(&w->lock);
+
+	for (prev = &w->subs; (s = *prev); ) {
+		if (s->ctx != ctx || (id && s->id != *id)) {
+			prev = &s->next;
+			continue;
+		}
+
+		*prev = s->next;
+		s->unlinked = 1;
+		subscriber_put(s);
+		err = 0;
+	}
+
+	pthread_mutex_unlock(&w->lock);
+	return err;
+}
+
+static int text_send(struct subscriber *s, const struct kmsgrab_event *ev,
+		     const struct kmsgrab_rect *rects, const void *frame)
+{
+	char buf[256 + KMSGRAB_EVENT_MAX_RECTS * 48];
+	size_t len;
+	uint32_t i;
+
+	if (!ev)
+		return write_all(s->fd, "OK\n", 3);
+
+	len = snprintf(buf, sizeof(buf),
+		       "EVENT %"PRIu64" %lld.%09lld changed=%s%s%s fb=%"PRIu32
+		       " hash=%016"PRIx64" size=%"PRIu32"x%"PRIu32,
+		       ev->seq, (long long)ev->tv_sec, (long long)ev->tv_nsec,
+		       ev->changed & KMSGRAB_WATCH_FB ? "fb" : "",
+		       ev->changed == WATCH_CHANGES ? "," : "",
+		       ev->changed & KMSGRAB_WATCH_CONTENT ? "content" : "",
+		       ev->fb_id, ev->hash, ev->width, ev->height);
+
+	for (i = 0; i < ev->nb_rects; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len,
+				"%s%"PRIu32",%"PRIu32",%"PRIu32",%"PRIu32,
+				i ? ";" : " rects=", rects[i].x, rects[i].y,
+				rects[i].width, rects[i].height);
+	}
+
+	if (ev->frame_size) {
+		len += snprintf(buf + len, sizeof(buf) - len,
+				" frame=%"PRIu64" %"PRIu32, ev->frame_id,
+				ev->frame_size);
+	}
+
+	len += snprintf(buf + len, sizeof(buf) - len, "\n");
+
+	if (write_all(s->fd, buf, len))
+		return -EPIPE;
+
+	/* Like FETCH: the encoded picture follows the line */
+	return ev->frame_size ? write_all(s->fd, frame, ev->frame_size) : 0;
+}
+
+static void text_release(struct subscriber *s)
+{
+	close(s->fd);
+	free(s);
+}
+
+int daemon_text_subscribe(struct daemon *d, int cli_fd, char *args)
+{
+	struct timeval timeout = {
+		.tv_sec = WATCH_SEND_TIMEOUT_MS / 1000,
+		.tv_usec = (WATCH_SEND_TIMEOUT_MS % 1000) * 1000,
+	};
+	struct subscriber *s;
+	char *tok, *end, *save = NULL;
+	unsigned long val;
+	int err;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	for (tok = strtok_r(args, " \t", &save); tok;
+	     tok = strtok_r(NULL, " \t", &save)) {
+		if (!strcmp(tok, "fb")) {
+			s->params.flags |= KMSGRAB_WATCH_FB;
+		} else if (!strcmp(tok, "content")) {
+			s->params.flags |= KMSGRAB_WATCH_CONTENT;
+		} else if (!strcmp(tok, "rects")) {
+			s->params.flags |= KMSGRAB_WATCH_CONTENT | KMSGRAB_WATCH_RECTS;
+		} else if (!strcmp(tok, "frame")) {
+			s->params.flags |= KMSGRAB_WATCH_FRAME;
+		} else if (!strncmp(tok, "interval=", 9) ||
+			   !strncmp(tok, "poll=", 5)) {
+			val = strtoul(strchr(tok, '=') + 1, &end, 10);
+			if (*end || end == strchr(tok, '=') + 1 || val > UINT32_MAX) {
+				err = -EINVAL;
+				goto err_free;
+			}
+
+			if (tok[0] == 'i')
+				s->params.min_interval_ms = (uint32_t)val;
+			else
+				s->params.poll_ms = (uint32_t)val;
+		} else {
+			err = -EINVAL;
+			goto err_free;
+		}
+	}
+
+	s->send = text_send;
+	s->release = text_release;
+	s->fd = cli_fd;
+	s->id = (uint32_t)cli_fd;
+
+	/* Don't let a client that stops reading hold the watcher back */
+	setsockopt(cli_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	err = daemon_subscribe(d, s);
+	if (err)
+		goto err_free;
+
+	return 0;
+
+err_free:
+	free(s);
+	return err;
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - square tiles of packed RGB888 pictures
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_TILES_H__
+#define __KMSGRAB_TILES_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static inline uint32_t tiles_across(uint32_t len, uint32_t size)
+{
+	return (len + size - 1) / size;
+}
+
+/* Position and size of the tile @index, the last ones being cut short. */
+static inline void tile_rect(uint32_t index, uint32_t width, uint32_t height,
+			     uint32_t size, uint32_t *x, uint32_t *y,
+			     uint32_t *w, uint32_t *h)
+{
+	uint32_t tiles_w = tiles_across(width, size);
+
+	*x = index % tiles_w * size;
+	*y = index / tiles_w * size;
+	*w = width - *x < size ? width - *x : size;
+	*h = height - *y < size ? height - *y : size;
+}
+
+static inline int tile_changed(const uint8_t *a, const uint8_t *b,
+			       size_t stride, uint32_t w, uint32_t h)
+{
+	for (; h; h--, a += stride, b += stride)
+		if (memcmp(a, b, (size_t)w * 3))
+			return 1;
+
+	return 0;
+}
+
+#endif /* __KMSGRAB_TILES_H__ */
@@ -0,0 +1,580 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - timelapse archives
+ *
+ * For long recordings, where one picture per frame costs disk space and CPU
+ * time for every frame, even when nothing moves: each frame is diffed by
+ * tiles against the previous one, and only the tiles that changed are
+ * encoded, stacked into one small picture. A keyframe with the whole frame
+ * is written every keyframe_ms, so that any frame can be rebuilt from the
+ * last keyframe before it, found with the index, without decoding the whole
+ * archive. A static screen then costs a pass of memcmp() and a few dozen
+ * bytes per frame.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "core.h"
+#include "tiles.h"
+#include "timelapse.h"
+
+static int index_path(char *buf, size_t len, const char *fn)
+{
+	if (snprintf(buf, len, "%s.idx", fn) >= (int)len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+int timelapse_open(struct timelapse *tl, const char *fn,
+		   const struct kmsgrab_encoder *enc, const char *format,
+		   const struct kmsgrab_encode_opts *opts,
+		   unsigned int keyframe_ms)
+{
+	struct tl_header hdr = {
+		.magic = htole32(TIMELAPSE_MAGIC),
+		.version = htole32(TIMELAPSE_VERSION),
+		.tile_size = htole32(TIMELAPSE_TILE_SIZE),
+	};
+	char idx[PATH_MAX];
+	int err;
+
+	memset(tl, 0, sizeof(*tl));
+	tl->enc = enc;
+	tl->format = format;
+	tl->opts = *opts;
+	tl->keyframe_ms = keyframe_ms;
+
+	err = index_path(idx, sizeof(idx), fn);
+	if (err)
+		return err;
+
+	tl->file = fopen(fn, "w");
+	if (!tl->file)
+		return -errno;
+
+	tl->index = fopen(idx, "w");
+	if (!tl->index) {
+		err = -errno;
+		fclose(tl->file);
+		return err;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, tl->file) != 1) {
+		timelapse_close(tl);
+		return -EIO;
+	}
+
+	tl->offset = sizeof(hdr);
+	return 0;
+}
+
+int timelapse_close(struct timelapse *tl)
+{
+	int ret = 0;
+
+	if (fclose(tl->file))
+		ret = -errno;
+	if (fclose(tl->index) && !ret)
+		ret = -errno;
+
+	free(tl->last);
+	tl->last = NULL;
+
+	return ret;
+}
+
+static int encode_picture(const struct timelapse *tl, const uint8_t *pixels,
+			  uint32_t width, uint32_t height,
+			  char **buf, size_t *size)
+{
+	struct kmsgrab_image img = {
+		.pixels = pixels,
+		.width = width,
+		.height = height,
+		.stride = (size_t)width * 3,
+	};
+	FILE *file;
+	int err;
+
+	file = open_memstream(buf, size);
+	if (!file)
+		return -errno;
+
+	err = tl->enc->write(file, &img, &tl->opts);
+
+	if (fclose(file) && !err)
+		err = -errno;
+	if (err) {
+		free(*buf);
+		*buf = NULL;
+		*size = 0;
+	}
+
+	return err;
+}
+
+static int64_t elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (int64_t)(to->tv_sec - from->tv_sec) * 1000 +
+		(to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/*
+ * Stack the tiles of @frame that differ from the previous frame into a
+ * column of @nb full tiles, and update the previous frame with them.
+ */
+static int diff_tiles(struct timelapse *tl, const struct frame *frame,
+		      uint32_t **changed, uint32_t *nb, uint8_t **column)
+{
+	uint32_t nb_tiles, i, x, y, w, h;
+	size_t stride = (size_t)frame->width * 3, offset;
+	const size_t tile_line = TIMELAPSE_TILE_SIZE * 3;
+	const uint8_t *src;
+	uint8_t *dst, *last;
+
+	nb_tiles = tiles_across(frame->width, TIMELAPSE_TILE_SIZE) *
+		tiles_across(frame->height, TIMELAPSE_TILE_SIZE);
+
+	*changed = malloc(nb_tiles * sizeof(**changed));
+	if (!*changed)
+		return -ENOMEM;
+
+	for (*nb = 0, i = 0; i < nb_tiles; i++) {
+		tile_rect(i, frame->width, frame->height, TIMELAPSE_TILE_SIZE,
+			  &x, &y, &w, &h);
+		offset = y * stride + x * 3;
+
+		if (tile_changed(frame->pixels + offset, tl->last + offset,
+				 stride, w, h))
+			(*changed)[(*nb)++] = i;
+	}
+
+	if (!*nb)
+		return 0;
+
+	/* Tiles cut short at the edges are padded with black */
+	*column = calloc((size_t)*nb * TIMELAPSE_TILE_SIZE, tile_line);
+	if (!*column)
+		return -ENOMEM;
+
+	for (i = 0; i < *nb; i++) {
+		tile_rect((*changed)[i], frame->width, frame->height,
+			  TIMELAPSE_TILE_SIZE, &x, &y, &w, &h);
+		offset = y * stride + x * 3;
+
+		src = frame->pixels + offset;
+		last = tl->last + offset;
+		dst = *column + (size_t)i * TIMELAPSE_TILE_SIZE * tile_line;
+
+		for (; h; h--, src += stride, last += stride, dst += tile_line) {
+			memcpy(dst, src, w * 3);
+			memcpy(last, src, w * 3);
+		}
+
+		(*changed)[i] = htole32((*changed)[i]);
+	}
+
+	return 0;
+}
+
+int timelapse_add(struct timelapse *tl, const struct frame *frame)
+{
+	size_t stride = (size_t)frame->width * 3, size = 0;
+	struct tl_record rec = { 0 };
+	struct tl_index_entry entry;
+	uint32_t nb = 0, *changed = NULL;
+	uint8_t *column = NULL, *last;
+	char *picture = NULL;
+	int64_t age;
+	int keyframe, err;
+
+	age = tl->last ? elapsed_ms(&tl->keyframe_time, &frame->timestamp) : 0;
+	keyframe = !tl->last || frame->width != tl->last_w ||
+		frame->height != tl->last_h ||
+		age < 0 || age >= tl->keyframe_ms;
+
+	if (keyframe) {
+		if (frame->width != tl->last_w || frame->height != tl->last_h) {
+			last = realloc(tl->last, stride * frame->height);
+			if (!last)
+				return -ENOMEM;
+
+			tl->last = last;
+			tl->last_w = frame->width;
+			tl->last_h = frame->height;
+		}
+
+		memcpy(tl->last, frame->pixels, stride * frame->height);
+
+		err = encode_picture(tl, frame->pixels, frame->width,
+				     frame->height, &picture, &size);
+	} else {
+		err = diff_tiles(tl, frame, &changed, &nb, &column);
+		if (!err && nb)
+			err = encode_picture(tl, column, TIMELAPSE_TILE_SIZE,
+					     nb * TIMELAPSE_TILE_SIZE,
+					     &picture, &size);
+	}
+
+	if (err)
+		goto out_free;
+
+	if (keyframe) {
+		tl->keyframe_offset = tl->offset;
+		tl->keyframe_time = frame->timestamp;
+	}
+
+	rec.magic = htole32(TIMELAPSE_RECORD_MAGIC);
+	rec.flags = htole32(keyframe ? TL_RECORD_KEYFRAME : 0);
+	rec.id = htole64(frame->id);
+	rec.tv_sec = htole64(frame->timestamp.tv_sec);
+	rec.tv_nsec = htole64(frame->timestamp.tv_nsec);
+	rec.width = htole32(frame->width);
+	rec.height = htole32(frame->height);
+	rec.nb_tiles = htole32(nb);
+	strncpy(rec.format, tl->format, sizeof(rec.format));
+	rec.size = htole64(size);
+
+	entry.tv_sec = rec.tv_sec;
+	entry.tv_nsec = rec.tv_nsec;
+	entry.offset = htole64(tl->offset);
+	entry.keyframe_offset = htole64(tl->keyframe_offset);
+
+	/* The index only points to records that were written entirely */
+	if (fwrite(&rec, sizeof(rec), 1, tl->file) != 1 ||
+	    (nb && fwrite(changed, sizeof(*changed), nb, tl->file) != nb) ||
+	    (size && fwrite(picture, 1, size, tl->file) != size) ||
+	    fflush(tl->file) ||
+	    fwrite(&entry, sizeof(entry), 1, tl->index) != 1 ||
+	    fflush(tl->index)) {
+		err = -EIO;
+		goto out_free;
+	}
+
+	tl->offset += sizeof(rec) + nb * sizeof(*changed) + size;
+
+	DBG("[debug] timelapse: frame %"PRIu64" %s, %"PRIu32" tiles, %zu bytes\n",
+	    frame->id, keyframe ? "keyframe" : "delta", nb, size);
+
+out_free:
+	/* The previous frame may be ahead of the archive; start over */
+	if (err) {
+		free(tl->last);
+		tl->last = NULL;
+		tl->last_w = tl->last_h = 0;
+	}
+
+	free(picture);
+	free(column);
+	free(changed);
+	return err;
+}
+
+static int read_index(const char *fn, struct tl_index_entry **entries,
+		      size_t *nb)
+{
+	struct tl_index_entry *e;
+	char idx[PATH_MAX];
+	struct stat st;
+	FILE *file;
+	size_t i;
+	int err;
+
+	err = index_path(idx, sizeof(idx), fn);
+	if (err)
+		return err;
+
+	file = fopen(idx, "r");
+	if (!file)
+		return -errno;
+
+	if (fstat(fileno(file), &st)) {
+		err = -errno;
+		fclose(file);
+		return err;
+	}
+
+	/* An entry cut short by a crash is ignored */
+	*nb = st.st_size / sizeof(*e);
+	if (!*nb) {
+		fclose(file);
+		return -ENOENT;
+	}
+
+	e = malloc(*nb * sizeof(*e));
+	if (!e) {
+		fclose(file);
+		return -ENOMEM;
+	}
+
+	if (fread(e, sizeof(*e), *nb, file) != *nb) {
+		free(e);
+		fclose(file);
+		return -EIO;
+	}
+
+	fclose(file);
+
+	for (i = 0; i < *nb; i++) {
+		e[i].tv_sec = le64toh(e[i].tv_sec);
+		e[i].tv_nsec = le64toh(e[i].tv_nsec);
+		e[i].offset = le64toh(e[i].offset);
+		e[i].keyframe_offset = le64toh(e[i].keyframe_offset);
+	}
+
+	*entries = e;
+	return 0;
+}
+
+int timelapse_span(const char *fn, struct timespec *first,
+		   struct timespec *last)
+{
+	struct tl_index_entry *entries;
+	size_t nb;
+	int err;
+
+	err = read_index(fn, &entries, &nb);
+	if (err)
+		return err;
+
+	first->tv_sec = entries[0].tv_sec;
+	first->tv_nsec = entries[0].tv_nsec;
+	last->tv_sec = entries[nb - 1].tv_sec;
+	last->tv_nsec = entries[nb - 1].tv_nsec;
+
+	free(entries);
+	return 0;
+}
+
+static int decode_picture(const struct tl_record *rec, char *buf,
+			  uint8_t **pixels, uint32_t *width, uint32_t *height)
+{
+	const struct kmsgrab_encoder *enc;
+	char format[sizeof(rec->format) + 1];
+	FILE *file;
+	int err;
+
+	memcpy(format, rec->format, sizeof(rec->format));
+	format[sizeof(rec->format)] = '\0';
+
+	enc = get_encoder(format);
+	if (!enc || !enc->read)
+		return -ENOTSUP;
+
+	file = fmemopen(buf, rec->size, "r");
+	if (!file)
+		return -errno;
+
+	err = enc->read(file, pixels, width, height);
+	fclose(file);
+
+	return err;
+}
+
+/* Read the record at the current position, and decode its picture. */
+static int read_record(FILE *file, struct tl_record *rec, uint32_t **tiles,
+		       uint8_t **pixels, uint32_t *width, uint32_t *height)
+{
+	uint32_t i, nb_tiles;
+	int err = -EINVAL, has_picture;
+	char *buf = NULL;
+
+	*tiles = NULL;
+	*pixels = NULL;
+
+	if (fread(rec, sizeof(*rec), 1, file) != 1)
+		return -EIO;
+
+	rec->flags = le32toh(rec->flags);
+	rec->id = le64toh(rec->id);
+	rec->tv_sec = le64toh(rec->tv_sec);
+	rec->tv_nsec = le64toh(rec->tv_nsec);
+	rec->width = le32toh(rec->width);
+	rec->height = le32toh(rec->height);
+	rec->nb_tiles = le32toh(rec->nb_tiles);
+	rec->size = le64toh(rec->size);
+
+	nb_tiles = tiles_across(rec->width, TIMELAPSE_TILE_SIZE) *
+		tiles_across(rec->height, TIMELAPSE_TILE_SIZE);
+
+	/* Only keyframes and frames with changed tiles have a picture */
+	has_picture = (rec->flags & TL_RECORD_KEYFRAME) || rec->nb_tiles;
+
+	if (le32toh(rec->magic) != TIMELAPSE_RECORD_MAGIC ||
+	    rec->nb_tiles > nb_tiles || (rec->size != 0) != has_picture ||
+	    rec->size > ((uint64_t)rec->width * rec->height * 3 + 4096) * 2)
+		return -EINVAL;
+
+	*tiles = malloc(rec->nb_tiles * sizeof(**tiles) + 1);
+	buf = malloc(rec->size + 1);
+	if (!*tiles || !buf) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	if (fread(*tiles, sizeof(**tiles), rec->nb_tiles, file) != rec->nb_tiles ||
+	    fread(buf, 1, rec->size, file) != rec->size) {
+		err = -EIO;
+		goto out_free;
+	}
+
+	for (i = 0; i < rec->nb_tiles; i++) {
+		(*tiles)[i] = le32toh((*tiles)[i]);
+		if ((*tiles)[i] >= nb_tiles)
+			goto out_free;
+	}
+
+	if (rec->size) {
+		err = decode_picture(rec, buf, pixels, width, height);
+		if (err)
+			goto out_free;
+	}
+
+	free(buf);
+	return 0;
+
+out_free:
+	free(buf);
+	free(*tiles);
+	*tiles = NULL;
+	return err;
+}
+
+/* Copy the column of tiles of a record over the frame it applies to. */
+static int apply_tiles(struct frame *frame, const uint32_t *tiles,
+		       uint32_t nb, const uint8_t *column,
+		       uint32_t width, uint32_t height)
+{
+	size_t stride = (size_t)frame->width * 3;
+	const size_t tile_line = TIMELAPSE_TILE_SIZE * 3;
+	uint32_t i, x, y, w, h;
+	const uint8_t *src;
+	uint8_t *dst;
+
+	if (width != TIMELAPSE_TILE_SIZE ||
+	    height != nb * TIMELAPSE_TILE_SIZE)
+		return -EINVAL;
+
+	for (i = 0; i < nb; i++) {
+		tile_rect(tiles[i], frame->width, frame->height,
+			  TIMELAPSE_TILE_SIZE, &x, &y, &w, &h);
+
+		src = column + (size_t)i * TIMELAPSE_TILE_SIZE * tile_line;
+		dst = frame->pixels + y * stride + x * 3;
+
+		for (; h; h--, src += tile_line, dst += stride)
+			memcpy(dst, src, w * 3);
+	}
+
+	return 0;
+}
+
+int timelapse_extract(const char *fn, const struct timespec *at,
+		      struct frame *frame)
+{
+	struct tl_index_entry *entries, *target;
+	uint32_t *tiles, width, height;
+	size_t nb, lo, hi, mid;
+	struct tl_header hdr;
+	struct tl_record rec;
+	uint8_t *pixels;
+	FILE *file;
+	off_t offset;
+	int err;
+
+	err = read_index(fn, &entries, &nb);
+	if (err)
+		return err;
+
+	/* Look for the first frame after @at; the one before is the target */
+	for (lo = 0, hi = nb; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+
+		if (entries[mid].tv_sec > at->tv_sec ||
+		    (entries[mid].tv_sec == at->tv_sec &&
+		     entries[mid].tv_nsec > at->tv_nsec))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	target = &entries[lo ? lo - 1 : 0];
+
+	file = fopen(fn, "r");
+	if (!file) {
+		err = -errno;
+		goto out_free_entries;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1 ||
+	    le32toh(hdr.magic) != TIMELAPSE_MAGIC ||
+	    le32toh(hdr.version) != TIMELAPSE_VERSION ||
+	    le32toh(hdr.tile_size) != TIMELAPSE_TILE_SIZE) {
+		err = -EINVAL;
+		goto out_close;
+	}
+
+	if (fseeko(file, target->keyframe_offset, SEEK_SET)) {
+		err = -errno;
+		goto out_close;
+	}
+
+	DBG("[debug] timelapse: frame at %"PRIu64", from the keyframe at %"PRIu64"\n",
+	    target->offset, target->keyframe_offset);
+
+	frame->pixels = NULL;
+
+	do {
+		offset = ftello(file);
+
+		err = read_record(file, &rec, &tiles, &pixels, &width, &height);
+		if (err)
+			break;
+
+		if (rec.flags & TL_RECORD_KEYFRAME) {
+			if (width != rec.width || height != rec.height) {
+				err = -EINVAL;
+			} else {
+				free(frame->pixels);
+				frame->pixels = pixels;
+				frame->width = width;
+				frame->height = height;
+				pixels = NULL;
+			}
+		} else if (!frame->pixels || rec.width != frame->width ||
+			   rec.height != frame->height) {
+			/* Deltas only follow their keyframe */
+			err = -EINVAL;
+		} else if (rec.nb_tiles) {
+			err = apply_tiles(frame, tiles, rec.nb_tiles, pixels,
+					  width, height);
+		}
+
+		frame->id = rec.id;
+		frame->timestamp.tv_sec = rec.tv_sec;
+		frame->timestamp.tv_nsec = rec.tv_nsec;
+
+		free(pixels);
+		free(tiles);
+	} while (!err && (uint64_t)offset < target->offset);
+
+	if (err) {
+		free(frame->pixels);
+		frame->pixels = NULL;
+	}
+
+out_close:
+	fclose(file);
+out_free_entries:
+	free(entries);
+	return err;
+}
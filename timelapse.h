@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - timelapse archives
+ *
+ * An archive starts with a struct tl_header, followed by one record per
+ * frame: a struct tl_record, then for the frames that are not keyframes,
+ * the indices (uint32_t) of the tiles that changed since the previous frame,
+ * then a picture in the record's file format: the whole frame for keyframes,
+ * or the changed tiles stacked in a column, each padded to a full tile.
+ * Frames without changes have no picture at all.
+ *
+ * The index, "<archive>.idx", holds one struct tl_index_entry per record, in
+ * order, so that the frame at any time is found with a binary search. All
+ * the fields are little-endian.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_TIMELAPSE_H__
+#define __KMSGRAB_TIMELAPSE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "kmsgrab.h"
+#include "pipeline.h"
+
+#define TIMELAPSE_MAGIC		0x414c544b /* "KTLA" */
+#define TIMELAPSE_RECORD_MAGIC	0x464c544b /* "KTLF" */
+#define TIMELAPSE_VERSION	1
+
+#define TIMELAPSE_TILE_SIZE	32
+
+/* Default period of the keyframes, which bounds the cost of a seek */
+#define TIMELAPSE_KEYFRAME_MS	60000
+
+#define TL_RECORD_KEYFRAME	(1 << 0)
+
+struct tl_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t tile_size;
+	uint32_t reserved;
+};
+
+struct tl_record {
+	uint32_t magic;
+	uint32_t flags;
+	uint64_t id;
+	int64_t tv_sec, tv_nsec;
+	uint32_t width, height;
+	uint32_t nb_tiles;
+
+	/* Extension of the file format of the picture, e.g. ".kraw" */
+	char format[8];
+	uint32_t reserved;
+	uint64_t size;
+};
+
+struct tl_index_entry {
+	int64_t tv_sec, tv_nsec;
+	uint64_t offset;
+	uint64_t keyframe_offset;
+};
+
+struct timelapse {
+	FILE *file, *index;
+	uint64_t offset;
+
+	/* Encoder of the pictures, and the extension it is found by */
+	const struct kmsgrab_encoder *enc;
+	const char *format;
+	struct kmsgrab_encode_opts opts;
+
+	unsigned int keyframe_ms;
+	uint64_t keyframe_offset;
+	struct timespec keyframe_time;
+
+	/* Previous frame, to diff against */
+	uint8_t *last;
+	uint32_t last_w, last_h;
+};
+
+/*
+ * Create the archive @fn and its index, whose pictures are written with
+ * @enc, found by the extension @format.
+ */
+int timelapse_open(struct timelapse *tl, const char *fn,
+		   const struct kmsgrab_encoder *enc, const char *format,
+		   const struct kmsgrab_encode_opts *opts,
+		   unsigned int keyframe_ms);
+int timelapse_close(struct timelapse *tl);
+
+/* Append @frame, as a keyframe or as the tiles that changed. */
+int timelapse_add(struct timelapse *tl, const struct frame *frame);
+
+/*
+ * Rebuild the last frame captured at or before @at (or the first one, if
+ * they are all later), from its keyframe. The pixels are allocated for
+ * @frame, which is to be freed by the caller.
+ */
+int timelapse_extract(const char *fn, const struct timespec *at,
+		      struct frame *frame);
+
+/* Time of the first and last frames of the archive @fn. */
+int timelapse_span(const char *fn, struct timespec *first,
+		   struct timespec *last);
+
+#endif /* __KMSGRAB_TIMELAPSE_H__ */
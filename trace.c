@@ -0,0 +1,163 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - capture traces
+ *
+ * Records what the captures read from the framebuffer, with everything the
+ * conversion depends on, so that the frames of a field system can be
+ * replayed through the same conversion, scaling and encoding anywhere.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+int trace_create(struct trace *t, const char *fn)
+{
+	struct trace_header hdr = {
+		.magic = htole32(TRACE_MAGIC),
+		.version = htole32(TRACE_VERSION),
+	};
+
+	memset(t, 0, sizeof(*t));
+
+	t->file = fopen(fn, "w");
+	if (!t->file)
+		return -errno;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, t->file) != 1 || fflush(t->file)) {
+		fclose(t->file);
+		return -EIO;
+	}
+
+	pthread_mutex_init(&t->lock, NULL);
+	return 0;
+}
+
+int trace_add(struct trace *t, const struct trace_record *rec,
+	      const struct trace_prop *props, const void *data)
+{
+	struct trace_prop le_props[TRACE_MAX_PROPS];
+	struct trace_record le = *rec;
+	unsigned int i;
+	int err = 0;
+
+	if (rec->nb_props > TRACE_MAX_PROPS)
+		return -EINVAL;
+
+	le.magic = htole32(TRACE_RECORD_MAGIC);
+	le.nb_props = htole32(rec->nb_props);
+	le.tv_sec = htole64(rec->tv_sec);
+	le.tv_nsec = htole64(rec->tv_nsec);
+	le.width = htole32(rec->width);
+	le.height = htole32(rec->height);
+	le.pixel_format = htole32(rec->pixel_format);
+	le.flags = htole32(rec->flags);
+	le.modifier = htole64(rec->modifier);
+	for (i = 0; i < 4; i++) {
+		le.pitches[i] = htole32(rec->pitches[i]);
+		le.offsets[i] = htole32(rec->offsets[i]);
+	}
+	le.bpp = htole32(rec->bpp);
+	le.depth = htole32(rec->depth);
+	le.rotation = htole32(rec->rotation);
+	le.size = htole64(rec->size);
+
+	for (i = 0; i < rec->nb_props; i++) {
+		le_props[i] = props[i];
+		le_props[i].value = htole64(props[i].value);
+	}
+
+	pthread_mutex_lock(&t->lock);
+
+	if (fwrite(&le, sizeof(le), 1, t->file) != 1 ||
+	    (rec->nb_props && fwrite(le_props, sizeof(*le_props),
+				     rec->nb_props, t->file) != rec->nb_props) ||
+	    (rec->size && fwrite(data, rec->size, 1, t->file) != 1) ||
+	    fflush(t->file))
+		err = -EIO;
+
+	pthread_mutex_unlock(&t->lock);
+
+	return err;
+}
+
+int trace_open(const char *fn, FILE **file)
+{
+	struct trace_header hdr;
+
+	*file = fopen(fn, "r");
+	if (!*file)
+		return -errno;
+
+	if (fread(&hdr, sizeof(hdr), 1, *file) != 1 ||
+	    le32toh(hdr.magic) != TRACE_MAGIC ||
+	    le32toh(hdr.version) != TRACE_VERSION) {
+		fclose(*file);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int trace_next(FILE *file, struct trace_record *rec, struct trace_prop *props,
+	       uint8_t **data, size_t *capacity)
+{
+	unsigned int i;
+	uint8_t *buf;
+	size_t len;
+
+	/* A record cut short, by a crash of the recording, is an error */
+	len = fread(rec, 1, sizeof(*rec), file);
+	if (len != sizeof(*rec))
+		return !len && feof(file) ? -ENOENT : -EIO;
+
+	rec->nb_props = le32toh(rec->nb_props);
+	rec->tv_sec = le64toh(rec->tv_sec);
+	rec->tv_nsec = le64toh(rec->tv_nsec);
+	rec->width = le32toh(rec->width);
+	rec->height = le32toh(rec->height);
+	rec->pixel_format = le32toh(rec->pixel_format);
+	rec->flags = le32toh(rec->flags);
+	rec->modifier = le64toh(rec->modifier);
+	for (i = 0; i < 4; i++) {
+		rec->pitches[i] = le32toh(rec->pitches[i]);
+		rec->offsets[i] = le32toh(rec->offsets[i]);
+	}
+	rec->bpp = le32toh(rec->bpp);
+	rec->depth = le32toh(rec->depth);
+	rec->rotation = le32toh(rec->rotation);
+	rec->size = le64toh(rec->size);
+
+	/* Nothing scans out more than 16384 lines of 64 KiB */
+	if (le32toh(rec->magic) != TRACE_RECORD_MAGIC ||
+	    rec->nb_props > TRACE_MAX_PROPS || rec->size > (1ull << 30))
+		return -EINVAL;
+
+	if (rec->nb_props &&
+	    fread(props, sizeof(*props), rec->nb_props, file) != rec->nb_props)
+		return -EIO;
+
+	for (i = 0; i < rec->nb_props; i++) {
+		props[i].name[sizeof(props[i].name) - 1] = '\0';
+		props[i].value = le64toh(props[i].value);
+	}
+
+	if (rec->size > *capacity) {
+		buf = realloc(*data, rec->size);
+		if (!buf)
+			return -ENOMEM;
+
+		*data = buf;
+		*capacity = rec->size;
+	}
+
+	if (rec->size && fread(*data, rec->size, 1, file) != 1)
+		return -EIO;
+
+	return 0;
+}
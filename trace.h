@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KMS/DRM screenshot tool - capture traces
+ *
+ * A trace starts with a struct trace_header, followed by one record per
+ * capture: a struct trace_record, its nb_props plane properties (struct
+ * trace_prop), then the @size bytes of the framebuffer mapping as they were
+ * read, pitch padding included. All the fields are little-endian.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#ifndef __KMSGRAB_TRACE_H__
+#define __KMSGRAB_TRACE_H__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC		0x4352544b /* "KTRC" */
+#define TRACE_RECORD_MAGIC	0x4652544b /* "KTRF" */
+#define TRACE_VERSION		1
+
+#define TRACE_MAX_PROPS		32
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t reserved[2];
+};
+
+struct trace_prop {
+	char name[32];
+	uint64_t value;
+};
+
+struct trace_record {
+	uint32_t magic;
+	uint32_t nb_props;
+
+	/* CLOCK_MONOTONIC time of the readback, to pace the replay */
+	int64_t tv_sec, tv_nsec;
+
+	/* From drmModeGetFB2(); pixel_format is 0 if it was not available */
+	uint32_t width, height;
+	uint32_t pixel_format;
+	uint32_t flags;
+	uint64_t modifier;
+	uint32_t pitches[4];
+	uint32_t offsets[4];
+
+	/* From drmModeGetFB(), which the conversion goes by */
+	uint32_t bpp, depth;
+
+	/* Rotation the picture was captured with, also among the properties */
+	uint32_t rotation;
+	uint32_t reserved;
+
+	uint64_t size;
+};
+
+struct trace {
+	pthread_mutex_t lock;
+	FILE *file;
+};
+
+/*
+ * Create the trace @fn, which captures from any thread can be added to. It
+ * is flushed after each capture, and left for the exit to close.
+ */
+int trace_create(struct trace *t, const char *fn);
+
+/* Append a capture, and flush it so that the trace survives a crash. */
+int trace_add(struct trace *t, const struct trace_record *rec,
+	      const struct trace_prop *props, const void *data);
+
+/* Open the trace @fn for reading, and check its header. */
+int trace_open(const char *fn, FILE **file);
+
+/*
+ * Read the next capture of a trace into @rec, @props (of TRACE_MAX_PROPS
+ * entries) and @data, which is grown as needed up to @capacity bytes.
+ * Returns -ENOENT at the end of the trace.
+ */
+int trace_next(FILE *file, struct trace_record *rec, struct trace_prop *props,
+	       uint8_t **data, size_t *capacity);
+
+#endif /* __KMSGRAB_TRACE_H__ */
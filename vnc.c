@@ -0,0 +1,1394 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KMS/DRM screenshot tool - VNC server
+ *
+ * Serves the screen over RFB (versions 3.3 to 3.8), view only, so that
+ * remote support tools work on systems without fbdev. Each client gets a
+ * thread, which captures through the daemon whenever the client waits for
+ * an update, at most every vnc_interval_ms. The frame is compared by tiles
+ * with the last picture sent to that client, on the capturing thread, and
+ * only the tiles that changed are copied, then sent as runs of tiles in the
+ * first of Raw, ZRLE or Tight that the client asked for. A static screen
+ * costs one pass of memcmp() per capture, and nothing on the wire.
+ *
+ * The server listens on a UNIX socket with the owner and mode of the IPC
+ * socket, so that only the users who may already request captures can
+ * connect, without authentication; remote clients come through SSH tunnels.
+ * TCP, on the loopback interface, is opt-in and requires the password of
+ * RFB's VNC authentication, which only resists casual local users.
+ *
+ * Copyright (c) 2021 Paul Cercueil <paul@crapouillou.net>
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "daemon.h"
+#include "des.h"
+#include "tiles.h"
+
+/* Also the size of the tiles of ZRLE, so that they line up */
+#define VNC_TILE_SIZE		64
+
+#define VNC_NAME		"kmsgrab"
+#define VNC_ZLIB_LEVEL		1
+
+/* Tight rectangles are at most this wide */
+#define VNC_TIGHT_MAX_WIDTH	2048
+
+/* Tight data shorter than this is sent uncompressed */
+#define VNC_TIGHT_MIN_SIZE	12
+
+enum vnc_encoding {
+	VNC_ENC_RAW		= 0,
+	VNC_ENC_TIGHT		= 7,
+	VNC_ENC_ZRLE		= 16,
+	VNC_ENC_JPEG_QUALITY_0	= -32,
+	VNC_ENC_JPEG_QUALITY_9	= -23,
+	VNC_ENC_DESKTOP_SIZE	= -223,
+};
+
+enum vnc_message {
+	VNC_SET_PIXEL_FORMAT	= 0,
+	VNC_SET_ENCODINGS	= 2,
+	VNC_UPDATE_REQUEST	= 3,
+	VNC_KEY_EVENT		= 4,
+	VNC_POINTER_EVENT	= 5,
+	VNC_CLIENT_CUT_TEXT	= 6,
+};
+
+#define VNC_SECURITY_NONE	1
+#define VNC_SECURITY_VNC	2
+
+/* Longest password of the VNC authentication; the rest is ignored */
+#define VNC_PASSWORD_LEN	8
+
+/* Delay before a failed authentication is reported, against guessing */
+#define VNC_AUTH_DELAY_S	1
+
+#define VNC_TIGHT_FILL		0x80
+#define VNC_TIGHT_JPEG		0x90
+
+/* 32-bit little-endian BGRX, as sent in the ServerInit message */
+static const uint8_t vnc_default_format[16] = {
+	32, 24, 0, 1, 0, 255, 0, 255, 0, 255, 16, 8, 0,
+};
+
+/* JPEG quality of the Tight quality levels 0 to 9, as used by TigerVNC */
+static const uint8_t vnc_jpeg_quality[10] = {
+	15, 29, 41, 42, 62, 77, 79, 86, 92, 100,
+};
+
+struct vnc_server {
+	struct daemon *d;
+	int fd, tcp;
+
+	/* Clients must pass the VNC authentication if set */
+	int auth;
+	struct des_key key;
+
+	/* Encoder of the Tight JPEG rectangles, or NULL */
+	const struct kmsgrab_encoder *jpeg;
+};
+
+struct vnc_client {
+	struct vnc_server *srv;
+	int fd;
+
+	/* Pixel format of the client, as a lookup table per component */
+	uint32_t lut[3][256];
+	unsigned int bpp;
+	int big_endian;
+
+	/* Bytes of the pixels in ZRLE (CPIXEL), and where they start */
+	unsigned int cpixel_len, cpixel_off;
+
+	/* Pixels of Tight are sent as RGB888 with 24-bit formats (TPIXEL) */
+	int tight_rgb;
+
+	int encoding;
+	int jpeg_quality;
+	int desktop_size;
+
+	/* Last picture sent, and its tiles that changed since */
+	uint8_t *shadow;
+	uint8_t *dirty;
+	uint32_t width, height;
+	uint32_t tiles_w, tiles_h;
+	int resized;
+	int err;
+
+	/* Update requested, not sent yet; sent even without changes if forced */
+	int pending, force;
+	uint32_t req_x, req_y, req_w, req_h;
+
+	z_stream zrle, tight;
+
+	/* Message being built, and pixels before and after compression */
+	uint8_t *buf, *scratch, *zbuf;
+	size_t len, size, scratch_size, zbuf_size;
+};
+
+static uint16_t get_be16(const uint8_t *p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		(uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_be16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static int vnc_read(int fd, void *buf, size_t len)
+{
+	char *ptr = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = read(fd, ptr, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret ? -errno : -EPIPE;
+
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int vnc_grow(uint8_t **buf, size_t *size, size_t len)
+{
+	uint8_t *ptr;
+
+	if (len <= *size)
+		return 0;
+
+	ptr = realloc(*buf, len);
+	if (!ptr)
+		return -ENOMEM;
+
+	*buf = ptr;
+	*size = len;
+	return 0;
+}
+
+/* Make room for @len bytes at the end of the message. */
+static uint8_t *vnc_reserve(struct vnc_client *c, size_t len)
+{
+	size_t size = c->size ? c->size : 65536;
+	uint8_t *ptr;
+
+	while (size < c->len + len)
+		size *= 2;
+
+	if (vnc_grow(&c->buf, &c->size, size))
+		return NULL;
+
+	ptr = c->buf + c->len;
+	c->len += len;
+	return ptr;
+}
+
+static int vnc_put(struct vnc_client *c, const void *data, size_t len)
+{
+	uint8_t *ptr = vnc_reserve(c, len);
+
+	if (!ptr)
+		return -ENOMEM;
+
+	memcpy(ptr, data, len);
+	return 0;
+}
+
+static int vnc_set_format(struct vnc_client *c, const uint8_t *fmt)
+{
+	unsigned int i, v, max[3], shift[3];
+	uint32_t mask = 0;
+
+	/* Color maps are not supported */
+	if (!fmt[3] || (fmt[0] != 8 && fmt[0] != 16 && fmt[0] != 32))
+		return -EPROTO;
+
+	for (i = 0; i < 3; i++) {
+		max[i] = get_be16(fmt + 4 + 2 * i);
+		shift[i] = fmt[10 + i];
+		if (!max[i] || shift[i] >= fmt[0])
+			return -EPROTO;
+
+		for (v = 0; v < 256; v++)
+			c->lut[i][v] = (v * max[i] + 127) / 255 << shift[i];
+
+		mask |= c->lut[i][255];
+	}
+
+	c->bpp = fmt[0] / 8;
+	c->big_endian = fmt[2];
+
+	/* 32-bit pixels of up to 24 bits are sent as their 3 useful bytes */
+	c->cpixel_len = c->bpp;
+	c->cpixel_off = 0;
+	if (c->bpp == 4 && fmt[1] <= 24) {
+		if (!(mask & 0xff000000)) {
+			c->cpixel_len = 3;
+			c->cpixel_off = c->big_endian;
+		} else if (!(mask & 0xff)) {
+			c->cpixel_len = 3;
+			c->cpixel_off = !c->big_endian;
+		}
+	}
+
+	c->tight_rgb = c->bpp == 4 && fmt[1] == 24 &&
+		max[0] == 255 && max[1] == 255 && max[2] == 255;
+
+	DBG("[debug] vnc: client %d: %u bpp, depth %u, max %u/%u/%u, "
+	    "shift %u/%u/%u\n", c->fd, fmt[0], fmt[1], max[0], max[1], max[2],
+	    shift[0], shift[1], shift[2]);
+
+	return 0;
+}
+
+static inline uint32_t vnc_pixel(const struct vnc_client *c, const uint8_t *rgb)
+{
+	return c->lut[0][rgb[0]] | c->lut[1][rgb[1]] | c->lut[2][rgb[2]];
+}
+
+/* Write @p as the bpp bytes of a pixel, in the client's byte order. */
+static inline void vnc_store(const struct vnc_client *c, uint8_t *dst,
+			     uint32_t p)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->bpp; i++) {
+		if (c->big_endian)
+			dst[c->bpp - 1 - i] = p >> (8 * i);
+		else
+			dst[i] = p >> (8 * i);
+	}
+}
+
+static inline void vnc_store_cpixel(const struct vnc_client *c, uint8_t *dst,
+				    uint32_t p)
+{
+	uint8_t buf[4];
+
+	vnc_store(c, buf, p);
+	memcpy(dst, buf + c->cpixel_off, c->cpixel_len);
+}
+
+static int vnc_resize(struct vnc_client *c, uint32_t width, uint32_t height)
+{
+	uint32_t tiles_w = tiles_across(width, VNC_TILE_SIZE);
+	uint32_t tiles_h = tiles_across(height, VNC_TILE_SIZE);
+	uint8_t *shadow, *dirty;
+
+	shadow = malloc((size_t)width * height * 3);
+	dirty = malloc((size_t)tiles_w * tiles_h);
+	if (!shadow || !dirty) {
+		free(shadow);
+		free(dirty);
+		return -ENOMEM;
+	}
+
+	free(c->shadow);
+	free(c->dirty);
+	c->shadow = shadow;
+	c->dirty = dirty;
+	c->width = width;
+	c->height = height;
+	c->tiles_w = tiles_w;
+	c->tiles_h = tiles_h;
+
+	return 0;
+}
+
+/* Called on the capturing thread, with the capture lock held. */
+static int vnc_inspect(const struct frame *frame, void *p)
+{
+	size_t stride = (size_t)frame->width * 3, offset;
+	uint32_t i, x, y, w, h;
+	struct vnc_client *c = p;
+	const uint8_t *src;
+	uint8_t *dst;
+
+	if (frame->width != c->width || frame->height != c->height) {
+		c->err = vnc_resize(c, frame->width, frame->height);
+		if (c->err)
+			return 0;
+
+		c->resized = 1;
+
+		memcpy(c->shadow, frame->pixels, stride * frame->height);
+		memset(c->dirty, 1, (size_t)c->tiles_w * c->tiles_h);
+		return 0;
+	}
+
+	for (i = 0; i < c->tiles_w * c->tiles_h; i++) {
+		tile_rect(i, frame->width, frame->height, VNC_TILE_SIZE,
+			  &x, &y, &w, &h);
+		offset = y * stride + x * 3;
+
+		if (!tile_changed(frame->pixels + offset, c->shadow + offset,
+				  stride, w, h))
+			continue;
+
+		c->dirty[i] = 1;
+
+		for (src = frame->pixels + offset, dst = c->shadow + offset; h;
+		     h--, src += stride, dst += stride)
+			memcpy(dst, src, w * 3);
+	}
+
+	return 0;
+}
+
+static int vnc_capture(struct vnc_client *c)
+{
+	struct grab_request req = {
+		.publish_only = 1,
+		.inspect = vnc_inspect,
+		.ctx = c,
+	};
+	struct timespec ts;
+	uint64_t id;
+	int err;
+
+	c->err = 0;
+
+	err = daemon_capture(c->srv->d, &req, &id, &ts);
+	if (err)
+		return err;
+
+	return c->err;
+}
+
+/* Compress @len bytes of the scratch buffer into the zlib buffer. */
+static int vnc_deflate(struct vnc_client *c, z_stream *zs, size_t len,
+		       size_t *out_len)
+{
+	size_t bound = deflateBound(zs, len) + 64;
+
+	if (vnc_grow(&c->zbuf, &c->zbuf_size, bound))
+		return -ENOMEM;
+
+	zs->next_in = c->scratch;
+	zs->avail_in = len;
+	zs->next_out = c->zbuf;
+	zs->avail_out = bound;
+
+	/* The stream goes on over the whole connection */
+	if (deflate(zs, Z_SYNC_FLUSH) != Z_OK || zs->avail_in)
+		return -EIO;
+
+	*out_len = bound - zs->avail_out;
+	return 0;
+}
+
+static int vnc_put_raw(struct vnc_client *c, uint32_t x, uint32_t y,
+		       uint32_t w, uint32_t h)
+{
+	size_t stride = (size_t)c->width * 3;
+	const uint8_t *src;
+	uint8_t *dst;
+	uint32_t i;
+
+	dst = vnc_reserve(c, (size_t)w * h * c->bpp);
+	if (!dst)
+		return -ENOMEM;
+
+	for (src = c->shadow + y * stride + x * 3; h; h--, src += stride)
+		for (i = 0; i < w; i++, dst += c->bpp)
+			vnc_store(c, dst, vnc_pixel(c, src + i * 3));
+
+	return 0;
+}
+
+/*
+ * Encode one ZRLE tile: solid, with a packed palette of up to 16 colors, or
+ * raw. Returns the number of bytes written.
+ */
+static size_t zrle_tile(const struct vnc_client *c, uint8_t *dst,
+			const uint8_t *src, size_t stride, uint32_t w, uint32_t h)
+{
+	uint8_t index[VNC_TILE_SIZE * VNC_TILE_SIZE], byte, *ptr = dst + 1;
+	unsigned int nb = 0, bits, nb_bits, i;
+	uint32_t palette[16], pixel;
+	uint32_t x, y;
+
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			pixel = vnc_pixel(c, src + y * stride + x * 3);
+
+			for (i = 0; i < nb && palette[i] != pixel; i++);
+			if (i == nb) {
+				if (nb == 16)
+					goto out_raw;
+				palette[nb++] = pixel;
+			}
+
+			index[y * w + x] = i;
+		}
+	}
+
+	dst[0] = nb;
+	for (i = 0; i < nb; i++, ptr += c->cpixel_len)
+		vnc_store_cpixel(c, ptr, palette[i]);
+
+	if (nb == 1)
+		return ptr - dst;
+
+	bits = nb <= 2 ? 1 : nb <= 4 ? 2 : 4;
+
+	/* Each row of indices starts on a new byte */
+	for (y = 0; y < h; y++) {
+		for (byte = 0, nb_bits = 0, x = 0; x < w; x++) {
+			byte = byte << bits | index[y * w + x];
+			nb_bits += bits;
+
+			if (nb_bits == 8) {
+				*ptr++ = byte;
+				byte = 0;
+				nb_bits = 0;
+			}
+		}
+
+		if (nb_bits)
+			*ptr++ = byte << (8 - nb_bits);
+	}
+
+	return ptr - dst;
+
+out_raw:
+	dst[0] = 0;
+	for (y = 0; y < h; y++)
+		for (x = 0; x < w; x++, ptr += c->cpixel_len)
+			vnc_store_cpixel(c, ptr, vnc_pixel(c, src + y * stride + x * 3));
+
+	return ptr - dst;
+}
+
+static int vnc_put_zrle(struct vnc_client *c, uint32_t x, uint32_t y,
+			uint32_t w, uint32_t h)
+{
+	size_t stride = (size_t)c->width * 3, len = 0, zlen;
+	uint32_t tx, ty, tw, th;
+	uint8_t hdr[4];
+	int err;
+
+	err = vnc_grow(&c->scratch, &c->scratch_size,
+		       (size_t)tiles_across(w, VNC_TILE_SIZE) *
+		       tiles_across(h, VNC_TILE_SIZE) *
+		       (1 + VNC_TILE_SIZE * VNC_TILE_SIZE * c->cpixel_len));
+	if (err)
+		return err;
+
+	for (ty = y; ty < y + h; ty += VNC_TILE_SIZE) {
+		th = y + h - ty < VNC_TILE_SIZE ? y + h - ty : VNC_TILE_SIZE;
+
+		for (tx = x; tx < x + w; tx += VNC_TILE_SIZE) {
+			tw = x + w - tx < VNC_TILE_SIZE ? x + w - tx : VNC_TILE_SIZE;
+
+			len += zrle_tile(c, c->scratch + len,
+					 c->shadow + ty * stride + tx * 3,
+					 stride, tw, th);
+		}
+	}
+
+	err = vnc_deflate(c, &c->zrle, len, &zlen);
+	if (err)
+		return err;
+
+	put_be32(hdr, zlen);
+
+	err = vnc_put(c, hdr, sizeof(hdr));
+	if (!err)
+		err = vnc_put(c, c->zbuf, zlen);
+
+	return err;
+}
+
+/* Tight lengths take 1 to 3 bytes, 7 bits at a time. */
+static int vnc_put_compact(struct vnc_client *c, size_t len)
+{
+	uint8_t buf[3];
+	size_t nb = 0;
+
+	buf[nb++] = len & 0x7f;
+	if (len > 0x7f) {
+		buf[0] |= 0x80;
+		buf[nb++] = len >> 7 & 0x7f;
+
+		if (len > 0x3fff) {
+			buf[1] |= 0x80;
+			buf[nb++] = len >> 14;
+		}
+	}
+
+	return vnc_put(c, buf, nb);
+}
+
+static int vnc_is_solid(const struct vnc_client *c, uint32_t x, uint32_t y,
+			uint32_t w, uint32_t h)
+{
+	size_t stride = (size_t)c->width * 3;
+	const uint8_t *first = c->shadow + y * stride + x * 3, *line;
+	uint32_t i;
+
+	for (line = first; h; h--, line += stride)
+		for (i = 0; i < w; i++)
+			if (memcmp(line + i * 3, first, 3))
+				return 0;
+
+	return 1;
+}
+
+static int vnc_put_tight_jpeg(struct vnc_client *c, uint32_t x, uint32_t y,
+			      uint32_t w, uint32_t h)
+{
+	struct kmsgrab_encode_opts opts = c->srv->d->out->opts;
+	struct kmsgrab_image img = {
+		.pixels = c->shadow + y * (size_t)c->width * 3 + x * 3,
+		.width = w,
+		.height = h,
+		.stride = (size_t)c->width * 3,
+	};
+	uint8_t control = VNC_TIGHT_JPEG;
+	char *data = NULL;
+	size_t size = 0;
+	FILE *file;
+	int err;
+
+	/* Rectangles are small, and decoded as baseline JPEG by some clients */
+	opts.quality = vnc_jpeg_quality[c->jpeg_quality];
+	opts.target_size = 0;
+	opts.threads = 1;
+	opts.progressive = 0;
+
+	file = open_memstream(&data, &size);
+	if (!file)
+		return -errno;
+
+	err = c->srv->jpeg->write(file, &img, &opts);
+	if (fclose(file) && !err)
+		err = -errno;
+
+	if (!err)
+		err = vnc_put(c, &control, 1);
+	if (!err)
+		err = vnc_put_compact(c, size);
+	if (!err)
+		err = vnc_put(c, data, size);
+
+	free(data);
+	return err;
+}
+
+/*
+ * Tight: a fill for solid rectangles, JPEG if the client gave a quality
+ * level, otherwise the pixels compressed with zlib (stream 0, no filter).
+ */
+static int vnc_put_tight(struct vnc_client *c, uint32_t x, uint32_t y,
+			 uint32_t w, uint32_t h)
+{
+	size_t stride = (size_t)c->width * 3, tpixel, len, zlen;
+	uint8_t control, *dst;
+	const uint8_t *src;
+	uint32_t i;
+	int err;
+
+	tpixel = c->tight_rgb ? 3 : c->bpp;
+	src = c->shadow + y * stride + x * 3;
+
+	if (vnc_is_solid(c, x, y, w, h)) {
+		dst = vnc_reserve(c, 1 + tpixel);
+		if (!dst)
+			return -ENOMEM;
+
+		dst[0] = VNC_TIGHT_FILL;
+		if (c->tight_rgb)
+			memcpy(dst + 1, src, 3);
+		else
+			vnc_store(c, dst + 1, vnc_pixel(c, src));
+
+		return 0;
+	}
+
+	if (c->jpeg_quality >= 0 && c->srv->jpeg)
+		return vnc_put_tight_jpeg(c, x, y, w, h);
+
+	len = (size_t)w * h * tpixel;
+	err = vnc_grow(&c->scratch, &c->scratch_size, len);
+	if (err)
+		return err;
+
+	for (dst = c->scratch; h; h--, src += stride) {
+		if (c->tight_rgb) {
+			memcpy(dst, src, (size_t)w * 3);
+			dst += (size_t)w * 3;
+			continue;
+		}
+
+		for (i = 0; i < w; i++, dst += c->bpp)
+			vnc_store(c, dst, vnc_pixel(c, src + i * 3));
+	}
+
+	control = 0;
+	err = vnc_put(c, &control, 1);
+	if (err)
+		return err;
+
+	if (len < VNC_TIGHT_MIN_SIZE)
+		return vnc_put(c, c->scratch, len);
+
+	err = vnc_deflate(c, &c->tight, len, &zlen);
+	if (!err)
+		err = vnc_put_compact(c, zlen);
+	if (!err)
+		err = vnc_put(c, c->zbuf, zlen);
+
+	return err;
+}
+
+static int vnc_put_rect_header(struct vnc_client *c, uint32_t x, uint32_t y,
+			       uint32_t w, uint32_t h, int32_t encoding)
+{
+	uint8_t *hdr = vnc_reserve(c, 12);
+
+	if (!hdr)
+		return -ENOMEM;
+
+	put_be16(hdr, x);
+	put_be16(hdr + 2, y);
+	put_be16(hdr + 4, w);
+	put_be16(hdr + 6, h);
+	put_be32(hdr + 8, (uint32_t)encoding);
+
+	return 0;
+}
+
+/* Append the rectangles of a run of tiles. Returns how many, or an error. */
+static int vnc_put_rect(struct vnc_client *c, uint32_t x, uint32_t y,
+			uint32_t w, uint32_t h)
+{
+	uint32_t rw, max_w = c->encoding == VNC_ENC_TIGHT ?
+		VNC_TIGHT_MAX_WIDTH : w;
+	int err, nb = 0;
+
+	for (; w; x += rw, w -= rw, nb++) {
+		rw = w < max_w ? w : max_w;
+
+		err = vnc_put_rect_header(c, x, y, rw, h, c->encoding);
+		if (err)
+			return err;
+
+		switch (c->encoding) {
+		case VNC_ENC_ZRLE:
+			err = vnc_put_zrle(c, x, y, rw, h);
+			break;
+		case VNC_ENC_TIGHT:
+			err = vnc_put_tight(c, x, y, rw, h);
+			break;
+		default:
+			err = vnc_put_raw(c, x, y, rw, h);
+			break;
+		}
+
+		if (err)
+			return err;
+	}
+
+	return nb;
+}
+
+static uint32_t min_u32(uint32_t a, uint32_t b)
+{
+	return a < b ? a : b;
+}
+
+static uint32_t max_u32(uint32_t a, uint32_t b)
+{
+	return a > b ? a : b;
+}
+
+/*
+ * Send the tiles that changed within the requested area, one rectangle per
+ * run of tiles on a row. Tiles that are partly outside stay dirty.
+ */
+static int vnc_send_update(struct vnc_client *c)
+{
+	uint32_t tx, ty, end, i, x0, x1, y0, y1, nb = 0;
+	uint32_t req_x1 = c->req_x + c->req_w, req_y1 = c->req_y + c->req_h;
+	uint8_t *hdr, *dirty;
+	int ret;
+
+	c->len = 0;
+	hdr = vnc_reserve(c, 4);
+	if (!hdr)
+		return -ENOMEM;
+
+	if (c->resized) {
+		if (!c->desktop_size)
+			return -ENOTSUP;
+
+		/* The client asks for the new picture once it has resized */
+		ret = vnc_put_rect_header(c, 0, 0, c->width, c->height,
+					  VNC_ENC_DESKTOP_SIZE);
+		if (ret)
+			return ret;
+
+		nb = 1;
+		c->resized = 0;
+		goto out_send;
+	}
+
+	for (ty = 0; ty < c->tiles_h; ty++) {
+		y0 = max_u32(ty * VNC_TILE_SIZE, c->req_y);
+		y1 = min_u32(min_u32((ty + 1) * VNC_TILE_SIZE, c->height), req_y1);
+		if (y0 >= y1)
+			continue;
+
+		dirty = c->dirty + ty * c->tiles_w;
+
+		for (tx = 0; tx < c->tiles_w; tx = end) {
+			if (!dirty[tx]) {
+				end = tx + 1;
+				continue;
+			}
+
+			for (end = tx + 1; end < c->tiles_w && dirty[end]; end++);
+
+			x0 = max_u32(tx * VNC_TILE_SIZE, c->req_x);
+			x1 = min_u32(min_u32(end * VNC_TILE_SIZE, c->width), req_x1);
+			if (x0 >= x1)
+				continue;
+
+			for (i = tx; i < end; i++) {
+				if (i * VNC_TILE_SIZE >= c->req_x &&
+				    min_u32((i + 1) * VNC_TILE_SIZE, c->width) <= req_x1 &&
+				    ty * VNC_TILE_SIZE >= c->req_y &&
+				    min_u32((ty + 1) * VNC_TILE_SIZE, c->height) <= req_y1)
+					dirty[i] = 0;
+			}
+
+			ret = vnc_put_rect(c, x0, y0, x1 - x0, y1 - y0);
+			if (ret < 0)
+				return ret;
+
+			nb += ret;
+		}
+	}
+
+	if (!nb && !c->force)
+		return 0;
+
+out_send:
+	if (nb > UINT16_MAX)
+		return -E2BIG;
+
+	hdr = c->buf;
+	hdr[0] = 0;
+	hdr[1] = 0;
+	put_be16(hdr + 2, nb);
+
+	c->pending = 0;
+	c->force = 0;
+
+	return write_all(c->fd, c->buf, c->len);
+}
+
+static int vnc_set_encodings(struct vnc_client *c, unsigned int nb)
+{
+	uint8_t buf[4];
+	int32_t enc;
+	int err;
+
+	c->encoding = -1;
+	c->jpeg_quality = -1;
+	c->desktop_size = 0;
+
+	/* The client lists the encodings by order of preference */
+	for (; nb; nb--) {
+		err = vnc_read(c->fd, buf, sizeof(buf));
+		if (err)
+			return err;
+
+		enc = (int32_t)get_be32(buf);
+
+		if (c->encoding < 0 && (enc == VNC_ENC_RAW ||
+					enc == VNC_ENC_ZRLE ||
+					enc == VNC_ENC_TIGHT))
+			c->encoding = enc;
+		else if (enc >= VNC_ENC_JPEG_QUALITY_0 &&
+			 enc <= VNC_ENC_JPEG_QUALITY_9)
+			c->jpeg_quality = enc - VNC_ENC_JPEG_QUALITY_0;
+		else if (enc == VNC_ENC_DESKTOP_SIZE)
+			c->desktop_size = 1;
+	}
+
+	if (c->encoding < 0)
+		c->encoding = VNC_ENC_RAW;
+
+	DBG("[debug] vnc: client %d: encoding %d, JPEG quality %d%s\n",
+	    c->fd, c->encoding, c->jpeg_quality,
+	    c->desktop_size ? ", resizable" : "");
+
+	return 0;
+}
+
+static int vnc_request_update(struct vnc_client *c, const uint8_t *msg)
+{
+	uint32_t x = get_be16(msg + 1), y = get_be16(msg + 3);
+	uint32_t w = get_be16(msg + 5), h = get_be16(msg + 7);
+	uint32_t tx, ty;
+
+	c->pending = 1;
+	c->req_x = x;
+	c->req_y = y;
+	c->req_w = w;
+	c->req_h = h;
+
+	if (msg[0])
+		return 0;
+
+	/* Not incremental: the whole area is to be sent */
+	c->force = 1;
+
+	for (ty = y / VNC_TILE_SIZE; ty < c->tiles_h &&
+	     ty * VNC_TILE_SIZE < y + h; ty++)
+		for (tx = x / VNC_TILE_SIZE; tx < c->tiles_w &&
+		     tx * VNC_TILE_SIZE < x + w; tx++)
+			c->dirty[ty * c->tiles_w + tx] = 1;
+
+	return 0;
+}
+
+/* Discard @len bytes, e.g. of a clipboard we don't use. */
+static int vnc_skip(struct vnc_client *c, size_t len)
+{
+	uint8_t buf[256];
+	size_t nb;
+	int err;
+
+	for (; len; len -= nb) {
+		nb = len < sizeof(buf) ? len : sizeof(buf);
+
+		err = vnc_read(c->fd, buf, nb);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int vnc_handle_message(struct vnc_client *c)
+{
+	uint8_t type, msg[19];
+	int err;
+
+	err = vnc_read(c->fd, &type, 1);
+	if (err)
+		return err;
+
+	switch (type) {
+	case VNC_SET_PIXEL_FORMAT:
+		err = vnc_read(c->fd, msg, 19);
+		return err ? err : vnc_set_format(c, msg + 3);
+	case VNC_SET_ENCODINGS:
+		err = vnc_read(c->fd, msg, 3);
+		return err ? err : vnc_set_encodings(c, get_be16(msg + 1));
+	case VNC_UPDATE_REQUEST:
+		err = vnc_read(c->fd, msg, 9);
+		return err ? err : vnc_request_update(c, msg);
+	case VNC_KEY_EVENT:
+		/* View only: input events are ignored */
+		return vnc_skip(c, 7);
+	case VNC_POINTER_EVENT:
+		return vnc_skip(c, 5);
+	case VNC_CLIENT_CUT_TEXT:
+		err = vnc_read(c->fd, msg, 7);
+		return err ? err : vnc_skip(c, get_be32(msg + 3));
+	default:
+		DBG("[debug] vnc: client %d: unknown message %u\n", c->fd, type);
+		return -EPROTO;
+	}
+}
+
+/*
+ * VNC authentication: the client encrypts a random challenge with DES, keyed
+ * by the password.
+ */
+static int vnc_authenticate(struct vnc_client *c, unsigned int minor)
+{
+	static const char reason[] = "Authentication failed";
+	uint8_t challenge[16], response[16], buf[4];
+	unsigned int i, diff = 0;
+	int err;
+
+	if (getrandom(challenge, sizeof(challenge), 0) != sizeof(challenge))
+		return -errno;
+
+	err = write_all(c->fd, challenge, sizeof(challenge));
+	if (!err)
+		err = vnc_read(c->fd, response, sizeof(response));
+	if (err)
+		return err;
+
+	des_encrypt(&c->srv->key, challenge, challenge);
+	des_encrypt(&c->srv->key, challenge + 8, challenge + 8);
+
+	for (i = 0; i < sizeof(challenge); i++)
+		diff |= challenge[i] ^ response[i];
+
+	if (!diff) {
+		put_be32(buf, 0);
+		return write_all(c->fd, buf, 4);
+	}
+
+	fprintf(stderr, "VNC authentication failed\n");
+	sleep(VNC_AUTH_DELAY_S);
+
+	put_be32(buf, 1);
+	err = write_all(c->fd, buf, 4);
+	if (!err && minor >= 8) {
+		put_be32(buf, sizeof(reason) - 1);
+		err = write_all(c->fd, buf, 4);
+		if (!err)
+			err = write_all(c->fd, reason, sizeof(reason) - 1);
+	}
+
+	return err ? err : -EACCES;
+}
+
+static int vnc_handshake(struct vnc_client *c)
+{
+	static const char version[] = "RFB 003.008\n";
+	uint8_t buf[24 + sizeof(VNC_NAME) - 1];
+	unsigned int major, minor;
+	char reply[13];
+	uint8_t type;
+	int err;
+
+	err = write_all(c->fd, version, 12);
+	if (!err)
+		err = vnc_read(c->fd, reply, 12);
+	if (err)
+		return err;
+
+	reply[12] = '\0';
+	if (sscanf(reply, "RFB %3u.%3u", &major, &minor) != 2 || major != 3)
+		return -EPROTO;
+
+	type = c->srv->auth ? VNC_SECURITY_VNC : VNC_SECURITY_NONE;
+
+	if (minor >= 7) {
+		/* The client picks from a list of security types */
+		buf[0] = 1;
+		buf[1] = type;
+
+		err = write_all(c->fd, buf, 2);
+		if (!err)
+			err = vnc_read(c->fd, buf, 1);
+		if (err)
+			return err;
+		if (buf[0] != type)
+			return -EPROTO;
+	} else {
+		put_be32(buf, type);
+		err = write_all(c->fd, buf, 4);
+	}
+
+	if (err)
+		return err;
+
+	if (type == VNC_SECURITY_VNC) {
+		err = vnc_authenticate(c, minor);
+	} else if (minor >= 8) {
+		/* Only RFB 3.8 reports the success of no authentication */
+		put_be32(buf, 0);
+		err = write_all(c->fd, buf, 4);
+	}
+
+	/* ClientInit: everybody shares the screen */
+	if (!err)
+		err = vnc_read(c->fd, buf, 1);
+	if (err)
+		return err;
+
+	/* The size of the framebuffer comes from the first picture */
+	err = vnc_capture(c);
+	if (err)
+		return err;
+
+	if (c->width > UINT16_MAX || c->height > UINT16_MAX)
+		return -E2BIG;
+
+	put_be16(buf, c->width);
+	put_be16(buf + 2, c->height);
+	memcpy(buf + 4, vnc_default_format, sizeof(vnc_default_format));
+	put_be32(buf + 20, sizeof(VNC_NAME) - 1);
+	memcpy(buf + 24, VNC_NAME, sizeof(VNC_NAME) - 1);
+
+	/* The client learns the size of the first picture from ServerInit */
+	c->resized = 0;
+
+	DBG("[debug] vnc: client %d: RFB 3.%u, %"PRIu32"x%"PRIu32"\n",
+	    c->fd, minor, c->width, c->height);
+
+	return write_all(c->fd, buf, sizeof(buf));
+}
+
+static void vnc_client_free(struct vnc_client *c)
+{
+	deflateEnd(&c->zrle);
+	deflateEnd(&c->tight);
+	if (c->fd >= 0)
+		close(c->fd);
+	free(c->shadow);
+	free(c->dirty);
+	free(c->buf);
+	free(c->scratch);
+	free(c->zbuf);
+	free(c);
+}
+
+static int vnc_ms_until(const struct timespec *ts)
+{
+	struct timespec now;
+	int64_t ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!timespec_before(&now, ts))
+		return 0;
+
+	ms = (int64_t)(ts->tv_sec - now.tv_sec) * 1000 +
+		(ts->tv_nsec - now.tv_nsec + 999999) / 1000000;
+
+	return (int)ms;
+}
+
+static void *vnc_client_thread(void *arg)
+{
+	struct vnc_client *c = arg;
+	struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+	unsigned int interval_ms = c->srv->d->cfg->vnc_interval_ms;
+	struct timespec next;
+	int err, timeout;
+
+	err = vnc_handshake(c);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!err) {
+		/* Nothing to capture for until the client asks */
+		timeout = c->pending ? vnc_ms_until(&next) : -1;
+
+		if (poll(&pfd, 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			err = -errno;
+			break;
+		}
+
+		if (pfd.revents) {
+			err = vnc_handle_message(c);
+			if (err)
+				break;
+		}
+
+		if (!c->pending || vnc_ms_until(&next))
+			continue;
+
+		clock_gettime(CLOCK_MONOTONIC, &next);
+		timespec_add_ms(&next, interval_ms);
+
+		err = vnc_capture(c);
+		if (err) {
+			/* Try again on the next period, e.g. after a modeset */
+			DBG("[debug] vnc: capture failed: %s\n", strerror(-err));
+			err = 0;
+			continue;
+		}
+
+		err = vnc_send_update(c);
+	}
+
+	DBG("[debug] vnc: client %d closed: %s\n", c->fd, strerror(-err));
+
+	vnc_client_free(c);
+	return NULL;
+}
+
+static int vnc_client_open(struct vnc_server *srv, int fd)
+{
+	struct vnc_client *c;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err, one = 1;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	c->srv = srv;
+	c->fd = fd;
+	c->encoding = VNC_ENC_RAW;
+	c->jpeg_quality = -1;
+	vnc_set_format(c, vnc_default_format);
+
+	if (deflateInit(&c->zrle, VNC_ZLIB_LEVEL) != Z_OK) {
+		free(c);
+		return -ENOMEM;
+	}
+
+	if (deflateInit(&c->tight, VNC_ZLIB_LEVEL) != Z_OK) {
+		deflateEnd(&c->zrle);
+		free(c);
+		return -ENOMEM;
+	}
+
+	/* Updates are written at once; don't hold their tail back */
+	if (srv->tcp)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&thread, &attr, vnc_client_thread, c);
+	pthread_attr_destroy(&attr);
+	if (err) {
+		/* The caller closes the socket */
+		c->fd = -1;
+		vnc_client_free(c);
+		return -err;
+	}
+
+	DBG("[debug] vnc: client %d connected\n", fd);
+
+	return 0;
+}
+
+static void *vnc_listen_thread(void *arg)
+{
+	struct vnc_server *srv = arg;
+	int fd;
+
+	for (;;) {
+		fd = accept(srv->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "VNC accept failed: %s\n", strerror(errno));
+			break;
+		}
+
+		if (vnc_client_open(srv, fd))
+			close(fd);
+	}
+
+	close(srv->fd);
+	free(srv);
+	return NULL;
+}
+
+/* Read the password of the VNC authentication, on the first line of @fn. */
+static int vnc_read_password(struct vnc_server *srv, const char *fn)
+{
+	uint8_t key[VNC_PASSWORD_LEN] = { 0 };
+	char line[256];
+	unsigned int i, j;
+	size_t len;
+	FILE *f;
+	int err;
+
+	f = fopen(fn, "re");
+	if (!f) {
+		err = -errno;
+		fprintf(stderr, "Unable to open VNC password file %s: %s\n",
+			fn, strerror(-err));
+		return err;
+	}
+
+	if (!fgets(line, sizeof(line), f))
+		line[0] = '\0';
+	fclose(f);
+
+	len = strcspn(line, "\r\n");
+	if (!len) {
+		fprintf(stderr, "Empty VNC password in %s\n", fn);
+		return -EINVAL;
+	}
+
+	if (len > VNC_PASSWORD_LEN)
+		fprintf(stderr, "VNC passwords are cut to %u characters\n",
+			VNC_PASSWORD_LEN);
+
+	/* RFB uses the bits of each character in reverse order as the key */
+	for (i = 0; i < VNC_PASSWORD_LEN && i < len; i++)
+		for (j = 0; j < 8; j++)
+			key[i] |= (((unsigned char)line[i] >> j) & 1) << (7 - j);
+
+	des_set_key(&srv->key, key);
+	srv->auth = 1;
+
+	memset(line, 0, sizeof(line));
+	memset(key, 0, sizeof(key));
+
+	return 0;
+}
+
+/* Bind a UNIX socket at @path, with the owner and mode of the IPC socket. */
+static int vnc_bind_unix(int fd, const char *path, const char *ipc_path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat st;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	strcpy(addr.sun_path, path);
+
+	if (stat(ipc_path, &st) < 0)
+		return -errno;
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		return -errno;
+
+	if (chown(path, st.st_uid, st.st_gid) < 0 ||
+	    chmod(path, st.st_mode & 07777) < 0) {
+		unlink(path);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int vnc_bind_tcp(int fd, unsigned int port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	int one = 1;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* Start a listening thread on @d->cfg->vnc_path, or on TCP if @tcp. */
+static int vnc_server_start(struct daemon *d, int tcp)
+{
+	const struct daemon_config *cfg = d->cfg;
+	struct vnc_server *srv;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	srv = calloc(1, sizeof(*srv));
+	if (!srv)
+		return -ENOMEM;
+
+	srv->d = d;
+	srv->tcp = tcp;
+
+	/* Looked up once, so that a missing encoder is reported at startup */
+	srv->jpeg = get_encoder(".jpg");
+
+	if (tcp) {
+		err = vnc_read_password(srv, cfg->vnc_password_file);
+		if (err)
+			goto err_free_srv;
+	}
+
+	srv->fd = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (srv->fd < 0) {
+		err = -errno;
+		goto err_free_srv;
+	}
+
+	if (tcp)
+		err = vnc_bind_tcp(srv->fd, cfg->vnc_port);
+	else
+		err = vnc_bind_unix(srv->fd, cfg->vnc_path, cfg->socket_path);
+	if (err)
+		goto err_close_fd;
+
+	if (listen(srv->fd, 4) < 0) {
+		err = -errno;
+		goto err_unlink;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = -pthread_create(&thread, &attr, vnc_listen_thread, srv);
+	pthread_attr_destroy(&attr);
+	if (err)
+		goto err_unlink;
+
+	if (tcp)
+		DBG("[debug] vnc: listening on 127.0.0.1:%u\n", cfg->vnc_port);
+	else
+		DBG("[debug] vnc: listening on %s\n", cfg->vnc_path);
+
+	return 0;
+
+err_unlink:
+	if (!tcp)
+		unlink(cfg->vnc_path);
+err_close_fd:
+	close(srv->fd);
+err_free_srv:
+	memset(&srv->key, 0, sizeof(srv->key));
+	free(srv);
+	return err;
+}
+
+int daemon_vnc_start(struct daemon *d)
+{
+	int err;
+
+	if (d->cfg->vnc_path) {
+		err = vnc_server_start(d, 0);
+		if (err)
+			return err;
+	}
+
+	if (d->cfg->vnc_port)
+		return vnc_server_start(d, 1);
+
+	return 0;
+}